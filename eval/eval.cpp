@@ -0,0 +1,650 @@
+// Runs a background subtraction classifier over a labeled cloud recording,
+// and reports how well it agrees with the labels, per frame and in total.
+// Frames are decoded and classified on all cores. Only the background model
+// is updated in frame order, as each frame depends on the ones before it.
+//
+// Like the inspector, background is the positive class.
+
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ARCHIVE_WRITING_APIS
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "miniz.c"
+#include "recording_format.cpp"
+
+#include "magic_motion.h"
+#include "timing.h"
+#include "background_model.cpp"
+#include "label_log.cpp"
+#include "frame_cache.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_TRESHOLDS 16
+#define FRAMES_PER_THREAD 2 // Frames in flight per thread. Each takes ~20 bytes per point
+
+typedef enum
+{
+    EVAL_NONE,
+    EVAL_NAIVE,
+    EVAL_MOG
+} EvalClassifier;
+
+static const char *classifier_names[] = { "none", "naive", "mog" };
+
+typedef enum
+{
+    OUTPUT_CSV,
+    OUTPUT_JSON
+} OutputFormat;
+
+typedef struct
+{
+    EvalClassifier classifier;
+    float tresholds[MAX_TRESHOLDS];
+    int num_tresholds;
+    int calibration_frames;
+    int mog_duration;
+    float mog_treshold;
+    int num_threads;
+    OutputFormat format;
+} EvalSettings;
+
+typedef struct
+{
+    size_t true_positive;
+    size_t false_positive;
+    size_t true_negative;
+    size_t false_negative;
+} Confusion;
+
+typedef struct
+{
+    size_t frame;
+    bool ok;
+    bool calibrating; // Not classified, and not counted
+
+    // Filled in by the decode pass
+    size_t num_points;
+    V3 *positions;
+    MagicMotionTag *labels;
+    Voxel *voxels;
+    double decode_ms;
+
+    // Filled in by the model pass, and then the classify pass
+    float *background_model; // As it was before this frame
+    Confusion confusion[MAX_TRESHOLDS];
+    size_t labeled_points;
+    double classify_ms;
+} EvalFrame;
+
+typedef struct
+{
+    int fd;
+    const size_t *frame_offsets;
+    const EvalSettings *settings;
+    EvalFrame *frames;
+    uint32_t num_frames;
+} EvalPass;
+
+// Same scan as the inspector does when it loads a recording
+static size_t *
+_ReadFrameOffsets(FILE *file, size_t *frame_count)
+{
+    fseek(file, -(long)sizeof(size_t), SEEK_END);
+    if(fread(frame_count, sizeof(size_t), 1, file) != 1)
+    {
+        return NULL;
+    }
+
+    rewind(file);
+
+    size_t *offsets = (size_t *)malloc(sizeof(size_t)*(*frame_count));
+    for(size_t i=0; i<*frame_count; ++i)
+    {
+        offsets[i] = ftell(file);
+
+        size_t index, num_points;
+        if(fscanf(file, "frame %zu %zu", &index, &num_points) != 2 || index != i+1)
+        {
+            fprintf(stderr, "Frame %zu invalid header\n", i+1);
+            free(offsets);
+            return NULL;
+        }
+
+        fseek(file, offsets[i], SEEK_SET);
+        for(int c=0; c != '\n' && c != EOF; c = fgetc(file)) {}
+
+        for(int j=0; j<3; ++j)
+        {
+            size_t blob_word = 0;
+            fread(&blob_word, sizeof(size_t), 1, file);
+            fseek(file, BLOB_SIZE(blob_word), SEEK_CUR);
+        }
+
+        // Skip the newline
+        fseek(file, 1, SEEK_CUR);
+    }
+
+    return offsets;
+}
+
+static bool
+_DecodeFrame(EvalPass *pass, EvalFrame *frame)
+{
+    char line[64];
+    size_t offset = pass->frame_offsets[frame->frame];
+    ssize_t n = pread(pass->fd, line, sizeof(line)-1, (off_t)offset);
+    if(n <= 0)
+    {
+        return false;
+    }
+
+    line[n] = '\0';
+    char *newline = strchr(line, '\n');
+    size_t index;
+    if(!newline || sscanf(line, "frame %zu %zu", &index, &frame->num_points) != 2)
+    {
+        return false;
+    }
+
+    offset += (newline - line) + 1;
+
+    frame->positions = (V3 *)malloc(sizeof(V3)*frame->num_points);
+    frame->labels = (MagicMotionTag *)malloc(sizeof(MagicMotionTag)*frame->num_points);
+
+    CloudStream streams[3] = { CLOUD_POSITIONS, CLOUD_COLORS, CLOUD_TAGS };
+    for(int i=0; i<3; ++i)
+    {
+        size_t blob_word = 0;
+        if(!_ReadAt(pass->fd, &blob_word, sizeof(size_t), offset))
+        {
+            return false;
+        }
+
+        offset += sizeof(size_t);
+        size_t blob_size = BLOB_SIZE(blob_word);
+
+        // Colors are not needed to classify
+        if(streams[i] != CLOUD_COLORS)
+        {
+            void *target = (streams[i] == CLOUD_POSITIONS) ? (void *)frame->positions :
+                                                             (void *)frame->labels;
+            void *blob = malloc(blob_size);
+            bool ok = _ReadAt(pass->fd, blob, blob_size, offset) &&
+                      DecompressCloudBlob(blob_word, streams[i], blob, frame->num_points, target);
+            free(blob);
+
+            if(!ok)
+            {
+                return false;
+            }
+        }
+
+        offset += blob_size;
+    }
+
+    // Point counts, as MagicMotion_CaptureFrame makes them
+    frame->voxels = (Voxel *)calloc(NUM_VOXELS, sizeof(Voxel));
+    _CountVoxelPoints(frame->positions, frame->num_points, frame->voxels);
+
+    return true;
+}
+
+// Tags the points with the library's own classification, once per
+// treshold, and tallies the tags against the labels
+static void
+_ClassifyFrame(const EvalSettings *settings, EvalFrame *frame)
+{
+    const float *model = (settings->classifier == EVAL_NONE) ? NULL : frame->background_model;
+
+    MagicMotionTag *tags = (MagicMotionTag *)malloc(sizeof(MagicMotionTag)*frame->num_points);
+    ColorPixel *colors = (ColorPixel *)calloc(frame->num_points, sizeof(ColorPixel)); // Not needed, but read
+    Voxel *voxels = (Voxel *)calloc(NUM_VOXELS, sizeof(Voxel));
+    uint32_t *occupied = (uint32_t *)malloc(sizeof(uint32_t)*NUM_VOXELS);
+    unsigned int num_occupied = 0;
+
+    for(size_t i=0; i<frame->num_points; ++i)
+    {
+        int label = frame->labels[i] & (TAG_FOREGROUND | TAG_BACKGROUND);
+        if(label == TAG_FOREGROUND || label == TAG_BACKGROUND)
+        {
+            ++frame->labeled_points;
+        }
+    }
+
+    for(int t=0; t<settings->num_tresholds; ++t)
+    {
+        for(size_t i=0; i<frame->num_points; ++i)
+        {
+            tags[i] = (MagicMotionTag)(frame->labels[i] & ~(TAG_FOREGROUND | TAG_BACKGROUND));
+        }
+
+        // Only the voxels that got points for the last treshold need clearing
+        for(unsigned int i=0; i<num_occupied; ++i)
+        {
+            memset(&voxels[occupied[i]], 0, sizeof(Voxel));
+        }
+
+        num_occupied = 0;
+        _ClassifyCloud(frame->positions, colors, tags, frame->num_points,
+                       model, settings->tresholds[t], voxels, occupied, &num_occupied);
+        if(settings->classifier == EVAL_NAIVE)
+        {
+            _FilterSparseForeground(frame->positions, tags, frame->num_points, voxels);
+        }
+
+        Confusion *c = &frame->confusion[t];
+        for(size_t i=0; i<frame->num_points; ++i)
+        {
+            int label = frame->labels[i] & (TAG_FOREGROUND | TAG_BACKGROUND);
+            if(label != TAG_FOREGROUND && label != TAG_BACKGROUND)
+            {
+                continue;
+            }
+
+            if(tags[i] & TAG_BACKGROUND)
+            {
+                if(label == TAG_BACKGROUND) ++c->true_positive;
+                else ++c->false_positive;
+            }
+            else
+            {
+                if(label == TAG_FOREGROUND) ++c->true_negative;
+                else ++c->false_negative;
+            }
+        }
+    }
+
+    free(occupied);
+    free(voxels);
+    free(colors);
+    free(tags);
+}
+
+static void
+_Decode(void *userdata, uint32_t i)
+{
+    EvalPass *pass = (EvalPass *)userdata;
+    EvalFrame *frame = &pass->frames[i];
+    double start = GetWallMilliseconds();
+    frame->ok = _DecodeFrame(pass, frame);
+    frame->decode_ms = GetWallMilliseconds() - start;
+}
+
+static void
+_Classify(void *userdata, uint32_t i)
+{
+    EvalPass *pass = (EvalPass *)userdata;
+    EvalFrame *frame = &pass->frames[i];
+    if(frame->ok && !frame->calibrating)
+    {
+        double start = GetWallMilliseconds();
+        _ClassifyFrame(pass->settings, frame);
+        frame->classify_ms = GetWallMilliseconds() - start;
+    }
+}
+
+static void
+_PrintRow(FILE *out, OutputFormat format, bool *first_row, const char *frame, float treshold,
+          size_t points, size_t labeled, const Confusion *c, double decode_ms, double classify_ms)
+{
+    double tp = (double)c->true_positive;
+    double precision = (c->true_positive + c->false_positive) ? tp / (c->true_positive + c->false_positive) : 0;
+    double recall = (c->true_positive + c->false_negative) ? tp / (c->true_positive + c->false_negative) : 0;
+    double f1 = (precision + recall > 0) ? 2*precision*recall / (precision + recall) : 0;
+
+    if(format == OUTPUT_CSV)
+    {
+        fprintf(out, "%s,%g,%zu,%zu,%zu,%zu,%zu,%zu,%.6f,%.6f,%.6f,%.3f,%.3f\n",
+                frame, treshold, points, labeled,
+                c->true_positive, c->false_positive, c->true_negative, c->false_negative,
+                precision, recall, f1, decode_ms, classify_ms);
+    }
+    else
+    {
+        fprintf(out, "%s\n    {\"frame\": %s, \"treshold\": %g, \"points\": %zu, \"labeled\": %zu, "
+                     "\"tp\": %zu, \"fp\": %zu, \"tn\": %zu, \"fn\": %zu, "
+                     "\"precision\": %.6f, \"recall\": %.6f, \"f1\": %.6f, "
+                     "\"decode_ms\": %.3f, \"classify_ms\": %.3f}",
+                *first_row ? "" : ",", frame, treshold, points, labeled,
+                c->true_positive, c->false_positive, c->true_negative, c->false_negative,
+                precision, recall, f1, decode_ms, classify_ms);
+    }
+
+    *first_row = false;
+}
+
+// File names may hold any byte but NUL, so quotes, backslashes and control
+// characters are escaped
+static void
+_PrintJSONString(FILE *out, const char *string)
+{
+    fputc('"', out);
+    for(const char *c=string; *c; ++c)
+    {
+        if(*c == '"' || *c == '\\')
+        {
+            fputc('\\', out);
+            fputc(*c, out);
+        }
+        else if((unsigned char)*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", (unsigned char)*c);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static int
+_ParseTresholds(const char *list, float *tresholds)
+{
+    int count = 0;
+    const char *c = list;
+    while(*c && count < MAX_TRESHOLDS)
+    {
+        char *end;
+        tresholds[count++] = strtof(c, &end);
+        if(end == c)
+        {
+            return 0;
+        }
+
+        c = (*end == ',') ? end+1 : end;
+    }
+
+    return count;
+}
+
+static void
+_PrintUsage(void)
+{
+    fprintf(stderr,
+            "usage: magicmotion_eval <cloud recording> [options]\n"
+            "  -c none|naive|mog    Classifier (default mog)\n"
+            "  -t <t0,t1,...>       Background probability tresholds, up to %d (default %g)\n"
+            "  -n <frames>          Frames the naive classifier calibrates on (default 30)\n"
+            "  -d <frames>          Frames the MOG classifier averages over (default %d)\n"
+            "  -p <points>          Average point count of MOG background voxels (default %g)\n"
+            "  -j <threads>         Threads (default one per core)\n"
+            "  -f csv|json          Output format (default csv)\n"
+            "  -o <file>            Output file (default stdout)\n"
+            "Label edits in <cloud recording>.labels are used as they are in the inspector.\n",
+            MAX_TRESHOLDS, BACKGROUND_PROBABILITY_TRESHOLD, MOG_DURATION, MOG_POINT_COUNT_TRESHOLD);
+}
+
+int
+main(int num_args, char *args[])
+{
+    if(num_args < 2)
+    {
+        _PrintUsage();
+        return 1;
+    }
+
+    const char *recording_filename = args[1];
+    const char *output_filename = NULL;
+
+    EvalSettings settings = {};
+    settings.classifier = EVAL_MOG;
+    settings.tresholds[0] = BACKGROUND_PROBABILITY_TRESHOLD;
+    settings.num_tresholds = 1;
+    settings.calibration_frames = 30;
+    settings.mog_duration = MOG_DURATION;
+    settings.mog_treshold = MOG_POINT_COUNT_TRESHOLD;
+    settings.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    settings.format = OUTPUT_CSV;
+
+    for(int i=2; i<num_args; ++i)
+    {
+        const char *value = (i+1 < num_args) ? args[i+1] : NULL;
+        if(!value)
+        {
+            _PrintUsage();
+            return 1;
+        }
+
+        if(strcmp(args[i], "-c") == 0)
+        {
+            if(strcmp(value, "none") == 0) settings.classifier = EVAL_NONE;
+            else if(strcmp(value, "naive") == 0) settings.classifier = EVAL_NAIVE;
+            else if(strcmp(value, "mog") == 0) settings.classifier = EVAL_MOG;
+            else
+            {
+                _PrintUsage();
+                return 1;
+            }
+        }
+        else if(strcmp(args[i], "-t") == 0)
+        {
+            settings.num_tresholds = _ParseTresholds(value, settings.tresholds);
+            if(settings.num_tresholds == 0)
+            {
+                _PrintUsage();
+                return 1;
+            }
+        }
+        else if(strcmp(args[i], "-n") == 0) settings.calibration_frames = atoi(value);
+        else if(strcmp(args[i], "-d") == 0) settings.mog_duration = MAX(atoi(value), 1);
+        else if(strcmp(args[i], "-p") == 0) settings.mog_treshold = (float)atof(value);
+        else if(strcmp(args[i], "-j") == 0) settings.num_threads = atoi(value);
+        else if(strcmp(args[i], "-f") == 0)
+        {
+            if(strcmp(value, "csv") == 0) settings.format = OUTPUT_CSV;
+            else if(strcmp(value, "json") == 0) settings.format = OUTPUT_JSON;
+            else
+            {
+                _PrintUsage();
+                return 1;
+            }
+        }
+        else if(strcmp(args[i], "-o") == 0) output_filename = value;
+        else
+        {
+            _PrintUsage();
+            return 1;
+        }
+
+        ++i;
+    }
+
+    if(settings.num_threads < 1)
+    {
+        settings.num_threads = 1;
+    }
+    else if(settings.num_threads > MAX_FRAME_BATCH_THREADS)
+    {
+        settings.num_threads = MAX_FRAME_BATCH_THREADS;
+    }
+
+    FILE *recording = fopen(recording_filename, "rb");
+    if(!recording)
+    {
+        fprintf(stderr, "Failed to open %s\n", recording_filename);
+        return 1;
+    }
+
+    size_t frame_count = 0;
+    size_t *frame_offsets = _ReadFrameOffsets(recording, &frame_count);
+    if(!frame_offsets)
+    {
+        fprintf(stderr, "%s is not a cloud recording\n", recording_filename);
+        return 1;
+    }
+
+    FILE *out = output_filename ? fopen(output_filename, "w") : stdout;
+    if(!out)
+    {
+        fprintf(stderr, "Failed to open %s\n", output_filename);
+        return 1;
+    }
+
+    LabelLog labels;
+    OpenLabelLog(&labels, recording_filename, frame_count);
+
+    double start_time = GetWallMilliseconds();
+
+    const size_t batch_size = settings.num_threads * FRAMES_PER_THREAD;
+    EvalFrame *frames = (EvalFrame *)calloc(batch_size, sizeof(EvalFrame));
+    float *models = (float *)malloc(sizeof(float)*NUM_VOXELS*batch_size);
+
+    float *background_model = (float *)calloc(NUM_VOXELS, sizeof(float));
+    float *point_counts = (float *)calloc(NUM_VOXELS, sizeof(float));
+
+    EvalPass pass = {};
+    pass.fd = fileno(recording);
+    pass.frame_offsets = frame_offsets;
+    pass.settings = &settings;
+    pass.frames = frames;
+
+    Confusion totals[MAX_TRESHOLDS] = {};
+    size_t total_points = 0, total_labeled = 0, frames_evaluated = 0, frames_failed = 0;
+    double total_decode_ms = 0, total_classify_ms = 0;
+
+    bool first_row = true;
+    if(settings.format == OUTPUT_CSV)
+    {
+        fprintf(out, "frame,treshold,points,labeled,tp,fp,tn,fn,precision,recall,f1,decode_ms,classify_ms\n");
+    }
+    else
+    {
+        fprintf(out, "{\n  \"recording\": ");
+        _PrintJSONString(out, recording_filename);
+        fprintf(out, ",\n  \"classifier\": \"%s\",\n  \"frames\": [",
+                classifier_names[settings.classifier]);
+    }
+
+    for(size_t batch_start=0; batch_start<frame_count; batch_start+=batch_size)
+    {
+        pass.num_frames = (uint32_t)MIN(batch_size, frame_count-batch_start);
+        for(uint32_t i=0; i<pass.num_frames; ++i)
+        {
+            memset(&frames[i], 0, sizeof(EvalFrame));
+            frames[i].frame = batch_start+i;
+            frames[i].background_model = models + NUM_VOXELS*i;
+        }
+
+        RunFrameBatch(pass.num_frames, settings.num_threads, _Decode, &pass);
+
+        for(uint32_t i=0; i<pass.num_frames; ++i)
+        {
+            EvalFrame *frame = &frames[i];
+            if(!frame->ok)
+            {
+                fprintf(stderr, "Failed to decode frame %zu, skipping it\n", frame->frame+1);
+                ++frames_failed;
+                continue;
+            }
+
+            ApplyLabels(&labels, frame->frame, frame->num_points, frame->labels);
+
+            if(settings.classifier == EVAL_NAIVE)
+            {
+                // The library tags every point as foreground while calibrating
+                frame->calibrating = frame->frame < (size_t)settings.calibration_frames;
+                if(frame->calibrating)
+                {
+                    _UpdateNaiveCalibration(point_counts, frame->voxels);
+                    if(frame->frame+1 == (size_t)settings.calibration_frames)
+                    {
+                        _FinishNaiveCalibration(point_counts, background_model);
+                    }
+                }
+            }
+
+            memcpy(frame->background_model, background_model, sizeof(float)*NUM_VOXELS);
+
+            if(settings.classifier == EVAL_MOG)
+            {
+                _UpdateSimpleMOG(point_counts, frame->voxels, frame->frame+1,
+                                 settings.mog_duration, settings.mog_treshold, background_model);
+            }
+        }
+
+        RunFrameBatch(pass.num_frames, settings.num_threads, _Classify, &pass);
+
+        for(uint32_t i=0; i<pass.num_frames; ++i)
+        {
+            EvalFrame *frame = &frames[i];
+            if(frame->ok && !frame->calibrating)
+            {
+                char frame_number[32];
+                snprintf(frame_number, sizeof(frame_number), "%zu", frame->frame+1);
+                for(int t=0; t<settings.num_tresholds; ++t)
+                {
+                    _PrintRow(out, settings.format, &first_row, frame_number, settings.tresholds[t],
+                              frame->num_points, frame->labeled_points, &frame->confusion[t],
+                              frame->decode_ms, frame->classify_ms);
+
+                    totals[t].true_positive += frame->confusion[t].true_positive;
+                    totals[t].false_positive += frame->confusion[t].false_positive;
+                    totals[t].true_negative += frame->confusion[t].true_negative;
+                    totals[t].false_negative += frame->confusion[t].false_negative;
+                }
+
+                total_points += frame->num_points;
+                total_labeled += frame->labeled_points;
+                total_decode_ms += frame->decode_ms;
+                total_classify_ms += frame->classify_ms;
+                ++frames_evaluated;
+            }
+
+            free(frame->positions);
+            free(frame->labels);
+            free(frame->voxels);
+        }
+    }
+
+    if(settings.format == OUTPUT_JSON)
+    {
+        fprintf(out, "\n  ],\n  \"total\": [");
+        first_row = true;
+    }
+
+    for(int t=0; t<settings.num_tresholds; ++t)
+    {
+        _PrintRow(out, settings.format, &first_row, settings.format == OUTPUT_CSV ? "total" : "null",
+                  settings.tresholds[t], total_points, total_labeled, &totals[t],
+                  total_decode_ms, total_classify_ms);
+    }
+
+    double wall_seconds = (GetWallMilliseconds() - start_time) / 1000.0;
+    if(settings.format == OUTPUT_JSON)
+    {
+        fprintf(out, "\n  ],\n  \"frames_evaluated\": %zu,\n  \"threads\": %d,\n  \"wall_seconds\": %.3f\n}\n",
+                frames_evaluated, settings.num_threads, wall_seconds);
+    }
+
+    fprintf(stderr, "Evaluated %zu frames with the %s classifier in %.2f s on %d threads\n",
+            frames_evaluated, classifier_names[settings.classifier], wall_seconds, settings.num_threads);
+    if(frames_failed > 0)
+    {
+        fprintf(stderr, "%zu frames failed to decode\n", frames_failed);
+    }
+
+    free(point_counts);
+    free(background_model);
+    free(models);
+    free(frames);
+    free(frame_offsets);
+    CloseLabelLog(&labels);
+    fclose(recording);
+    if(out != stdout)
+    {
+        fclose(out);
+    }
+
+    return frames_failed > 0 ? 1 : 0;
+}
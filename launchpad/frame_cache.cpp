@@ -0,0 +1,534 @@
+#include "frame_cache.h"
+#include "recording_format.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Expects recording_format.cpp to be included already
+
+#define NO_FRAME ((size_t)-1)
+
+static bool
+_ReadFrameHeader(FrameCache *cache, size_t frame, size_t *num_points, size_t *data_offset)
+{
+    char line[64];
+    size_t offset = cache->frame_offsets[frame];
+    ssize_t n = pread(cache->fd, line, sizeof(line)-1, (off_t)offset);
+    if(n <= 0)
+    {
+        printf("Failed to read frame %zu\n", frame+1);
+        return false;
+    }
+
+    line[n] = '\0';
+    char *newline = strchr(line, '\n');
+
+    size_t index;
+    if(!newline || sscanf(line, "frame %zu %zu", &index, num_points) != 2)
+    {
+        printf("Frame %zu invalid header\n", frame+1);
+        return false;
+    }
+
+    if(index != frame+1)
+    {
+        printf("Frame %zu has invalid frame number (%zu)\n", frame+1, index);
+        return false;
+    }
+
+    *data_offset = offset + (newline - line) + 1;
+    return true;
+}
+
+static bool
+_DecodeFrame(FrameCache *cache, CachedFrame *slot, size_t offset)
+{
+    slot->positions = (V3 *)malloc(sizeof(V3)*slot->num_points);
+    slot->colors = (ColorPixel *)malloc(sizeof(ColorPixel)*slot->num_points);
+    slot->tags = (MagicMotionTag *)malloc(sizeof(MagicMotionTag)*slot->num_points);
+
+    void *targets[3] = { slot->positions, slot->colors, slot->tags };
+    CloudStream streams[3] = { CLOUD_POSITIONS, CLOUD_COLORS, CLOUD_TAGS };
+
+    for(int i=0; i<3; ++i)
+    {
+        size_t blob_word = 0;
+        if(!_ReadAt(cache->fd, &blob_word, sizeof(size_t), offset))
+        {
+            return false;
+        }
+
+        offset += sizeof(size_t);
+        size_t blob_size = BLOB_SIZE(blob_word);
+        void *blob = malloc(blob_size);
+        bool ok = _ReadAt(cache->fd, blob, blob_size, offset) &&
+                  DecompressCloudBlob(blob_word, streams[i], blob, slot->num_points, targets[i]);
+        free(blob);
+
+        if(!ok)
+        {
+            printf("Failed to decompress frame %zu\n", slot->frame+1);
+            return false;
+        }
+
+        offset += blob_size;
+    }
+
+    return true;
+}
+
+static CachedFrame *
+_FindFrame(FrameCache *cache, size_t frame)
+{
+    for(int i=0; i<FRAME_CACHE_SLOTS; ++i)
+    {
+        CachedFrame *slot = &cache->slots[i];
+        if(slot->state != CACHED_FRAME_EMPTY && slot->frame == frame)
+        {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+_IsWanted(FrameCache *cache, size_t frame)
+{
+    for(int i=0; i<PREFETCH_FRAMES; ++i)
+    {
+        if(cache->wanted[i] == frame)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+_Unwant(FrameCache *cache, size_t frame)
+{
+    for(int i=0; i<PREFETCH_FRAMES; ++i)
+    {
+        if(cache->wanted[i] == frame)
+        {
+            cache->wanted[i] = NO_FRAME;
+        }
+    }
+}
+
+static void
+_EvictSlot(FrameCache *cache, CachedFrame *slot)
+{
+    free(slot->positions);
+    free(slot->colors);
+    free(slot->tags);
+    cache->used_bytes -= slot->bytes;
+    memset(slot, 0, sizeof(CachedFrame));
+}
+
+// Makes room for the frame by evicting the least recently used frames. The
+// prefetcher does not evict frames it was asked to prefetch, and gives up
+// instead. The render thread goes over budget if it has to.
+static CachedFrame *
+_ReserveSlot(FrameCache *cache, size_t frame, size_t num_points, bool prefetch)
+{
+    size_t bytes = num_points*(sizeof(V3)+sizeof(ColorPixel)+sizeof(MagicMotionTag));
+
+    CachedFrame *empty;
+    while(true)
+    {
+        empty = NULL;
+        CachedFrame *victim = NULL;
+        for(int i=0; i<FRAME_CACHE_SLOTS; ++i)
+        {
+            CachedFrame *slot = &cache->slots[i];
+            if(slot->state == CACHED_FRAME_EMPTY)
+            {
+                empty = slot;
+            }
+            else if(slot->state == CACHED_FRAME_READY && slot != cache->pinned &&
+                    !(prefetch && _IsWanted(cache, slot->frame)) &&
+                    (!victim || slot->last_used < victim->last_used))
+            {
+                victim = slot;
+            }
+        }
+
+        if(empty && cache->used_bytes + bytes <= cache->max_bytes)
+        {
+            break;
+        }
+
+        if(!victim)
+        {
+            if(prefetch)
+            {
+                return NULL;
+            }
+
+            break;
+        }
+
+        _EvictSlot(cache, victim);
+    }
+
+    if(empty)
+    {
+        empty->state = CACHED_FRAME_LOADING;
+        empty->frame = frame;
+        empty->num_points = num_points;
+        empty->bytes = bytes;
+        cache->used_bytes += bytes;
+    }
+
+    return empty;
+}
+
+// Called with the lock held
+static void
+_FinishSlot(FrameCache *cache, CachedFrame *slot, bool ok)
+{
+    if(ok)
+    {
+        slot->state = CACHED_FRAME_READY;
+        slot->last_used = ++cache->clock;
+    }
+    else
+    {
+        _EvictSlot(cache, slot);
+    }
+
+    pthread_cond_broadcast(&cache->changed);
+}
+
+static void *
+_PrefetchThread(void *userdata)
+{
+    FrameCache *cache = (FrameCache *)userdata;
+
+    pthread_mutex_lock(&cache->lock);
+    while(cache->running)
+    {
+        size_t frame = NO_FRAME;
+        for(int i=0; i<PREFETCH_FRAMES; ++i)
+        {
+            if(cache->wanted[i] != NO_FRAME && !_FindFrame(cache, cache->wanted[i]))
+            {
+                frame = cache->wanted[i];
+                break;
+            }
+        }
+
+        if(frame == NO_FRAME)
+        {
+            pthread_cond_wait(&cache->changed, &cache->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        size_t num_points, offset;
+        bool ok = _ReadFrameHeader(cache, frame, &num_points, &offset);
+        pthread_mutex_lock(&cache->lock);
+
+        if(!ok)
+        {
+            _Unwant(cache, frame);
+            continue;
+        }
+
+        // The render thread may have loaded it, or moved on, in the meantime
+        if(_FindFrame(cache, frame) || !_IsWanted(cache, frame))
+        {
+            continue;
+        }
+
+        CachedFrame *slot = _ReserveSlot(cache, frame, num_points, true);
+        if(!slot)
+        {
+            // NOTE(istarnion): Full of frames that are wanted more. Wait for
+            // the render thread to ask for something else
+            for(int i=0; i<PREFETCH_FRAMES; ++i)
+            {
+                cache->wanted[i] = NO_FRAME;
+            }
+
+            continue;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        ok = _DecodeFrame(cache, slot, offset);
+        pthread_mutex_lock(&cache->lock);
+
+        if(!ok)
+        {
+            _Unwant(cache, frame);
+        }
+
+        _FinishSlot(cache, slot, ok);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+bool
+StartFrameCache(FrameCache *cache, const char *filename, const size_t *frame_offsets,
+                size_t frame_count, size_t max_bytes)
+{
+    memset(cache, 0, sizeof(FrameCache));
+
+    // Both the render thread and the prefetcher read the file, so the cache
+    // has a descriptor of its own and reads it with _ReadAt only
+    cache->fd = open(filename, O_RDONLY);
+    if(cache->fd < 0)
+    {
+        printf("Failed to open %s for the frame cache\n", filename);
+        return false;
+    }
+
+    cache->started = true;
+    cache->frame_offsets = frame_offsets;
+    cache->frame_count = frame_count;
+    cache->max_bytes = max_bytes;
+    for(int i=0; i<PREFETCH_FRAMES; ++i)
+    {
+        cache->wanted[i] = NO_FRAME;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->changed, NULL);
+
+    cache->running = true;
+    if(pthread_create(&cache->prefetcher, NULL, _PrefetchThread, cache) != 0)
+    {
+        printf("Failed to start the prefetch thread. Frames are loaded when shown\n");
+        cache->running = false;
+    }
+
+    return true;
+}
+
+void
+StopFrameCache(FrameCache *cache)
+{
+    if(!cache->started)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    bool was_running = cache->running;
+    cache->running = false;
+    pthread_cond_broadcast(&cache->changed);
+    pthread_mutex_unlock(&cache->lock);
+
+    if(was_running)
+    {
+        pthread_join(cache->prefetcher, NULL);
+    }
+
+    for(int i=0; i<FRAME_CACHE_SLOTS; ++i)
+    {
+        if(cache->slots[i].state != CACHED_FRAME_EMPTY)
+        {
+            _EvictSlot(cache, &cache->slots[i]);
+        }
+    }
+
+    pthread_cond_destroy(&cache->changed);
+    pthread_mutex_destroy(&cache->lock);
+    close(cache->fd);
+
+    memset(cache, 0, sizeof(FrameCache));
+}
+
+const CachedFrame *
+GetCachedFrame(FrameCache *cache, size_t frame)
+{
+    if(!cache->started || frame >= cache->frame_count)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    // The last frame is not needed anymore, and may be evicted to make room
+    cache->pinned = NULL;
+
+    CachedFrame *slot;
+    while(true)
+    {
+        slot = _FindFrame(cache, frame);
+        if(slot && slot->state == CACHED_FRAME_LOADING)
+        {
+            pthread_cond_wait(&cache->changed, &cache->lock);
+            continue;
+        }
+        else if(slot)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        size_t num_points, offset;
+        bool ok = _ReadFrameHeader(cache, frame, &num_points, &offset);
+        pthread_mutex_lock(&cache->lock);
+
+        if(!ok)
+        {
+            break;
+        }
+
+        // The prefetcher may have started on it while we were reading
+        if(_FindFrame(cache, frame))
+        {
+            continue;
+        }
+
+        slot = _ReserveSlot(cache, frame, num_points, false);
+        if(slot)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            ok = _DecodeFrame(cache, slot, offset);
+            pthread_mutex_lock(&cache->lock);
+
+            _FinishSlot(cache, slot, ok);
+            if(!ok)
+            {
+                slot = NULL;
+            }
+        }
+
+        break;
+    }
+
+    if(slot)
+    {
+        slot->last_used = ++cache->clock;
+        cache->pinned = slot;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return slot;
+}
+
+bool
+ReadFrame(FrameCache *cache, size_t frame, CachedFrame *result)
+{
+    memset(result, 0, sizeof(CachedFrame));
+    if(!cache->started || frame >= cache->frame_count)
+    {
+        return false;
+    }
+
+    size_t offset;
+    result->frame = frame;
+    if(!_ReadFrameHeader(cache, frame, &result->num_points, &offset) ||
+       !_DecodeFrame(cache, result, offset))
+    {
+        FreeFrame(result);
+        return false;
+    }
+
+    result->state = CACHED_FRAME_READY;
+    result->bytes = result->num_points*(sizeof(V3)+sizeof(ColorPixel)+sizeof(MagicMotionTag));
+    return true;
+}
+
+void
+FreeFrame(CachedFrame *frame)
+{
+    free(frame->positions);
+    free(frame->colors);
+    free(frame->tags);
+    memset(frame, 0, sizeof(CachedFrame));
+}
+
+typedef struct
+{
+    FrameBatchWork work;
+    void *userdata;
+    uint32_t num_frames;
+    uint32_t next_frame;
+} FrameBatch;
+
+static void *
+_FrameBatchWorker(void *userdata)
+{
+    FrameBatch *batch = (FrameBatch *)userdata;
+    while(true)
+    {
+        uint32_t i = __atomic_fetch_add(&batch->next_frame, 1, __ATOMIC_SEQ_CST);
+        if(i >= batch->num_frames)
+        {
+            break;
+        }
+
+        batch->work(batch->userdata, i);
+    }
+
+    return NULL;
+}
+
+void
+RunFrameBatch(uint32_t num_frames, int num_threads, FrameBatchWork work, void *userdata)
+{
+    FrameBatch batch;
+    batch.work = work;
+    batch.userdata = userdata;
+    batch.num_frames = num_frames;
+    batch.next_frame = 0;
+
+    pthread_t threads[MAX_FRAME_BATCH_THREADS];
+    int num_started = 0;
+    for(int i=1; i<num_threads && i<MAX_FRAME_BATCH_THREADS; ++i)
+    {
+        if(pthread_create(&threads[num_started], NULL, _FrameBatchWorker, &batch) == 0)
+        {
+            ++num_started;
+        }
+    }
+
+    _FrameBatchWorker(&batch);
+
+    for(int i=0; i<num_started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void
+PrefetchFrames(FrameCache *cache, size_t frame, int direction)
+{
+    if(!cache->started || cache->frame_count == 0)
+    {
+        return;
+    }
+
+    size_t count = cache->frame_count;
+    size_t forward = (direction < 0) ? count-1 : 1; // One step in the scrub direction, modulo count
+
+    pthread_mutex_lock(&cache->lock);
+
+    size_t next = frame;
+    for(int i=0; i<PREFETCH_AHEAD; ++i)
+    {
+        next = (next + forward) % count;
+        cache->wanted[i] = next;
+    }
+
+    size_t previous = frame;
+    for(int i=0; i<PREFETCH_BEHIND; ++i)
+    {
+        previous = (previous + count - forward) % count;
+        cache->wanted[PREFETCH_AHEAD+i] = previous;
+    }
+
+    pthread_cond_broadcast(&cache->changed);
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,86 @@
+#ifndef FRAME_CACHE_H_
+#define FRAME_CACHE_H_
+
+#include "magic_motion.h" // V3, ColorPixel, MagicMotionTag
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Decoded frames of a cloud recording, kept in least recently used order
+// within a memory budget. A background thread decodes the frames around the
+// one being looked at, in the direction the user is scrubbing, so stepping
+// through a recording does not wait for inflate.
+typedef enum
+{
+    CACHED_FRAME_EMPTY,
+    CACHED_FRAME_LOADING,
+    CACHED_FRAME_READY
+} CachedFrameState;
+
+typedef struct
+{
+    CachedFrameState state;
+    size_t frame;
+    size_t num_points;
+    V3 *positions;
+    ColorPixel *colors;
+    MagicMotionTag *tags; // As recorded, without label edits
+    size_t bytes;
+    uint64_t last_used;
+} CachedFrame;
+
+#define FRAME_CACHE_SLOTS 64
+#define PREFETCH_AHEAD 4
+#define PREFETCH_BEHIND 1
+#define PREFETCH_FRAMES (PREFETCH_AHEAD+PREFETCH_BEHIND)
+
+typedef struct
+{
+    bool started;
+    int fd;
+    const size_t *frame_offsets;
+    size_t frame_count;
+    size_t max_bytes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // A slot finished loading, or new frames are wanted
+    pthread_t prefetcher;
+    bool running;
+
+    CachedFrame slots[FRAME_CACHE_SLOTS];
+    size_t used_bytes;
+    uint64_t clock;
+    CachedFrame *pinned; // Returned by the last GetCachedFrame, never evicted
+
+    size_t wanted[PREFETCH_FRAMES]; // Frames to prefetch, nearest first
+} FrameCache;
+
+#define DEFAULT_FRAME_CACHE_BYTES ((size_t)1 << 30)
+
+// frame_offsets must stay valid until StopFrameCache
+bool StartFrameCache(FrameCache *cache, const char *filename, const size_t *frame_offsets,
+                     size_t frame_count, size_t max_bytes);
+void StopFrameCache(FrameCache *cache);
+
+// Decodes the frame if it is not cached. The frame stays valid until the next
+// call. Returns NULL if the frame could not be read.
+const CachedFrame *GetCachedFrame(FrameCache *cache, size_t frame);
+
+// Decodes a frame into a CachedFrame of its own, without caching it, for
+// work over many frames. Safe to call from any thread. Free it with FreeFrame.
+bool ReadFrame(FrameCache *cache, size_t frame, CachedFrame *result);
+void FreeFrame(CachedFrame *frame);
+
+// Calls work(userdata, i) for every i below num_frames, on up to num_threads
+// threads. The calling thread works too, and every thread takes the next
+// frame left, so slow frames do not hold the others back. For passes over a
+// batch of frames read with ReadFrame.
+#define MAX_FRAME_BATCH_THREADS 64
+typedef void (*FrameBatchWork)(void *userdata, uint32_t i);
+void RunFrameBatch(uint32_t num_frames, int num_threads, FrameBatchWork work, void *userdata);
+
+// Starts decoding the frames after (direction 1) or before (direction -1) the
+// given one in the background, wrapping around at the ends.
+void PrefetchFrames(FrameCache *cache, size_t frame, int direction);
+
+#endif /* end of include guard: FRAME_CACHE_H_ */
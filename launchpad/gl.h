@@ -1438,6 +1438,8 @@ typedef ptrdiff_t GLsizeiptr;
 typedef float GLfloat;
 typedef double GLdouble;
 typedef float GLclampf;
+typedef uint64_t GLuint64;
+typedef struct __GLsync *GLsync;
 // End of OpenGL types
 
 // OpenGL functions
@@ -1487,6 +1489,10 @@ typedef float GLclampf;
     GLE(void,       BindBuffer,                 GLenum target, GLuint buffer) \
     GLE(void *,     MapBuffer,                  GLenum target, GLenum access) \
     GLE(void,       UnmapBuffer,                GLenum target) \
+    GLE(void *,     MapBufferRange,             GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access) \
+    GLE(GLsync,     FenceSync,                  GLenum condition, GLbitfield flags) \
+    GLE(GLenum,     ClientWaitSync,             GLsync sync, GLbitfield flags, GLuint64 timeout) \
+    GLE(void,       DeleteSync,                 GLsync sync) \
     GLE(void,       DeleteBuffers,              GLsizei n, const GLuint *buffers) \
     GLE(void,       GenFramebuffers,            GLsizei n, GLuint *framebuffers) \
     GLE(void,       BindFramebuffer,            GLenum target, GLuint framebuffer) \
@@ -1546,19 +1552,27 @@ typedef float GLclampf;
     GLE(void,       BindFragDataLocation,       GLuint program, GLuint color, const GLchar *name) \
     GLE(void,       EnableVertexAttribArray,    GLuint index) \
     GLE(void,       VertexAttribPointer,        GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid *pointer) \
+    GLE(void,       VertexAttribIPointer,       GLuint index, GLint size, GLenum type, GLsizei stride, const GLvoid *pointer) \
+    GLE(void,       VertexAttribDivisor,        GLuint index, GLuint divisor) \
     GLE(void,       DrawElements,               GLenum mode, GLsizei count, GLenum type, const GLvoid *indices) \
     GLE(void,       DrawElementsInstanced,      GLenum mode, GLsizei count, GLenum type, const GLvoid *indices, GLsizei primcount) \
     GLE(void,       DrawArrays,                 GLenum mode, GLint first, GLsizei count) \
     GLE(void,       DrawArraysInstanced,        GLenum mode, GLint first, GLsizei count, GLsizei instancecount) \
     GLE(void,       DrawElementsBaseVertex,     GLenum mode, GLsizei count, GLenum type, GLvoid *indices, GLint basevertex)
+
+// Newer than the context we ask for, so these may be NULL. Check before use.
+#define ISTARI_GL_OPTIONAL_FUNCS \
+    GLE(void,       BufferStorage,              GLenum target, GLsizeiptr size, const GLvoid *data, GLbitfield flags)
 // End of OpenGL functions
 
 #define GLE(ret, name, ...) typedef ret APIENTRY name##proc(__VA_ARGS__); extern name##proc * gl##name;
 ISTARI_GL_FUNCS
+ISTARI_GL_OPTIONAL_FUNCS
 #undef GLE
 
 #define GLE(ret, name, ...) name##proc * gl##name;
 ISTARI_GL_FUNCS
+ISTARI_GL_OPTIONAL_FUNCS
 #undef GLE
 
 void
@@ -1567,6 +1581,9 @@ load_gl_functions()
 #define GLE(ret, name, ...) gl##name = (name##proc *) SDL_GL_GetProcAddress("gl"#name); SDL_assert(gl##name);
     ISTARI_GL_FUNCS
 #undef GLE
+#define GLE(ret, name, ...) gl##name = (name##proc *) SDL_GL_GetProcAddress("gl"#name);
+    ISTARI_GL_OPTIONAL_FUNCS
+#undef GLE
 }
 
 #if DEBUG
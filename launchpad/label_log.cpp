@@ -0,0 +1,284 @@
+#include "label_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define LABEL_RECORD_MAGIC 0x4c424c31 // "LBL1"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t frame;
+    uint32_t num_points;
+    uint32_t foreground_size; // Bytes of run lengths that follow
+    uint32_t background_size;
+} LabelRecordHeader;
+
+// A mask is stored as the lengths of alternating runs of clear and set bits,
+// starting with a (possibly empty) run of clear bits. Lengths are varints,
+// seven bits per byte. A run of n points never takes more than n bytes, so a
+// mask never takes more than num_points+1 bytes.
+static size_t
+_EncodeRuns(const MagicMotionTag *tags, size_t num_points, uint32_t bit, uint8_t *output)
+{
+    size_t size = 0;
+    bool set = false;
+    size_t i = 0;
+    do
+    {
+        size_t run = 0;
+        while(i < num_points && ((tags[i] & bit) != 0) == set)
+        {
+            ++run;
+            ++i;
+        }
+
+        do
+        {
+            uint8_t byte = run & 0x7F;
+            run >>= 7;
+            output[size++] = byte | (run ? 0x80 : 0);
+        } while(run);
+
+        set = !set;
+    } while(i < num_points);
+
+    return size;
+}
+
+static bool
+_DecodeRuns(const uint8_t *runs, size_t size, size_t num_points, uint32_t bit, MagicMotionTag *tags)
+{
+    size_t i = 0;
+    size_t offset = 0;
+    bool set = false;
+    while(offset < size)
+    {
+        size_t run = 0;
+        int shift = 0;
+        uint8_t byte;
+        do
+        {
+            if(offset >= size || shift > 56)
+            {
+                return false;
+            }
+
+            byte = runs[offset++];
+            run |= (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+
+        if(run > num_points - i)
+        {
+            return false;
+        }
+
+        if(set)
+        {
+            for(size_t end = i+run; i<end; ++i)
+            {
+                tags[i] = (MagicMotionTag)(tags[i] | bit);
+            }
+        }
+        else
+        {
+            i += run;
+        }
+
+        set = !set;
+    }
+
+    return i == num_points;
+}
+
+void
+OpenLabelLog(LabelLog *log, const char *recording_filename, size_t num_frames)
+{
+    memset(log, 0, sizeof(LabelLog));
+    snprintf(log->filename, sizeof(log->filename), "%s.labels", recording_filename);
+
+    log->num_frames = num_frames;
+    log->record_offsets = (size_t *)malloc(sizeof(size_t)*num_frames);
+    for(size_t i=0; i<num_frames; ++i)
+    {
+        log->record_offsets[i] = NO_LABEL_RECORD;
+    }
+
+    // NOTE(istarnion): The file is created by the first AppendLabels
+    log->file = fopen(log->filename, "rb+");
+    if(!log->file)
+    {
+        return;
+    }
+
+    fseek(log->file, 0, SEEK_END);
+    size_t file_size = ftell(log->file);
+    rewind(log->file);
+
+    size_t offset = 0;
+    while(offset < file_size)
+    {
+        LabelRecordHeader header;
+        if(fread(&header, sizeof(header), 1, log->file) != 1 ||
+           header.magic != LABEL_RECORD_MAGIC ||
+           header.frame >= num_frames)
+        {
+            break;
+        }
+
+        size_t record_size = sizeof(header) + header.foreground_size + header.background_size;
+        if(offset + record_size > file_size)
+        {
+            break;
+        }
+
+        log->record_offsets[header.frame] = offset;
+        ++log->num_records;
+        offset += record_size;
+        fseek(log->file, offset, SEEK_SET);
+    }
+
+    // NOTE(istarnion): A record that was cut short when the inspector died
+    // is dropped, so that new records are appended right after the last good one
+    if(offset < file_size)
+    {
+        printf("Dropping %zu bytes of broken label records from %s\n",
+               file_size - offset, log->filename);
+        fflush(log->file);
+        ftruncate(fileno(log->file), offset);
+    }
+
+    if(log->num_records > 0)
+    {
+        printf("Loaded %zu label records from %s\n", log->num_records, log->filename);
+    }
+}
+
+void
+CloseLabelLog(LabelLog *log)
+{
+    if(log->file)
+    {
+        fclose(log->file);
+    }
+
+    free(log->record_offsets);
+    memset(log, 0, sizeof(LabelLog));
+}
+
+void
+DeleteLabelLog(LabelLog *log)
+{
+    char filename[sizeof(log->filename)];
+    strcpy(filename, log->filename);
+    CloseLabelLog(log);
+    remove(filename);
+}
+
+bool
+AppendLabels(LabelLog *log, size_t frame, size_t num_points, const MagicMotionTag *tags)
+{
+    if(frame >= log->num_frames)
+    {
+        return false;
+    }
+
+    if(!log->file)
+    {
+        log->file = fopen(log->filename, "wb+");
+        if(!log->file)
+        {
+            printf("Failed to create label log %s\n", log->filename);
+            return false;
+        }
+    }
+
+    uint8_t *record = (uint8_t *)malloc(sizeof(LabelRecordHeader) + 2*(num_points+1));
+    uint8_t *runs = record + sizeof(LabelRecordHeader);
+
+    LabelRecordHeader header;
+    header.magic = LABEL_RECORD_MAGIC;
+    header.frame = (uint32_t)frame;
+    header.num_points = (uint32_t)num_points;
+    header.foreground_size = (uint32_t)_EncodeRuns(tags, num_points, TAG_FOREGROUND, runs);
+    header.background_size = (uint32_t)_EncodeRuns(tags, num_points, TAG_BACKGROUND,
+                                                    runs + header.foreground_size);
+    memcpy(record, &header, sizeof(header));
+
+    size_t record_size = sizeof(header) + header.foreground_size + header.background_size;
+
+    fseek(log->file, 0, SEEK_END);
+    size_t offset = ftell(log->file);
+    bool ok = fwrite(record, 1, record_size, log->file) == record_size;
+    ok = (fflush(log->file) == 0) && ok;
+    free(record);
+
+    if(!ok)
+    {
+        printf("Failed to write labels of frame %zu to %s\n", frame+1, log->filename);
+        return false;
+    }
+
+    log->record_offsets[frame] = offset;
+    ++log->num_records;
+    return true;
+}
+
+bool
+HasLabels(const LabelLog *log, size_t frame)
+{
+    return frame < log->num_frames &&
+           log->record_offsets[frame] != NO_LABEL_RECORD;
+}
+
+bool
+ApplyLabels(LabelLog *log, size_t frame, size_t num_points, MagicMotionTag *tags)
+{
+    if(!HasLabels(log, frame))
+    {
+        return false;
+    }
+
+    LabelRecordHeader header;
+    fseek(log->file, log->record_offsets[frame], SEEK_SET);
+    if(fread(&header, sizeof(header), 1, log->file) != 1 ||
+       header.num_points != num_points)
+    {
+        printf("Labels of frame %zu do not match the recording\n", frame+1);
+        return false;
+    }
+
+    size_t runs_size = header.foreground_size + header.background_size;
+    uint8_t *runs = (uint8_t *)malloc(runs_size);
+    MagicMotionTag *labeled = (MagicMotionTag *)malloc(sizeof(MagicMotionTag)*num_points);
+    bool ok = fread(runs, 1, runs_size, log->file) == runs_size;
+    if(ok)
+    {
+        for(size_t i=0; i<num_points; ++i)
+        {
+            labeled[i] = (MagicMotionTag)(tags[i] & ~(TAG_FOREGROUND | TAG_BACKGROUND));
+        }
+
+        // Leave the tags alone unless both masks are good
+        ok = _DecodeRuns(runs, header.foreground_size, num_points, TAG_FOREGROUND, labeled) &&
+             _DecodeRuns(runs + header.foreground_size, header.background_size,
+                         num_points, TAG_BACKGROUND, labeled);
+        if(ok)
+        {
+            memcpy(tags, labeled, sizeof(MagicMotionTag)*num_points);
+        }
+    }
+
+    free(labeled);
+    free(runs);
+
+    if(!ok)
+    {
+        printf("Labels of frame %zu are corrupt\n", frame+1);
+    }
+
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef LABEL_LOG_H_
+#define LABEL_LOG_H_
+
+#include "magic_motion.h" // MagicMotionTag
+#include <stdio.h>
+#include <stddef.h>
+
+// Label edits made in the inspector are appended to a sidecar file next to
+// the recording, instead of rewriting the recording itself. Each record holds
+// the foreground and background masks of one frame, run length encoded, and
+// the last record of a frame wins. The inspector merges the records into the
+// frames as it loads them, and "Compact labels" writes them into the recording.
+typedef struct
+{
+    FILE *file;
+    char filename[256];
+    size_t num_frames;
+    size_t *record_offsets; // Latest record of each frame, or NO_LABEL_RECORD
+    size_t num_records;
+} LabelLog;
+
+#define NO_LABEL_RECORD ((size_t)-1)
+
+void OpenLabelLog(LabelLog *log, const char *recording_filename, size_t num_frames);
+void CloseLabelLog(LabelLog *log);
+void DeleteLabelLog(LabelLog *log);
+
+bool AppendLabels(LabelLog *log, size_t frame, size_t num_points, const MagicMotionTag *tags);
+bool HasLabels(const LabelLog *log, size_t frame);
+
+// Overwrites the foreground and background bits of the tags of the given
+// frame. Returns false if the frame has no labels, or they do not fit.
+bool ApplyLabels(LabelLog *log, size_t frame, size_t num_points, MagicMotionTag *tags);
+
+#endif /* end of include guard: LABEL_LOG_H_ */
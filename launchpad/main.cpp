@@ -8,6 +8,9 @@
 #include "renderer.cpp"
 #include "camera.cpp"
 #include "video_recorder.cpp"
+#include "label_log.cpp"
+#include "frame_cache.cpp"
+#include "point_index.cpp"
 
 #include "scene_viewer.cpp"
 #include "scene_inspector.cpp"
@@ -138,6 +141,52 @@ main(int num_args, char *args[])
                 ImGui::Text("Frametime avg: %.00f ms, min: %.00f ms, max: %.00f ms",
                             average_frametime, min_frametime, max_frametime);
                 ImGui::PlotLines("##", frametimes_ms, max_num_frametime_samples);
+
+                const FrameStatsHistory *stats = MagicMotion_GetFrameStats();
+                ImGui::Separator();
+                if(stats->num_frames == 0)
+                {
+                    ImGui::Text("No frames captured");
+                }
+                else
+                {
+                    // Averages over the history, oldest frame first in the plot
+                    double wall_ms[NUM_FRAME_STAGES] = {};
+                    double cpu_ms[NUM_FRAME_STAGES] = {};
+                    float capture_ms[FRAME_STATS_HISTORY_LENGTH];
+                    float max_capture_ms = 0.0f;
+                    for(unsigned int i=0; i<stats->num_frames; ++i)
+                    {
+                        unsigned int slot = (stats->newest + FRAME_STATS_HISTORY_LENGTH - (stats->num_frames-1) + i) %
+                                            FRAME_STATS_HISTORY_LENGTH;
+                        const FrameStats *frame = &stats->frames[slot];
+                        for(int stage=0; stage<NUM_FRAME_STAGES; ++stage)
+                        {
+                            wall_ms[stage] += frame->wall_ns[stage] / 1e6 / stats->num_frames;
+                            cpu_ms[stage] += frame->cpu_ns[stage] / 1e6 / stats->num_frames;
+                        }
+
+                        capture_ms[i] = frame->total_wall_ns / 1e6f;
+                        if(capture_ms[i] > max_capture_ms) max_capture_ms = capture_ms[i];
+                    }
+
+                    ImGui::Text("Capture, last %u frames (ms, wall / CPU):", stats->num_frames);
+                    for(int stage=0; stage<NUM_FRAME_STAGES; ++stage)
+                    {
+                        ImGui::Text("  %-16s %7.2f / %7.2f",
+                                    MagicMotion_GetFrameStageName((FrameStage)stage),
+                                    wall_ms[stage], cpu_ms[stage]);
+                    }
+
+                    ImGui::Text("Capture max: %.2f ms", max_capture_ms);
+                    ImGui::PlotLines("##capture", capture_ms, stats->num_frames);
+
+                    const FrameStats *latest = &stats->frames[stats->newest];
+                    ImGui::Text("Points: %u, in bounds: %u, foreground: %u",
+                                latest->num_points, latest->num_points_in_bounds, latest->num_foreground);
+                    ImGui::Text("Occupied voxels: %u", latest->num_occupied_voxels);
+                    ImGui::Text("Dropped sensor frames: %llu", (unsigned long long)stats->total_dropped);
+                }
             }
 
             ImGui::End();
@@ -0,0 +1,200 @@
+#include "point_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+// NaN goes in the first cell, and anything out of bounds in the nearest one.
+// Never decreases as v increases, which QueryPointIndex depends on.
+static inline int
+_CellCoord(float v, float origin, float inverse_cell_size, int dim)
+{
+    float c = (v - origin) * inverse_cell_size;
+    if(!(c >= 0.0f))
+    {
+        return 0;
+    }
+    else if(c >= (float)dim)
+    {
+        return dim-1;
+    }
+
+    return (int)c;
+}
+
+static inline size_t
+_CellOf(const PointIndex *index, V3 p)
+{
+    int x = _CellCoord(p.x, index->origin.x, index->inverse_cell_size, index->dims[0]);
+    int y = _CellCoord(p.y, index->origin.y, index->inverse_cell_size, index->dims[1]);
+    int z = _CellCoord(p.z, index->origin.z, index->inverse_cell_size, index->dims[2]);
+    return x + (size_t)index->dims[0]*(y + (size_t)index->dims[1]*z);
+}
+
+void
+BuildPointIndex(PointIndex *index, const V3 *points, size_t num_points)
+{
+    index->num_points = num_points;
+
+    // Bounds of the finite points
+    V3 lo = { FLT_MAX, FLT_MAX, FLT_MAX };
+    V3 hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for(size_t i=0; i<num_points; ++i)
+    {
+        for(int axis=0; axis<3; ++axis)
+        {
+            float v = points[i].v[axis];
+            if(v >= -FLT_MAX && v <= FLT_MAX)
+            {
+                lo.v[axis] = MIN(lo.v[axis], v);
+                hi.v[axis] = MAX(hi.v[axis], v);
+            }
+        }
+    }
+
+    float extents[3];
+    float max_extent = 0;
+    for(int axis=0; axis<3; ++axis)
+    {
+        if(lo.v[axis] > hi.v[axis])
+        {
+            lo.v[axis] = hi.v[axis] = 0;
+        }
+
+        extents[axis] = hi.v[axis] - lo.v[axis];
+        max_extent = MAX(max_extent, extents[axis]);
+    }
+
+    // Cubic cells, sized for POINTS_PER_CELL points in a cell if the points
+    // were spread evenly. Flat clouds get no more than MAX_INDEX_DIM cells
+    // across their widest side.
+    float cell_size = 1.0f;
+    if(max_extent > 0)
+    {
+        float min_cell_size = max_extent / MAX_INDEX_DIM;
+        double volume = 1.0;
+        for(int axis=0; axis<3; ++axis)
+        {
+            volume *= MAX(extents[axis], min_cell_size);
+        }
+
+        double target_cells = MAX(num_points / POINTS_PER_CELL, (size_t)1);
+        cell_size = MAX((float)cbrt(volume / target_cells), min_cell_size);
+    }
+
+    index->origin = lo;
+    index->inverse_cell_size = 1.0f / cell_size;
+
+    size_t num_cells = 1;
+    for(int axis=0; axis<3; ++axis)
+    {
+        index->dims[axis] = MIN((int)(extents[axis] * index->inverse_cell_size) + 1, MAX_INDEX_DIM);
+        num_cells *= index->dims[axis];
+    }
+
+    if(index->cell_capacity < num_cells+1)
+    {
+        free(index->cell_starts);
+        index->cell_starts = (uint32_t *)malloc(sizeof(uint32_t)*(num_cells+1));
+        index->cell_capacity = num_cells+1;
+    }
+
+    if(index->point_capacity < num_points)
+    {
+        free(index->points);
+        index->points = (uint32_t *)malloc(sizeof(uint32_t)*num_points);
+        index->point_capacity = num_points;
+    }
+
+    // Counting sort by cell
+    uint32_t *starts = index->cell_starts;
+    memset(starts, 0, sizeof(uint32_t)*(num_cells+1));
+    for(size_t i=0; i<num_points; ++i)
+    {
+        ++starts[_CellOf(index, points[i])+1];
+    }
+
+    for(size_t c=0; c<num_cells; ++c)
+    {
+        starts[c+1] += starts[c];
+    }
+
+    // Every cell start ends up where the next cell starts
+    for(size_t i=0; i<num_points; ++i)
+    {
+        index->points[starts[_CellOf(index, points[i])]++] = (uint32_t)i;
+    }
+
+    memmove(starts+1, starts, sizeof(uint32_t)*num_cells);
+    starts[0] = 0;
+}
+
+void
+FreePointIndex(PointIndex *index)
+{
+    free(index->cell_starts);
+    free(index->points);
+    memset(index, 0, sizeof(PointIndex));
+}
+
+size_t
+QueryPointIndex(const PointIndex *index, const V3 *points, V3 min, V3 max, size_t *result)
+{
+    if(index->num_points == 0)
+    {
+        return 0;
+    }
+
+    int lo[3], hi[3];
+    for(int axis=0; axis<3; ++axis)
+    {
+        lo[axis] = _CellCoord(min.v[axis], index->origin.v[axis], index->inverse_cell_size, index->dims[axis]);
+        hi[axis] = _CellCoord(max.v[axis], index->origin.v[axis], index->inverse_cell_size, index->dims[axis]);
+    }
+
+    size_t count = 0;
+    for(int z=lo[2]; z<=hi[2]; ++z)
+    {
+        for(int y=lo[1]; y<=hi[1]; ++y)
+        {
+            for(int x=lo[0]; x<=hi[0]; ++x)
+            {
+                size_t cell = x + (size_t)index->dims[0]*(y + (size_t)index->dims[1]*z);
+                uint32_t begin = index->cell_starts[cell];
+                uint32_t end = index->cell_starts[cell+1];
+
+                // NOTE(istarnion): The points of a cell strictly between the
+                // cells of min and max are inside the box on that axis, as
+                // cell coordinates never decrease along an axis. The edge
+                // cells, where NaN and infinite points go, never are.
+                bool inside = x > lo[0] && x < hi[0] &&
+                              y > lo[1] && y < hi[1] &&
+                              z > lo[2] && z < hi[2];
+                if(inside)
+                {
+                    for(uint32_t k=begin; k<end; ++k)
+                    {
+                        result[count++] = index->points[k];
+                    }
+
+                    continue;
+                }
+
+                for(uint32_t k=begin; k<end; ++k)
+                {
+                    uint32_t i = index->points[k];
+                    V3 p = points[i];
+                    if(!(p.x < min.x || p.x > max.x ||
+                         p.y < min.y || p.y > max.y ||
+                         p.z < min.z || p.z > max.z))
+                    {
+                        result[count++] = i;
+                    }
+                }
+            }
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,38 @@
+#ifndef POINT_INDEX_H_
+#define POINT_INDEX_H_
+
+#include "magic_math.h" // V3
+#include <stddef.h>
+#include <stdint.h>
+
+// A uniform grid over the points of one frame, so the boxinator only looks at
+// the points in the cells its box overlaps. The points are bucketed by cell
+// with a counting sort, so building it is two passes over the points. The
+// cell size follows the bounds and the number of points, to keep around
+// POINTS_PER_CELL points in a cell.
+typedef struct
+{
+    V3 origin; // Corner of the first cell
+    float inverse_cell_size;
+    int dims[3];
+
+    uint32_t *cell_starts; // Where the points of every cell start in points, one past the end last
+    uint32_t *points;      // Point indices, ordered by cell
+    size_t num_points;
+
+    // Grows, but never shrinks, so scrubbing does not allocate
+    size_t cell_capacity;
+    size_t point_capacity;
+} PointIndex;
+
+#define POINTS_PER_CELL 8
+#define MAX_INDEX_DIM 256
+
+void BuildPointIndex(PointIndex *index, const V3 *points, size_t num_points);
+void FreePointIndex(PointIndex *index);
+
+// Writes the indices of the points inside the box to result, which must
+// have room for all points, in no particular order. Returns how many there are.
+size_t QueryPointIndex(const PointIndex *index, const V3 *points, V3 min, V3 max, size_t *result);
+
+#endif /* end of include guard: POINT_INDEX_H_ */
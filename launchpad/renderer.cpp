@@ -1,6 +1,8 @@
 #include "renderer.h"
 
 #include <assert.h>
+#include <string.h>
+#include <stddef.h>
 #include <SDL.h>
 #include "gl.h"
 #include "ui.h"
@@ -16,14 +18,57 @@ typedef struct
     GLint mvp_loc;
 } RenderData;
 
+// Cubes are drawn instanced, with the center and color of each cube as
+// per-instance attributes, so any number of them is a single draw.
+typedef struct
+{
+    V3 center;
+    ColorPixel color;
+    uint8_t padding;
+} CubeInstance;
+
 typedef struct
 {
     GLuint shader;
     GLint mvp_loc;
-    GLint positions_loc;
-    GLint colors_loc;
+
+    GLuint instance_buffer;
+    size_t instance_capacity;
 } RenderInstancedData;
 
+#define MIN_CUBE_INSTANCES 1024
+
+// Point clouds are streamed through a ring of buffer segments, each big enough
+// for a whole cloud. A frame writes its points straight into one segment while
+// the GPU may still be drawing from the others, and a fence per segment tells
+// us when it is done with it.
+#define POINT_RING_SEGMENTS 3
+#define MIN_POINT_RING_CAPACITY (1 << 16)
+
+typedef struct
+{
+    GLuint vertex_array;
+    GLuint position_buffer;
+    GLuint color_buffer;
+    GLuint tag_buffer;
+
+    GLuint shader;
+    GLint mvp_loc;
+    GLint remove_background_loc;
+    GLint visualize_bgsub_loc;
+    bool remove_background;
+    bool visualize_bgsub;
+
+    bool persistent;   // Mapped once for good, instead of around every frame
+    size_t capacity;   // Points per segment
+    int segment;       // The segment written to by the current or last frame
+    GLsync fences[POINT_RING_SEGMENTS];
+
+    V3 *positions;     // Start of the whole ring while persistently mapped
+    uint32_t *colors;  // RGBA8, see RendererBeginPointCloud
+    MagicMotionTag *tags;
+} PointRing;
+
 static SDL_Window *window;
 static SDL_GLContext gl_context;
 static int width;
@@ -35,12 +80,45 @@ static Mat4 projection_view_matrix;
 static RenderData frustum_data;
 static RenderData cube_data;
 static RenderData wire_cube_data;
-static RenderData point_data;
+static PointRing point_ring;
 static RenderInstancedData cube_instanced_data;
 static GLuint full_quad_shader;
 
+// Sensor previews show a RGBA8 texture. Color frames are uploaded straight
+// into it. Depth frames are uploaded as floats into a second texture, and
+// colormapped into the first by drawing into it.
+struct PreviewTexture
+{
+    GLuint texture;
+    GLuint unpack_buffer;
+    int width;
+    int height;
+
+    bool is_depth;
+    GLuint depth_texture;
+    GLuint framebuffer;
+};
+
+static struct
+{
+    GLuint vertex_array; // Empty, the shader makes its own triangle
+    GLuint shader;
+    GLint max_depth_loc;
+    GLint step_loc;
+} depth_preview_data;
+
 static GLuint _CreateShaderProgram(const char *source_file);
 static void _DeleteRenderData(RenderData *data);
+static void _ResizePreview(PreviewTexture *preview, int width, int height, bool is_depth);
+static void _UploadPreviewPixels(PreviewTexture *preview, GLuint texture, const void *pixels,
+                                 size_t pixel_size, GLenum format, GLenum type);
+static CubeInstance *_MapCubeInstances(size_t num_cubes);
+static void _DrawCubeInstances(Mat4 mvp, size_t num_cubes);
+static void _WaitForFence(GLsync *fence);
+static void *_MapRingSegment(GLuint buffer, size_t element_size, size_t first, size_t count);
+static void _UnmapRingSegments(void);
+static void _AllocatePointRing(size_t capacity);
+static void _DeletePointRing(void);
 
 void
 RendererInit(const char *title, int width, int height)
@@ -174,10 +252,25 @@ RendererInit(const char *title, int width, int height)
         cube_data.shader = _CreateShaderProgram("shaders/cube.glsl");
         cube_data.mvp_loc = glGetUniformLocation(cube_data.shader, "MVP");
 
+        // NOTE(istarnion): The instance attributes live in the cube VAO too.
+        // cube.glsl does not read them, but the buffer is never empty, so
+        // plain cube draws never point them at nothing.
+        glGenBuffers(1, &cube_instanced_data.instance_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, cube_instanced_data.instance_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(CubeInstance)*MIN_CUBE_INSTANCES, NULL, GL_STREAM_DRAW);
+        cube_instanced_data.instance_capacity = MIN_CUBE_INSTANCES;
+
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
+                              (GLvoid *)offsetof(CubeInstance, center));
+        glVertexAttribDivisor(2, 1);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(CubeInstance),
+                              (GLvoid *)offsetof(CubeInstance, color));
+        glVertexAttribDivisor(3, 1);
+
         cube_instanced_data.shader = _CreateShaderProgram("shaders/instanced_cubes.glsl");
         cube_instanced_data.mvp_loc = glGetUniformLocation(cube_instanced_data.shader, "MVP");
-        cube_instanced_data.positions_loc = glGetUniformLocation(cube_instanced_data.shader, "Positions");
-        cube_instanced_data.colors_loc = glGetUniformLocation(cube_instanced_data.shader, "Colors");
 
         // Then for the wire cube
         static const GLushort wire_indices[] = {
@@ -206,30 +299,44 @@ RendererInit(const char *title, int width, int height)
     }
 
     {
-        glGenVertexArrays(1, &point_data.vertex_array);
-        glBindVertexArray(point_data.vertex_array);
-
-        glGenBuffers(1, &point_data.vertex_buffer);
-        glBindBuffer(GL_ARRAY_BUFFER, point_data.vertex_buffer);
-
+        // NOTE(istarnion): Immutable storage is GL 4.4, and we ask for 3.3 to
+        // run on macOS. Without it, the ring is mapped unsynchronized around
+        // every frame instead, and the fences keep that just as safe.
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        point_ring.persistent = glBufferStorage &&
+                                (major > 4 || (major == 4 && minor >= 4) ||
+                                 SDL_GL_ExtensionSupported("GL_ARB_buffer_storage"));
+
+        glGenVertexArrays(1, &point_ring.vertex_array);
+        glBindVertexArray(point_ring.vertex_array);
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float)*3, 0);
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
 
-        // We're abusing the element buffer member here to do non-interlaced position and color
-        // Consider changing the RenderData struct to better suit the various needs
-        glGenBuffers(1, &point_data.element_buffer);
-        glBindBuffer(GL_ARRAY_BUFFER, point_data.element_buffer);
+        _AllocatePointRing(MIN_POINT_RING_CAPACITY);
 
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(float)*3, 0);
+        point_ring.shader = _CreateShaderProgram("shaders/point.glsl");
+        point_ring.mvp_loc = glGetUniformLocation(point_ring.shader, "MVP");
+        point_ring.remove_background_loc = glGetUniformLocation(point_ring.shader, "RemoveBackground");
+        point_ring.visualize_bgsub_loc = glGetUniformLocation(point_ring.shader, "VisualizeBGSub");
 
-        point_data.shader = _CreateShaderProgram("shaders/point.glsl");
-        point_data.mvp_loc = glGetUniformLocation(cube_data.shader, "MVP");
+        glUseProgram(point_ring.shader);
+        glUniform1ui(glGetUniformLocation(point_ring.shader, "ForegroundTag"), TAG_FOREGROUND);
+        glUniform1ui(glGetUniformLocation(point_ring.shader, "BackgroundTag"), TAG_BACKGROUND);
     }
 
     {
         full_quad_shader = _CreateShaderProgram("shaders/full_quad.glsl");
     }
+
+    {
+        glGenVertexArrays(1, &depth_preview_data.vertex_array);
+        depth_preview_data.shader = _CreateShaderProgram("shaders/depth_preview.glsl");
+        depth_preview_data.max_depth_loc = glGetUniformLocation(depth_preview_data.shader, "MaxDepth");
+        depth_preview_data.step_loc = glGetUniformLocation(depth_preview_data.shader, "Step");
+    }
 }
 
 void
@@ -237,9 +344,13 @@ RendererQuit(void)
 {
     _DeleteRenderData(&frustum_data);
     _DeleteRenderData(&cube_data);
-    _DeleteRenderData(&point_data);
+    _DeletePointRing();
 
     glDeleteProgram(cube_instanced_data.shader);
+    glDeleteBuffers(1, &cube_instanced_data.instance_buffer);
+
+    glDeleteProgram(depth_preview_data.shader);
+    glDeleteVertexArrays(1, &depth_preview_data.vertex_array);
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
@@ -351,6 +462,73 @@ RendererDestroyTexture(void *texture)
     glDeleteTextures(1, &tex);
 }
 
+PreviewTexture *
+RendererCreatePreviewTexture(void)
+{
+    PreviewTexture *preview = (PreviewTexture *)calloc(1, sizeof(PreviewTexture));
+    glGenTextures(1, &preview->texture);
+    glGenBuffers(1, &preview->unpack_buffer);
+
+    return preview;
+}
+
+void
+RendererDestroyPreviewTexture(PreviewTexture *preview)
+{
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDeleteTextures(1, &preview->texture);
+    glDeleteTextures(1, &preview->depth_texture);
+    glDeleteFramebuffers(1, &preview->framebuffer);
+    glDeleteBuffers(1, &preview->unpack_buffer);
+    free(preview);
+}
+
+void *
+RendererGetPreviewTexture(PreviewTexture *preview)
+{
+    return (void *)(intptr_t)preview->texture;
+}
+
+void
+RendererUpdateColorPreview(PreviewTexture *preview, const ColorPixel *pixels, int width, int height)
+{
+    _ResizePreview(preview, width, height, false);
+    _UploadPreviewPixels(preview, preview->texture, pixels, sizeof(ColorPixel), GL_RGB, GL_UNSIGNED_BYTE);
+}
+
+void
+RendererUpdateDepthPreview(PreviewTexture *preview, const float *depths, int width, int height,
+                           float max_depth, float step)
+{
+    _ResizePreview(preview, width, height, true);
+    _UploadPreviewPixels(preview, preview->depth_texture, depths, sizeof(float), GL_RED, GL_FLOAT);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, preview->framebuffer);
+    glViewport(0, 0, width, height);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, preview->depth_texture);
+    glBindVertexArray(depth_preview_data.vertex_array);
+    glUseProgram(depth_preview_data.shader);
+    glUniform1f(depth_preview_data.max_depth_loc, max_depth);
+    glUniform1f(depth_preview_data.step_loc, step);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glEnable(GL_BLEND);
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    check_gl_errors();
+}
+
 void
 RenderWireCube(V3 center, V3 size)
 {
@@ -377,59 +555,162 @@ RenderCube(V3 center, V3 size)
     glDrawElements(GL_TRIANGLES, 6*6, GL_UNSIGNED_SHORT, NULL);
 }
 
+static inline ColorPixel
+_V3ToColor(V3 c)
+{
+    return (ColorPixel){
+        (uint8_t)(MIN(MAX(c.x, 0.0f), 1.0f) * 255.0f),
+        (uint8_t)(MIN(MAX(c.y, 0.0f), 1.0f) * 255.0f),
+        (uint8_t)(MIN(MAX(c.z, 0.0f), 1.0f) * 255.0f)
+    };
+}
+
 void
-RenderCubes(V3 *centers, V3 *colors, size_t num_cubes)
+RenderCubes(const V3 *centers, const V3 *colors, size_t num_cubes)
 {
-    glBindVertexArray(cube_data.vertex_array);
-    glUseProgram(cube_instanced_data.shader);
+    CubeInstance *instances = _MapCubeInstances(num_cubes);
+    if(instances)
+    {
+        for(size_t i=0; i<num_cubes; ++i)
+        {
+            instances[i].center = centers[i];
+            instances[i].color = _V3ToColor(colors[i]);
+        }
 
-    glUniformMatrix4fv(cube_instanced_data.mvp_loc, 1, GL_FALSE, (float *)&projection_view_matrix);
+        _DrawCubeInstances(projection_view_matrix, num_cubes);
+    }
+}
 
-    // Draw in instanced batches of up to 512 cubes at a time
-    for(size_t i=0; i<num_cubes; i+=256)
+void
+RenderVoxels(const Voxel *voxels, const uint32_t *indices, size_t num_indices, uint32_t min_point_count)
+{
+    CubeInstance *instances = _MapCubeInstances(num_indices);
+    if(instances)
     {
-        int num_cubes_to_draw = MIN(256, num_cubes-i);
-        glUniform3fv(cube_instanced_data.positions_loc, num_cubes_to_draw, (GLfloat *)(centers+i));
-        glUniform3fv(cube_instanced_data.colors_loc, num_cubes_to_draw, (GLfloat *)(colors+i));
-        glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_SHORT, NULL, num_cubes_to_draw);
+        size_t num_cubes = 0;
+        for(size_t i=0; i<num_indices; ++i)
+        {
+            const Voxel *voxel = &voxels[indices[i]];
+            if(voxel->point_count >= min_point_count)
+            {
+                instances[num_cubes].center = VOXEL_TO_WORLD(indices[i]);
+                instances[num_cubes].color = voxel->color;
+                ++num_cubes;
+            }
+        }
+
+        _DrawCubeInstances(projection_view_matrix, num_cubes);
     }
-
-    check_gl_errors();
 }
 
 void
 RenderColoredCube(V3 center, V3 size, V3 color)
 {
-    glBindVertexArray(cube_data.vertex_array);
-    glUseProgram(cube_instanced_data.shader);
+    CubeInstance *instance = _MapCubeInstances(1);
+    if(instance)
+    {
+        instance->center = (V3){ 0, 0, 0 };
+        instance->color = _V3ToColor(color);
 
-    Mat4 model_matrix = TransformMat4(center, size, MakeV3(0, 0, 0));
-    Mat4 mvp = MulMat4(model_matrix, projection_view_matrix);
-    glUniformMatrix4fv(cube_instanced_data.mvp_loc, 1, GL_FALSE, (float *)&mvp);
+        Mat4 model_matrix = TransformMat4(center, size, MakeV3(0, 0, 0));
+        _DrawCubeInstances(MulMat4(model_matrix, projection_view_matrix), 1);
+    }
+}
 
-    V3 zero = (V3){ 0, 0, 0 };
-    glUniform3fv(cube_instanced_data.positions_loc, 1, (GLfloat *)&zero);
-    glUniform3fv(cube_instanced_data.colors_loc, 1, (GLfloat *)&color);
-    glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_SHORT, NULL, 1);
+bool
+RendererBeginPointCloud(size_t max_points, V3 **positions, uint32_t **colors, MagicMotionTag **tags)
+{
+    if(max_points == 0)
+    {
+        return false;
+    }
 
-    check_gl_errors();
+    if(max_points > point_ring.capacity)
+    {
+        size_t capacity = point_ring.capacity;
+        while(capacity < max_points)
+        {
+            capacity *= 2;
+        }
+
+        _AllocatePointRing(capacity);
+    }
+
+    point_ring.segment = (point_ring.segment + 1) % POINT_RING_SEGMENTS;
+    _WaitForFence(&point_ring.fences[point_ring.segment]);
+
+    size_t first = point_ring.segment * point_ring.capacity;
+    if(point_ring.persistent)
+    {
+        *positions = point_ring.positions + first;
+        *colors = point_ring.colors + first;
+        *tags = point_ring.tags + first;
+    }
+    else
+    {
+        *positions = (V3 *)_MapRingSegment(point_ring.position_buffer, sizeof(V3), first, max_points);
+        *colors = (uint32_t *)_MapRingSegment(point_ring.color_buffer, sizeof(uint32_t), first, max_points);
+        *tags = (MagicMotionTag *)_MapRingSegment(point_ring.tag_buffer, sizeof(MagicMotionTag), first, max_points);
+
+        if(!*positions || !*colors || !*tags)
+        {
+            fprintf(stderr, "Failed to map the point cloud buffers\n");
+            _UnmapRingSegments();
+            return false;
+        }
+    }
+
+    return true;
 }
 
 void
-RenderPointCloud(V3 *points, V3 *colors, size_t num_points)
+RendererEndPointCloud(size_t num_points)
 {
-    glBindVertexArray(point_data.vertex_array);
-    glUseProgram(point_data.shader);
+    if(!point_ring.persistent)
+    {
+        _UnmapRingSegments();
+    }
 
-    glUniformMatrix4fv(point_data.mvp_loc, 1, GL_FALSE, (float *)&projection_view_matrix);
+    if(num_points > 0)
+    {
+        glBindVertexArray(point_ring.vertex_array);
+        glUseProgram(point_ring.shader);
 
-    glBindBuffer(GL_ARRAY_BUFFER, point_data.vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(V3)*num_points, points, GL_STREAM_DRAW);
+        glUniformMatrix4fv(point_ring.mvp_loc, 1, GL_FALSE, (float *)&projection_view_matrix);
+        glUniform1i(point_ring.remove_background_loc, point_ring.remove_background);
+        glUniform1i(point_ring.visualize_bgsub_loc, point_ring.visualize_bgsub);
 
-    glBindBuffer(GL_ARRAY_BUFFER, point_data.element_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(V3)*num_points, colors, GL_STREAM_DRAW);
+        glDrawArrays(GL_POINTS, point_ring.segment * point_ring.capacity, num_points);
+    }
+
+    point_ring.fences[point_ring.segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
-    glDrawArrays(GL_POINTS, 0, num_points);
+    check_gl_errors();
+}
+
+void
+RenderPointCloud(const V3 *points, const ColorPixel *colors, const MagicMotionTag *tags, size_t num_points)
+{
+    V3 *gpu_points;
+    uint32_t *gpu_colors;
+    MagicMotionTag *gpu_tags;
+    if(RendererBeginPointCloud(num_points, &gpu_points, &gpu_colors, &gpu_tags))
+    {
+        memcpy(gpu_points, points, sizeof(V3)*num_points);
+        for(size_t i=0; i<num_points; ++i)
+        {
+            gpu_colors[i] = PackPointColor(colors[i]);
+        }
+        memcpy(gpu_tags, tags, sizeof(MagicMotionTag)*num_points);
+        RendererEndPointCloud(num_points);
+    }
+}
+
+void
+RendererSetPointCloudFilter(bool remove_background, bool visualize_bgsub)
+{
+    point_ring.remove_background = remove_background;
+    point_ring.visualize_bgsub = visualize_bgsub;
 }
 
 void
@@ -539,6 +820,271 @@ _CreateShaderProgram(const char *source_file)
     return shader;
 }
 
+// Orphans the instance buffer and maps room for num_cubes instances in the
+// new storage, so we never wait for the GPU to finish the last cubes drawn.
+// Draw them with _DrawCubeInstances.
+static CubeInstance *
+_MapCubeInstances(size_t num_cubes)
+{
+    if(num_cubes == 0)
+    {
+        return NULL;
+    }
+
+    while(cube_instanced_data.instance_capacity < num_cubes)
+    {
+        cube_instanced_data.instance_capacity *= 2;
+    }
+
+    size_t size = sizeof(CubeInstance)*cube_instanced_data.instance_capacity;
+    glBindBuffer(GL_ARRAY_BUFFER, cube_instanced_data.instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+    CubeInstance *instances = (CubeInstance *)glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(CubeInstance)*num_cubes,
+                                                               GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(!instances)
+    {
+        fprintf(stderr, "Failed to map the cube instance buffer\n");
+    }
+
+    return instances;
+}
+
+static void
+_DrawCubeInstances(Mat4 mvp, size_t num_cubes)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, cube_instanced_data.instance_buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+
+    if(num_cubes > 0)
+    {
+        glBindVertexArray(cube_data.vertex_array);
+        glUseProgram(cube_instanced_data.shader);
+        glUniformMatrix4fv(cube_instanced_data.mvp_loc, 1, GL_FALSE, (float *)&mvp);
+
+        glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_SHORT, NULL, num_cubes);
+    }
+
+    check_gl_errors();
+}
+
+static void
+_CreatePreviewStorage(GLuint texture, GLint internal_format, GLint filter, int width, int height, GLenum format, GLenum type)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, NULL);
+}
+
+// Reallocates the textures only when the size or kind of image changes
+static void
+_ResizePreview(PreviewTexture *preview, int width, int height, bool is_depth)
+{
+    if(preview->width == width && preview->height == height && preview->is_depth == is_depth)
+    {
+        return;
+    }
+
+    preview->width = width;
+    preview->height = height;
+    preview->is_depth = is_depth;
+
+    _CreatePreviewStorage(preview->texture, GL_RGBA8, GL_LINEAR, width, height, GL_RGBA, GL_UNSIGNED_BYTE);
+
+    if(is_depth)
+    {
+        if(!preview->depth_texture)
+        {
+            glGenTextures(1, &preview->depth_texture);
+            glGenFramebuffers(1, &preview->framebuffer);
+        }
+
+        // Depths should not be blended between pixels before they are colormapped
+        _CreatePreviewStorage(preview->depth_texture, GL_R32F, GL_NEAREST, width, height, GL_RED, GL_FLOAT);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, preview->framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, preview->texture, 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            fprintf(stderr, "Depth preview framebuffer is incomplete\n");
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+}
+
+// Copies the pixels into the unpack buffer, which is orphaned first so we
+// never wait for the last upload, and lets the driver copy them into the
+// texture from there when it gets to it.
+static void
+_UploadPreviewPixels(PreviewTexture *preview, GLuint texture, const void *pixels,
+                     size_t pixel_size, GLenum format, GLenum type)
+{
+    size_t size = pixel_size * preview->width * preview->height;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, preview->unpack_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    void *mapping = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(mapping)
+    {
+        memcpy(mapping, pixels, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // NOTE(istarnion): Rows of RGB pixels are not 4 byte aligned
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, preview->width, preview->height, format, type, NULL);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to map the preview pixel buffer\n");
+    }
+
+    // Anything else uploading pixels, like ImGui, expects them from client memory
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+static void
+_WaitForFence(GLsync *fence)
+{
+    if(*fence)
+    {
+        GLenum result;
+        do
+        {
+            result = glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+        } while(result == GL_TIMEOUT_EXPIRED);
+
+        if(result == GL_WAIT_FAILED)
+        {
+            fprintf(stderr, "Failed to wait for a point cloud fence\n");
+        }
+
+        glDeleteSync(*fence);
+        *fence = NULL;
+    }
+}
+
+// Only used when the ring is not persistently mapped. The fence has already
+// told us the GPU is done with this segment, so there is no need to sync.
+static void *
+_MapRingSegment(GLuint buffer, size_t element_size, size_t first, size_t count)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    return glMapBufferRange(GL_ARRAY_BUFFER, element_size*first, element_size*count,
+                            GL_MAP_WRITE_BIT |
+                            GL_MAP_INVALIDATE_RANGE_BIT |
+                            GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+static void
+_UnmapRingSegments(void)
+{
+    GLuint buffers[] = {
+        point_ring.position_buffer,
+        point_ring.color_buffer,
+        point_ring.tag_buffer
+    };
+
+    for(int i=0; i<3; ++i)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers[i]);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+}
+
+static GLuint
+_CreateRingBuffer(size_t size, void **mapping)
+{
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+    if(point_ring.persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        *mapping = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        *mapping = NULL;
+    }
+
+    return buffer;
+}
+
+// Waits for the GPU to finish with every segment, so it also serves to
+// throw the ring away.
+static void
+_ReleasePointRing(void)
+{
+    for(int i=0; i<POINT_RING_SEGMENTS; ++i)
+    {
+        _WaitForFence(&point_ring.fences[i]);
+    }
+
+    // Deleting a buffer unmaps it
+    glDeleteBuffers(1, &point_ring.position_buffer);
+    glDeleteBuffers(1, &point_ring.color_buffer);
+    glDeleteBuffers(1, &point_ring.tag_buffer);
+    point_ring.position_buffer = point_ring.color_buffer = point_ring.tag_buffer = 0;
+    point_ring.positions = NULL;
+    point_ring.colors = NULL;
+    point_ring.tags = NULL;
+}
+
+static void
+_AllocatePointRing(size_t capacity)
+{
+    _ReleasePointRing();
+
+    point_ring.capacity = capacity;
+
+    void *positions, *colors, *tags;
+    glBindVertexArray(point_ring.vertex_array);
+
+    point_ring.position_buffer = _CreateRingBuffer(sizeof(V3)*capacity*POINT_RING_SEGMENTS, &positions);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(V3), 0);
+
+    // NOTE(istarnion): Colors are four bytes, so every point's color is
+    // aligned. Three byte colors are converted on a slow path by many drivers.
+    point_ring.color_buffer = _CreateRingBuffer(sizeof(uint32_t)*capacity*POINT_RING_SEGMENTS, &colors);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(uint32_t), 0);
+
+    // NOTE(istarnion): MagicMotionTag is an enum, which is an int on
+    // everything we build for. The shader reads it as a uint.
+    point_ring.tag_buffer = _CreateRingBuffer(sizeof(MagicMotionTag)*capacity*POINT_RING_SEGMENTS, &tags);
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(MagicMotionTag), 0);
+
+    if(point_ring.persistent && (!positions || !colors || !tags))
+    {
+        fprintf(stderr, "Failed to map the point cloud buffers persistently, "
+                        "mapping them every frame instead\n");
+        point_ring.persistent = false;
+        _AllocatePointRing(capacity);
+        return;
+    }
+
+    point_ring.positions = (V3 *)positions;
+    point_ring.colors = (uint32_t *)colors;
+    point_ring.tags = (MagicMotionTag *)tags;
+}
+
+static void
+_DeletePointRing(void)
+{
+    _ReleasePointRing();
+    glDeleteProgram(point_ring.shader);
+    glDeleteVertexArrays(1, &point_ring.vertex_array);
+}
+
 static void
 _DeleteRenderData(RenderData *data)
 {
@@ -2,6 +2,9 @@
 #define RENDERER_H_
 
 #include "frustum.h"
+#include "magic_motion.h" // ColorPixel, MagicMotionTag
+#include <stdint.h>
+#include <string.h>
 
 void RendererInit(const char *title, int width, int height);
 void RendererQuit(void);
@@ -18,11 +21,55 @@ V3 RendererScreenPointToRay(float x, float y);
 void *RendererCreateTexture(const void *pixels, int width, int height);
 void RendererDestroyTexture(void *texture);
 
+// A texture for showing a sensor image that changes every frame. It keeps
+// its storage, and only reallocates it when the image changes size or kind.
+// Depth images are uploaded as is, and colormapped on the GPU from black at
+// zero to white at max_depth, in bands of step if step is above zero.
+typedef struct PreviewTexture PreviewTexture;
+
+PreviewTexture *RendererCreatePreviewTexture(void);
+void RendererDestroyPreviewTexture(PreviewTexture *preview);
+void *RendererGetPreviewTexture(PreviewTexture *preview); // For ImGui::Image
+void RendererUpdateColorPreview(PreviewTexture *preview, const ColorPixel *pixels, int width, int height);
+void RendererUpdateDepthPreview(PreviewTexture *preview, const float *depths, int width, int height,
+                                float max_depth, float step);
+
 void RenderWireCube(V3 center, V3 size);
 void RenderCube(V3 center, V3 size);
 void RenderColoredCube(V3 center, V3 size, V3 color);
-void RenderCubes(V3 *centers, V3 *colors, size_t num_cubes);
-void RenderPointCloud(V3 *points, V3 *colors, size_t num_points);
+void RenderCubes(const V3 *centers, const V3 *colors, size_t num_cubes);
+
+// Draws the voxels at the given indices that have at least min_point_count
+// points, in their average color. All in one draw.
+void RenderVoxels(const Voxel *voxels, const uint32_t *indices, size_t num_indices, uint32_t min_point_count);
+
+// Red in the first byte in memory, as GL reads GL_UNSIGNED_BYTE attributes.
+// Alpha is opaque, and not used by the point shader.
+static inline uint32_t
+PackPointColor(ColorPixel c)
+{
+    uint8_t bytes[4] = { c.r, c.g, c.b, 255 };
+    uint32_t result;
+    memcpy(&result, bytes, sizeof(uint32_t));
+    return result;
+}
+
+// Hands out room for up to max_points points, in memory the GPU reads from.
+// Write the positions, colors and tags, then draw the first num_points of
+// them with RendererEndPointCloud. Colors are RGBA8, made with
+// PackPointColor. Only one point cloud can be written at a time. Returns
+// false if there is nothing to write to, and then RendererEndPointCloud must
+// not be called.
+bool RendererBeginPointCloud(size_t max_points, V3 **positions, uint32_t **colors, MagicMotionTag **tags);
+void RendererEndPointCloud(size_t num_points);
+void RenderPointCloud(const V3 *points, const ColorPixel *colors, const MagicMotionTag *tags, size_t num_points);
+
+// How point clouds are drawn from their tags. Removing the background hides
+// every point that is not foreground, and visualizing background subtraction
+// tints foreground green and background red. Done in the shader, so it is
+// free to change.
+void RendererSetPointCloudFilter(bool remove_background, bool visualize_bgsub);
+
 void RenderFrustum(const Frustum *frustum);
 void RenderFullscreenQuad(void);
 
@@ -1,4 +1,8 @@
 #include "scene_inspector.h"
+#include "recording_format.h"
+#include "label_log.h"
+#include "frame_cache.h"
+#include "point_index.h"
 #include <unistd.h>
 
 namespace inspector
@@ -10,15 +14,33 @@ namespace inspector
     static size_t frame_count;
 
     static bool dirty_frame_flag;
+    static LabelLog label_log;
+    static FrameCache frame_cache;
+    static size_t last_loaded_frame;
+    static int scrub_direction;
 
+    // Points and colors belong to the frame cache. Tags are copied, as they are edited
     static size_t cloud_size;
-    static V3 *spatial_cloud;
-    static ColorPixel *color_cloud;
+    static size_t cloud_capacity;
+    static const V3 *spatial_cloud;
+    static const ColorPixel *color_cloud;
     static MagicMotionTag *old_tag_cloud;
     static MagicMotionTag *tag_cloud;
     static size_t *boxed_indices;
     static size_t num_boxed_indices;
 
+    // Built when a frame is loaded. The points in the box are looked up again
+    // when the box moves, or another frame is loaded
+    static PointIndex point_index;
+    static bool boxed_indices_valid;
+    static V3 boxed_min;
+    static V3 boxed_max;
+
+    // Applying the box to a range of frames decodes this many frames per
+    // thread at a time
+    #define MAX_RANGE_THREADS 16
+    #define RANGE_FRAMES_PER_THREAD 2
+
     static Camera cam;
 
     enum BoxEffect
@@ -41,13 +63,15 @@ namespace inspector
         BoxEffect box_effect;
         V3 box_position;
         V3 box_size;
+
+        int range_first; // Frame numbers, starting at 1 like the ones shown
+        int range_last;
     } UI;
 
-    static void
-    _SetClassTag(MagicMotionTag *tag, MagicMotionTag new_tag)
+    static MagicMotionTag
+    _WithClassTag(MagicMotionTag tag, MagicMotionTag new_tag)
     {
-        dirty_frame_flag = true;
-        int old_tag = (int)*tag;
+        int old_tag = (int)tag;
         if(new_tag == TAG_FOREGROUND)
         {
             old_tag &= ~TAG_BACKGROUND;
@@ -59,7 +83,14 @@ namespace inspector
             old_tag |=  TAG_BACKGROUND;
         }
 
-        *tag = (MagicMotionTag)old_tag;
+        return (MagicMotionTag)old_tag;
+    }
+
+    static void
+    _SetClassTag(MagicMotionTag *tag, MagicMotionTag new_tag)
+    {
+        dirty_frame_flag = true;
+        *tag = _WithClassTag(*tag, new_tag);
     }
 
     static void
@@ -98,6 +129,13 @@ namespace inspector
     static bool
     _LoadRecording(const char *file)
     {
+        // The cache reads frame_offsets, and owns the points of the current frame
+        StopFrameCache(&frame_cache);
+        spatial_cloud = NULL;
+        color_cloud = NULL;
+        cloud_size = 0;
+        boxed_indices_valid = false;
+
         recording_file = NULL;
         FILE *fd = fopen(file, "rb+");
         if(!fd || ferror(fd))
@@ -142,9 +180,9 @@ namespace inspector
 
             for(int j=0; j<3; ++j)
             {
-                size_t compressed_size = 0;
-                fread(&compressed_size, sizeof(size_t), 1, fd);
-                fseek(fd, compressed_size, SEEK_CUR);
+                size_t blob_word = 0;
+                fread(&blob_word, sizeof(size_t), 1, fd);
+                fseek(fd, BLOB_SIZE(blob_word), SEEK_CUR);
             }
 
             // Skip the newline
@@ -153,153 +191,364 @@ namespace inspector
 
         recording_file = fd;
 
-        return true;
-    }
+        CloseLabelLog(&label_log);
+        OpenLabelLog(&label_log, file, frame_count);
 
-    static void *
-    _LoadAndDecompressBuffer(FILE *fd, void *target_buffer, size_t target_buffer_size)
-    {
-        size_t compressed_size = 0;
-        fread(&compressed_size, sizeof(size_t), 1, fd);
-
-        uint8_t *compressed_buffer = (uint8_t *)malloc(compressed_size);
-        size_t bytes_read = fread(compressed_buffer, 1, compressed_size, fd);
-        if(bytes_read != compressed_size)
+        if(!StartFrameCache(&frame_cache, file, frame_offsets, frame_count, DEFAULT_FRAME_CACHE_BYTES))
         {
-            printf("Failed to read compressed data\n");
-            free(compressed_buffer);
-            return NULL;
+            fclose(fd);
+            recording_file = NULL;
+            return false;
         }
 
-        bytes_read = tinfl_decompress_mem_to_mem(target_buffer, target_buffer_size,
-                                                 compressed_buffer, compressed_size, 0);
-
-        free(compressed_buffer);
-
-        if(bytes_read != target_buffer_size)
-        {
-            return NULL;
-        }
+        last_loaded_frame = 0;
+        scrub_direction = 1;
 
-        return target_buffer;
+        return true;
     }
 
     static void
     _LoadFrame(size_t index)
     {
         assert(recording_file);
-        fseek(recording_file, frame_offsets[index], SEEK_SET);
 
-        size_t i, num_points;
-        size_t offset = ftell(recording_file);
-        if(fscanf(recording_file, "frame %zu %zu\n", &i, &num_points) != 2)
+        boxed_indices_valid = false;
+
+        const CachedFrame *frame = GetCachedFrame(&frame_cache, index);
+        if(!frame)
         {
-            printf("Frame %zu invalid header\n", (index+1));
+            spatial_cloud = NULL;
+            color_cloud = NULL;
+            cloud_size = 0;
             return;
         }
 
-        if(i != (index+1))
+        // Scrubbing direction is the shorter way around from the last frame
+        size_t steps_forward = (index + frame_count - last_loaded_frame) % frame_count;
+        if(steps_forward != 0)
         {
-            printf("Frame %zu has invalid frame number (%zu)\n", index, i);
-            return;
+            scrub_direction = (steps_forward <= frame_count/2) ? 1 : -1;
         }
 
-        fseek(recording_file, offset, SEEK_SET);
-        for(uint8_t c=0; c != '\n'; fread(&c, 1, 1, recording_file)) {}
+        PrefetchFrames(&frame_cache, index, scrub_direction);
+        last_loaded_frame = index;
+
+        size_t num_points = frame->num_points;
+        if(num_points > cloud_capacity)
+        {
+            tag_cloud = (MagicMotionTag *)realloc(tag_cloud, sizeof(MagicMotionTag)*num_points);
+            old_tag_cloud = (MagicMotionTag *)realloc(old_tag_cloud, sizeof(MagicMotionTag)*num_points);
+            boxed_indices = (size_t *)realloc(boxed_indices, sizeof(size_t)*num_points);
+            cloud_capacity = num_points;
+        }
 
-        // NOTE(istarnion): This is unsafe. Should do reallocs safer later
-        spatial_cloud = (V3 *)realloc(spatial_cloud, sizeof(V3)*num_points);
-        color_cloud = (ColorPixel *)realloc(color_cloud, sizeof(ColorPixel)*num_points);
-        tag_cloud = (MagicMotionTag *)realloc(tag_cloud, sizeof(MagicMotionTag)*num_points);
-        old_tag_cloud = (MagicMotionTag *)realloc(old_tag_cloud, sizeof(MagicMotionTag)*num_points);
-        boxed_indices = (size_t *)realloc(boxed_indices, sizeof(size_t)*num_points);
+        spatial_cloud = frame->positions;
+        color_cloud = frame->colors;
+        memcpy(tag_cloud, frame->tags, sizeof(MagicMotionTag)*num_points);
 
-        _LoadAndDecompressBuffer(recording_file, spatial_cloud, sizeof(V3)*num_points);
-        _LoadAndDecompressBuffer(recording_file, color_cloud, sizeof(ColorPixel)*num_points);
-        _LoadAndDecompressBuffer(recording_file, tag_cloud, sizeof(MagicMotionTag)*num_points);
+        // Edits made since the recording was last compacted
+        ApplyLabels(&label_log, index, num_points, tag_cloud);
 
         memcpy(old_tag_cloud, tag_cloud, sizeof(MagicMotionTag)*num_points);
 
+        BuildPointIndex(&point_index, spatial_cloud, num_points);
+
         cloud_size = num_points;
         dirty_frame_flag = false;
     }
 
     static void
-    _UpdateFile(size_t from_frame)
+    _SaveLabels(size_t frame)
     {
         if(!dirty_frame_flag) return;
 
         // First, calc and print stats for empirical data
-        _CalcMetrics(from_frame);
+        _CalcMetrics(frame);
+
+        // NOTE(istarnion): Appending to the label log is O(points in the frame).
+        // Rewriting the recording is left to _CompactLabels
+        if(AppendLabels(&label_log, frame, cloud_size, tag_cloud))
+        {
+            dirty_frame_flag = false;
+        }
+    }
 
-        // Save the file anew, starting from the tag cloud
-        // of from_frame.
+    typedef struct
+    {
+        CachedFrame frame;
+        bool ok;
+        size_t changed_points;
+    } RangeFrame;
+
+    typedef struct
+    {
+        RangeFrame *frames;
+        uint32_t num_frames;
+        size_t first_frame;
+        V3 min;
+        V3 max;
+        MagicMotionTag new_tag;
+    } RangeApply;
+
+    static void
+    _RangeDecode(void *userdata, uint32_t i)
+    {
+        RangeApply *apply = (RangeApply *)userdata;
+        RangeFrame *range_frame = &apply->frames[i];
+        range_frame->ok = ReadFrame(&frame_cache, apply->first_frame+i, &range_frame->frame);
+    }
 
-        fseek(recording_file, 0, SEEK_END);
-        size_t end_pos = ftell(recording_file);
+    static void
+    _RangeBox(void *userdata, uint32_t i)
+    {
+        RangeApply *apply = (RangeApply *)userdata;
+        const V3 min = apply->min;
+        const V3 max = apply->max;
 
-        // Read in everything that follows from_file into
-        // a buffer so we can write it back later. We have
-        // to do this, as the new compressed tag cloud will
-        // most likely have a different size than the old one
-        if(from_frame >= (frame_count-1))
+        RangeFrame *range_frame = &apply->frames[i];
+        if(!range_frame->ok)
         {
-            fseek(recording_file, -sizeof(size_t), SEEK_END);
+            return;
         }
-        else
+
+        // NOTE(istarnion): Every frame is visited once, so building an
+        // index would cost as much as testing every point
+        CachedFrame *frame = &range_frame->frame;
+        for(size_t j=0; j<frame->num_points; ++j)
         {
-            fseek(recording_file, frame_offsets[from_frame+1], SEEK_SET);
+            V3 p = frame->positions[j];
+            if(!(p.x < min.x || p.x > max.x ||
+                 p.y < min.y || p.y > max.y ||
+                 p.z < min.z || p.z > max.z))
+            {
+                MagicMotionTag tag = _WithClassTag(frame->tags[j], apply->new_tag);
+                if(tag != frame->tags[j])
+                {
+                    frame->tags[j] = tag;
+                    ++range_frame->changed_points;
+                }
+            }
         }
+    }
 
-        size_t tail_start = ftell(recording_file);
+    // Sets the tags of the points inside the box in frames first to last,
+    // and appends the frames that changed to the label log. The frames are
+    // decoded and edited in parallel, a batch at a time. The label log is a
+    // single file, so it is read and appended to from this thread only.
+    static bool
+    _ApplyBoxToFrames(size_t first, size_t last, V3 min, V3 max, MagicMotionTag new_tag)
+    {
+        int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = MAX(1, MIN(num_threads, MAX_RANGE_THREADS));
 
-        size_t tail_size = end_pos - tail_start;
-        void *tail = malloc(tail_size);
-        fread(tail, 1, tail_size, recording_file);
+        const uint32_t batch_size = num_threads * RANGE_FRAMES_PER_THREAD;
+        RangeFrame *frames = (RangeFrame *)calloc(batch_size, sizeof(RangeFrame));
 
-        // Find where the tag_cloud of from_frame is stored
-        // First, skip the frame header
-        fseek(recording_file, frame_offsets[from_frame], SEEK_SET);
-        for(uint8_t c=0; c != '\n'; fread(&c, 1, 1, recording_file)) {}
+        RangeApply apply = {};
+        apply.frames = frames;
+        apply.min = min;
+        apply.max = max;
+        apply.new_tag = new_tag;
 
-        // Then, skip spatial and color
-        for(int i=0; i<2; ++i)
+        bool ok = true;
+        size_t frames_edited = 0;
+        for(size_t batch_start=first; batch_start<=last; batch_start+=batch_size)
         {
-            size_t compressed_size = 0;
-            fread(&compressed_size, sizeof(size_t), 1, recording_file);
-            fseek(recording_file, compressed_size, SEEK_CUR);
+            apply.first_frame = batch_start;
+            apply.num_frames = (uint32_t)MIN((size_t)batch_size, last+1-batch_start);
+            memset(frames, 0, sizeof(RangeFrame)*batch_size);
+
+            RunFrameBatch(apply.num_frames, num_threads, _RangeDecode, &apply);
+
+            // Edits made since the recording was last compacted
+            for(uint32_t i=0; i<apply.num_frames; ++i)
+            {
+                if(frames[i].ok)
+                {
+                    ApplyLabels(&label_log, batch_start+i, frames[i].frame.num_points, frames[i].frame.tags);
+                }
+            }
+
+            RunFrameBatch(apply.num_frames, num_threads, _RangeBox, &apply);
+
+            for(uint32_t i=0; i<apply.num_frames; ++i)
+            {
+                RangeFrame *range_frame = &frames[i];
+                if(!range_frame->ok)
+                {
+                    printf("Failed to read frame %zu, it is not changed\n", batch_start+i+1);
+                    ok = false;
+                }
+                else if(range_frame->changed_points > 0)
+                {
+                    ok = AppendLabels(&label_log, batch_start+i, range_frame->frame.num_points,
+                                      range_frame->frame.tags) && ok;
+                    ++frames_edited;
+                }
+
+                FreeFrame(&range_frame->frame);
+            }
         }
 
-        size_t old_size = 0;
-        fread(&old_size, sizeof(size_t), 1, recording_file);
-        fseek(recording_file, -sizeof(size_t), SEEK_CUR);
+        printf("Applied the box to frames %zu-%zu, %zu of them changed\n", first+1, last+1, frames_edited);
 
+        free(frames);
+        return ok;
+    }
+
+    static void *
+    _CompressTags(const MagicMotionTag *tags, size_t num_points, BlobLayout layout, size_t *blob_word)
+    {
         size_t compressed_size = 0;
-        void *compressed_tags = tdefl_compress_mem_to_heap(tag_cloud,
-                sizeof(MagicMotionTag)*cloud_size, &compressed_size, 0);
+        void *compressed_tags;
+
+        // Keep compact recordings compact
+        if(layout == BLOB_LAYOUT_TAGS_U8)
+        {
+            uint8_t *packed_tags = (uint8_t *)malloc(num_points);
+            PackTags(tags, num_points, packed_tags);
+            compressed_tags = tdefl_compress_mem_to_heap(packed_tags, num_points, &compressed_size, 0);
+            free(packed_tags);
+        }
+        else
+        {
+            layout = BLOB_LAYOUT_RAW;
+            compressed_tags = tdefl_compress_mem_to_heap(tags, sizeof(MagicMotionTag)*num_points,
+                                                         &compressed_size, 0);
+        }
+
+        *blob_word = BLOB_WORD_WITH_LAYOUT(compressed_size, BLOB_DEFLATE, layout);
+        return compressed_tags;
+    }
+
+    static bool
+    _CopyBytes(FILE *from, FILE *to, size_t size)
+    {
+        uint8_t buffer[64*1024];
+        while(size > 0)
+        {
+            size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+            if(fread(buffer, 1, n, from) != n || fwrite(buffer, 1, n, to) != n)
+            {
+                return false;
+            }
+
+            size -= n;
+        }
+
+        return true;
+    }
+
+    // Writes the labels into a copy of the recording, which then replaces it.
+    // This is a single pass over the file, however many frames were edited.
+    static bool
+    _CompactLabels(void)
+    {
+        _SaveLabels(frame_index);
+        if(label_log.num_records == 0)
+        {
+            return true;
+        }
+
+        char compacted_filename[sizeof(recording_filename)+16];
+        snprintf(compacted_filename, sizeof(compacted_filename), "%s.compacting", recording_filename);
+        FILE *out = fopen(compacted_filename, "wb");
+        if(!out)
+        {
+            printf("Failed to open %s\n", compacted_filename);
+            return false;
+        }
+
+        bool ok = true;
+        MagicMotionTag *tags = NULL;
+        for(size_t i=0; i<frame_count && ok; ++i)
+        {
+            fseek(recording_file, frame_offsets[i], SEEK_SET);
+
+            size_t index, num_points;
+            if(fscanf(recording_file, "frame %zu %zu", &index, &num_points) != 2)
+            {
+                printf("Frame %zu invalid header\n", (i+1));
+                ok = false;
+                break;
+            }
+
+            fseek(recording_file, frame_offsets[i], SEEK_SET);
+            for(uint8_t c=0; c != '\n' && ok; )
+            {
+                ok = fread(&c, 1, 1, recording_file) == 1 && fwrite(&c, 1, 1, out) == 1;
+            }
 
-        fwrite(&compressed_size, sizeof(size_t), 1, recording_file);
-        fwrite(compressed_tags, 1, compressed_size, recording_file);
-        uint8_t newline = '\n';
-        fwrite(&newline, 1, 1, recording_file);
+            // Spatial and color are copied as they are
+            for(int j=0; j<2 && ok; ++j)
+            {
+                size_t blob_word = 0;
+                ok = fread(&blob_word, sizeof(size_t), 1, recording_file) == 1 &&
+                     fwrite(&blob_word, sizeof(size_t), 1, out) == 1 &&
+                     _CopyBytes(recording_file, out, BLOB_SIZE(blob_word));
+            }
+
+            size_t blob_word = 0;
+            ok = ok && fread(&blob_word, sizeof(size_t), 1, recording_file) == 1;
+            if(!ok)
+            {
+                break;
+            }
+
+            if(HasLabels(&label_log, i))
+            {
+                size_t blob_size = BLOB_SIZE(blob_word);
+                void *blob = malloc(blob_size);
+                tags = (MagicMotionTag *)realloc(tags, sizeof(MagicMotionTag)*num_points);
+                ok = fread(blob, 1, blob_size, recording_file) == blob_size &&
+                     DecompressCloudBlob(blob_word, CLOUD_TAGS, blob, num_points, tags) &&
+                     ApplyLabels(&label_log, i, num_points, tags);
+                free(blob);
+
+                if(ok)
+                {
+                    size_t new_blob_word;
+                    void *compressed_tags = _CompressTags(tags, num_points, BLOB_LAYOUT(blob_word), &new_blob_word);
+                    ok = fwrite(&new_blob_word, sizeof(size_t), 1, out) == 1 &&
+                         fwrite(compressed_tags, 1, BLOB_SIZE(new_blob_word), out) == BLOB_SIZE(new_blob_word);
+                    mz_free(compressed_tags);
+                }
+            }
+            else
+            {
+                ok = fwrite(&blob_word, sizeof(size_t), 1, out) == 1 &&
+                     _CopyBytes(recording_file, out, BLOB_SIZE(blob_word));
+            }
 
-        mz_free(compressed_tags);
+            uint8_t newline = '\n';
+            ok = ok && fwrite(&newline, 1, 1, out) == 1;
+        }
 
-        fwrite(tail, 1, tail_size, recording_file);
-        free(tail);
+        free(tags);
 
-        int64_t size_delta = (int64_t)compressed_size - (int64_t)old_size;
-        for(size_t i=from_frame+1; i<frame_count; ++i)
+        ok = ok && fwrite(&frame_count, sizeof(size_t), 1, out) == 1;
+        ok = (fclose(out) == 0) && ok;
+        if(!ok)
         {
-            frame_offsets[i] += size_delta;
+            printf("Failed to compact labels into %s\n", recording_filename);
+            remove(compacted_filename);
+            return false;
         }
 
-        if(size_delta < 0)
+        fclose(recording_file);
+        recording_file = NULL;
+        if(rename(compacted_filename, recording_filename) != 0)
         {
-            ftruncate(fileno(recording_file), end_pos + size_delta);
+            printf("Failed to replace %s\n", recording_filename);
+            remove(compacted_filename);
+            _LoadRecording(recording_filename);
+            return false;
         }
 
-        dirty_frame_flag = false;
+        printf("Compacted %zu label records into %s\n", label_log.num_records, recording_filename);
+        DeleteLabelLog(&label_log);
+
+        return _LoadRecording(recording_filename);
     }
 
     bool
@@ -313,6 +562,11 @@ namespace inspector
         spatial_cloud = NULL;
         color_cloud = NULL;
         tag_cloud = NULL;
+        old_tag_cloud = NULL;
+        boxed_indices = NULL;
+        boxed_indices_valid = false;
+        cloud_size = 0;
+        cloud_capacity = 0;
 
         dirty_frame_flag = false;
 
@@ -324,6 +578,8 @@ namespace inspector
         UI.remove_bg = false;
 
         UI.box_size = (V3){ 1, 1, 1 };
+        UI.range_first = 1;
+        UI.range_last = 1;
 
         return true;
     }
@@ -343,7 +599,7 @@ namespace inspector
         {
             if(ImGui::Button("<"))
             {
-                _UpdateFile(frame_index);
+                _SaveLabels(frame_index);
 
                 if(frame_index == 0)
                 {
@@ -358,7 +614,7 @@ namespace inspector
 
             if(ImGui::Button(">"))
             {
-                _UpdateFile(frame_index);
+                _SaveLabels(frame_index);
 
                 ++frame_index;
 
@@ -379,7 +635,7 @@ namespace inspector
                 frame_index = (size_t)(f * frame_count);
                 if(frame_index != old_frame_index)
                 {
-                    _UpdateFile(old_frame_index);
+                    _SaveLabels(old_frame_index);
                     if(frame_index >= frame_count) frame_index = frame_count-1;
                     _LoadFrame(frame_index);
                 }
@@ -424,6 +680,18 @@ namespace inspector
             }
         }
 
+        if(frame_count > 0 && ImGui::Button("Compact labels"))
+        {
+            if(_CompactLabels())
+            {
+                _LoadFrame(frame_index);
+            }
+            else
+            {
+                strncpy(UI.tooltip, "Failed to compact labels", 127);
+            }
+        }
+
         if(ImGui::BeginMenu("View"))
         {
             ImGui::MenuItem("Point Cloud", NULL, &UI.render_point_cloud);
@@ -463,22 +731,44 @@ namespace inspector
             V3 min = SubV3(UI.box_position, ScaleV3(UI.box_size, 0.5));
             V3 max = AddV3(UI.box_position, ScaleV3(UI.box_size, 0.5));
 
-            num_boxed_indices = 0;
-            for(size_t i=0; i<cloud_size; ++i)
+            if(!boxed_indices_valid ||
+               memcmp(&min, &boxed_min, sizeof(V3)) != 0 ||
+               memcmp(&max, &boxed_max, sizeof(V3)) != 0)
             {
-                V3 p = spatial_cloud[i];
-                if(!(p.x < min.x || p.x > max.x ||
-                     p.y < min.y || p.y > max.y ||
-                     p.z < min.z || p.z > max.z))
-                {
-                    boxed_indices[num_boxed_indices++] = i;
-                }
+                num_boxed_indices = (cloud_size > 0) ? QueryPointIndex(&point_index, spatial_cloud, min, max, boxed_indices) : 0;
+                boxed_min = min;
+                boxed_max = max;
+                boxed_indices_valid = true;
             }
 
             ImGui::Text("Contained points: %zu", num_boxed_indices);
             ImGui::RadioButton("Neutral", (int *)&UI.box_effect, (int)BOX_NEUTRAL);
             ImGui::RadioButton("Foregroundinate", (int *)&UI.box_effect, (int)BOX_FOREGROUNDINATE);
             ImGui::RadioButton("Backgroundinate", (int *)&UI.box_effect, (int)BOX_BACKGROUNDINATE);
+
+            if(frame_count > 0 &&
+               (UI.box_effect == BOX_FOREGROUNDINATE || UI.box_effect == BOX_BACKGROUNDINATE))
+            {
+                ImGui::InputInt("First frame", &UI.range_first);
+                ImGui::InputInt("Last frame", &UI.range_last);
+                UI.range_first = MAX(1, MIN(UI.range_first, (int)frame_count));
+                UI.range_last = MAX(UI.range_first, MIN(UI.range_last, (int)frame_count));
+
+                if(ImGui::Button("Apply to frames"))
+                {
+                    MagicMotionTag new_tag = (UI.box_effect == BOX_BACKGROUNDINATE) ? TAG_BACKGROUND :
+                                                                                      TAG_FOREGROUND;
+
+                    // The current frame may have edits that are not in the label log yet
+                    _SaveLabels(frame_index);
+                    if(!_ApplyBoxToFrames(UI.range_first-1, UI.range_last-1, min, max, new_tag))
+                    {
+                        strncpy(UI.tooltip, "Failed to apply the box to some frames", 127);
+                    }
+
+                    _LoadFrame(frame_index);
+                }
+            }
         }
         else
         {
@@ -517,51 +807,8 @@ namespace inspector
 
         if(UI.render_point_cloud)
         {
-            V3 *fcolors = (V3 *)malloc(cloud_size * sizeof(V3));
-
-            if(UI.visualize_bgsub)
-            {
-                for(size_t i=0; i<cloud_size; ++i)
-                {
-                    float r = 1.0f,
-                          g = 1.0f,
-                          b = 1.0f;
-
-                    if(tag_cloud[i] & TAG_FOREGROUND)
-                    {
-                        r = 0.5f;
-                        g = 2.0f;
-                        b = 0.5f;
-                    }
-                    else if(tag_cloud[i] & TAG_BACKGROUND)
-                    {
-                        r = 2.0f;
-                        g = 0.5f;
-                        b = 0.5f;
-                    }
-
-                    fcolors[i] = (V3){
-                        (color_cloud[i].r / 255.0f) * r,
-                        (color_cloud[i].g / 255.0f) * g,
-                        (color_cloud[i].b / 255.0f) * b
-                    };
-                }
-            }
-            else
-            {
-                for(size_t i=0; i<cloud_size; ++i)
-                {
-                    fcolors[i] = (V3){
-                        (color_cloud[i].r / 255.0f),
-                        (color_cloud[i].g / 255.0f),
-                        (color_cloud[i].b / 255.0f)
-                    };
-                }
-            }
-
-            RenderPointCloud(spatial_cloud, fcolors, cloud_size);
-
-            free(fcolors);
+            RendererSetPointCloudFilter(false, UI.visualize_bgsub);
+            RenderPointCloud(spatial_cloud, color_cloud, tag_cloud, cloud_size);
         }
     }
 
@@ -570,13 +817,16 @@ namespace inspector
     {
         if(cloud_size > 0)
         {
-            _UpdateFile(frame_index);
+            _SaveLabels(frame_index);
         }
 
-        free(spatial_cloud);
-        free(color_cloud);
+        StopFrameCache(&frame_cache);
+        CloseLabelLog(&label_log);
+
         free(tag_cloud);
+        free(old_tag_cloud);
         free(boxed_indices);
+        FreePointIndex(&point_index);
     }
 }
 
@@ -47,7 +47,9 @@ namespace viewer
 
     static VideoRecorder *video_recorder;
 
-    static void *sensor_preview;
+    // One for each feed of every sensor, so switching between them does not reallocate
+    static PreviewTexture *color_previews[MAX_SENSORS];
+    static PreviewTexture *depth_previews[MAX_SENSORS];
     static void *ocv_test_texture;
 
     enum UIMode
@@ -62,6 +64,16 @@ namespace viewer
         char recording_filename_cloud[128];
         char recording_filename_video[128];
         bool is_recording;
+        int color_codec;
+        int jpeg_quality;
+        int backpressure;
+        bool direct_io;
+        int preallocate_mb;
+        bool compact_clouds;
+        bool foreground_only;
+        float flight_seconds;
+        int flight_memory_mb;
+        bool flight_include_clouds;
 
         bool sensor_view_open;
         int camera_index;
@@ -83,6 +95,22 @@ namespace viewer
         bool remove_bg;
     } UI;
 
+    // Saves the flight recorder to files named after the current time
+    static void
+    _SaveFlightRecording(void)
+    {
+        char timestamp[64];
+        time_t now = time(NULL);
+        strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", localtime(&now));
+
+        char video_file[128];
+        char cloud_file[128];
+        snprintf(video_file, sizeof(video_file), "flight_%s_video.vid", timestamp);
+        snprintf(cloud_file, sizeof(cloud_file), "flight_%s_cloud.vid", timestamp);
+
+        MagicMotion_DumpFlightRecording(video_file, UI.flight_include_clouds ? cloud_file : NULL);
+    }
+
     bool
     SceneInit(void)
     {
@@ -119,6 +147,10 @@ namespace viewer
         UI.render_point_cloud = true;
         UI.visualize_bgsub = true;
         UI.render_voxel_bounds = true;
+        UI.color_codec = COLOR_CODEC_DEFLATE;
+        UI.jpeg_quality = 90;
+        UI.flight_seconds = 10;
+        UI.flight_memory_mb = 1024;
 
         return true;
     }
@@ -274,14 +306,53 @@ namespace viewer
 
             if(!UI.is_recording)
             {
+                ImGui::RadioButton("Lossless color", &UI.color_codec, (int)COLOR_CODEC_DEFLATE);
+                ImGui::SameLine();
+                ImGui::RadioButton("JPEG color", &UI.color_codec, (int)COLOR_CODEC_JPEG);
+                if(UI.color_codec == COLOR_CODEC_JPEG)
+                {
+                    ImGui::SliderInt("Quality", &UI.jpeg_quality, 1, 100);
+                }
+
+                ImGui::Text("When falling behind:");
+                ImGui::RadioButton("Wait", &UI.backpressure, (int)BACKPRESSURE_BLOCK);
+                ImGui::SameLine();
+                ImGui::RadioButton("Drop oldest", &UI.backpressure, (int)BACKPRESSURE_DROP_OLDEST);
+                ImGui::SameLine();
+                ImGui::RadioButton("Drop newest", &UI.backpressure, (int)BACKPRESSURE_DROP_NEWEST);
+                ImGui::Checkbox("Bypass page cache", &UI.direct_io);
+                ImGui::InputInt("Preallocate (MiB)", &UI.preallocate_mb);
+                ImGui::Checkbox("Compact point clouds", &UI.compact_clouds);
+                ImGui::Checkbox("Foreground points only", &UI.foreground_only);
+
                 if(ImGui::Button("Start recording"))
                 {
-                    video_recorder = StartVideoRecording(UI.recording_filename_cloud, UI.recording_filename_video, num_active_sensors, MagicMotion_GetSensorInfo());
-                    UI.is_recording = true;
+                    VideoRecorderSettings settings = {};
+                    settings.color_codec = (ColorCodec)UI.color_codec;
+                    settings.jpeg_quality = UI.jpeg_quality;
+                    settings.backpressure = (BackpressurePolicy)UI.backpressure;
+                    settings.direct_io = UI.direct_io;
+                    settings.preallocate_bytes = (size_t)MAX(UI.preallocate_mb, 0) << 20;
+                    settings.compact_clouds = UI.compact_clouds;
+                    settings.foreground_only = UI.foreground_only;
+
+                    video_recorder = StartVideoRecording(UI.recording_filename_cloud, UI.recording_filename_video, num_active_sensors, MagicMotion_GetSensorInfo(), &settings);
+                    UI.is_recording = (video_recorder != NULL);
                 }
             }
             else
             {
+                VideoRecorderStats stats;
+                GetRecorderStats(video_recorder, &stats);
+                ImGui::Text("Frames written: %zu, dropped: %zu",
+                            stats.frames_written, stats.frames_dropped);
+                ImGui::Text("Queue depth: %zu (max %zu)",
+                            stats.queue_depth, stats.max_queue_depth);
+                ImGui::Text("Buffered: %.1f MiB, pool: %.1f MiB, pool misses: %zu",
+                            (float)stats.buffered_bytes/(1024*1024),
+                            (float)stats.allocated_bytes/(1024*1024),
+                            stats.pool_misses);
+
                 if(ImGui::Button("Stop recording"))
                 {
                     StopRecording(video_recorder);
@@ -290,6 +361,48 @@ namespace viewer
                 }
             }
 
+            ImGui::Separator();
+
+            FlightRecorderStatus flight;
+            MagicMotion_GetFlightRecorderStatus(&flight);
+            if(!flight.active)
+            {
+                ImGui::SliderFloat("Seconds to keep", &UI.flight_seconds, 1, 60);
+                ImGui::InputInt("Memory (MiB)", &UI.flight_memory_mb);
+                ImGui::Checkbox("Keep point clouds", &UI.flight_include_clouds);
+                if(ImGui::Button("Start flight recorder"))
+                {
+                    MagicMotion_StartFlightRecorder(UI.flight_seconds,
+                                                    (size_t)MAX(UI.flight_memory_mb, 1) << 20,
+                                                    UI.flight_include_clouds);
+                }
+            }
+            else
+            {
+                ImGui::Text("Flight recorder: %.1f s in %u frames, %.1f MiB, %zu skipped",
+                            flight.seconds_held, flight.num_frames,
+                            (float)flight.bytes_used/(1024*1024), flight.frames_skipped);
+                if(flight.dump_failed)
+                {
+                    ImGui::Text("The last flight recording could not be saved");
+                }
+
+                if(flight.dumping)
+                {
+                    ImGui::Text("Saving...");
+                }
+                else if(ImGui::Button("Save flight recording"))
+                {
+                    _SaveFlightRecording();
+                }
+
+                ImGui::SameLine();
+                if(ImGui::Button("Stop flight recorder"))
+                {
+                    MagicMotion_StopFlightRecorder();
+                }
+            }
+
             ImGui::End();
         }
 
@@ -297,11 +410,6 @@ namespace viewer
         {
             ImGui::Begin("Sensor View", &UI.sensor_view_open);
 
-            if(sensor_preview)
-            {
-                RendererDestroyTexture(sensor_preview);
-            }
-
             for(int i=0; i<num_active_sensors; ++i)
             {
                 ImGui::PushID(i);
@@ -313,49 +421,39 @@ namespace viewer
             ImGui::RadioButton("Depth Feed", (int *)&UI.color_feed, 0);
 
             int width, height;
+            PreviewTexture *sensor_preview;
             if(UI.color_feed)
             {
-                MagicMotion_GetColorImageResolution(UI.camera_index, &width, &height);
-                uint32_t pixels[width * height];
-                const ColorPixel *colors = MagicMotion_GetColorImage(UI.camera_index);
-                for(int i=0; i<width*height; ++i)
+                PreviewTexture **preview = &color_previews[UI.camera_index];
+                if(!*preview)
                 {
-                    ColorPixel c = *colors++;
-
-                    uint32_t p = (c.b << 16) |
-                                 (c.g << 8)  |
-                                 (c.r)       |
-                                 0xFF000000;
-                    pixels[i] = p;
+                    *preview = RendererCreatePreviewTexture();
                 }
 
-                sensor_preview = RendererCreateTexture(pixels, width, height);
+                MagicMotion_GetColorImageResolution(UI.camera_index, &width, &height);
+                RendererUpdateColorPreview(*preview, MagicMotion_GetColorImage(UI.camera_index),
+                                           width, height);
+                sensor_preview = *preview;
             }
             else
             {
                 ImGui::Checkbox("Step Depth Image", &UI.step_depth_image);
-                MagicMotion_GetDepthImageResolution(UI.camera_index, &width, &height);
-                uint32_t pixels[width * height];
-                const float *depths = MagicMotion_GetDepthImage(UI.camera_index);
-                for(int i=0; i<width*height; ++i)
+
+                PreviewTexture **preview = &depth_previews[UI.camera_index];
+                if(!*preview)
                 {
-                    float d = (*depths++) / 5000.0f;
-                    if(UI.step_depth_image)
-                    {
-                        d = floorf(d / 10.0f) * 10.0f;
-                    }
-
-                    uint8_t v = 255 * d;
-                    uint32_t p = (v << 16) |
-                                 (v << 8)  |
-                                 (v)       |
-                                 0xFF000000;
-                    pixels[i] = p;
+                    *preview = RendererCreatePreviewTexture();
                 }
-                sensor_preview = RendererCreateTexture(pixels, width, height);
+
+                // Depths are in mm. Stepping shows 10cm bands
+                MagicMotion_GetDepthImageResolution(UI.camera_index, &width, &height);
+                RendererUpdateDepthPreview(*preview, MagicMotion_GetDepthImage(UI.camera_index),
+                                           width, height, 5000.0f,
+                                           UI.step_depth_image ? 100.0f : 0.0f);
+                sensor_preview = *preview;
             }
 
-            ImGui::Image(sensor_preview, ImVec2(width, height));
+            ImGui::Image(RendererGetPreviewTexture(sensor_preview), ImVec2(width, height));
             ImGui::Text("(%d x %d)", width, height);
 
             if(ImGui::Button("Save component textures"))
@@ -521,69 +619,8 @@ namespace viewer
 
         if(UI.render_point_cloud && point_cloud_size > 0)
         {
-            // Stack allocating these is risky!
-            V3 *fcolors = (V3 *)calloc(point_cloud_size, sizeof(V3));
-            V3 *points = (V3 *)calloc(point_cloud_size, sizeof(V3));
-
-            size_t actual_cloud_size = 0;
-            for(size_t i=0; i<point_cloud_size; ++i)
-            {
-                /*
-                remove bg | is foreground | should render (result)
-                y           y               y
-                n           y               y
-                y           n               n
-                n           n               y
-
-                This shows that the only case we should _not_ render a point
-                is when remove bg is true and the point does not have the
-                foreground tag
-                */
-                if(!(UI.remove_bg && (tags[i] & TAG_FOREGROUND) == 0))
-                {
-                    points[actual_cloud_size] = positions[i];
-
-                    if(UI.visualize_bgsub)
-                    {
-                        float r = 1.0f,
-                              g = 1.0f,
-                              b = 1.0f;
-
-                        if(tags[i] & TAG_FOREGROUND)
-                        {
-                            r = 0.5f;
-                            g = 2.0f;
-                            b = 0.5f;
-                        }
-                        else if(tags[i] & TAG_BACKGROUND)
-                        {
-                            r = 2.0f;
-                            g = 0.5f;
-                            b = 0.5f;
-                        }
-
-                        fcolors[actual_cloud_size] = (V3){
-                            (colors[i].r / 255.0f) * r,
-                            (colors[i].g / 255.0f) * g,
-                            (colors[i].b / 255.0f) * b
-                        };
-                    }
-                    else
-                    {
-                        fcolors[actual_cloud_size] = (V3){
-                            colors[i].r / 255.0f,
-                            colors[i].g / 255.0f,
-                            colors[i].b / 255.0f
-                        };
-                    }
-
-                    ++actual_cloud_size;
-                }
-            }
-
-            RenderPointCloud(points, fcolors, actual_cloud_size);
-            free(points);
-            free(fcolors);
+            RendererSetPointCloudFilter(UI.remove_bg, UI.visualize_bgsub);
+            RenderPointCloud(positions, colors, tags, point_cloud_size);
         }
 
         if(UI.is_recording)
@@ -605,42 +642,10 @@ namespace viewer
 
         if(UI.render_voxels)
         {
-            Voxel *voxels = MagicMotion_GetVoxels();
-            V3 voxel_centers[256];
-            V3 voxel_colors[256];
-            int voxel_index = 0;
-            for(int z=0; z<NUM_VOXELS_Z; ++z)
-            {
-                for(int y=0; y<NUM_VOXELS_Y; ++y)
-                {
-                    for(int x=0; x<NUM_VOXELS_X; ++x)
-                    {
-                        const int i = VOXEL_INDEX(x, y, z);
-                        if(voxels[i].point_count > 8)
-                        {
-                            ColorPixel c = voxels[i].color;
-                            voxel_colors[voxel_index] = (V3){
-                                c.r / 255.0f,
-                                c.g / 255.0f,
-                                c.b / 255.0f
-                            };
-
-                            voxel_centers[voxel_index++] = VOXEL_TO_WORLD(i);
-
-                            if(voxel_index >= 256)
-                            {
-                                RenderCubes(voxel_centers, voxel_colors, 256);
-                                voxel_index = 0;
-                            }
-                        }
-                    }
-                }
-            }
-
-            if(voxel_index > 0)
-            {
-                RenderCubes(voxel_centers, voxel_colors, voxel_index);
-            }
+            // Voxels need more than a few points to not just be noise
+            RenderVoxels(MagicMotion_GetVoxels(),
+                         MagicMotion_GetOccupiedVoxels(),
+                         MagicMotion_GetNumOccupiedVoxels(), 9);
         }
 
         {
@@ -665,6 +670,11 @@ namespace viewer
     void
     SceneEnd(void)
     {
+        for(int i=0; i<MAX_SENSORS; ++i)
+        {
+            if(color_previews[i]) RendererDestroyPreviewTexture(color_previews[i]);
+            if(depth_previews[i]) RendererDestroyPreviewTexture(depth_previews[i]);
+        }
     }
 }
 
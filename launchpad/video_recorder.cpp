@@ -1,10 +1,15 @@
 #include "magic_motion.h" // MagiMotionTag
 #include "sensor_interface.h" // ColorPixel
+#include "recording_format.h" // BLOB_WORD
+#include "video_recorder.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <pthread.h>
-#include <semaphore.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #define MINIZ_NO_STDIO
 #define MINIZ_NO_TIME
@@ -13,153 +18,1149 @@
 #define MINIZ_NO_ZLIB_APIS
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "miniz.c"
+#include "recording_format.cpp" // DecompressBlob, used by the inspector
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_SUB(p, v) __atomic_fetch_sub((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS(p, expected, desired) __atomic_compare_exchange_n((p), (expected), (desired), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+typedef enum
+{
+    JOB_DEFLATE, // Deflated and written as a blob
+    JOB_JPEG     // A RGB image that is JPEG encoded and written as a blob
+} RecorderJobType;
+
+// Which part of a frame a job holds. The writer thread writes the text
+// around each blob, so nothing but frame data goes through the queue.
+typedef enum
+{
+    STREAM_CLOUD_POSITIONS,
+    STREAM_CLOUD_COLORS,
+    STREAM_CLOUD_TAGS,
+    STREAM_VIDEO_COLOR,
+    STREAM_VIDEO_DEPTH
+} RecorderStream;
+
+// Buffers come in power of two size classes and are kept around after use,
+// so once a recording has warmed up, frames are recorded without touching the
+// heap. Each class is a bounded lock free queue of free buffers, with room for
+// every buffer of that size that can be in use at once (see _InitPool).
+#define MIN_SIZE_CLASS 12 // 4 KiB
+#define NUM_SIZE_CLASSES 20 // Up to 2 GiB
+#define POOL_WARMUP_FRAMES 60 // Buffers allocated after this are pool misses
+
+typedef struct
+{
+    size_t sequence;
+    void *data;
+} PoolCell;
+
+typedef struct
+{
+    PoolCell *cells;
+    size_t capacity;
+    size_t push_position;
+    size_t pop_position;
+} SizeClass;
+
 typedef struct
 {
     void *data;
+    int size_class;
+} PooledBuffer;
+
+typedef struct
+{
+    RecorderJobType type;
+    RecorderStream stream;
+    size_t frame; // As counted by the render thread, including dropped frames
+    size_t n_points; // Only used by STREAM_CLOUD_POSITIONS
+
+    PooledBuffer input;
     size_t n_bytes;
-    FILE *fd;
-} QueuedBuffer;
+    int width, height; // Only used by JOB_JPEG
+
+    // Large buffers are split into several jobs, one per chunk
+    uint32_t chunk_index;
+    uint32_t chunk_count;
+    size_t chunk_size;
+
+    // Filled in by the worker that encodes the job
+    PooledBuffer output;
+    size_t output_size;
+    BlobEncoding encoding;
+    bool encoded;
+
+    // Filled in by the writer thread, and pointed to by the batch it writes
+    char prefix[64];
+    const char *suffix;
+    size_t blob_word;
+    uint32_t chunk_table[2+MAX_BLOB_CHUNKS]; // Only in the first chunk
+} RecorderJob;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool overflow;
+} OutputBuffer;
+
+// A counting semaphore. POSIX has sem_init, but macOS only implements named
+// semaphores, and those are shared by every process that opens the same
+// name. The lock is only taken when a thread has to go to sleep, or has to
+// wake one up.
+typedef struct
+{
+    uint32_t count;
+    uint32_t waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Signal;
+
+// Frames are tracked in a ring next to the jobs, so that a whole frame can be
+// dropped at once. The frame number is packed in with the state, so a stale
+// slot never looks like the frame that replaced it.
+typedef enum
+{
+    FRAME_PENDING,
+    FRAME_WRITING,
+    FRAME_CANCELLED
+} FrameState;
+
+#define FRAME_STATE(frame, state) (((size_t)(frame) << 2) | (size_t)(state))
+
+// One of the two files being recorded to. With direct I/O everything goes
+// through an aligned staging buffer, since O_DIRECT only takes aligned
+// writes. The unaligned tail is kept until the next batch, or until the
+// file is closed.
+typedef struct
+{
+    int fd;
+    size_t size; // Bytes written so far, staged bytes included
+    bool preallocated;
+    bool failed;
+    uint8_t *staging;
+    size_t staged;
+} RecordingFile;
+
+// Buffers larger than this are deflated in chunks, on several workers
+#define CHUNK_SIZE ((size_t)256 << 10)
+
+#define DIRECT_IO_ALIGNMENT 4096
+#define STAGING_SIZE ((size_t)8 << 20)
+
+// The writer thread writes whatever is ready in one go, up to this much
+#define MAX_BATCH_JOBS 64
+#define MAX_BATCH_BYTES ((size_t)64 << 20)
+#define IOVECS_PER_JOB 4
+#if MAX_BATCH_JOBS < MAX_BLOB_CHUNKS
+#error "A batch must have room for a whole chunked blob"
+#endif
 
 #define QUEUE_LENGTH 1024
-#define N_CONSUMERS 1
+#define MAX_WORKERS 16
+
+enum
+{
+    SCRATCH_POSITIONS,
+    SCRATCH_COLORS,
+    SCRATCH_TAGS,
+    SCRATCH_QUANTIZED,
+    SCRATCH_PACKED_TAGS,
+    NUM_SCRATCH_BUFFERS
+};
+#define DEFAULT_MAX_BUFFERED_BYTES ((size_t)512 << 20)
 
 typedef struct VideoRecorder
 {
-    FILE *cloud_file;
-    FILE *video_file;
-    size_t frame_count;
+    bool in_use;
+    RecordingFile cloud_file;
+    RecordingFile video_file;
 
-    volatile bool running;
+    VideoRecorderSettings settings;
 
-    QueuedBuffer buffer_queue[QUEUE_LENGTH];
-    size_t producer_index;
-    size_t consumer_index;
-    size_t buffer_count;
-    pthread_mutex_t lock;
-    pthread_mutex_t file_lock;
-    sem_t *empty;
-    sem_t *full;
+    bool running;
+
+    // A job lives in the slot given by its sequence number until it has been
+    // written. The render thread hands out sequence numbers, the workers
+    // claim jobs in sequence order and encode them in parallel, and the
+    // writer thread writes them to file in sequence order as they complete.
+    // Each counter is only advanced by one side, so no locks are needed.
+    RecorderJob jobs[QUEUE_LENGTH];
+    size_t next_sequence;  // Sequence number of the next job to be queued
+    size_t claim_sequence; // Next job to be claimed by a worker
+    size_t write_sequence; // Next job to be written
+    Signal job_queued;
+    Signal job_encoded;
+    Signal space_freed;
+
+    size_t frame_states[QUEUE_LENGTH];
+    size_t current_frame;  // Frame the render thread is adding jobs to
+    size_t sealed_frame;   // Last frame that will get no more jobs
+    size_t writing_frame;  // Frame the writer thread is at
+    size_t frames_written; // Also the frame number written to file
+    size_t frames_dropped;
+    bool dropping_frame;   // The current frame was dropped, skip the rest of it
 
-    pthread_t consumers[N_CONSUMERS];
+    // Used by the render thread to convert clouds before they are queued
+    void *scratch[NUM_SCRATCH_BUFFERS];
+    size_t scratch_sizes[NUM_SCRATCH_BUFFERS];
+
+    SizeClass pool[NUM_SIZE_CLASSES];
+    size_t buffered_bytes; // Size of all job inputs not yet encoded
+    size_t allocated_bytes;
+    size_t pool_misses;
+    size_t max_queue_depth;
+
+    int num_workers;
+    pthread_t workers[MAX_WORKERS];
+    pthread_t writer;
 } VideoRecorder;
 
 // Why support multiple recorders?
 #define MAX_RECORDERS 4
 static VideoRecorder recorders[MAX_RECORDERS];
 
+static void
+_InitSignal(Signal *signal)
+{
+    signal->count = 0;
+    signal->waiters = 0;
+    pthread_mutex_init(&signal->lock, NULL);
+    pthread_cond_init(&signal->cond, NULL);
+}
+
+static void
+_DestroySignal(Signal *signal)
+{
+    pthread_cond_destroy(&signal->cond);
+    pthread_mutex_destroy(&signal->lock);
+}
+
+static void
+_PostSignal(Signal *signal)
+{
+    __atomic_fetch_add(&signal->count, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&signal->waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&signal->lock);
+        pthread_cond_signal(&signal->cond);
+        pthread_mutex_unlock(&signal->lock);
+    }
+}
+
+static bool
+_TryWaitSignal(Signal *signal)
+{
+    uint32_t count = __atomic_load_n(&signal->count, __ATOMIC_SEQ_CST);
+    while(count > 0)
+    {
+        if(__atomic_compare_exchange_n(&signal->count, &count, count-1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+_WaitSignal(Signal *signal)
+{
+    while(!_TryWaitSignal(signal))
+    {
+        pthread_mutex_lock(&signal->lock);
+        __atomic_fetch_add(&signal->waiters, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&signal->count, __ATOMIC_SEQ_CST) == 0)
+        {
+            pthread_cond_wait(&signal->cond, &signal->lock);
+        }
+        __atomic_fetch_sub(&signal->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&signal->lock);
+    }
+}
+
+static bool
+_OpenRecordingFile(RecordingFile *file, const char *path, const VideoRecorderSettings *settings)
+{
+    memset(file, 0, sizeof(RecordingFile));
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(file->fd < 0)
+    {
+        fprintf(stderr, "Failed to open %s for recording: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if(settings->direct_io)
+    {
+        bool direct = false;
+#if defined(O_DIRECT)
+        int flags = fcntl(file->fd, F_GETFL);
+        direct = (fcntl(file->fd, F_SETFL, flags | O_DIRECT) == 0);
+#elif defined(F_NOCACHE)
+        direct = (fcntl(file->fd, F_NOCACHE, 1) == 0);
+#endif
+        if(direct && posix_memalign((void **)&file->staging, DIRECT_IO_ALIGNMENT, STAGING_SIZE) == 0)
+        {
+            file->staged = 0;
+        }
+        else
+        {
+            // NOTE(istarnion): tmpfs and some network file systems do not
+            // support O_DIRECT. Recording through the page cache still works.
+            fprintf(stderr, "Direct I/O is not available for %s, using buffered writes\n", path);
+            file->staging = NULL;
+        }
+    }
+
+    if(settings->preallocate_bytes > 0)
+    {
+#if defined(__linux__)
+        // Grows the file up front, so it is not fragmented as it grows.
+        // Cut back to what was actually written when the file is closed.
+        file->preallocated = (fallocate(file->fd, 0, 0, (off_t)settings->preallocate_bytes) == 0);
+#endif
+    }
+
+    return true;
+}
+
+static bool
+_WriteVectors(int fd, struct iovec *iov, int count)
+{
+    while(count > 0)
+    {
+        ssize_t written = writev(fd, iov, MIN(count, IOV_MAX));
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        // Skip past what was written, and fix up a partially written vector
+        while(count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if(count > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+// Writes out as much of the staging buffer as can be written aligned
+static bool
+_FlushStaging(RecordingFile *file)
+{
+    size_t aligned = file->staged & ~((size_t)DIRECT_IO_ALIGNMENT-1);
+    if(aligned == 0)
+    {
+        return true;
+    }
+
+    struct iovec iov = { file->staging, aligned };
+    if(!_WriteVectors(file->fd, &iov, 1))
+    {
+        return false;
+    }
+
+    file->staged -= aligned;
+    memmove(file->staging, file->staging+aligned, file->staged);
+    return true;
+}
+
+// The vectors may be modified
+static void
+_WriteToFile(RecordingFile *file, struct iovec *iov, int count)
+{
+    if(file->failed || count == 0)
+    {
+        return;
+    }
+
+    bool ok = true;
+    if(file->staging)
+    {
+        for(int i=0; ok && i<count; ++i)
+        {
+            const uint8_t *data = (const uint8_t *)iov[i].iov_base;
+            size_t remaining = iov[i].iov_len;
+            file->size += remaining;
+            while(ok && remaining > 0)
+            {
+                size_t n = MIN(remaining, STAGING_SIZE - file->staged);
+                memcpy(file->staging + file->staged, data, n);
+                file->staged += n;
+                data += n;
+                remaining -= n;
+                if(file->staged == STAGING_SIZE)
+                {
+                    ok = _FlushStaging(file);
+                }
+            }
+        }
+
+        ok = ok && _FlushStaging(file);
+    }
+    else
+    {
+        for(int i=0; i<count; ++i)
+        {
+            file->size += iov[i].iov_len;
+        }
+
+        ok = _WriteVectors(file->fd, iov, count);
+    }
+
+    if(!ok)
+    {
+        fprintf(stderr, "Failed to write recording: %s\n", strerror(errno));
+        file->failed = true;
+    }
+}
+
+static void
+_CloseRecordingFile(RecordingFile *file)
+{
+    if(file->staging)
+    {
+        if(file->staged > 0 && !file->failed)
+        {
+            // The tail is not a whole block, so it can not be written directly
+#if defined(O_DIRECT)
+            int flags = fcntl(file->fd, F_GETFL);
+            fcntl(file->fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+            struct iovec iov = { file->staging, file->staged };
+            if(!_WriteVectors(file->fd, &iov, 1))
+            {
+                fprintf(stderr, "Failed to write recording: %s\n", strerror(errno));
+            }
+        }
+
+        free(file->staging);
+    }
+
+    if(file->preallocated)
+    {
+        ftruncate(file->fd, (off_t)file->size);
+    }
+
+    close(file->fd);
+    memset(file, 0, sizeof(RecordingFile));
+}
+
+static int
+_SizeClass(size_t n_bytes)
+{
+    int size_class = MIN_SIZE_CLASS;
+    while(((size_t)1 << size_class) < n_bytes)
+    {
+        ++size_class;
+    }
+
+    return size_class;
+}
+
+// A class is only allocated from when it has no free buffers, so it never
+// holds more buffers than were in use at once. Inputs are held to the
+// buffered bytes budget, with one more to let a job larger than the budget
+// through, and there is at most one output per job in the queue.
+static void
+_InitPool(VideoRecorder *recorder)
+{
+    size_t max_buffered_bytes = recorder->settings.max_buffered_bytes;
+    for(int i=0; i<NUM_SIZE_CLASSES; ++i)
+    {
+        SizeClass *c = &recorder->pool[i];
+        size_t max_inputs = (max_buffered_bytes >> (MIN_SIZE_CLASS+i)) + 1;
+        c->capacity = MIN(max_inputs, (size_t)QUEUE_LENGTH) + QUEUE_LENGTH;
+        c->cells = (PoolCell *)malloc(c->capacity * sizeof(PoolCell));
+        for(size_t j=0; j<c->capacity; ++j)
+        {
+            c->cells[j].sequence = j;
+            c->cells[j].data = NULL;
+        }
+        c->push_position = 0;
+        c->pop_position = 0;
+    }
+}
+
+// Bounded multi producer/multi consumer queue, after Dmitry Vyukov. Each cell
+// carries a sequence number that tells whether it is ready to be pushed to or
+// popped from at a given position, so threads never see a half written cell.
+static bool
+_PushFreeBuffer(SizeClass *c, void *data)
+{
+    size_t position = __atomic_load_n(&c->push_position, __ATOMIC_RELAXED);
+    while(true)
+    {
+        PoolCell *cell = &c->cells[position % c->capacity];
+        size_t sequence = ATOMIC_LOAD(&cell->sequence);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&c->push_position, &position, position+1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->data = data;
+                ATOMIC_STORE(&cell->sequence, position+1);
+                return true;
+            }
+        }
+        else if(diff < 0)
+        {
+            return false; // Full
+        }
+        else
+        {
+            position = __atomic_load_n(&c->push_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *
+_PopFreeBuffer(SizeClass *c)
+{
+    size_t position = __atomic_load_n(&c->pop_position, __ATOMIC_RELAXED);
+    while(true)
+    {
+        PoolCell *cell = &c->cells[position % c->capacity];
+        size_t sequence = ATOMIC_LOAD(&cell->sequence);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(position+1);
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&c->pop_position, &position, position+1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                void *data = cell->data;
+                ATOMIC_STORE(&cell->sequence, position+c->capacity);
+                return data;
+            }
+        }
+        else if(diff < 0)
+        {
+            return NULL; // Empty
+        }
+        else
+        {
+            position = __atomic_load_n(&c->pop_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// frame is the frame the buffer is for, to tell warm-up from pool misses
+static PooledBuffer
+_AcquireBuffer(VideoRecorder *recorder, int size_class, size_t frame)
+{
+    SDL_assert(size_class < MIN_SIZE_CLASS+NUM_SIZE_CLASSES);
+
+    PooledBuffer result;
+    result.size_class = size_class;
+    result.data = _PopFreeBuffer(&recorder->pool[size_class-MIN_SIZE_CLASS]);
+    if(!result.data)
+    {
+        // Only happens until the pool has grown to fit the recording
+        result.data = malloc((size_t)1 << size_class);
+        ATOMIC_ADD(&recorder->allocated_bytes, (size_t)1 << size_class);
+        if(frame >= POOL_WARMUP_FRAMES)
+        {
+            ATOMIC_ADD(&recorder->pool_misses, 1);
+        }
+    }
+
+    return result;
+}
+
+static void
+_ReleaseBuffer(VideoRecorder *recorder, PooledBuffer *buffer)
+{
+    if(buffer->data)
+    {
+        SizeClass *c = &recorder->pool[buffer->size_class-MIN_SIZE_CLASS];
+        if(!_PushFreeBuffer(c, buffer->data))
+        {
+            free(buffer->data);
+            ATOMIC_SUB(&recorder->allocated_bytes, (size_t)1 << buffer->size_class);
+        }
+
+        buffer->data = NULL;
+    }
+}
+
+static void
+_FreePool(VideoRecorder *recorder)
+{
+    for(int i=0; i<NUM_SIZE_CLASSES; ++i)
+    {
+        void *data;
+        while((data = _PopFreeBuffer(&recorder->pool[i])))
+        {
+            free(data);
+        }
+
+        free(recorder->pool[i].cells);
+    }
+}
+
+static bool
+_IsFrameCancelled(VideoRecorder *recorder, size_t frame)
+{
+    size_t state = ATOMIC_LOAD(&recorder->frame_states[frame % QUEUE_LENGTH]);
+    return state == FRAME_STATE(frame, FRAME_CANCELLED);
+}
+
+static mz_bool
+_PutDeflateOutput(const void *data, int size, void *context)
+{
+    OutputBuffer *output = (OutputBuffer *)context;
+    if(output->size + size > output->capacity)
+    {
+        output->overflow = true;
+        return MZ_FALSE;
+    }
+
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+    return MZ_TRUE;
+}
+
+static void
+_PutJPEGOutput(void *context, void *data, int size)
+{
+    _PutDeflateOutput(data, size, context);
+}
+
+// Returns false if the output buffer was too small
+static bool
+_EncodeInto(VideoRecorder *recorder, RecorderJob *job, RecorderJobType type, tdefl_compressor *compressor)
+{
+    OutputBuffer output = {0};
+    output.data = (uint8_t *)job->output.data;
+    output.capacity = (size_t)1 << job->output.size_class;
+
+    if(type == JOB_DEFLATE)
+    {
+        tdefl_init(compressor, _PutDeflateOutput, &output, 0);
+        tdefl_compress_buffer(compressor, job->input.data, job->n_bytes, TDEFL_FINISH);
+        job->encoding = BLOB_DEFLATE;
+    }
+    else
+    {
+        stbi_write_jpg_to_func(_PutJPEGOutput, &output,
+                               job->width, job->height, 3,
+                               job->input.data, recorder->settings.jpeg_quality);
+        job->encoding = BLOB_JPEG;
+    }
+
+    job->output_size = output.size;
+    return !output.overflow;
+}
+
+static void
+_EncodeJob(VideoRecorder *recorder, RecorderJob *job, tdefl_compressor *compressor)
+{
+    // Deflate hardly ever grows data by more than a few bytes per block,
+    // and a JPEG is a lot smaller than the raw image. Should either one
+    // still not fit, try again with deflate in a bigger buffer.
+    RecorderJobType type = job->type;
+    int size_class = _SizeClass(job->n_bytes + job->n_bytes/16 + 1024);
+    while(true)
+    {
+        job->output = _AcquireBuffer(recorder, size_class, job->frame);
+        if(_EncodeInto(recorder, job, type, compressor))
+        {
+            break;
+        }
+
+        _ReleaseBuffer(recorder, &job->output);
+        type = JOB_DEFLATE;
+        ++size_class;
+    }
+}
+
 static void *
-_ConsumerThread(void *userdata)
+_WorkerThread(void *userdata)
 {
     VideoRecorder *recorder = (VideoRecorder *)userdata;
 
-    struct timespec waittime = {0};
-    waittime.tv_sec = 1;
-    while(recorder->running)
+    // NOTE(istarnion): The compressor state is a few hundred kilobytes,
+    // so each worker keeps its own for the whole recording
+    tdefl_compressor *compressor = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+
+    while(true)
     {
-        if(sem_timedwait(recorder->full, &waittime))
+        _WaitSignal(&recorder->job_queued);
+
+        // StopRecording posts once per worker after the last job
+        size_t sequence = ATOMIC_ADD(&recorder->claim_sequence, 1);
+        if(sequence >= ATOMIC_LOAD(&recorder->next_sequence))
         {
-            continue;
+            break;
         }
 
-        pthread_mutex_lock(&recorder->lock);
+        RecorderJob *job = &recorder->jobs[sequence % QUEUE_LENGTH];
+        if(!_IsFrameCancelled(recorder, job->frame))
+        {
+            _EncodeJob(recorder, job, compressor);
+        }
 
-        QueuedBuffer buffer = recorder->buffer_queue[recorder->consumer_index];
+        // The raw frame is not needed anymore
+        _ReleaseBuffer(recorder, &job->input);
+        ATOMIC_SUB(&recorder->buffered_bytes, (size_t)1 << job->input.size_class);
+        _PostSignal(&recorder->space_freed);
+
+        ATOMIC_STORE(&job->encoded, true);
+        _PostSignal(&recorder->job_encoded);
+    }
 
-        ++recorder->consumer_index;
-        if(recorder->consumer_index >= QUEUE_LENGTH)
+    free(compressor);
+
+    return NULL;
+}
+
+static BlobLayout
+_StreamLayout(VideoRecorder *recorder, RecorderStream stream)
+{
+    if(recorder->settings.compact_clouds)
+    {
+        if(stream == STREAM_CLOUD_POSITIONS)
         {
-            recorder->consumer_index = 0;
+            return BLOB_LAYOUT_POSITIONS_Q16;
         }
+        else if(stream == STREAM_CLOUD_TAGS)
+        {
+            return BLOB_LAYOUT_TAGS_U8;
+        }
+    }
 
-        --recorder->buffer_count;
+    return BLOB_LAYOUT_RAW;
+}
 
-        pthread_mutex_unlock(&recorder->lock);
-        sem_post(recorder->empty);
+// Adds the text around the blob, the blob word and the blob itself.
+// A chunked blob is added from all of its jobs, starting at the first.
+static int
+_AddJobToBatch(VideoRecorder *recorder, RecorderJob *job, struct iovec *iov)
+{
+    job->prefix[0] = '\0';
+    job->suffix = "";
+    switch(job->stream)
+    {
+        case STREAM_CLOUD_POSITIONS:
+            sprintf(job->prefix, "frame %zu %zu\n", recorder->frames_written, job->n_points);
+            break;
+        case STREAM_CLOUD_TAGS:
+            job->suffix = "\n";
+            break;
+        case STREAM_VIDEO_COLOR:
+            sprintf(job->prefix, "frame %zu\ncolor\n", recorder->frames_written);
+            break;
+        case STREAM_VIDEO_DEPTH:
+            strcpy(job->prefix, "\ndepth\n");
+            job->suffix = "\n";
+            break;
+        default: break;
+    }
 
-        pthread_mutex_lock(&recorder->file_lock);
-        fwrite(buffer.data, 1, buffer.n_bytes, buffer.fd);
-        pthread_mutex_unlock(&recorder->file_lock);
-        free(buffer.data);
+    int count = 0;
+    size_t prefix_length = strlen(job->prefix);
+    if(prefix_length > 0)
+    {
+        iov[count].iov_base = job->prefix;
+        iov[count++].iov_len = prefix_length;
+    }
+
+    iov[count].iov_base = &job->blob_word;
+    iov[count++].iov_len = sizeof(size_t);
+
+    if(job->chunk_count > 1)
+    {
+        size_t job_sequence = job - recorder->jobs;
+        size_t blob_size = CHUNK_TABLE_SIZE(job->chunk_count);
+        job->chunk_table[0] = job->chunk_count;
+        job->chunk_table[1] = (uint32_t)job->chunk_size;
+        iov[count].iov_base = job->chunk_table;
+        iov[count++].iov_len = CHUNK_TABLE_SIZE(job->chunk_count);
+
+        for(uint32_t i=0; i<job->chunk_count; ++i)
+        {
+            RecorderJob *chunk = &recorder->jobs[(job_sequence+i) % QUEUE_LENGTH];
+            job->chunk_table[2+i] = (uint32_t)chunk->output_size;
+            blob_size += chunk->output_size;
+            iov[count].iov_base = chunk->output.data;
+            iov[count++].iov_len = chunk->output_size;
+        }
+
+        job->blob_word = BLOB_WORD_WITH_LAYOUT(blob_size, BLOB_DEFLATE_CHUNKED, _StreamLayout(recorder, job->stream));
+    }
+    else
+    {
+        job->blob_word = BLOB_WORD_WITH_LAYOUT(job->output_size, job->encoding, _StreamLayout(recorder, job->stream));
+        iov[count].iov_base = job->output.data;
+        iov[count++].iov_len = job->output_size;
+    }
+
+    size_t suffix_length = strlen(job->suffix);
+    if(suffix_length > 0)
+    {
+        iov[count].iov_base = (void *)job->suffix;
+        iov[count++].iov_len = suffix_length;
+    }
+
+    return count;
+}
+
+static void *
+_WriterThread(void *userdata)
+{
+    VideoRecorder *recorder = (VideoRecorder *)userdata;
+
+    struct iovec cloud_iov[MAX_BATCH_JOBS*IOVECS_PER_JOB];
+    struct iovec video_iov[MAX_BATCH_JOBS*IOVECS_PER_JOB];
+
+    while(true)
+    {
+        // Load running first. Once it is false, every job has been queued.
+        bool running = ATOMIC_LOAD(&recorder->running);
+        size_t next_sequence = ATOMIC_LOAD(&recorder->next_sequence);
+
+        // Collect the jobs that are ready, in sequence. Later jobs wait for
+        // the next one in sequence, even if they are done. A frame is not
+        // started until the render thread is done with it, so the whole
+        // frame can still be dropped until then.
+        size_t sequence = recorder->write_sequence;
+        size_t end = sequence;
+        size_t batch_bytes = 0;
+        int num_cloud_iov = 0;
+        int num_video_iov = 0;
+        while(end < next_sequence && end-sequence < MAX_BATCH_JOBS && batch_bytes < MAX_BATCH_BYTES)
+        {
+            RecorderJob *job = &recorder->jobs[end % QUEUE_LENGTH];
+            if(!ATOMIC_LOAD(&job->encoded) || job->frame > ATOMIC_LOAD(&recorder->sealed_frame))
+            {
+                break;
+            }
+
+            size_t *frame_state = &recorder->frame_states[job->frame % QUEUE_LENGTH];
+            if(job->frame != recorder->writing_frame)
+            {
+                ATOMIC_STORE(&recorder->writing_frame, job->frame);
+
+                size_t expected = FRAME_STATE(job->frame, FRAME_PENDING);
+                if(ATOMIC_CAS(frame_state, &expected, FRAME_STATE(job->frame, FRAME_WRITING)))
+                {
+                    ATOMIC_ADD(&recorder->frames_written, 1);
+                }
+            }
+
+            // Jobs of dropped frames are skipped one by one, since a frame
+            // dropped while being queued may end in the middle of a blob
+            size_t num_jobs = 1;
+            if(ATOMIC_LOAD(frame_state) == FRAME_STATE(job->frame, FRAME_WRITING))
+            {
+                // A chunked blob is written once all of its chunks are done
+                num_jobs = job->chunk_count;
+                if(end+num_jobs > next_sequence || end+num_jobs-sequence > MAX_BATCH_JOBS)
+                {
+                    break;
+                }
+
+                bool blob_ready = true;
+                for(size_t i=1; blob_ready && i<num_jobs; ++i)
+                {
+                    blob_ready = ATOMIC_LOAD(&recorder->jobs[(end+i) % QUEUE_LENGTH].encoded);
+                }
+
+                if(!blob_ready)
+                {
+                    break;
+                }
+
+                if(job->stream == STREAM_VIDEO_COLOR || job->stream == STREAM_VIDEO_DEPTH)
+                {
+                    num_video_iov += _AddJobToBatch(recorder, job, video_iov+num_video_iov);
+                }
+                else
+                {
+                    num_cloud_iov += _AddJobToBatch(recorder, job, cloud_iov+num_cloud_iov);
+                }
+
+                for(size_t i=0; i<num_jobs; ++i)
+                {
+                    batch_bytes += recorder->jobs[(end+i) % QUEUE_LENGTH].output_size;
+                }
+            }
+
+            end += num_jobs;
+        }
+
+        if(end == sequence)
+        {
+            if(!running && sequence == next_sequence)
+            {
+                break;
+            }
+
+            _WaitSignal(&recorder->job_encoded);
+            continue;
+        }
+
+        // One system call per file, however many buffers are ready
+        _WriteToFile(&recorder->cloud_file, cloud_iov, num_cloud_iov);
+        _WriteToFile(&recorder->video_file, video_iov, num_video_iov);
+
+        for(size_t i=sequence; i<end; ++i)
+        {
+            RecorderJob *job = &recorder->jobs[i % QUEUE_LENGTH];
+            _ReleaseBuffer(recorder, &job->output);
+            job->encoded = false;
+        }
+
+        ATOMIC_STORE(&recorder->write_sequence, end);
+        _PostSignal(&recorder->space_freed);
     }
 
     return NULL;
 }
 
-void
-_WriteBuffer(VideoRecorder *recorder, const void *data, size_t n_bytes, FILE *fd)
+// Everything queued for the current frame is skipped by the workers and the
+// writer, and the rest of it is never queued
+static void
+_DropCurrentFrame(VideoRecorder *recorder)
+{
+    size_t frame = recorder->current_frame;
+    size_t expected = FRAME_STATE(frame, FRAME_PENDING);
+    if(ATOMIC_CAS(&recorder->frame_states[frame % QUEUE_LENGTH], &expected, FRAME_STATE(frame, FRAME_CANCELLED)))
+    {
+        ATOMIC_ADD(&recorder->frames_dropped, 1);
+    }
+
+    recorder->dropping_frame = true;
+}
+
+// Drops the oldest finished frame the writer has not started on yet.
+// Returns false if there is no such frame.
+static bool
+_DropOldestFrame(VideoRecorder *recorder)
 {
-    QueuedBuffer buffer = {0};
+    for(size_t frame = ATOMIC_LOAD(&recorder->writing_frame)+1;
+        frame < recorder->current_frame; ++frame)
     {
-        buffer.data = malloc(n_bytes);
-        memcpy(buffer.data, data, n_bytes);
-        buffer.n_bytes = n_bytes;
-        buffer.fd = fd;
+        size_t expected = FRAME_STATE(frame, FRAME_PENDING);
+        if(ATOMIC_CAS(&recorder->frame_states[frame % QUEUE_LENGTH], &expected, FRAME_STATE(frame, FRAME_CANCELLED)))
+        {
+            ATOMIC_ADD(&recorder->frames_dropped, 1);
+            return true;
+        }
     }
 
-    sem_wait(recorder->empty);
-    pthread_mutex_lock(&recorder->lock);
+    return false;
+}
+
+// A frame shares its state slot with every QUEUE_LENGTH-th frame before it.
+// The slot is still in use if the frame in it has not been written past,
+// and was not dropped.
+static bool
+_IsFrameSlotInUse(VideoRecorder *recorder, size_t frame)
+{
+    size_t state = ATOMIC_LOAD(&recorder->frame_states[frame % QUEUE_LENGTH]);
+    size_t slot_frame = state >> 2;
+    return slot_frame != 0 && slot_frame != frame &&
+           slot_frame >= ATOMIC_LOAD(&recorder->writing_frame) &&
+           (state & 3) != FRAME_CANCELLED;
+}
 
-    recorder->buffer_queue[recorder->producer_index] = buffer;
-    ++recorder->producer_index;
-    if(recorder->producer_index >= QUEUE_LENGTH)
+static void
+_BeginFrame(VideoRecorder *recorder)
+{
+    if(recorder->current_frame > 0)
     {
-        recorder->producer_index = 0;
+        ATOMIC_STORE(&recorder->sealed_frame, recorder->current_frame);
+        _PostSignal(&recorder->job_encoded);
     }
 
-    ++recorder->buffer_count;
+    ++recorder->current_frame;
+    recorder->dropping_frame = false;
 
-    pthread_mutex_unlock(&recorder->lock);
-    sem_post(recorder->full);
+    // NOTE(istarnion): After many dropped frames, the frame the writer is
+    // on can be a whole ring behind. Its slot must not be taken over, or
+    // the writer would skip the rest of a frame it has started on. The new
+    // frame is dropped without a state of its own, or waits for the writer.
+    while(true)
+    {
+        while(_TryWaitSignal(&recorder->space_freed));
+
+        if(!_IsFrameSlotInUse(recorder, recorder->current_frame))
+        {
+            break;
+        }
+
+        if(recorder->settings.backpressure == BACKPRESSURE_DROP_NEWEST)
+        {
+            ATOMIC_ADD(&recorder->frames_dropped, 1);
+            recorder->dropping_frame = true;
+            return;
+        }
+
+        _WaitSignal(&recorder->space_freed);
+    }
+
+    ATOMIC_STORE(&recorder->frame_states[recorder->current_frame % QUEUE_LENGTH],
+                 FRAME_STATE(recorder->current_frame, FRAME_PENDING));
 }
 
-void
-_WriteString(VideoRecorder *recorder, const char *s, FILE *fd)
+// Copies the data into a pooled buffer and queues it for encoding. What
+// happens when the queue is full depends on the backpressure policy.
+static void
+_QueueJob(VideoRecorder *recorder, RecorderStream stream, RecorderJobType type,
+          const void *data, size_t n_bytes, int width, int height, size_t n_points,
+          uint32_t chunk_index, uint32_t chunk_count, size_t chunk_size)
+{
+    if(recorder->dropping_frame)
+    {
+        return;
+    }
+
+    int size_class = _SizeClass(n_bytes);
+    size_t class_bytes = (size_t)1 << size_class;
+    size_t max_buffered_bytes = recorder->settings.max_buffered_bytes;
+
+    size_t queue_depth;
+    while(true)
+    {
+        // Old wakeups are stale, the state is checked right below
+        while(_TryWaitSignal(&recorder->space_freed));
+
+        queue_depth = recorder->next_sequence - ATOMIC_LOAD(&recorder->write_sequence);
+        size_t buffered_bytes = ATOMIC_LOAD(&recorder->buffered_bytes);
+
+        // A job larger than the whole budget still goes through on its own
+        if(queue_depth < QUEUE_LENGTH &&
+           (buffered_bytes == 0 || buffered_bytes + class_bytes <= max_buffered_bytes))
+        {
+            break;
+        }
+
+        if(recorder->settings.backpressure == BACKPRESSURE_DROP_NEWEST)
+        {
+            _DropCurrentFrame(recorder);
+            return;
+        }
+        else if(recorder->settings.backpressure == BACKPRESSURE_DROP_OLDEST)
+        {
+            // If nothing can be dropped, wait for the frame being written
+            _DropOldestFrame(recorder);
+        }
+
+        _WaitSignal(&recorder->space_freed);
+    }
+
+    RecorderJob *job = &recorder->jobs[recorder->next_sequence % QUEUE_LENGTH];
+    job->type = type;
+    job->stream = stream;
+    job->frame = recorder->current_frame;
+    job->n_points = n_points;
+    job->input = _AcquireBuffer(recorder, size_class, recorder->current_frame);
+    memcpy(job->input.data, data, n_bytes);
+    job->n_bytes = n_bytes;
+    job->width = width;
+    job->height = height;
+    job->chunk_index = chunk_index;
+    job->chunk_count = chunk_count;
+    job->chunk_size = chunk_size;
+    job->output.data = NULL;
+    job->output_size = 0;
+    job->encoded = false;
+
+    ATOMIC_ADD(&recorder->buffered_bytes, class_bytes);
+    recorder->max_queue_depth = MAX(recorder->max_queue_depth, queue_depth+1);
+
+    ATOMIC_STORE(&recorder->next_sequence, recorder->next_sequence+1);
+    _PostSignal(&recorder->job_queued);
+}
+
+// Deflated buffers larger than CHUNK_SIZE are split into chunks, which are
+// queued as separate jobs so different workers can compress them
+static void
+_QueueBlob(VideoRecorder *recorder, RecorderStream stream, RecorderJobType type,
+           const void *data, size_t n_bytes, int width, int height, size_t n_points)
 {
-    size_t len = strlen(s);
-    _WriteBuffer(recorder, s, len, fd);
+    if(type != JOB_DEFLATE || n_bytes <= CHUNK_SIZE)
+    {
+        _QueueJob(recorder, stream, type, data, n_bytes, width, height, n_points, 0, 1, n_bytes);
+        return;
+    }
+
+    size_t chunk_size = MAX(CHUNK_SIZE, (n_bytes + MAX_BLOB_CHUNKS-1) / MAX_BLOB_CHUNKS);
+    uint32_t chunk_count = (uint32_t)((n_bytes + chunk_size-1) / chunk_size);
+    for(uint32_t i=0; i<chunk_count; ++i)
+    {
+        size_t offset = i*chunk_size;
+        _QueueJob(recorder, stream, type, (const uint8_t *)data + offset,
+                  MIN(chunk_size, n_bytes-offset), width, height, n_points,
+                  i, chunk_count, chunk_size);
+    }
 }
 
 VideoRecorder *
-StartVideoRecording(const char *cloud_file, const char *video_file, const size_t num_sensors, const SensorInfo *sensors)
+StartVideoRecording(const char *cloud_file, const char *video_file, const size_t num_sensors, const SensorInfo *sensors, const VideoRecorderSettings *settings)
 {
     VideoRecorder *result = NULL;
 
     for(int i=0; i<MAX_RECORDERS; ++i)
     {
         VideoRecorder *recorder = &recorders[i];
-        if(recorder->cloud_file == NULL || recorder->video_file == NULL)
+        if(!recorder->in_use)
         {
             result = recorder;
             memset(result, 0, sizeof(VideoRecorder));
-            result->cloud_file = fopen(cloud_file, "wb");
-            result->video_file = fopen(video_file, "wb");
-            if(result->cloud_file == NULL || ferror(result->cloud_file) ||
-               result->video_file == NULL || ferror(result->video_file))
+            if(!_OpenRecordingFile(&result->cloud_file, cloud_file, settings))
+            {
+                result = NULL;
+            }
+            else if(!_OpenRecordingFile(&result->video_file, video_file, settings))
             {
-                result->cloud_file = NULL;
-                result->video_file = NULL;
+                _CloseRecordingFile(&result->cloud_file);
                 result = NULL;
             }
+            else
+            {
+                result->in_use = true;
+            }
 
             break;
         }
     }
 
-    result->running = true;
-
-    pthread_mutex_init(&result->lock, NULL);
-    pthread_mutex_init(&result->file_lock, NULL);
-    result->full = sem_open("full", O_CREAT, 0600, 0);
-    result->empty = sem_open("empty", O_CREAT, 0600, QUEUE_LENGTH);
+    if(!result)
+    {
+        return NULL;
+    }
 
-    for(int i=0; i<N_CONSUMERS; ++i)
+    result->settings = *settings;
+    result->settings.jpeg_quality = MIN(MAX(result->settings.jpeg_quality, 1), 100);
+    if(result->settings.max_buffered_bytes == 0)
     {
-        pthread_create(&result->consumers[i], NULL, _ConsumerThread, result);
+        result->settings.max_buffered_bytes = DEFAULT_MAX_BUFFERED_BYTES;
     }
 
     char header[1024] = {0};
@@ -184,7 +1185,32 @@ StartVideoRecording(const char *cloud_file, const char *video_file, const size_t
         header_offset = strlen(header);
     }
 
-    _WriteString(result, header, result->video_file);
+    // Written before the writer thread starts
+    struct iovec header_iov = { header, header_offset };
+    _WriteToFile(&result->video_file, &header_iov, 1);
+
+    _InitPool(result);
+    _InitSignal(&result->job_queued);
+    _InitSignal(&result->job_encoded);
+    _InitSignal(&result->space_freed);
+
+    result->running = true;
+
+    // Leave one core for the render thread
+    int num_workers = settings->num_workers;
+    if(num_workers <= 0)
+    {
+        num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    }
+
+    result->num_workers = MIN(MAX(num_workers, 1), MAX_WORKERS);
+
+    for(int i=0; i<result->num_workers; ++i)
+    {
+        pthread_create(&result->workers[i], NULL, _WorkerThread, result);
+    }
+
+    pthread_create(&result->writer, NULL, _WriterThread, result);
 
     return result;
 }
@@ -194,65 +1220,151 @@ StopRecording(VideoRecorder *recorder)
 {
     SDL_assert(recorder);
 
-    printf("Writing %zu as the %zu last bytes\n", recorder->frame_count, sizeof(size_t));
-    fwrite(&recorder->frame_count, sizeof(size_t), 1, recorder->cloud_file);
-    fwrite(&recorder->frame_count, sizeof(size_t), 1, recorder->video_file);
+    // The threads finish all queued jobs before they exit
+    ATOMIC_STORE(&recorder->sealed_frame, recorder->current_frame);
+    ATOMIC_STORE(&recorder->running, false);
+    _PostSignal(&recorder->job_encoded);
+    for(int i=0; i<recorder->num_workers; ++i)
+    {
+        _PostSignal(&recorder->job_queued);
+    }
 
-    recorder->running = false;
-    for(int i=0; i<N_CONSUMERS; ++i)
+    for(int i=0; i<recorder->num_workers; ++i)
     {
-        pthread_join(recorder->consumers[i], NULL);
+        pthread_join(recorder->workers[i], NULL);
     }
 
-    sem_close(recorder->full);
-    sem_close(recorder->empty);
-    pthread_mutex_destroy(&recorder->lock);
+    pthread_join(recorder->writer, NULL);
 
-    fclose(recorder->cloud_file);
-    fclose(recorder->video_file);
+    size_t frame_count = recorder->frames_written;
+    printf("Writing %zu as the %zu last bytes\n", frame_count, sizeof(size_t));
+    struct iovec trailer = { &frame_count, sizeof(size_t) };
+    _WriteToFile(&recorder->cloud_file, &trailer, 1);
+    trailer.iov_base = &frame_count;
+    trailer.iov_len = sizeof(size_t);
+    _WriteToFile(&recorder->video_file, &trailer, 1);
+
+    if(recorder->frames_dropped > 0)
+    {
+        printf("Dropped %zu frames while recording\n", recorder->frames_dropped);
+    }
+
+    if(recorder->pool_misses > 0)
+    {
+        printf("Allocated %zu buffers after the first %d frames\n",
+               recorder->pool_misses, POOL_WARMUP_FRAMES);
+    }
+
+    _DestroySignal(&recorder->job_queued);
+    _DestroySignal(&recorder->job_encoded);
+    _DestroySignal(&recorder->space_freed);
+    _FreePool(recorder);
+
+    for(int i=0; i<NUM_SCRATCH_BUFFERS; ++i)
+    {
+        free(recorder->scratch[i]);
+    }
+
+    _CloseRecordingFile(&recorder->cloud_file);
+    _CloseRecordingFile(&recorder->video_file);
 
     memset(recorder, 0, sizeof(VideoRecorder));
 }
 
-static void
-CompressAndWriteData(VideoRecorder *recorder, FILE *f, const void *data, size_t size)
+void
+GetRecorderStats(VideoRecorder *recorder, VideoRecorderStats *stats)
 {
-    size_t compressed_size;
-    void *compressed_data = tdefl_compress_mem_to_heap(data, size, &compressed_size, 0);
-    printf("Frame was compressed from %zu to %zu (%.02f%%)\n", size, compressed_size, ((float)compressed_size/(float)size)*100);
-    _WriteBuffer(recorder, &compressed_size, sizeof(size_t), f);
-    _WriteBuffer(recorder, compressed_data, compressed_size, f);
-    free(compressed_data);
+    SDL_assert(recorder && stats);
+
+    stats->frames_written = ATOMIC_LOAD(&recorder->frames_written);
+    stats->frames_dropped = ATOMIC_LOAD(&recorder->frames_dropped);
+    stats->queue_depth = recorder->next_sequence - ATOMIC_LOAD(&recorder->write_sequence);
+    stats->max_queue_depth = recorder->max_queue_depth;
+    stats->buffered_bytes = ATOMIC_LOAD(&recorder->buffered_bytes);
+    stats->allocated_bytes = ATOMIC_LOAD(&recorder->allocated_bytes);
+    stats->pool_misses = ATOMIC_LOAD(&recorder->pool_misses);
+}
+
+// Grows, but never shrinks, so steady recording does not allocate
+static void *
+_ScratchBuffer(VideoRecorder *recorder, int index, size_t size)
+{
+    if(recorder->scratch_sizes[index] < size)
+    {
+        free(recorder->scratch[index]);
+        recorder->scratch[index] = malloc(size);
+        recorder->scratch_sizes[index] = size;
+    }
+
+    return recorder->scratch[index];
 }
 
 void
 WriteVideoFrame(VideoRecorder *recorder, size_t n_points, const V3 *xyz, const ColorPixel *rgb, const MagicMotionTag *tags)
 {
-    ++recorder->frame_count;
-    char header[128] = {0};
-    sprintf(header, "frame %zu %zu\n", recorder->frame_count, n_points);
-    _WriteString(recorder, header, recorder->cloud_file);
-    CompressAndWriteData(recorder, recorder->cloud_file, xyz, n_points*sizeof(V3));
-    CompressAndWriteData(recorder, recorder->cloud_file, rgb, n_points*sizeof(ColorPixel));
-    CompressAndWriteData(recorder, recorder->cloud_file, tags, n_points*sizeof(MagicMotionTag));
-    _WriteString(recorder, "\n", recorder->cloud_file);
+    _BeginFrame(recorder);
+
+    if(recorder->settings.foreground_only)
+    {
+        V3 *fg_xyz = (V3 *)_ScratchBuffer(recorder, SCRATCH_POSITIONS, n_points*sizeof(V3));
+        ColorPixel *fg_rgb = (ColorPixel *)_ScratchBuffer(recorder, SCRATCH_COLORS, n_points*sizeof(ColorPixel));
+        MagicMotionTag *fg_tags = (MagicMotionTag *)_ScratchBuffer(recorder, SCRATCH_TAGS, n_points*sizeof(MagicMotionTag));
+
+        size_t n_foreground = 0;
+        for(size_t i=0; i<n_points; ++i)
+        {
+            if(tags[i] & TAG_FOREGROUND)
+            {
+                fg_xyz[n_foreground] = xyz[i];
+                fg_rgb[n_foreground] = rgb[i];
+                fg_tags[n_foreground] = tags[i];
+                ++n_foreground;
+            }
+        }
+
+        n_points = n_foreground;
+        xyz = fg_xyz;
+        rgb = fg_rgb;
+        tags = fg_tags;
+    }
+
+    if(recorder->settings.compact_clouds)
+    {
+        int16_t *quantized = (int16_t *)_ScratchBuffer(recorder, SCRATCH_QUANTIZED, n_points*3*sizeof(int16_t));
+        uint8_t *packed_tags = (uint8_t *)_ScratchBuffer(recorder, SCRATCH_PACKED_TAGS, n_points);
+        QuantizePositions(xyz, n_points, quantized);
+        PackTags(tags, n_points, packed_tags);
+
+        _QueueBlob(recorder, STREAM_CLOUD_POSITIONS, JOB_DEFLATE, quantized, n_points*3*sizeof(int16_t), 0, 0, n_points);
+        _QueueBlob(recorder, STREAM_CLOUD_COLORS, JOB_DEFLATE, rgb, n_points*sizeof(ColorPixel), 0, 0, 0);
+        _QueueBlob(recorder, STREAM_CLOUD_TAGS, JOB_DEFLATE, packed_tags, n_points, 0, 0, 0);
+    }
+    else
+    {
+        _QueueBlob(recorder, STREAM_CLOUD_POSITIONS, JOB_DEFLATE, xyz, n_points*sizeof(V3), 0, 0, n_points);
+        _QueueBlob(recorder, STREAM_CLOUD_COLORS, JOB_DEFLATE, rgb, n_points*sizeof(ColorPixel), 0, 0, 0);
+        _QueueBlob(recorder, STREAM_CLOUD_TAGS, JOB_DEFLATE, tags, n_points*sizeof(MagicMotionTag), 0, 0, 0);
+    }
 }
 
 void
 AddVideoFrame(VideoRecorder *recorder, size_t color_w, size_t color_h, size_t depth_w, size_t depth_h, const ColorPixel *colors, const float *depths)
 {
-    char header[128] = {0};
-    sprintf(header, "frame %zu\ncolor\n", recorder->frame_count);
-    _WriteString(recorder, header, recorder->video_file);
-    CompressAndWriteData(recorder, recorder->video_file, colors, color_w*color_h*sizeof(ColorPixel));
-    memset(header, 0, 128);
-    sprintf(header, "\ndepth\n");
-    _WriteString(recorder, header, recorder->video_file);
-    CompressAndWriteData(recorder, recorder->video_file, depths, depth_w*depth_h*sizeof(float));
-    _WriteString(recorder, "\n", recorder->video_file);
+    SDL_assert(recorder->current_frame > 0); // WriteVideoFrame starts the frame
+
+    if(recorder->settings.color_codec == COLOR_CODEC_JPEG)
+    {
+        _QueueBlob(recorder, STREAM_VIDEO_COLOR, JOB_JPEG, colors, color_w*color_h*sizeof(ColorPixel),
+                   (int)color_w, (int)color_h, 0);
+    }
+    else
+    {
+        _QueueBlob(recorder, STREAM_VIDEO_COLOR, JOB_DEFLATE, colors, color_w*color_h*sizeof(ColorPixel), 0, 0, 0);
+    }
+
+    _QueueBlob(recorder, STREAM_VIDEO_DEPTH, JOB_DEFLATE, depths, depth_w*depth_h*sizeof(float), 0, 0, 0);
 }
 
 #ifdef __cplusplus
 } // extern "C"
 #endif
-
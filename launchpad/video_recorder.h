@@ -9,10 +9,49 @@ extern "C" {
 
 typedef struct VideoRecorder VideoRecorder;
 
-VideoRecorder *StartVideoRecording(const char *cloud_file, const char *video_file, const size_t num_sensors, const SensorInfo *sensors);
+typedef enum
+{
+    COLOR_CODEC_DEFLATE, // Lossless, but raw RGB barely compresses
+    COLOR_CODEC_JPEG
+} ColorCodec;
+
+// What to do when frames come in faster than they can be compressed and written
+typedef enum
+{
+    BACKPRESSURE_BLOCK,       // Wait for room. Nothing is lost, but the frame rate drops
+    BACKPRESSURE_DROP_OLDEST, // Drop the oldest frame that is not being written yet
+    BACKPRESSURE_DROP_NEWEST  // Drop the frame that did not fit
+} BackpressurePolicy;
+
+typedef struct
+{
+    ColorCodec color_codec;
+    int jpeg_quality; // 1-100. Only used with COLOR_CODEC_JPEG
+    int num_workers; // Threads doing compression. 0 picks one less than the number of cores
+    BackpressurePolicy backpressure;
+    size_t max_buffered_bytes; // Raw frame data waiting to be compressed. 0 means 512 MiB
+    bool direct_io; // Bypass the page cache (O_DIRECT). Falls back to buffered writes if unsupported
+    size_t preallocate_bytes; // Reserve this much disk space for each file up front. Linux only
+    bool compact_clouds; // Store cloud positions as int16 and tags as bytes
+    bool foreground_only; // Only store cloud points tagged as foreground
+} VideoRecorderSettings;
+
+typedef struct
+{
+    size_t frames_written;
+    size_t frames_dropped;
+    size_t queue_depth; // Buffers queued, being compressed or being written
+    size_t max_queue_depth;
+    size_t buffered_bytes;
+    size_t allocated_bytes; // Held by the buffer pool, in use or not
+    size_t pool_misses; // Buffers allocated after warming up. Should stay 0
+} VideoRecorderStats;
+
+VideoRecorder *StartVideoRecording(const char *cloud_file, const char *video_file, const size_t num_sensors, const SensorInfo *sensors, const VideoRecorderSettings *settings);
 void StopRecording(VideoRecorder *recorder);
 void WriteCloudFrame(VideoRecorder *recorder, size_t n_points, const V3 *xyz, const ColorPixel *rgb, const MagicMotionTag *tags);
 void AddVideoFrame(VideoRecorder *recorder, size_t color_w, size_t color_h, size_t depth_w, size_t depth_h, const ColorPixel *colors, const float *depths);
+void GetRecorderStats(VideoRecorder *recorder, VideoRecorderStats *stats);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,854 @@
+// Turns a raw recording (recording_video.vid) into a new cloud recording with
+// the current sensor calibration and a classifier of choice, without playing
+// it back in real time.
+//
+// The frames are split into one range per thread, and the ranges are
+// processed side by side into files of their own, which are joined in order
+// at the end. The MOG classifier depends on the frames before, so every range
+// but the first starts by running the model over a warm-up window of the
+// frames before it. Warm-up frames are not written, and need neither their
+// color frames nor any encoding, so they cost far less than the frames that
+// are. The naive classifier is calibrated once, on the first frames of the
+// recording, and shared by all ranges.
+
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ARCHIVE_WRITING_APIS
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "miniz.c"
+#include "recording_format.cpp"
+
+// Color frames may be stored as JPEG
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_NO_STDIO
+#include "stb_image.h"
+
+#include "magic_motion.h"
+#include "timing.h"
+#include "sensor_serialization.cpp"
+#include "background_model.cpp"
+#include "point_cloud.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_REPROCESS_THREADS 64
+
+typedef enum
+{
+    REPROCESS_NONE,
+    REPROCESS_NAIVE,
+    REPROCESS_MOG
+} ReprocessClassifier;
+
+static const char *classifier_names[] = { "none", "naive", "mog" };
+
+typedef struct
+{
+    ReprocessClassifier classifier;
+    float treshold;
+    int calibration_frames;
+    int mog_duration;
+    float mog_treshold;
+    int warmup_frames;
+    int num_threads;
+    bool compact_clouds;
+    bool foreground_only;
+} ReprocessSettings;
+
+typedef struct
+{
+    int fd;
+    size_t num_sensors;
+    SensorInfo sensors[MAX_SENSORS];
+    Frustum frustums[MAX_SENSORS];
+    size_t cloud_capacity; // Points in a frame if every pixel has a depth
+
+    size_t num_frames;
+    size_t *color_offsets; // Of the blob word, num_sensors per frame
+    size_t *depth_offsets;
+} RawRecording;
+
+// Buffers a range decodes into, and grows as needed
+typedef struct
+{
+    uint8_t *blob;
+    size_t blob_capacity;
+
+    ColorPixel *color_frames[MAX_SENSORS];
+    DepthPixel *depth_frames[MAX_SENSORS];
+
+    V3 *spatial_cloud;
+    ColorPixel *color_cloud;
+    MagicMotionTag *tag_cloud;
+    Voxel *voxels;
+
+    // Points written when only foreground is kept
+    V3 *foreground_positions;
+    ColorPixel *foreground_colors;
+    MagicMotionTag *foreground_tags;
+
+    int16_t *quantized;
+    uint8_t *packed_tags;
+} RangeBuffers;
+
+typedef struct
+{
+    const RawRecording *recording;
+    const ReprocessSettings *settings;
+    const float *naive_model; // NULL until calibrated
+
+    size_t warmup_start;
+    size_t first_frame;
+    size_t end_frame;
+
+    char filename[512];
+    bool ok;
+    size_t points_written;
+    double milliseconds;
+} FrameRange;
+
+// Same scan as the recording sensor interface does
+static bool
+_OpenRawRecording(RawRecording *recording, const char *filename)
+{
+    memset(recording, 0, sizeof(RawRecording));
+
+    FILE *file = fopen(filename, "rb");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+
+    fseek(file, -(long)sizeof(size_t), SEEK_END);
+    if(fread(&recording->num_frames, sizeof(size_t), 1, file) != 1)
+    {
+        fprintf(stderr, "%s is not a raw recording\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    rewind(file);
+
+    if(fscanf(file, "%zu sensors\n", &recording->num_sensors) != 1 ||
+       recording->num_sensors == 0 || recording->num_sensors > MAX_SENSORS)
+    {
+        fprintf(stderr, "%s is not a raw recording\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    for(size_t i=0; i<recording->num_sensors; ++i)
+    {
+        SensorInfo *info = &recording->sensors[i];
+        strncpy(info->URI, "REC", 128);
+        fscanf(file, "%s %s %s\n", info->vendor, info->name, info->serial);
+        fscanf(file, "%d %d %f\n",
+               &info->color_stream_info.width, &info->color_stream_info.height,
+               &info->color_stream_info.fov);
+        fscanf(file, "%d %d %f %f %f\n",
+               &info->depth_stream_info.width, &info->depth_stream_info.height,
+               &info->depth_stream_info.fov,
+               &info->depth_stream_info.min_depth, &info->depth_stream_info.max_depth);
+
+        info->color_stream_info.aspect_ratio = (float)info->color_stream_info.width /
+                                               (float)info->color_stream_info.height;
+        info->depth_stream_info.aspect_ratio = (float)info->depth_stream_info.width /
+                                               (float)info->depth_stream_info.height;
+
+        recording->frustums[i] = _DefaultFrustum(info);
+        recording->cloud_capacity += info->depth_stream_info.width * info->depth_stream_info.height;
+    }
+
+    const size_t num_blobs = recording->num_frames * recording->num_sensors;
+    recording->color_offsets = (size_t *)malloc(sizeof(size_t)*num_blobs);
+    recording->depth_offsets = (size_t *)malloc(sizeof(size_t)*num_blobs);
+
+    bool ok = true;
+    for(size_t i=0; i<recording->num_frames && ok; ++i)
+    {
+        for(size_t j=0; j<recording->num_sensors && ok; ++j)
+        {
+            size_t frame_index;
+            char frame_type[64] = {0};
+            ok = fscanf(file, "frame %zu\n", &frame_index) == 1 && frame_index == i+1 &&
+                 fgets(frame_type, 64, file) && strcmp(frame_type, "color\n") == 0;
+            if(!ok)
+            {
+                fprintf(stderr, "Frame %zu invalid header\n", i+1);
+                break;
+            }
+
+            recording->color_offsets[i*recording->num_sensors+j] = ftell(file);
+
+            size_t blob_word = 0;
+            fread(&blob_word, sizeof(size_t), 1, file);
+            fseek(file, BLOB_SIZE(blob_word)+1, SEEK_CUR); // Skip compressed data and following newline
+
+            memset(frame_type, 0, 64);
+            ok = fgets(frame_type, 64, file) && strcmp(frame_type, "depth\n") == 0;
+            if(!ok)
+            {
+                fprintf(stderr, "Frame %zu has no depth\n", i+1);
+                break;
+            }
+
+            recording->depth_offsets[i*recording->num_sensors+j] = ftell(file);
+            fread(&blob_word, sizeof(size_t), 1, file);
+            fseek(file, BLOB_SIZE(blob_word)+1, SEEK_CUR); // Skip compressed data and following newline
+        }
+    }
+
+    if(ok)
+    {
+        recording->fd = dup(fileno(file));
+    }
+    else
+    {
+        free(recording->color_offsets);
+        free(recording->depth_offsets);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+static void
+_CloseRawRecording(RawRecording *recording)
+{
+    close(recording->fd);
+    free(recording->color_offsets);
+    free(recording->depth_offsets);
+    memset(recording, 0, sizeof(RawRecording));
+}
+
+// Uses the calibrated frustum of every sensor found in the calibration file.
+// The others keep the frustum they get before calibration, as they would live.
+static void
+_ApplyCalibration(RawRecording *recording, const char *calibration_filename)
+{
+    SerializedSensor serialized_sensors[MAX_SENSORS];
+    int num_serialized_sensors = LoadSensorsFromFile(calibration_filename, serialized_sensors, MAX_SENSORS);
+    if(num_serialized_sensors < 0)
+    {
+        fprintf(stderr, "WARN: No calibration file \"%s\" found. Sensors are not transformed\n",
+                calibration_filename);
+    }
+
+    for(size_t i=0; i<recording->num_sensors; ++i)
+    {
+        const SensorInfo *sensor = &recording->sensors[i];
+        bool calibrated = false;
+        for(int j=0; j<num_serialized_sensors; ++j)
+        {
+            if(strcmp(sensor->serial, serialized_sensors[j].serial) == 0)
+            {
+                recording->frustums[i] = serialized_sensors[j].frustum;
+                calibrated = true;
+                break;
+            }
+        }
+
+        if(!calibrated && num_serialized_sensors >= 0)
+        {
+            fprintf(stderr, "WARN: %s is not in %s. It is not transformed\n",
+                    sensor->serial, calibration_filename);
+        }
+    }
+}
+
+static void *
+_Grow(void *buffer, size_t *capacity, size_t size)
+{
+    if(*capacity < size)
+    {
+        free(buffer);
+        buffer = malloc(size);
+        *capacity = size;
+    }
+
+    return buffer;
+}
+
+static bool
+_ReadBlob(int fd, size_t offset, size_t *blob_word, RangeBuffers *buffers)
+{
+    if(!_ReadAt(fd, blob_word, sizeof(size_t), offset))
+    {
+        return false;
+    }
+
+    size_t blob_size = BLOB_SIZE(*blob_word);
+    buffers->blob = (uint8_t *)_Grow(buffers->blob, &buffers->blob_capacity, blob_size);
+    return _ReadAt(fd, buffers->blob, blob_size, offset+sizeof(size_t));
+}
+
+static bool
+_ReadColorFrame(const RawRecording *recording, size_t frame, size_t sensor_index, RangeBuffers *buffers)
+{
+    const SensorInfo *sensor = &recording->sensors[sensor_index];
+    const size_t buffer_size = sensor->color_stream_info.width * sensor->color_stream_info.height * sizeof(ColorPixel);
+
+    size_t blob_word;
+    if(!_ReadBlob(recording->fd, recording->color_offsets[frame*recording->num_sensors+sensor_index],
+                  &blob_word, buffers))
+    {
+        return false;
+    }
+
+    if(BLOB_ENCODING(blob_word) == BLOB_JPEG)
+    {
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load_from_memory(buffers->blob, (int)BLOB_SIZE(blob_word),
+                                                &width, &height, &channels, 3);
+        bool ok = pixels &&
+                  width == sensor->color_stream_info.width &&
+                  height == sensor->color_stream_info.height;
+        if(ok)
+        {
+            memcpy(buffers->color_frames[sensor_index], pixels, buffer_size);
+        }
+
+        stbi_image_free(pixels);
+        return ok;
+    }
+
+    return DecompressBlob(BLOB_ENCODING(blob_word), buffers->blob, BLOB_SIZE(blob_word),
+                          buffers->color_frames[sensor_index], buffer_size);
+}
+
+static bool
+_ReadDepthFrame(const RawRecording *recording, size_t frame, size_t sensor_index, RangeBuffers *buffers)
+{
+    const SensorInfo *sensor = &recording->sensors[sensor_index];
+    const size_t buffer_size = sensor->depth_stream_info.width * sensor->depth_stream_info.height * sizeof(DepthPixel);
+
+    size_t blob_word;
+    return _ReadBlob(recording->fd, recording->depth_offsets[frame*recording->num_sensors+sensor_index],
+                     &blob_word, buffers) &&
+           DecompressBlob(BLOB_ENCODING(blob_word), buffers->blob, BLOB_SIZE(blob_word),
+                          buffers->depth_frames[sensor_index], buffer_size);
+}
+
+// Builds the cloud of a frame, as MagicMotion_CaptureFrame does. Without
+// colors, the color cloud is left as it is.
+static bool
+_BuildCloud(const RawRecording *recording, size_t frame, bool with_colors,
+            RangeBuffers *buffers, size_t *num_points)
+{
+    *num_points = 0;
+    for(size_t i=0; i<recording->num_sensors; ++i)
+    {
+        if(!_ReadDepthFrame(recording, frame, i, buffers) ||
+           (with_colors && !_ReadColorFrame(recording, frame, i, buffers)))
+        {
+            fprintf(stderr, "Failed to decode frame %zu of sensor %zu\n", frame+1, i);
+            return false;
+        }
+
+        *num_points += _ProjectDepthFrame(&recording->sensors[i], &recording->frustums[i],
+                                          buffers->depth_frames[i],
+                                          with_colors ? buffers->color_frames[i] : NULL,
+                                          (TAG_CAMERA_0 + i),
+                                          buffers->spatial_cloud + *num_points,
+                                          buffers->color_cloud + *num_points,
+                                          buffers->tag_cloud + *num_points);
+    }
+
+    return true;
+}
+
+static void
+_AllocateBuffers(const RawRecording *recording, RangeBuffers *buffers)
+{
+    memset(buffers, 0, sizeof(RangeBuffers));
+
+    for(size_t i=0; i<recording->num_sensors; ++i)
+    {
+        const SensorInfo *sensor = &recording->sensors[i];
+        buffers->color_frames[i] = (ColorPixel *)calloc(sensor->color_stream_info.width * sensor->color_stream_info.height, sizeof(ColorPixel));
+        buffers->depth_frames[i] = (DepthPixel *)calloc(sensor->depth_stream_info.width * sensor->depth_stream_info.height, sizeof(DepthPixel));
+    }
+
+    const size_t n = recording->cloud_capacity;
+    buffers->spatial_cloud = (V3 *)malloc(sizeof(V3)*n);
+    buffers->color_cloud = (ColorPixel *)malloc(sizeof(ColorPixel)*n);
+    buffers->tag_cloud = (MagicMotionTag *)malloc(sizeof(MagicMotionTag)*n);
+    buffers->voxels = (Voxel *)malloc(sizeof(Voxel)*NUM_VOXELS);
+
+    buffers->foreground_positions = (V3 *)malloc(sizeof(V3)*n);
+    buffers->foreground_colors = (ColorPixel *)malloc(sizeof(ColorPixel)*n);
+    buffers->foreground_tags = (MagicMotionTag *)malloc(sizeof(MagicMotionTag)*n);
+
+    buffers->quantized = (int16_t *)malloc(sizeof(int16_t)*3*n);
+    buffers->packed_tags = (uint8_t *)malloc(n);
+}
+
+static void
+_FreeBuffers(RangeBuffers *buffers)
+{
+    for(int i=0; i<MAX_SENSORS; ++i)
+    {
+        free(buffers->color_frames[i]);
+        free(buffers->depth_frames[i]);
+    }
+
+    free(buffers->blob);
+    free(buffers->spatial_cloud);
+    free(buffers->color_cloud);
+    free(buffers->tag_cloud);
+    free(buffers->voxels);
+    free(buffers->foreground_positions);
+    free(buffers->foreground_colors);
+    free(buffers->foreground_tags);
+    free(buffers->quantized);
+    free(buffers->packed_tags);
+}
+
+static bool
+_WriteBlob(FILE *file, const void *data, size_t size, BlobLayout layout)
+{
+    size_t compressed_size = 0;
+    void *compressed = tdefl_compress_mem_to_heap(data, size, &compressed_size, 0);
+    if(!compressed && size > 0)
+    {
+        return false;
+    }
+
+    size_t blob_word = BLOB_WORD_WITH_LAYOUT(compressed_size, BLOB_DEFLATE, layout);
+    bool ok = fwrite(&blob_word, sizeof(size_t), 1, file) == 1 &&
+              fwrite(compressed, 1, compressed_size, file) == compressed_size;
+    mz_free(compressed);
+    return ok;
+}
+
+// Same layout as WriteVideoFrame in the launchpad video recorder. num_written
+// is the number of points in the frame, which is fewer than num_points when
+// only the foreground is kept
+static bool
+_WriteCloudFrame(FILE *file, size_t frame, size_t num_points, const ReprocessSettings *settings,
+                 RangeBuffers *buffers, size_t *num_written)
+{
+    const V3 *xyz = buffers->spatial_cloud;
+    const ColorPixel *rgb = buffers->color_cloud;
+    const MagicMotionTag *tags = buffers->tag_cloud;
+
+    if(settings->foreground_only)
+    {
+        size_t n_foreground = 0;
+        for(size_t i=0; i<num_points; ++i)
+        {
+            if(tags[i] & TAG_FOREGROUND)
+            {
+                buffers->foreground_positions[n_foreground] = xyz[i];
+                buffers->foreground_colors[n_foreground] = rgb[i];
+                buffers->foreground_tags[n_foreground] = tags[i];
+                ++n_foreground;
+            }
+        }
+
+        num_points = n_foreground;
+        xyz = buffers->foreground_positions;
+        rgb = buffers->foreground_colors;
+        tags = buffers->foreground_tags;
+    }
+
+    *num_written = num_points;
+
+    bool ok = fprintf(file, "frame %zu %zu\n", frame+1, num_points) > 0;
+    if(settings->compact_clouds)
+    {
+        QuantizePositions(xyz, num_points, buffers->quantized);
+        PackTags(tags, num_points, buffers->packed_tags);
+
+        ok = ok &&
+             _WriteBlob(file, buffers->quantized, num_points*3*sizeof(int16_t), BLOB_LAYOUT_POSITIONS_Q16) &&
+             _WriteBlob(file, rgb, num_points*sizeof(ColorPixel), BLOB_LAYOUT_RAW) &&
+             _WriteBlob(file, buffers->packed_tags, num_points, BLOB_LAYOUT_TAGS_U8);
+    }
+    else
+    {
+        ok = ok &&
+             _WriteBlob(file, xyz, num_points*sizeof(V3), BLOB_LAYOUT_RAW) &&
+             _WriteBlob(file, rgb, num_points*sizeof(ColorPixel), BLOB_LAYOUT_RAW) &&
+             _WriteBlob(file, tags, num_points*sizeof(MagicMotionTag), BLOB_LAYOUT_RAW);
+    }
+
+    return ok && fputc('\n', file) != EOF;
+}
+
+static void *
+_ProcessRange(void *userdata)
+{
+    FrameRange *range = (FrameRange *)userdata;
+    const RawRecording *recording = range->recording;
+    const ReprocessSettings *settings = range->settings;
+
+    double start = GetWallMilliseconds();
+
+    FILE *out = fopen(range->filename, "wb");
+    if(!out)
+    {
+        fprintf(stderr, "Failed to open %s\n", range->filename);
+        return NULL;
+    }
+
+    RangeBuffers buffers;
+    _AllocateBuffers(recording, &buffers);
+
+    float *background_model = (float *)calloc(NUM_VOXELS, sizeof(float));
+    float *point_counts = (float *)calloc(NUM_VOXELS, sizeof(float));
+
+    bool ok = true;
+    for(size_t frame=range->warmup_start; frame<range->end_frame && ok; ++frame)
+    {
+        const bool warming_up = frame < range->first_frame;
+
+        size_t num_points;
+        ok = _BuildCloud(recording, frame, !warming_up, &buffers, &num_points);
+        if(!ok)
+        {
+            break;
+        }
+
+        memset(buffers.voxels, 0, sizeof(Voxel)*NUM_VOXELS);
+
+        if(warming_up)
+        {
+            _CountVoxelPoints(buffers.spatial_cloud, num_points, buffers.voxels);
+        }
+        else
+        {
+            const float *model = NULL;
+            if(settings->classifier == REPROCESS_NAIVE)
+            {
+                // The library tags every point as foreground while calibrating
+                model = (frame < (size_t)settings->calibration_frames) ? NULL : range->naive_model;
+            }
+            else if(settings->classifier == REPROCESS_MOG)
+            {
+                model = background_model;
+            }
+
+            _ClassifyCloud(buffers.spatial_cloud, buffers.color_cloud, buffers.tag_cloud, num_points,
+                           model, settings->treshold, buffers.voxels, NULL, NULL);
+
+            if(settings->classifier == REPROCESS_NAIVE)
+            {
+                _FilterSparseForeground(buffers.spatial_cloud, buffers.tag_cloud, num_points, buffers.voxels);
+            }
+
+            size_t num_written = 0;
+            ok = _WriteCloudFrame(out, frame, num_points, settings, &buffers, &num_written);
+            if(!ok)
+            {
+                fprintf(stderr, "Failed to write frame %zu to %s\n", frame+1, range->filename);
+            }
+
+            range->points_written += num_written;
+        }
+
+        // NOTE(istarnion): The frames are counted from the start of the warm-up,
+        // so the average is a plain mean until it covers the whole duration,
+        // instead of starting at zero
+        if(settings->classifier == REPROCESS_MOG)
+        {
+            _UpdateSimpleMOG(point_counts, buffers.voxels, frame - range->warmup_start + 1,
+                             settings->mog_duration, settings->mog_treshold, background_model);
+        }
+    }
+
+    if(fclose(out) != 0)
+    {
+        ok = false;
+    }
+
+    free(point_counts);
+    free(background_model);
+    _FreeBuffers(&buffers);
+
+    range->ok = ok;
+    range->milliseconds = GetWallMilliseconds() - start;
+    return NULL;
+}
+
+// The naive classifier keeps the highest point count of every voxel over the
+// first frames of the recording. It does not change after, so it is made once.
+static bool
+_CalibrateNaive(const RawRecording *recording, const ReprocessSettings *settings, float *background_model)
+{
+    RangeBuffers buffers;
+    _AllocateBuffers(recording, &buffers);
+    float *max_point_counts = (float *)calloc(NUM_VOXELS, sizeof(float));
+
+    bool ok = true;
+    size_t calibration_frames = MIN((size_t)settings->calibration_frames, recording->num_frames);
+    for(size_t frame=0; frame<calibration_frames && ok; ++frame)
+    {
+        size_t num_points;
+        ok = _BuildCloud(recording, frame, false, &buffers, &num_points);
+        if(ok)
+        {
+            memset(buffers.voxels, 0, sizeof(Voxel)*NUM_VOXELS);
+            _CountVoxelPoints(buffers.spatial_cloud, num_points, buffers.voxels);
+            _UpdateNaiveCalibration(max_point_counts, buffers.voxels);
+        }
+    }
+
+    _FinishNaiveCalibration(max_point_counts, background_model);
+
+    free(max_point_counts);
+    _FreeBuffers(&buffers);
+    return ok;
+}
+
+static bool
+_CopyFile(const char *filename, FILE *to)
+{
+    FILE *from = fopen(filename, "rb");
+    if(!from)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    static uint8_t buffer[4 << 20];
+    size_t n;
+    while(ok && (n = fread(buffer, 1, sizeof(buffer), from)) > 0)
+    {
+        ok = fwrite(buffer, 1, n, to) == n;
+    }
+
+    ok = ok && !ferror(from);
+    fclose(from);
+    return ok;
+}
+
+static void
+_PrintUsage(void)
+{
+    fprintf(stderr,
+            "usage: magicmotion_reprocess <raw recording> <cloud recording> [options]\n"
+            "  -s <file>            Sensor calibration (default sensors.ser)\n"
+            "  -c none|naive|mog    Classifier (default mog)\n"
+            "  -t <treshold>        Background probability treshold (default %g)\n"
+            "  -n <frames>          Frames the naive classifier calibrates on (default 30)\n"
+            "  -d <frames>          Frames the MOG classifier averages over (default %d)\n"
+            "  -p <points>          Average point count of MOG background voxels (default %g)\n"
+            "  -w <frames>          MOG warm-up before every range (default the MOG duration)\n"
+            "  -j <threads>         Threads, and frame ranges (default one per core)\n"
+            "  -z                   Compact point clouds\n"
+            "  -g                   Foreground points only\n",
+            BACKGROUND_PROBABILITY_TRESHOLD, MOG_DURATION, MOG_POINT_COUNT_TRESHOLD);
+}
+
+int
+main(int num_args, char *args[])
+{
+    if(num_args < 3)
+    {
+        _PrintUsage();
+        return 1;
+    }
+
+    const char *raw_filename = args[1];
+    const char *output_filename = args[2];
+    const char *calibration_filename = "sensors.ser";
+
+    ReprocessSettings settings = {};
+    settings.classifier = REPROCESS_MOG;
+    settings.treshold = BACKGROUND_PROBABILITY_TRESHOLD;
+    settings.calibration_frames = 30;
+    settings.mog_duration = MOG_DURATION;
+    settings.mog_treshold = MOG_POINT_COUNT_TRESHOLD;
+    settings.warmup_frames = -1;
+    settings.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for(int i=3; i<num_args; ++i)
+    {
+        if(strcmp(args[i], "-z") == 0)
+        {
+            settings.compact_clouds = true;
+            continue;
+        }
+        else if(strcmp(args[i], "-g") == 0)
+        {
+            settings.foreground_only = true;
+            continue;
+        }
+
+        const char *value = (i+1 < num_args) ? args[i+1] : NULL;
+        if(!value)
+        {
+            _PrintUsage();
+            return 1;
+        }
+
+        if(strcmp(args[i], "-c") == 0)
+        {
+            if(strcmp(value, "none") == 0) settings.classifier = REPROCESS_NONE;
+            else if(strcmp(value, "naive") == 0) settings.classifier = REPROCESS_NAIVE;
+            else if(strcmp(value, "mog") == 0) settings.classifier = REPROCESS_MOG;
+            else
+            {
+                _PrintUsage();
+                return 1;
+            }
+        }
+        else if(strcmp(args[i], "-s") == 0) calibration_filename = value;
+        else if(strcmp(args[i], "-t") == 0) settings.treshold = (float)atof(value);
+        else if(strcmp(args[i], "-n") == 0) settings.calibration_frames = MAX(atoi(value), 0);
+        else if(strcmp(args[i], "-d") == 0) settings.mog_duration = MAX(atoi(value), 1);
+        else if(strcmp(args[i], "-p") == 0) settings.mog_treshold = (float)atof(value);
+        else if(strcmp(args[i], "-w") == 0) settings.warmup_frames = MAX(atoi(value), 0);
+        else if(strcmp(args[i], "-j") == 0) settings.num_threads = atoi(value);
+        else
+        {
+            _PrintUsage();
+            return 1;
+        }
+
+        ++i;
+    }
+
+    if(settings.warmup_frames < 0)
+    {
+        settings.warmup_frames = settings.mog_duration;
+    }
+
+    if(settings.num_threads < 1)
+    {
+        settings.num_threads = 1;
+    }
+    else if(settings.num_threads > MAX_REPROCESS_THREADS)
+    {
+        settings.num_threads = MAX_REPROCESS_THREADS;
+    }
+
+    RawRecording recording;
+    if(!_OpenRawRecording(&recording, raw_filename))
+    {
+        return 1;
+    }
+
+    _ApplyCalibration(&recording, calibration_filename);
+
+    double start_time = GetWallMilliseconds();
+
+    float *naive_model = NULL;
+    if(settings.classifier == REPROCESS_NAIVE)
+    {
+        naive_model = (float *)calloc(NUM_VOXELS, sizeof(float));
+        if(!_CalibrateNaive(&recording, &settings, naive_model))
+        {
+            fprintf(stderr, "Failed to calibrate the naive classifier\n");
+            return 1;
+        }
+    }
+
+    const size_t num_frames = recording.num_frames;
+    const size_t num_ranges = MAX(MIN((size_t)settings.num_threads, num_frames), (size_t)1);
+    const size_t warmup = (settings.classifier == REPROCESS_MOG) ? (size_t)settings.warmup_frames : 0;
+
+    FrameRange *ranges = (FrameRange *)calloc(num_ranges, sizeof(FrameRange));
+    pthread_t threads[MAX_REPROCESS_THREADS];
+    bool started[MAX_REPROCESS_THREADS] = {};
+
+    for(size_t i=0; i<num_ranges; ++i)
+    {
+        FrameRange *range = &ranges[i];
+        range->recording = &recording;
+        range->settings = &settings;
+        range->naive_model = naive_model;
+        range->first_frame = num_frames*i/num_ranges;
+        range->end_frame = num_frames*(i+1)/num_ranges;
+        range->warmup_start = range->first_frame - MIN(warmup, range->first_frame);
+        snprintf(range->filename, sizeof(range->filename), "%s.part%zu", output_filename, i);
+
+        // The calling thread takes the last range
+        if(i+1 < num_ranges)
+        {
+            started[i] = pthread_create(&threads[i], NULL, _ProcessRange, range) == 0;
+        }
+    }
+
+    _ProcessRange(&ranges[num_ranges-1]);
+
+    for(size_t i=0; i+1<num_ranges; ++i)
+    {
+        if(started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        else
+        {
+            // NOTE(istarnion): Out of threads. Do it here, rather than fail
+            _ProcessRange(&ranges[i]);
+        }
+    }
+
+    bool ok = true;
+    size_t points_written = 0;
+    for(size_t i=0; i<num_ranges; ++i)
+    {
+        const FrameRange *range = &ranges[i];
+        fprintf(stderr, "Frames %zu-%zu (warm-up from %zu): %s in %.2f s\n",
+                range->first_frame+1, range->end_frame, range->warmup_start+1,
+                range->ok ? "done" : "FAILED", range->milliseconds / 1000.0);
+        ok = ok && range->ok;
+        points_written += range->points_written;
+    }
+
+    if(ok)
+    {
+        FILE *out = fopen(output_filename, "wb");
+        if(out)
+        {
+            for(size_t i=0; i<num_ranges && ok; ++i)
+            {
+                ok = _CopyFile(ranges[i].filename, out);
+            }
+
+            ok = ok && fwrite(&num_frames, sizeof(size_t), 1, out) == 1;
+            ok = (fclose(out) == 0) && ok;
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if(!ok)
+        {
+            fprintf(stderr, "Failed to write %s\n", output_filename);
+            remove(output_filename);
+        }
+    }
+
+    for(size_t i=0; i<num_ranges; ++i)
+    {
+        remove(ranges[i].filename);
+    }
+
+    if(ok)
+    {
+        fprintf(stderr, "Reprocessed %zu frames (%zu points) with the %s classifier into %s in %.2f s on %zu threads\n",
+                num_frames, points_written, classifier_names[settings.classifier], output_filename,
+                (GetWallMilliseconds() - start_time) / 1000.0, num_ranges);
+    }
+
+    free(ranges);
+    free(naive_model);
+    _CloseRawRecording(&recording);
+
+    return ok ? 0 : 1;
+}
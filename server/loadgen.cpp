@@ -0,0 +1,480 @@
+// Puts a magicmotion_server under query load, and reports how it holds up.
+// Every simulated client has a socket and a thread of its own, and sends
+// queries of random AABBs at a fixed rate, whether or not the last ones
+// were answered, or as fast as they are answered with a rate of 0.
+//
+// To measure the server alone, run it against a recording, by building
+// libMagicMotion with SENSOR_INTERFACE=SENSOR_RECORDING, so the frames
+// come in at the same pace every run.
+//
+// Version 1 queries wait for their AABBs per address, in as many slots as
+// the server has whitelist entries, so keep to 16 clients with -1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define MAX_LOAD_CLIENTS 256
+// Half the size of the voxel grid of the server, in dm
+#define GRID_HALF_X 25.0f
+#define GRID_HALF_Y 7.5f
+#define GRID_HALF_Z 25.0f
+
+#define DRAIN_SECONDS 0.5 // How long replies are waited for after the last query
+
+typedef struct
+{
+    sockaddr_in server;
+    int num_clients;
+    int num_boxes;   // Per query
+    double rate;     // Queries per second per client. 0 sends the next when the last is answered
+    double seconds;
+    int version;     // 1 or 2
+} LoadSettings;
+
+typedef struct
+{
+    const LoadSettings *settings;
+    int index;
+    int socket;
+
+    // Indexed by query sequence number
+    uint64_t *sent_at;
+    uint16_t *fragments_left;
+    size_t capacity;
+
+    uint32_t num_sent;
+    uint32_t awaiting_results; // Sequence number of the version 1 header last echoed
+    size_t num_completed;
+    size_t num_rejected;
+    double *latencies;         // Microseconds
+} LoadClient;
+
+static uint64_t
+_NowNanoseconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static float
+_Random(unsigned int *seed, float min, float max)
+{
+    return min + (max - min) * ((float)rand_r(seed) / (float)RAND_MAX);
+}
+
+static void
+_RandomAABB(unsigned int *seed, PacketAABB *aabb)
+{
+    // Boxes from one to a few voxels across, anywhere in the grid
+    const float half_size[3] = { GRID_HALF_X, GRID_HALF_Y, GRID_HALF_Z };
+    for(int axis=0; axis<3; ++axis)
+    {
+        float size = _Random(seed, 0.5f, 3.0f);
+        aabb->min[axis] = _Random(seed, -half_size[axis], half_size[axis] - size);
+        aabb->max[axis] = aabb->min[axis] + size;
+    }
+}
+
+static void
+_GrowClient(LoadClient *client)
+{
+    if(client->num_sent < client->capacity)
+    {
+        return;
+    }
+
+    size_t capacity = client->capacity ? client->capacity*2 : 4096;
+    client->sent_at = (uint64_t *)realloc(client->sent_at, capacity*sizeof(uint64_t));
+    client->fragments_left = (uint16_t *)realloc(client->fragments_left, capacity*sizeof(uint16_t));
+    client->latencies = (double *)realloc(client->latencies, capacity*sizeof(double));
+    client->capacity = capacity;
+}
+
+static void
+_SendQuery(LoadClient *client, unsigned int *seed)
+{
+    static const size_t max_boxes = PACKET_MTU_AABBS;
+    const LoadSettings *settings = client->settings;
+
+    _GrowClient(client);
+    uint32_t sequence = client->num_sent++;
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    if(settings->version == 1)
+    {
+        PacketHeader header = {};
+        header.type = PACKET_QUERY;
+        header.control = PACKET_CONTROL;
+        header.sequence = sequence;
+        header.data = (uint8_t)settings->num_boxes;
+
+        PacketAABB *aabbs = (PacketAABB *)packet;
+        for(int i=0; i<settings->num_boxes; ++i)
+        {
+            _RandomAABB(seed, &aabbs[i]);
+        }
+
+        client->sent_at[sequence] = _NowNanoseconds();
+        client->fragments_left[sequence] = 1;
+        sendto(client->socket, &header, sizeof(PacketHeader), 0,
+               (const sockaddr *)&settings->server, sizeof(sockaddr_in));
+        if(settings->num_boxes > 0)
+        {
+            sendto(client->socket, packet, settings->num_boxes*sizeof(PacketAABB), 0,
+                   (const sockaddr *)&settings->server, sizeof(sockaddr_in));
+        }
+    }
+    else
+    {
+        int num_fragments = (settings->num_boxes + max_boxes-1) / max_boxes;
+        client->sent_at[sequence] = _NowNanoseconds();
+        client->fragments_left[sequence] = num_fragments;
+
+        for(int first=0; first<settings->num_boxes; first+=max_boxes)
+        {
+            PacketHeaderV2 header = {};
+            header.type = PACKET_QUERY_V2;
+            header.control = PACKET_CONTROL;
+            header.sequence = sequence;
+            header.first_aabb = first;
+            header.num_aabbs = settings->num_boxes - first < (int)max_boxes ? settings->num_boxes - first : max_boxes;
+            header.total_aabbs = settings->num_boxes;
+            memcpy(packet, &header, sizeof(PacketHeaderV2));
+
+            PacketAABB *aabbs = (PacketAABB *)(packet + sizeof(PacketHeaderV2));
+            for(int i=0; i<header.num_aabbs; ++i)
+            {
+                _RandomAABB(seed, &aabbs[i]);
+            }
+
+            sendto(client->socket, packet, sizeof(PacketHeaderV2) + header.num_aabbs*sizeof(PacketAABB), 0,
+                   (const sockaddr *)&settings->server, sizeof(sockaddr_in));
+        }
+    }
+}
+
+static void
+_CompleteFragment(LoadClient *client, uint32_t sequence)
+{
+    if(sequence >= client->num_sent || client->fragments_left[sequence] == 0)
+    {
+        return;
+    }
+
+    if(--client->fragments_left[sequence] == 0)
+    {
+        uint64_t latency = _NowNanoseconds() - client->sent_at[sequence];
+        client->latencies[client->num_completed++] = latency / 1000.0;
+    }
+}
+
+/// Reads every reply waiting on the socket. Returns how many queries completed.
+static size_t
+_ReceiveReplies(LoadClient *client)
+{
+    size_t completed = client->num_completed;
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    ssize_t size;
+    while((size = recv(client->socket, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+    {
+        if(client->settings->version == 1)
+        {
+            // The header comes back first, and then the results
+            const PacketHeader *header = (const PacketHeader *)packet;
+            if(size == sizeof(PacketHeader) && header->control == PACKET_CONTROL && header->type == PACKET_QUERY)
+            {
+                if(header->data != client->settings->num_boxes)
+                {
+                    ++client->num_rejected;
+                    client->awaiting_results = UINT32_MAX;
+                }
+                else
+                {
+                    client->awaiting_results = header->sequence;
+                }
+            }
+            else if(client->awaiting_results != UINT32_MAX)
+            {
+                _CompleteFragment(client, client->awaiting_results);
+                client->awaiting_results = UINT32_MAX;
+            }
+        }
+        else if(size >= (ssize_t)(sizeof(PacketHeaderV2) + sizeof(uint32_t)))
+        {
+            const PacketHeaderV2 *header = (const PacketHeaderV2 *)packet;
+            if(header->control == PACKET_CONTROL && header->type == PACKET_QUERY_V2)
+            {
+                _CompleteFragment(client, header->sequence);
+            }
+        }
+    }
+
+    return client->num_completed - completed;
+}
+
+static void *
+_RunClient(void *userdata)
+{
+    LoadClient *client = (LoadClient *)userdata;
+    const LoadSettings *settings = client->settings;
+    unsigned int seed = 1234 + client->index;
+    client->awaiting_results = UINT32_MAX;
+
+    // Spread the clients over the first interval, so they do not send in lockstep
+    uint64_t interval = settings->rate > 0 ? (uint64_t)(1e9 / settings->rate) : 0;
+    uint64_t start = _NowNanoseconds() + (interval * client->index) / settings->num_clients;
+    uint64_t end = start + (uint64_t)(settings->seconds * 1e9);
+    uint64_t drain_end = end + (uint64_t)(DRAIN_SECONDS * 1e9);
+    uint64_t next_send = start;
+    bool waiting = false; // For a reply, with rate 0
+
+    pollfd poll_socket = { client->socket, POLLIN, 0 };
+
+    for(;;)
+    {
+        uint64_t now = _NowNanoseconds();
+        if(now >= drain_end || (now >= end && client->num_completed == client->num_sent))
+        {
+            break;
+        }
+
+        if(now < end && now >= next_send && !waiting)
+        {
+            _SendQuery(client, &seed);
+            if(interval)
+            {
+                next_send += interval;
+            }
+            else
+            {
+                waiting = true;
+            }
+        }
+
+        uint64_t wake = now < end && !waiting ? next_send : drain_end;
+        int timeout_ms = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        if(poll(&poll_socket, 1, timeout_ms) > 0)
+        {
+            if(_ReceiveReplies(client) > 0 || client->num_completed == client->num_sent)
+            {
+                waiting = false;
+            }
+        }
+        else if(waiting && interval == 0 && _NowNanoseconds() - client->sent_at[client->num_sent-1] > 1000000000ull)
+        {
+            // Lost, with nothing else in flight
+            waiting = false;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+_CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+_Percentile(const double *sorted, size_t count, double percentile)
+{
+    if(count == 0)
+    {
+        return 0.0;
+    }
+
+    size_t index = (size_t)(percentile / 100.0 * (count-1) + 0.5);
+    return sorted[index < count ? index : count-1];
+}
+
+static void
+_PrintUsage(void)
+{
+    fprintf(stderr,
+            "usage: magicmotion_loadgen [server address] [options]\n"
+            "    -c <clients>      Clients sending at once. Default 4\n"
+            "    -b <boxes>        AABBs per query. Default 16, at most 255 with -1\n"
+            "    -r <rate>         Queries per second per client, 0 for as fast as answered. Default 100\n"
+            "    -t <seconds>      How long to send. Default 10\n"
+            "    -1, -2            Protocol version. Default 1\n");
+}
+
+int
+main(int num_args, char *args[])
+{
+    const char *address = "127.0.0.1";
+    LoadSettings settings = {};
+    settings.num_clients = 4;
+    settings.num_boxes = 16;
+    settings.rate = 100.0;
+    settings.seconds = 10.0;
+    settings.version = 1;
+
+    for(int i=1; i<num_args; ++i)
+    {
+        if(args[i][0] != '-')
+        {
+            address = args[i];
+        }
+        else if(strcmp(args[i], "-1") == 0 || strcmp(args[i], "-2") == 0)
+        {
+            settings.version = args[i][1] - '0';
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-c") == 0)
+        {
+            settings.num_clients = atoi(args[++i]);
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-b") == 0)
+        {
+            settings.num_boxes = atoi(args[++i]);
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-r") == 0)
+        {
+            settings.rate = atof(args[++i]);
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-t") == 0)
+        {
+            settings.seconds = atof(args[++i]);
+        }
+        else
+        {
+            _PrintUsage();
+            return 1;
+        }
+    }
+
+    if(settings.num_clients < 1 || settings.num_clients > MAX_LOAD_CLIENTS ||
+       settings.num_boxes < 0 || (settings.version == 1 && settings.num_boxes > 255) ||
+       settings.num_boxes > 0xFFFF || settings.rate < 0 || settings.seconds <= 0)
+    {
+        _PrintUsage();
+        return 1;
+    }
+
+    settings.server.sin_family = AF_INET;
+    settings.server.sin_port = htons(PORT);
+    if(inet_pton(AF_INET, address, &settings.server.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address: %s\n", address);
+        return 1;
+    }
+
+    static LoadClient clients[MAX_LOAD_CLIENTS];
+    for(int i=0; i<settings.num_clients; ++i)
+    {
+        LoadClient *client = &clients[i];
+        client->settings = &settings;
+        client->index = i;
+        client->socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if(client->socket < 0)
+        {
+            perror("socket");
+            return 1;
+        }
+
+        int receive_buffer = 1 << 20;
+        setsockopt(client->socket, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    }
+
+    // Pinging whitelists us. All clients share the address, if not the port.
+    PacketHeader ping = {};
+    ping.type = PACKET_PING;
+    ping.control = PACKET_CONTROL;
+    sendto(clients[0].socket, &ping, sizeof(PacketHeader), 0, (const sockaddr *)&settings.server, sizeof(sockaddr_in));
+    pollfd poll_socket = { clients[0].socket, POLLIN, 0 };
+    if(poll(&poll_socket, 1, 1000) <= 0)
+    {
+        fprintf(stderr, "No answer from %s\n", address);
+        return 1;
+    }
+
+    uint8_t pong[MAX_PACKET_SIZE];
+    recv(clients[0].socket, pong, sizeof(pong), 0);
+
+    printf("%d clients sending %d AABBs per version %d query, ",
+           settings.num_clients, settings.num_boxes, settings.version);
+    if(settings.rate > 0) printf("%.0f per second each", settings.rate);
+    else printf("as fast as answered");
+    printf(", for %.1f s\n", settings.seconds);
+
+    // Clients that fail to start send nothing, and count for nothing
+    pthread_t threads[MAX_LOAD_CLIENTS];
+    int num_started = 0;
+    for(int i=0; i<settings.num_clients; ++i)
+    {
+        if(pthread_create(&threads[num_started], NULL, &_RunClient, &clients[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start client %d\n", i);
+            continue;
+        }
+
+        ++num_started;
+    }
+
+    for(int i=0; i<num_started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if(num_started < settings.num_clients)
+    {
+        printf("Only %d of %d clients started\n", num_started, settings.num_clients);
+    }
+
+    double elapsed = settings.seconds; // Queries are only sent for this long
+
+    size_t num_sent = 0;
+    size_t num_completed = 0;
+    size_t num_rejected = 0;
+    for(int i=0; i<settings.num_clients; ++i)
+    {
+        num_sent += clients[i].num_sent;
+        num_completed += clients[i].num_completed;
+        num_rejected += clients[i].num_rejected;
+    }
+
+    double *latencies = (double *)malloc((num_completed+1) * sizeof(double));
+    size_t count = 0;
+    for(int i=0; i<settings.num_clients; ++i)
+    {
+        memcpy(latencies + count, clients[i].latencies, clients[i].num_completed * sizeof(double));
+        count += clients[i].num_completed;
+    }
+
+    qsort(latencies, count, sizeof(double), _CompareDoubles);
+
+    size_t num_lost = num_sent - num_completed;
+    printf("Sent %zu queries, %zu answered, %zu lost (%.3f%%), %zu rejected\n",
+           num_sent, num_completed, num_lost, num_sent ? 100.0 * num_lost / num_sent : 0.0, num_rejected);
+    printf("Throughput: %.0f queries/s, %.0f AABBs/s\n",
+           num_completed / elapsed, num_completed * (double)settings.num_boxes / elapsed);
+    printf("Latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           _Percentile(latencies, count, 50.0), _Percentile(latencies, count, 99.0),
+           _Percentile(latencies, count, 99.9), count ? latencies[count-1] : 0.0);
+
+    free(latencies);
+    for(int i=0; i<settings.num_clients; ++i)
+    {
+        close(clients[i].socket);
+        free(clients[i].sent_at);
+        free(clients[i].fragments_left);
+        free(clients[i].latencies);
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+// The reading side of the shared memory frames. See magic_motion_shared.h.
+// Include it in one translation unit of the consumer, as magic_math.h can
+// only be in one.
+
+#include "magic_motion_shared.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct MagicMotionShared
+{
+    const uint8_t *memory;
+    size_t size;
+    const SharedMemoryHeader *header;
+    uint32_t last_sequence; // The last frame acquired
+};
+
+MagicMotionShared *
+MagicMotionShared_Attach(void)
+{
+    int fd = shm_open(SHARED_MEMORY_NAME, O_RDONLY, 0);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SharedMemoryHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    const SharedMemoryHeader *header = (const SharedMemoryHeader *)memory;
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHARED_MEMORY_MAGIC ||
+       header->version != SHARED_MEMORY_VERSION ||
+       header->slots_offset + header->slot_size * header->num_slots > (uint64_t)info.st_size)
+    {
+        fprintf(stderr, "%s is not shared memory we can read\n", SHARED_MEMORY_NAME);
+        munmap(memory, info.st_size);
+        return NULL;
+    }
+
+    MagicMotionShared *shared = (MagicMotionShared *)calloc(1, sizeof(MagicMotionShared));
+    shared->memory = (const uint8_t *)memory;
+    shared->size = info.st_size;
+    shared->header = header;
+
+    return shared;
+}
+
+void
+MagicMotionShared_Detach(MagicMotionShared *shared)
+{
+    if(shared)
+    {
+        munmap((void *)shared->memory, shared->size);
+        free(shared);
+    }
+}
+
+bool
+MagicMotionShared_IsRunning(const MagicMotionShared *shared)
+{
+    return __atomic_load_n(&shared->header->running, __ATOMIC_RELAXED) != 0;
+}
+
+bool
+MagicMotionShared_WaitForFrame(MagicMotionShared *shared, int timeout_ms)
+{
+    uint32_t *latest = (uint32_t *)&shared->header->latest_sequence;
+    uint32_t sequence = __atomic_load_n(latest, __ATOMIC_ACQUIRE);
+    if(sequence != shared->last_sequence)
+    {
+        return true;
+    }
+
+    // NOTE(istarnion): The server wakes everyone waiting on
+    // latest_sequence when it publishes. This returns right away if
+    // a frame came in since the load above.
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, latest, FUTEX_WAIT, sequence, &timeout, NULL, 0);
+
+    return __atomic_load_n(latest, __ATOMIC_ACQUIRE) != shared->last_sequence;
+}
+
+bool
+MagicMotionShared_AcquireFrame(MagicMotionShared *shared, MagicMotionSharedFrame *frame)
+{
+    const SharedMemoryHeader *header = shared->header;
+    uint32_t sequence = __atomic_load_n(&header->latest_sequence, __ATOMIC_ACQUIRE);
+    if(sequence == 0 || sequence == shared->last_sequence)
+    {
+        return false;
+    }
+
+    // Frames go in the slots in turn, so the sequence number tells us where
+    const uint8_t *slot = shared->memory + header->slots_offset +
+                          header->slot_size * (sequence % header->num_slots);
+    const SharedSlotHeader *slot_header = (const SharedSlotHeader *)slot;
+
+    uint32_t version = __atomic_load_n(&slot_header->version, __ATOMIC_ACQUIRE);
+    if((version & 1) || slot_header->sequence != sequence)
+    {
+        // Already being overwritten
+        return false;
+    }
+
+    frame->sequence = sequence;
+    frame->num_points = MIN(slot_header->num_points, header->point_capacity);
+    frame->positions = (const V3 *)(slot + header->positions_offset);
+    frame->colors = (const ColorPixel *)(slot + header->colors_offset);
+    frame->tags = (const MagicMotionTag *)(slot + header->tags_offset);
+    frame->voxels = (const Voxel *)(slot + header->voxels_offset);
+    frame->num_occupied = MIN(slot_header->num_occupied, (uint32_t)NUM_VOXELS);
+    frame->occupied = (const uint32_t *)(slot + header->occupied_offset);
+    frame->slot = slot_header;
+    frame->slot_version = version;
+
+    shared->last_sequence = sequence;
+
+    return true;
+}
+
+bool
+MagicMotionShared_ReleaseFrame(MagicMotionShared *shared, const MagicMotionSharedFrame *frame)
+{
+    // Everything read from the frame happens before the version is read again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->slot->version, __ATOMIC_RELAXED) == frame->slot_version;
+}
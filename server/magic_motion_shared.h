@@ -0,0 +1,106 @@
+#ifndef MAGIC_MOTION_SHARED_H_
+#define MAGIC_MOTION_SHARED_H_
+
+// Reads the frames magicmotion_server publishes in shared memory when it
+// runs with -s, so local programs get the cloud, tags and voxels of every
+// frame without owning the sensors or linking libMagicMotion.
+//
+// The server writes each frame into the next of SHARED_FRAME_SLOTS slots.
+// A slot has a version that is odd while it is written (a seqlock), so
+// readers work on the frame right where it is, and check afterwards that
+// it was not overwritten meanwhile:
+//
+//     MagicMotionSharedFrame frame;
+//     if(MagicMotionShared_AcquireFrame(shared, &frame))
+//     {
+//         ... use frame.positions, frame.voxels, ...
+//         if(!MagicMotionShared_ReleaseFrame(shared, &frame))
+//         {
+//             ... the server got too far ahead, throw away what was read
+//         }
+//     }
+//
+// A frame stays valid for SHARED_FRAME_SLOTS-1 frames after it is
+// published, which is long enough for anything that keeps up.
+
+#include "magic_motion.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHARED_MEMORY_NAME "/magicmotion"
+#define SHARED_MEMORY_MAGIC 0x4D4D5348 // "HSMM"
+#define SHARED_MEMORY_VERSION 1
+#define SHARED_FRAME_SLOTS 4
+
+// The layout of the shared memory. Written by the server only.
+typedef struct
+{
+    uint32_t magic;           // Set last, when the rest is ready
+    uint32_t version;         // SHARED_MEMORY_VERSION
+    uint32_t running;         // Cleared when the server shuts down
+    uint32_t latest_sequence; // The last frame published, 0 before the first. Also a futex
+    uint32_t point_capacity;
+    uint32_t num_slots;
+    uint64_t slots_offset;    // From the start of the shared memory
+    uint64_t slot_size;
+
+    // From the start of a slot
+    uint64_t positions_offset;
+    uint64_t colors_offset;
+    uint64_t tags_offset;
+    uint64_t voxels_offset;   // NUM_VOXELS Voxels
+    uint64_t occupied_offset; // Indices of the voxels with points
+} SharedMemoryHeader;
+
+// At the start of every slot
+typedef struct
+{
+    uint32_t version;         // Odd while the slot is written
+    uint32_t sequence;        // Frame sequence number, counting from 1
+    uint32_t num_points;
+    uint32_t num_occupied;
+} SharedSlotHeader;
+
+typedef struct MagicMotionShared MagicMotionShared;
+
+// Points into shared memory. Only good until MagicMotionShared_ReleaseFrame.
+typedef struct
+{
+    uint32_t sequence;
+    unsigned int num_points;
+    const V3 *positions;
+    const ColorPixel *colors;
+    const MagicMotionTag *tags;
+    const Voxel *voxels;
+    unsigned int num_occupied;
+    const uint32_t *occupied;
+
+    const SharedSlotHeader *slot;
+    uint32_t slot_version;
+} MagicMotionSharedFrame;
+
+// Maps the shared memory read only. Returns NULL if no server publishes frames
+MagicMotionShared *MagicMotionShared_Attach(void);
+void MagicMotionShared_Detach(MagicMotionShared *shared);
+
+// False once the server has shut down. Attach again to follow a new one.
+bool MagicMotionShared_IsRunning(const MagicMotionShared *shared);
+
+// Sleeps until there is a frame newer than the last acquired one, or the
+// timeout has passed. Returns true if there is one.
+bool MagicMotionShared_WaitForFrame(MagicMotionShared *shared, int timeout_ms);
+
+// Gets the latest frame, if it is newer than the last acquired one
+bool MagicMotionShared_AcquireFrame(MagicMotionShared *shared, MagicMotionSharedFrame *frame);
+
+// Returns false if the frame was overwritten while it was in use
+bool MagicMotionShared_ReleaseFrame(MagicMotionShared *shared, const MagicMotionSharedFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: MAGIC_MOTION_SHARED_H_ */
@@ -0,0 +1,236 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+// The UDP protocol of magicmotion_server, for the server and its clients.
+// All fields are in host byte order, as every machine we run on is little
+// endian.
+//
+// Version 1: A PacketHeader. Queries send their AABBs in a second datagram
+// of header.data PacketAABBs, and get the header back, followed by a
+// datagram of one byte per AABB, 1 if it has points in it, and the uint32
+// sequence number of the frame it was answered from.
+//
+// Version 2: Queries are a PacketHeaderV2 and its AABBs in one datagram.
+// A query of more AABBs than fit in a datagram is split in fragments,
+// which are answered one by one. Each answer is the header, followed by
+// the frame sequence number as a uint32, and one bit per AABB of the
+// fragment, lowest bit first.
+//
+// Shape queries are version 2 queries of another type, with PacketRays,
+// PacketSpheres, PacketCapsules or PacketOBBs in place of the AABBs. The
+// *_aabbs fields of the header count the shapes. Spheres, capsules and
+// boxes are answered with bits like AABBs, set if the center of a voxel
+// with points is inside. Rays are answered with a PacketRayHit each.
+//
+// Subscriptions: Instead of polling, a client can register volumes once
+// with a PacketSubscribe each, which is answered with its header, data = 1
+// if it was registered. After every frame, the server sends the client a
+// PacketEvents with the volumes that changed, if any did. A volume is
+// entered when it has at least enter_count points, and exited when it has
+// less than exit_count. Set exit_count below enter_count for hysteresis.
+// While entered, the server also reports the count whenever it has changed
+// by count_step or more since it was last reported, if count_step is not
+// zero. PacketUnsubscribe removes a volume, or all of a client's.
+//
+// Windows: Instead of debouncing answers themselves, clients can ask about
+// the voxels occupied in at least min_frames of the last frames frames, up
+// to 32. A version 2 or shape query with PACKET_WINDOWED set in its type
+// has a PacketWindow between the header and the shapes, and is answered as
+// usual, over the window. The type in the answer keeps the flag. A
+// subscription with window.frames above 0 counts the voxels in the volume
+// that are occupied over its window, instead of the points. Subscriptions
+// without the window, of PACKET_SUBSCRIBE_V1_SIZE bytes, are still taken.
+//
+// Streaming: A PACKET_STREAM_START header makes the server send the client
+// the occupancy of the voxel grid every frame, until PACKET_STREAM_STOP.
+// header.data is how many points a voxel needs to be occupied, 0 meaning 1.
+// It is answered with a PacketStreamInfo describing the grid. The occupancy
+// is a bitmap of one bit per voxel, in voxel index order, lowest bit first.
+// Each frame is sent as the XOR of its bitmap and the bitmap of base_frame,
+// the frame sent before it, or of an empty bitmap in keyframes, which have
+// base_frame = 0. The XOR is run length coded, a byte at a time: a token
+// byte t < 0x80 is followed by t+1 literal bytes, t from 0x80 to 0xFE
+// stands for t-0x7F zero bytes, and 0xFF is followed by a uint16 count of
+// zero bytes. Frames are split in PacketStreamFragments that each
+// code a range of the bitmap on their own, and fit an Ethernet frame.
+// A client that misses a fragment or a frame sends PACKET_STREAM_KEYFRAME,
+// and the server sends a keyframe next. It also does so every
+// STREAM_KEYFRAME_INTERVAL frames. Every fragment carries the time the frame
+// was captured, on the server's CLOCK_MONOTONIC in nanoseconds, so a client
+// on the same machine can tell how old a frame is when it has it.
+
+#include <stdint.h>
+
+#define PORT 16680
+#define PACKET_CONTROL 0x69 // Nice
+
+enum PacketType : uint8_t
+{
+    PACKET_PING = 0,
+    PACKET_QUERY = 1,
+    PACKET_SAVE_FLIGHT_RECORDING = 2, // Reply has data = 1 if saving started
+    PACKET_QUERY_V2 = 3,
+    PACKET_SUBSCRIBE = 4,
+    PACKET_UNSUBSCRIBE = 5,
+    PACKET_EVENTS = 6, // Only sent by the server
+    PACKET_STREAM_START = 7,
+    PACKET_STREAM_STOP = 8,
+    PACKET_STREAM_KEYFRAME = 9,
+    PACKET_STREAM_FRAGMENT = 10, // Only sent by the server
+    PACKET_RAYCAST = 11,
+    PACKET_QUERY_SPHERES = 12,
+    PACKET_QUERY_CAPSULES = 13,
+    PACKET_QUERY_OBBS = 14
+};
+
+#define PACKET_WINDOWED 0x80 // Or'ed into the type of a windowed query
+
+struct PacketHeader
+{
+    uint8_t type;
+    uint16_t control;
+    uint32_t sequence;
+    uint8_t data;
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketHeaderV2
+{
+    uint8_t type;
+    uint16_t control;
+    uint32_t sequence;     // Chosen by the client, and returned as is
+    uint16_t first_aabb;   // Index in the whole query of the first AABB in this fragment
+    uint16_t num_aabbs;    // AABBs in this fragment
+    uint16_t total_aabbs;  // AABBs in the whole query
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketWindow
+{
+    uint8_t frames;        // The last this many frames, 0 for no window
+    uint8_t min_frames;    // How many of them a voxel must be occupied in
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketAABB
+{
+    float min[3];
+    float max[3];
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketRay
+{
+    float origin[3];
+    float direction[3];    // Need not be normalized
+    float max_distance;
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketRayHit
+{
+    float distance;        // Along the normalized direction. Negative if nothing was hit
+    uint32_t voxel;        // Index of the voxel hit
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketSphere
+{
+    float center[3];
+    float radius;
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketCapsule
+{
+    float a[3];
+    float b[3];
+    float radius;
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketOBB
+{
+    float center[3];
+    float half_extents[3];
+    float axis_x[3];       // Unit vectors along the x and y of the box. z is x cross y
+    float axis_y[3];
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+enum VolumeShape : uint8_t
+{
+    VOLUME_AABB = 0,   // a is the min corner, b the max corner
+    VOLUME_SPHERE = 1  // a is the center, b[0] the radius
+};
+
+struct PacketSubscribe
+{
+    PacketHeader header;   // type is PACKET_SUBSCRIBE
+    uint16_t volume_id;    // Chosen by the client, and used in events
+    char name[16];         // For the server log only. Need not be terminated
+    uint8_t shape;         // VolumeShape
+    float a[3];
+    float b[3];
+    uint32_t enter_count;
+    uint32_t exit_count;
+    uint32_t count_step;
+    PacketWindow window;
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+#define PACKET_SUBSCRIBE_V1_SIZE (sizeof(PacketSubscribe) - sizeof(PacketWindow))
+
+#define ALL_VOLUMES 0xFFFF
+
+struct PacketUnsubscribe
+{
+    PacketHeader header;   // type is PACKET_UNSUBSCRIBE
+    uint16_t volume_id;    // Or ALL_VOLUMES
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+enum VolumeEventType : uint8_t
+{
+    VOLUME_ENTERED = 0,
+    VOLUME_EXITED = 1,
+    VOLUME_COUNT_CHANGED = 2
+};
+
+struct VolumeEvent
+{
+    uint16_t volume_id;
+    uint8_t type;          // VolumeEventType
+    uint32_t count;        // Points in the volume
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketEvents
+{
+    uint8_t type;          // PACKET_EVENTS
+    uint16_t control;
+    uint32_t frame;        // Sequence number of the frame the events are from
+    uint16_t num_events;   // VolumeEvents following this header
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketStreamInfo
+{
+    PacketHeader header;   // data = 1 if the stream was started
+    uint16_t voxels[3];    // Voxels along x, y and z
+    float voxel_size;
+    float origin[3];       // The min corner of the grid
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+struct PacketStreamFragment
+{
+    uint8_t type;          // PACKET_STREAM_FRAGMENT
+    uint16_t control;
+    uint32_t frame;
+    uint32_t base_frame;   // 0 in keyframes
+    uint32_t num_occupied; // Set bits in the whole bitmap of the frame, to check it by
+    uint16_t fragment;
+    uint16_t num_fragments;
+    uint32_t offset;       // First bitmap byte of the fragment
+    uint32_t length;       // Bitmap bytes coded in the fragment
+    uint64_t capture_time; // CLOCK_MONOTONIC nanoseconds on the server
+} __attribute__((packed)) __attribute__((aligned(1)));
+
+#define STREAM_FRAGMENT_SIZE 1472
+#define STREAM_KEYFRAME_INTERVAL 30
+
+// The server takes datagrams up to this size. Clients should keep to
+// PACKET_MTU_AABBS per fragment, to stay within an Ethernet frame, and to
+// as many shapes as fit in as many bytes.
+#define MAX_PACKET_SIZE 8192
+#define MAX_PACKET_AABBS ((MAX_PACKET_SIZE - sizeof(PacketHeaderV2)) / sizeof(PacketAABB))
+#define PACKET_MTU_AABBS ((1472 - sizeof(PacketHeaderV2)) / sizeof(PacketAABB))
+
+#endif /* end of include guard: PROTOCOL_H_ */
@@ -13,13 +13,25 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <assert.h>
 
 #include "magic_motion.h"
+#include "timing.h"
+#include "protocol.h"
 
-#define PORT 16680
 #define WHITELIST_LENGTH 16
+#define FLIGHT_RECORDER_FPS 30 // For sizing the flight recorder, when not given a size
+
+// Datagrams read or sent with one recvmmsg or sendmmsg
+#define PACKET_BATCH_SIZE 32
 
 static volatile bool global_running;
 
@@ -31,31 +43,47 @@ InterruptHandler(int signal)
     global_running = false;
 }
 
-enum PacketType : uint8_t
+static inline bool
+VerifyPacketControl(const PacketHeader *header)
 {
-    PACKET_PING = 0,
-    PACKET_QUERY = 1
-};
+    return header->control == PACKET_CONTROL;
+}
 
-struct PacketHeader
+/// The voxel grid of one captured frame. The capture loop fills one while
+/// the network thread answers queries from another, and they swap through
+/// a third, so neither waits for the other for more than a pointer swap.
+struct ServerFrame
 {
-    uint8_t type;
-    uint16_t control;
-    uint32_t sequence;
-    uint8_t data;
-} __attribute__((packed)) __attribute__((aligned(1)));
+    Voxel *voxels;
+    uint32_t *occupied; // The voxels with points, so the next copy knows what to clear
+    unsigned int num_occupied;
+    uint32_t sequence;  // Counts captured frames from 1. 0 before the first frame
+    uint64_t capture_time; // GetWallTimestamp from before the frame was captured
+    MagicMotionQueryGrid grid; // Over voxels, for the ray and shape queries
 
-struct PacketAABB
-{
-    float min[3];
-    float max[3];
-} __attribute__((packed)) __attribute__((aligned(1)));
+    // A copy of the occupancy history up to this frame, for windowed
+    // queries. The library's is overwritten by the next capture.
+    uint64_t *history;  // OCCUPANCY_HISTORY_LENGTH bitmaps of OCCUPANCY_WORDS words, in a ring
+    unsigned int history_newest;
+    unsigned int history_length;
+    uint32_t history_sequence; // The frame the copy was last brought up to
+};
 
-static inline bool
-VerifyPacketControl(const PacketHeader *header)
+static struct
 {
-    return header->control == 0x69; // Nice
-}
+    pthread_mutex_t mutex;
+    ServerFrame frames[3];
+    ServerFrame *back;  // Written by the capture loop
+    ServerFrame *ready; // The latest complete frame
+    ServerFrame *front; // Read by the network thread
+    bool ready_is_new;
+
+    // MagicMotion_DumpFlightRecording must be called from the capture loop,
+    // so the network thread leaves the request here
+    bool flight_save_requested;
+    PacketHeader flight_save_header;
+    sockaddr_in flight_save_from;
+} exchange;
 
 /// Create a UDP socket for listening on incoming packets.
 static int
@@ -112,49 +140,87 @@ SendPacket(int socket_handle, void *packet, size_t packet_size, sockaddr_in addr
     assert(sent_bytes == packet_size);
 }
 
-/// Try to receive a packet. If there is no packet available from
-/// the network card, it does not block, but returns false.
-/// Else, packet gets filled and the function returns true.
+/// The voxels an AABB query covers, from start up to but not including end.
+/// Returns false if it covers none, such as when it is outside the grid.
 static bool
-ReceivePacket(int socket_handle, void *packet, size_t packet_length, sockaddr_in *from)
+AABBVoxelRange(V3 min, V3 max, int *start, int *end)
 {
-    socklen_t from_size = sizeof(*from);
+    const float dims[3] = { NUM_VOXELS_X, NUM_VOXELS_Y, NUM_VOXELS_Z };
+    const float grid_min[3] = { BOUNDING_BOX_X/-2.0f, BOUNDING_BOX_Y/-2.0f, BOUNDING_BOX_Z/-2.0f };
+
+    for(int axis=0; axis<3; ++axis)
+    {
+        // Also false for NaN
+        if(!(min.v[axis] <= max.v[axis]))
+        {
+            return false;
+        }
 
-    int bytes_received = recvfrom(socket_handle,
-                                  (uint8_t *)packet, packet_length,
-                                  0, (sockaddr *)from, &from_size);
+        float first = floorf((min.v[axis] - grid_min[axis]) / VOXEL_SIZE);
+        float span = floorf((max.v[axis] - min.v[axis]) / VOXEL_SIZE);
+        float lo = MAX(first, 0.0f);
+        float hi = MIN(first + span, dims[axis]);
+        if(!(lo < hi))
+        {
+            return false;
+        }
 
-    return bytes_received == packet_length;
+        start[axis] = (int)lo;
+        end[axis] = (int)hi;
+    }
+
+    return true;
 }
 
-/// Returns the number of points inside the AABB
+/// Returns the number of points inside the AABB. The part of it outside
+/// the grid has no points.
 static int
-CheckAABBAgainstVoxelGrid(Voxel *voxels, V3 min, V3 max)
+CheckAABBAgainstVoxelGrid(const Voxel *voxels, V3 min, V3 max)
 {
     int result = 0;
 
-    int start = WORLD_TO_VOXEL(min);
-
-    int x_span = (max.x - min.x) / VOXEL_SIZE;
-    int y_span = (max.y - min.y) / VOXEL_SIZE;
-    int z_span = (max.z - min.z) / VOXEL_SIZE;
-
-    for(int z=0; z<z_span; ++z)
-    for(int y=0; y<y_span; ++y)
-    for(int x=0; x<x_span; ++x)
+    int start[3], end[3];
+    if(!AABBVoxelRange(min, max, start, end))
     {
-        int voxel = start +
-                    x +
-                    y * NUM_VOXELS_X +
-                    z * NUM_VOXELS_X * NUM_VOXELS_Y;
+        return 0;
+    }
 
-        int point_count = voxels[voxel].point_count;
+    for(int z=start[2]; z<end[2]; ++z)
+    for(int y=start[1]; y<end[1]; ++y)
+    for(int x=start[0]; x<end[0]; ++x)
+    {
+        int point_count = voxels[VOXEL_INDEX(x, y, z)].point_count;
         result += point_count;
     }
 
     return result;
 }
 
+/// Whether the AABB covers a voxel set in the occupancy bitmap, the same
+/// voxels CheckAABBAgainstVoxelGrid counts the points of
+static bool
+CheckAABBAgainstMask(const uint64_t *mask, V3 min, V3 max)
+{
+    int start[3], end[3];
+    if(!AABBVoxelRange(min, max, start, end))
+    {
+        return false;
+    }
+
+    for(int z=start[2]; z<end[2]; ++z)
+    for(int y=start[1]; y<end[1]; ++y)
+    for(int x=start[0]; x<end[0]; ++x)
+    {
+        uint32_t index = VOXEL_INDEX(x, y, z);
+        if(mask[index/64] & ((uint64_t)1 << (index%64)))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /// Add address to the whitelist
 static inline void
 Whitelist(uint32_t *whitelist, const sockaddr_in *address)
@@ -192,96 +258,925 @@ IsWhitelisted(const uint32_t *whitelist, const sockaddr_in *address)
     return result;
 }
 
-int
-main(int num_args, char *args[])
+/// Saves the flight recorder to files named after the current time
+static bool
+SaveFlightRecording(void)
 {
-    printf("%lu\n", sizeof(PacketHeader));
-    MagicMotion_Initialize();
-    unsigned int num_cameras = MagicMotion_GetNumCameras();
-    printf("Magic Motion initialized with %u camera(s)\n", num_cameras);
+    char timestamp[64];
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", localtime(&now));
 
-    int socket = CreateSocket(PORT);
+    char video_file[128];
+    char cloud_file[128];
+    snprintf(video_file, sizeof(video_file), "flight_%s_video.vid", timestamp);
+    snprintf(cloud_file, sizeof(cloud_file), "flight_%s_cloud.vid", timestamp);
 
-    signal(SIGINT, InterruptHandler);
+    return MagicMotion_DumpFlightRecording(video_file, cloud_file);
+}
+
+#include "shared_publisher.cpp"
+
+/// Copies the latest voxel grid into the back frame, and makes it the ready one
+static void
+PublishFrame(uint32_t sequence, uint64_t capture_time)
+{
+    ServerFrame *frame = exchange.back;
+
+    // Only the voxels that had points the last time this frame was used
+    // need clearing, and only those with points now need copying
+    for(unsigned int i=0; i<frame->num_occupied; ++i)
+    {
+        memset(&frame->voxels[frame->occupied[i]], 0, sizeof(Voxel));
+    }
+
+    const Voxel *voxels = MagicMotion_GetVoxels();
+    const uint32_t *occupied = MagicMotion_GetOccupiedVoxels();
+    unsigned int num_occupied = MagicMotion_GetNumOccupiedVoxels();
+    for(unsigned int i=0; i<num_occupied; ++i)
+    {
+        frame->voxels[occupied[i]] = voxels[occupied[i]];
+    }
+
+    memcpy(frame->occupied, occupied, num_occupied * sizeof(uint32_t));
+    frame->num_occupied = num_occupied;
+    frame->sequence = sequence;
+    frame->capture_time = capture_time;
+    MagicMotion_BuildQueryGrid(&frame->grid, frame->voxels, frame->occupied, num_occupied, 1);
+
+    // The frame has missed the frames published in the others since it was
+    // last used, which is usually two. Only those are copied.
+    unsigned int history_length = MagicMotion_GetOccupancyHistoryLength();
+    unsigned int missed = MIN(sequence - frame->history_sequence, OCCUPANCY_HISTORY_LENGTH);
+    missed = MIN(missed, history_length);
+    frame->history_newest = (frame->history_newest + sequence - frame->history_sequence) % OCCUPANCY_HISTORY_LENGTH;
+    for(unsigned int age=0; age<missed; ++age)
+    {
+        unsigned int slot = (frame->history_newest + OCCUPANCY_HISTORY_LENGTH - age) % OCCUPANCY_HISTORY_LENGTH;
+        memcpy(frame->history + slot*OCCUPANCY_WORDS, MagicMotion_GetOccupancyFrame(age),
+               sizeof(uint64_t)*OCCUPANCY_WORDS);
+    }
+
+    frame->history_length = history_length;
+    frame->history_sequence = sequence;
+
+    pthread_mutex_lock(&exchange.mutex);
+    exchange.back = exchange.ready;
+    exchange.ready = frame;
+    exchange.ready_is_new = true;
+    pthread_mutex_unlock(&exchange.mutex);
+}
+
+/// Gives the network thread the latest complete frame, if there is a new one
+static ServerFrame *
+AcquireFrame(void)
+{
+    pthread_mutex_lock(&exchange.mutex);
+    if(exchange.ready_is_new)
+    {
+        ServerFrame *frame = exchange.front;
+        exchange.front = exchange.ready;
+        exchange.ready = frame;
+        exchange.ready_is_new = false;
+    }
+
+    ServerFrame *result = exchange.front;
+    pthread_mutex_unlock(&exchange.mutex);
+
+    return result;
+}
+
+/// A version 1 query header waiting for its AABBs, which come in a datagram of their own
+struct PendingQuery
+{
+    bool active;
+    sockaddr_in from;
+    PacketHeader header;
+};
+
+/// Datagrams for recvmmsg and sendmmsg, each with a buffer of its own
+struct PacketBatch
+{
+    mmsghdr messages[PACKET_BATCH_SIZE];
+    iovec vectors[PACKET_BATCH_SIZE];
+    sockaddr_in addresses[PACKET_BATCH_SIZE];
+    uint8_t buffers[PACKET_BATCH_SIZE][MAX_PACKET_SIZE];
+    int count;
+};
+
+static void
+InitPacketBatch(PacketBatch *batch)
+{
+    for(int i=0; i<PACKET_BATCH_SIZE; ++i)
+    {
+        batch->vectors[i].iov_base = batch->buffers[i];
+        batch->vectors[i].iov_len = MAX_PACKET_SIZE;
+
+        msghdr *message = &batch->messages[i].msg_hdr;
+        memset(message, 0, sizeof(msghdr));
+        message->msg_name = &batch->addresses[i];
+        message->msg_namelen = sizeof(sockaddr_in);
+        message->msg_iov = &batch->vectors[i];
+        message->msg_iovlen = 1;
+    }
+
+    batch->count = 0;
+}
+
+/// Reads as many datagrams as are waiting, up to a batch, in one syscall.
+/// Returns how many were read.
+static int
+ReceivePackets(int socket_handle, PacketBatch *batch)
+{
+    for(int i=0; i<PACKET_BATCH_SIZE; ++i)
+    {
+        batch->vectors[i].iov_len = MAX_PACKET_SIZE;
+        batch->messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+
+    int count = recvmmsg(socket_handle, batch->messages, PACKET_BATCH_SIZE, 0, NULL);
+    batch->count = MAX(count, 0);
+
+    return batch->count;
+}
+
+/// Sends every queued reply, in as few syscalls as the kernel lets us
+static void
+FlushReplies(int socket_handle, PacketBatch *replies)
+{
+    int sent = 0;
+    while(sent < replies->count)
+    {
+        int result = sendmmsg(socket_handle, replies->messages + sent, replies->count - sent, MSG_CONFIRM);
+        if(result <= 0)
+        {
+            perror("sendmmsg");
+            break;
+        }
+
+        sent += result;
+    }
+
+    replies->count = 0;
+}
+
+/// Gives room for a reply of up to MAX_PACKET_SIZE bytes to the address.
+/// Set its size with FinishReply.
+static uint8_t *
+QueueReply(int socket_handle, PacketBatch *replies, const sockaddr_in *to)
+{
+    if(replies->count == PACKET_BATCH_SIZE)
+    {
+        FlushReplies(socket_handle, replies);
+    }
+
+    replies->addresses[replies->count] = *to;
+    return replies->buffers[replies->count];
+}
+
+static inline void
+FinishReply(PacketBatch *replies, size_t size)
+{
+    replies->vectors[replies->count].iov_len = size;
+    ++replies->count;
+}
+
+static inline void
+QueueHeaderReply(int socket_handle, PacketBatch *replies, const sockaddr_in *to, const PacketHeader *header)
+{
+    memcpy(QueueReply(socket_handle, replies, to), header, sizeof(PacketHeader));
+    FinishReply(replies, sizeof(PacketHeader));
+}
+
+static inline bool
+SameAddress(const sockaddr_in *a, const sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/// Checks the AABB against the occupancy bitmap, or against the points of
+/// the frame if mask is NULL
+static inline bool
+CheckPacketAABB(const ServerFrame *frame, const uint64_t *mask, const PacketAABB *aabb)
+{
+    V3 min = { aabb->min[0], aabb->min[1], aabb->min[2] };
+    V3 max = { aabb->max[0], aabb->max[1], aabb->max[2] };
+
+    if(mask)
+    {
+        return CheckAABBAgainstMask(mask, min, max);
+    }
+
+    return CheckAABBAgainstVoxelGrid(frame->voxels, min, max) > 0;
+}
+
+/// Answers a version 1 query, followed by the sequence number of the
+/// frame the results are from. Old clients only read the results, and UDP
+/// drops the rest for them.
+static void
+AnswerQuery(int socket_handle, PacketBatch *replies, const ServerFrame *frame,
+            const PacketHeader *header, const sockaddr_in *from,
+            const PacketAABB *aabbs, int num_aabbs)
+{
+    QueueHeaderReply(socket_handle, replies, from, header);
+
+    uint8_t *results = QueueReply(socket_handle, replies, from);
+    for(int i=0; i<num_aabbs; ++i)
+    {
+        results[i] = CheckPacketAABB(frame, NULL, &aabbs[i]) ? 1 : 0;
+    }
+
+    memcpy(results + num_aabbs, &frame->sequence, sizeof(uint32_t));
+    FinishReply(replies, num_aabbs + sizeof(uint32_t));
+}
+
+/// The size of one shape of a version 2 query of the type, 0 if it is no
+/// query. Windowed queries have the same shapes.
+static size_t
+QueryShapeSize(uint8_t type)
+{
+    switch(type & ~PACKET_WINDOWED)
+    {
+        case PACKET_QUERY_V2:       return sizeof(PacketAABB);
+        case PACKET_RAYCAST:        return sizeof(PacketRay);
+        case PACKET_QUERY_SPHERES:  return sizeof(PacketSphere);
+        case PACKET_QUERY_CAPSULES: return sizeof(PacketCapsule);
+        case PACKET_QUERY_OBBS:     return sizeof(PacketOBB);
+        default:                    return 0;
+    }
+}
+
+// A macro, as packed members can not be passed by pointer
+#define PACKET_V3(v) ((V3){ (v)[0], (v)[1], (v)[2] })
+
+/// Sets a bit per shape of a version 2 query that has points in it, or that
+/// has occupied voxels in it if the grid is over a window
+static void
+QueryShapes(const ServerFrame *frame, const MagicMotionQueryGrid *grid, uint8_t type,
+            const uint8_t *shapes, size_t num_shapes, uint8_t *bits)
+{
+    static bool results[MAX_PACKET_SIZE / sizeof(PacketSphere)];
+
+    if(type == PACKET_QUERY_V2)
+    {
+        const PacketAABB *aabbs = (const PacketAABB *)shapes;
+        for(size_t i=0; i<num_shapes; ++i)
+        {
+            results[i] = CheckPacketAABB(frame, grid->mask, &aabbs[i]);
+        }
+    }
+    else if(type == PACKET_QUERY_SPHERES)
+    {
+        static MagicMotionSphere spheres[MAX_PACKET_SIZE / sizeof(PacketSphere)];
+        const PacketSphere *packet_spheres = (const PacketSphere *)shapes;
+        for(size_t i=0; i<num_shapes; ++i)
+        {
+            spheres[i].center = PACKET_V3(packet_spheres[i].center);
+            spheres[i].radius = packet_spheres[i].radius;
+        }
+
+        MagicMotion_QuerySpheres(grid, spheres, num_shapes, results);
+    }
+    else if(type == PACKET_QUERY_CAPSULES)
+    {
+        static MagicMotionCapsule capsules[MAX_PACKET_SIZE / sizeof(PacketCapsule)];
+        const PacketCapsule *packet_capsules = (const PacketCapsule *)shapes;
+        for(size_t i=0; i<num_shapes; ++i)
+        {
+            capsules[i].a = PACKET_V3(packet_capsules[i].a);
+            capsules[i].b = PACKET_V3(packet_capsules[i].b);
+            capsules[i].radius = packet_capsules[i].radius;
+        }
+
+        MagicMotion_QueryCapsules(grid, capsules, num_shapes, results);
+    }
+    else if(type == PACKET_QUERY_OBBS)
+    {
+        static MagicMotionOBB boxes[MAX_PACKET_SIZE / sizeof(PacketOBB)];
+        const PacketOBB *packet_boxes = (const PacketOBB *)shapes;
+        for(size_t i=0; i<num_shapes; ++i)
+        {
+            boxes[i].center = PACKET_V3(packet_boxes[i].center);
+            boxes[i].half_extents = PACKET_V3(packet_boxes[i].half_extents);
+            boxes[i].axes[0] = NormalizeV3(PACKET_V3(packet_boxes[i].axis_x));
+            boxes[i].axes[1] = NormalizeV3(PACKET_V3(packet_boxes[i].axis_y));
+            boxes[i].axes[2] = CrossV3(boxes[i].axes[0], boxes[i].axes[1]);
+        }
+
+        MagicMotion_QueryOBBs(grid, boxes, num_shapes, results);
+    }
+
+    memset(bits, 0, (num_shapes + 7) / 8);
+    for(size_t i=0; i<num_shapes; ++i)
+    {
+        if(results[i])
+        {
+            bits[i/8] |= 1 << (i%8);
+        }
+    }
+}
+
+/// Puts a PacketRayHit per ray of a raycast query in hits
+static void
+QueryRays(const MagicMotionQueryGrid *grid, const PacketRay *packet_rays, size_t num_rays, PacketRayHit *hits)
+{
+    static MagicMotionRay rays[MAX_PACKET_SIZE / sizeof(PacketRay)];
+    static MagicMotionRayHit ray_hits[MAX_PACKET_SIZE / sizeof(PacketRay)];
+
+    for(size_t i=0; i<num_rays; ++i)
+    {
+        rays[i].origin = PACKET_V3(packet_rays[i].origin);
+        rays[i].direction = PACKET_V3(packet_rays[i].direction);
+        rays[i].max_distance = packet_rays[i].max_distance;
+    }
+
+    MagicMotion_Raycast(grid, rays, num_rays, ray_hits);
+
+    for(size_t i=0; i<num_rays; ++i)
+    {
+        PacketRayHit hit = { -1.0f, 0 };
+        if(ray_hits[i].hit)
+        {
+            hit.distance = ray_hits[i].distance;
+            hit.voxel = ray_hits[i].voxel;
+        }
+
+        memcpy(&hits[i], &hit, sizeof(PacketRayHit));
+    }
+}
+
+/// A window over the occupancy history of a frame, and a query grid over it
+struct OccupancyWindow
+{
+    uint32_t sequence; // Of the frame, 0 if unused
+    uint8_t frames;
+    uint8_t min_frames;
+    uint64_t mask[OCCUPANCY_WORDS];
+    MagicMotionQueryGrid grid;
+};
+
+#define MAX_CACHED_WINDOWS 8
+
+/// Windows made for the current frame, since clients tend to ask about the
+/// same few. Only touched by the network thread.
+static struct
+{
+    OccupancyWindow windows[MAX_CACHED_WINDOWS];
+    int next; // The one replaced next
+} window_cache;
+
+/// The voxels occupied in at least min_frames of the last frames frames,
+/// up to the given one. Valid until the next call.
+static const OccupancyWindow *
+GetOccupancyWindow(const ServerFrame *frame, uint8_t frames, uint8_t min_frames)
+{
+    for(int i=0; i<MAX_CACHED_WINDOWS; ++i)
+    {
+        OccupancyWindow *window = &window_cache.windows[i];
+        if(window->sequence == frame->sequence && window->frames == frames &&
+           window->min_frames == min_frames)
+        {
+            return window;
+        }
+    }
+
+    OccupancyWindow *window = &window_cache.windows[window_cache.next];
+    window_cache.next = (window_cache.next + 1) % MAX_CACHED_WINDOWS;
+
+    const uint64_t *bitmaps[OCCUPANCY_HISTORY_LENGTH];
+    unsigned int num_frames = MIN(MIN((unsigned int)frames, frame->history_length), OCCUPANCY_HISTORY_LENGTH);
+    for(unsigned int age=0; age<num_frames; ++age)
+    {
+        unsigned int slot = (frame->history_newest + OCCUPANCY_HISTORY_LENGTH - age) % OCCUPANCY_HISTORY_LENGTH;
+        bitmaps[age] = frame->history + slot*OCCUPANCY_WORDS;
+    }
+
+    MagicMotion_CombineOccupancy(bitmaps, num_frames, min_frames, window->mask);
+    MagicMotion_BuildMaskQueryGrid(&window->grid, window->mask);
+    window->sequence = frame->sequence;
+    window->frames = frames;
+    window->min_frames = min_frames;
+
+    return window;
+}
+
+/// Answers one fragment of a version 2 query, of AABBs or other shapes,
+/// over the frame or over a window of frames
+static void
+AnswerQueryV2(int socket_handle, PacketBatch *replies, const ServerFrame *frame,
+              const uint8_t *packet, size_t packet_size, const sockaddr_in *from)
+{
+    PacketHeaderV2 header;
+    memcpy(&header, packet, sizeof(PacketHeaderV2));
+
+    const MagicMotionQueryGrid *grid = &frame->grid;
+    size_t prefix_size = sizeof(PacketHeaderV2);
+    if(header.type & PACKET_WINDOWED)
+    {
+        prefix_size += sizeof(PacketWindow);
+    }
+
+    size_t shape_size = QueryShapeSize(header.type);
+    size_t shapes_size = packet_size >= prefix_size ? packet_size - prefix_size : 0;
+    size_t num_shapes = shapes_size / shape_size;
+    if(packet_size < prefix_size || shapes_size % shape_size != 0 || num_shapes != header.num_aabbs)
+    {
+        fprintf(stderr, "Query fragment has %zu bytes of shapes, but says it has %u\n",
+                shapes_size, header.num_aabbs);
+        header.num_aabbs = 0;
+        num_shapes = 0;
+    }
+    else if(header.type & PACKET_WINDOWED)
+    {
+        PacketWindow window;
+        memcpy(&window, packet + sizeof(PacketHeaderV2), sizeof(PacketWindow));
+        grid = &GetOccupancyWindow(frame, MAX(window.frames, 1), window.min_frames)->grid;
+    }
+
+    uint8_t *reply = QueueReply(socket_handle, replies, from);
+    memcpy(reply, &header, sizeof(PacketHeaderV2));
+    memcpy(reply + sizeof(PacketHeaderV2), &frame->sequence, sizeof(uint32_t));
+
+    uint8_t *results = reply + sizeof(PacketHeaderV2) + sizeof(uint32_t);
+    const uint8_t *shapes = packet + prefix_size;
+    size_t results_size;
+    uint8_t type = header.type & ~PACKET_WINDOWED;
+    if(type == PACKET_RAYCAST)
+    {
+        QueryRays(grid, (const PacketRay *)shapes, num_shapes, (PacketRayHit *)results);
+        results_size = num_shapes * sizeof(PacketRayHit);
+    }
+    else
+    {
+        QueryShapes(frame, grid, type, shapes, num_shapes, results);
+        results_size = (num_shapes + 7) / 8;
+    }
+
+    FinishReply(replies, sizeof(PacketHeaderV2) + sizeof(uint32_t) + results_size);
+}
 
+/// Everything the network thread keeps between packets
+struct NetworkState
+{
+    int socket;
     uint32_t whitelist[WHITELIST_LENGTH];
-    PacketAABB aabbs[256];
-    uint8_t results[256];
+    PendingQuery pending[WHITELIST_LENGTH];
+    PacketBatch packets;
+    PacketBatch replies;
+};
 
-    global_running = true;
-    while(global_running)
+#include "subscriptions.cpp"
+#include "stream.cpp"
+
+/// Answers version 1 AABBs. They have no header, so we know them by not
+/// being header sized, and by coming from an address we wait for AABBs from.
+static void
+HandleAABBPacket(NetworkState *state, const ServerFrame *frame,
+                 const uint8_t *packet, size_t packet_size, const sockaddr_in *from)
+{
+    PendingQuery *query = NULL;
+    for(int i=0; i<WHITELIST_LENGTH; ++i)
     {
-        MagicMotion_CaptureFrame();
-        Voxel *voxels = MagicMotion_GetVoxels();
+        if(state->pending[i].active && SameAddress(&state->pending[i].from, from))
+        {
+            query = &state->pending[i];
+            break;
+        }
+    }
+
+    if(!query)
+    {
+        fprintf(stderr, "Got AABBs without a query\n");
+        return;
+    }
+
+    if(packet_size == sizeof(PacketAABB) * query->header.data)
+    {
+        AnswerQuery(state->socket, &state->replies, frame, &query->header, from,
+                    (const PacketAABB *)packet, query->header.data);
+    }
+    else
+    {
+        query->header.data = 0;
+        QueueHeaderReply(state->socket, &state->replies, from, &query->header);
+    }
+
+    query->active = false;
+}
+
+static inline bool
+IsSubscribeSize(size_t packet_size)
+{
+    return packet_size == sizeof(PacketSubscribe) || packet_size == PACKET_SUBSCRIBE_V1_SIZE;
+}
+
+static void
+HandlePacket(NetworkState *state, const ServerFrame *frame,
+             const uint8_t *packet, size_t packet_size, const sockaddr_in *from)
+{
+    const PacketHeader *header = (const PacketHeader *)packet;
+    bool is_typed = packet_size >= sizeof(PacketHeader) && VerifyPacketControl(header) &&
+                    ((QueryShapeSize(header->type) > 0 && packet_size >= sizeof(PacketHeaderV2)) ||
+                     (header->type == PACKET_SUBSCRIBE && IsSubscribeSize(packet_size)) ||
+                     (header->type == PACKET_UNSUBSCRIBE && packet_size == sizeof(PacketUnsubscribe)));
+
+    if(packet_size != sizeof(PacketHeader) && !is_typed)
+    {
+        HandleAABBPacket(state, frame, packet, packet_size, from);
+    }
+    else if(VerifyPacketControl(header))
+    {
+        if(header->type == PACKET_PING)
+        {
+            puts("Ping packet");
+            Whitelist(state->whitelist, from);
+            // Return the PING packet
+            QueueHeaderReply(state->socket, &state->replies, from, header);
+        }
+        else if(QueryShapeSize(header->type) > 0)
+        {
+            // A header sized packet of a query type is not a query, and has
+            // no PacketHeaderV2 to answer with
+            if(packet_size < sizeof(PacketHeaderV2))
+            {
+                fprintf(stderr, "Got query packet of %zu bytes, too short for a query\n", packet_size);
+            }
+            else if(IsWhitelisted(state->whitelist, from))
+            {
+                AnswerQueryV2(state->socket, &state->replies, frame, packet, packet_size, from);
+            }
+            else
+            {
+                fprintf(stderr, "Got query packet from non-whitelisted IP\n");
+            }
+        }
+        else if(header->type == PACKET_STREAM_START)
+        {
+            if(IsWhitelisted(state->whitelist, from))
+            {
+                PacketStreamInfo info = {};
+                info.header = *header;
+                info.header.data = StartStream(from, header->data) ? 1 : 0;
+                info.voxels[0] = NUM_VOXELS_X;
+                info.voxels[1] = NUM_VOXELS_Y;
+                info.voxels[2] = NUM_VOXELS_Z;
+                info.voxel_size = VOXEL_SIZE;
+                info.origin[0] = BOUNDING_BOX_X/-2.0f;
+                info.origin[1] = BOUNDING_BOX_Y/-2.0f;
+                info.origin[2] = BOUNDING_BOX_Z/-2.0f;
+
+                memcpy(QueueReply(state->socket, &state->replies, from), &info, sizeof(PacketStreamInfo));
+                FinishReply(&state->replies, sizeof(PacketStreamInfo));
+            }
+            else
+            {
+                fprintf(stderr, "Got stream packet from non-whitelisted IP\n");
+            }
+        }
+        else if(header->type == PACKET_STREAM_STOP)
+        {
+            StopStream(from);
+        }
+        else if(header->type == PACKET_STREAM_KEYFRAME)
+        {
+            RequestKeyframe(from);
+        }
+        else if(header->type == PACKET_SUBSCRIBE && IsSubscribeSize(packet_size))
+        {
+            if(IsWhitelisted(state->whitelist, from))
+            {
+                // Subscriptions without a window have a zero one
+                PacketSubscribe subscribe = {};
+                memcpy(&subscribe, packet, packet_size);
 
-        PacketHeader header = {};
-        sockaddr_in from = {};
-        while(ReceivePacket(socket, &header, sizeof(PacketHeader), &from))
+                PacketHeader reply = *header;
+                reply.data = Subscribe(&subscribe, from) ? 1 : 0;
+                QueueHeaderReply(state->socket, &state->replies, from, &reply);
+            }
+            else
+            {
+                fprintf(stderr, "Got subscribe packet from non-whitelisted IP\n");
+            }
+        }
+        else if(header->type == PACKET_UNSUBSCRIBE && packet_size == sizeof(PacketUnsubscribe))
         {
-            if(VerifyPacketControl(&header))
+            Unsubscribe((const PacketUnsubscribe *)packet, from);
+        }
+        else if(header->type == PACKET_QUERY)
+        {
+            if(IsWhitelisted(state->whitelist, from))
             {
-                if(header.type == PACKET_PING)
+                if(header->data == 0)
                 {
-                    puts("Ping packet");
-                    Whitelist(whitelist, &from);
-                    // Return the PING packet
-                    SendPacket(socket, &header, sizeof(PacketHeader), from, MSG_CONFIRM);
+                    AnswerQuery(state->socket, &state->replies, frame, header, from, NULL, 0);
+                    return;
                 }
-                else if(header.type == PACKET_QUERY)
+
+                // NOTE(istarnion): The AABBs may not have arrived yet.
+                // A new query from the same address replaces an
+                // unanswered one, and if every slot is taken, the
+                // first one is reused.
+                PendingQuery *query = &state->pending[0];
+                for(int i=0; i<WHITELIST_LENGTH; ++i)
                 {
-                    if(IsWhitelisted(whitelist, &from))
+                    if(state->pending[i].active && SameAddress(&state->pending[i].from, from))
                     {
-                        int num_aabbs = header.data;
-                        if(ReceivePacket(socket, aabbs, sizeof(PacketAABB) * num_aabbs, &from))
-                        {
-                            printf("Got %d AABBs\n", num_aabbs);
-                            for(int i=0; i<num_aabbs; ++i)
-                            {
-                                V3 min = {
-                                    aabbs[i].min[0],
-                                    aabbs[i].min[1],
-                                    aabbs[i].min[2]
-                                };
-
-                                V3 max = {
-                                    aabbs[i].max[0],
-                                    aabbs[i].max[1],
-                                    aabbs[i].max[2]
-                                };
-
-                                bool collides = CheckAABBAgainstVoxelGrid(voxels, min, max);
-                                results[i] = collides ? 1 : 0;
-                            }
-
-                            SendPacket(socket, &header, sizeof(PacketHeader), from, MSG_CONFIRM);
-                            SendPacket(socket, results, num_aabbs, from, MSG_CONFIRM);
-                        }
-                        else
-                        {
-                            header.data = 0;
-                            SendPacket(socket, &header, sizeof(PacketHeader), from, MSG_CONFIRM);
-                        }
+                        query = &state->pending[i];
+                        break;
                     }
-                    else
+                    else if(!state->pending[i].active)
                     {
-                        fprintf(stderr, "Got query packet from non-whitelisted IP\n");
+                        query = &state->pending[i];
                     }
                 }
+
+                query->active = true;
+                query->from = *from;
+                query->header = *header;
+            }
+            else
+            {
+                fprintf(stderr, "Got query packet from non-whitelisted IP\n");
+            }
+        }
+        else if(header->type == PACKET_SAVE_FLIGHT_RECORDING)
+        {
+            if(IsWhitelisted(state->whitelist, from))
+            {
+                // Answered by the capture loop when it has started saving
+                pthread_mutex_lock(&exchange.mutex);
+                if(!exchange.flight_save_requested)
+                {
+                    exchange.flight_save_requested = true;
+                    exchange.flight_save_header = *header;
+                    exchange.flight_save_from = *from;
+                }
                 else
                 {
-                    fprintf(stderr, "Got packet with invalid type\n");
+                    PacketHeader reply = *header;
+                    reply.data = 0;
+                    QueueHeaderReply(state->socket, &state->replies, from, &reply);
                 }
+                pthread_mutex_unlock(&exchange.mutex);
             }
             else
             {
-                fprintf(stderr, "Incoming packet failed control\n");
+                fprintf(stderr, "Got flight recorder packet from non-whitelisted IP\n");
             }
         }
+        else
+        {
+            fprintf(stderr, "Got packet with invalid type\n");
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Incoming packet failed control\n");
     }
+}
+
+/// Answers every packet waiting on the socket from the given frame, a
+/// batch at a time
+static void
+HandlePackets(NetworkState *state, const ServerFrame *frame)
+{
+    PacketBatch *packets = &state->packets;
+    while(ReceivePackets(state->socket, packets) > 0)
+    {
+        for(int i=0; i<packets->count; ++i)
+        {
+            const mmsghdr *message = &packets->messages[i];
+            if(message->msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                fprintf(stderr, "Dropped a packet larger than %d bytes\n", MAX_PACKET_SIZE);
+                continue;
+            }
+
+            HandlePacket(state, frame, packets->buffers[i], message->msg_len, &packets->addresses[i]);
+        }
+
+        FlushReplies(state->socket, &state->replies);
+    }
+}
+
+struct NetworkThreadData
+{
+    int socket;
+    int wake_fd;  // Written to when the thread should stop
+    int frame_fd; // Written to when a frame has been published
+};
+
+/// Waits for packets, and answers them from the latest frame as soon as
+/// they arrive, regardless of where the capture loop is.
+static void *
+NetworkThread(void *userdata)
+{
+    NetworkThreadData *data = (NetworkThreadData *)userdata;
+
+    int epoll_handle = epoll_create1(0);
+    assert(epoll_handle >= 0);
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = data->socket;
+    epoll_ctl(epoll_handle, EPOLL_CTL_ADD, data->socket, &event);
+    event.data.fd = data->wake_fd;
+    epoll_ctl(epoll_handle, EPOLL_CTL_ADD, data->wake_fd, &event);
+    event.data.fd = data->frame_fd;
+    epoll_ctl(epoll_handle, EPOLL_CTL_ADD, data->frame_fd, &event);
+
+    NetworkState *state = (NetworkState *)calloc(1, sizeof(NetworkState));
+    state->socket = data->socket;
+    InitPacketBatch(&state->packets);
+    InitPacketBatch(&state->replies);
+
+    bool running = true;
+    while(running)
+    {
+        epoll_event events[3];
+        int num_events = epoll_wait(epoll_handle, events, 3, -1);
+        if(num_events < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i=0; i<num_events; ++i)
+        {
+            if(events[i].data.fd == data->wake_fd)
+            {
+                running = false;
+            }
+            else if(events[i].data.fd == data->frame_fd)
+            {
+                uint64_t frames;
+                read(data->frame_fd, &frames, sizeof(frames));
+                ServerFrame *frame = AcquireFrame();
+                UpdateSubscriptions(state->socket, &state->replies, frame);
+                UpdateStreams(state->socket, &state->replies, frame);
+            }
+            else
+            {
+                HandlePackets(state, AcquireFrame());
+            }
+        }
+    }
+
+    free(state);
+    close(epoll_handle);
+    return NULL;
+}
+
+int
+main(int num_args, char *args[])
+{
+    printf("%lu\n", sizeof(PacketHeader));
+    MagicMotion_Initialize();
+    unsigned int num_cameras = MagicMotion_GetNumCameras();
+    printf("Magic Motion initialized with %u camera(s)\n", num_cameras);
+
+    // -f <seconds> [MiB] keeps the last seconds of capture in memory, to be
+    // saved with a PACKET_SAVE_FLIGHT_RECORDING. Without a size, it reserves
+    // room for the seconds uncompressed, at FLIGHT_RECORDER_FPS.
+    for(int i=1; i<num_args-1; ++i)
+    {
+        if(strcmp(args[i], "-f") == 0)
+        {
+            float seconds = (float)atof(args[i+1]);
+            size_t max_bytes = 0;
+            if(i+2 < num_args && args[i+2][0] != '-')
+            {
+                max_bytes = (size_t)atol(args[i+2]) << 20;
+            }
+            else
+            {
+                size_t frame_bytes = 0;
+                const SensorInfo *sensors = MagicMotion_GetSensorInfo();
+                for(unsigned int j=0; j<num_cameras; ++j)
+                {
+                    size_t num_color = sensors[j].color_stream_info.width * sensors[j].color_stream_info.height;
+                    size_t num_depth = sensors[j].depth_stream_info.width * sensors[j].depth_stream_info.height;
+                    frame_bytes += num_color * sizeof(ColorPixel) + num_depth * sizeof(float);
+
+                    // Every depth pixel can be a point in the cloud
+                    frame_bytes += num_depth * (sizeof(V3) + sizeof(ColorPixel) + sizeof(MagicMotionTag));
+                }
+
+                max_bytes = (size_t)(frame_bytes * FLIGHT_RECORDER_FPS * seconds);
+            }
+
+            if(MagicMotion_StartFlightRecorder(seconds, max_bytes, true))
+            {
+                printf("Flight recorder keeps the last %.1f seconds, in up to %zu MiB\n",
+                       seconds, max_bytes >> 20);
+            }
+            else
+            {
+                fprintf(stderr, "Failed to start the flight recorder with %.1f seconds in %zu MiB\n",
+                        seconds, max_bytes >> 20);
+            }
+        }
+    }
+
+    // -s publishes every frame in shared memory, for local programs to
+    // read through magic_motion_shared.h
+    bool publish_shared = false;
+    for(int i=1; i<num_args; ++i)
+    {
+        if(strcmp(args[i], "-s") == 0)
+        {
+            unsigned int point_capacity = 0;
+            const SensorInfo *sensors = MagicMotion_GetSensorInfo();
+            for(unsigned int j=0; j<num_cameras; ++j)
+            {
+                point_capacity += sensors[j].depth_stream_info.width * sensors[j].depth_stream_info.height;
+            }
+
+            publish_shared = StartSharedFrames(point_capacity);
+        }
+    }
+
+    for(int i=0; i<3; ++i)
+    {
+        exchange.frames[i].voxels = (Voxel *)calloc(NUM_VOXELS, sizeof(Voxel));
+        exchange.frames[i].occupied = (uint32_t *)malloc(NUM_VOXELS * sizeof(uint32_t));
+        exchange.frames[i].history = (uint64_t *)malloc(OCCUPANCY_HISTORY_LENGTH * OCCUPANCY_WORDS * sizeof(uint64_t));
+    }
+
+    exchange.back = &exchange.frames[0];
+    exchange.ready = &exchange.frames[1];
+    exchange.front = &exchange.frames[2];
+    pthread_mutex_init(&exchange.mutex, NULL);
+
+    int socket = CreateSocket(PORT);
+
+    signal(SIGINT, InterruptHandler);
+
+    NetworkThreadData network_data;
+    network_data.socket = socket;
+    network_data.wake_fd = eventfd(0, 0);
+    assert(network_data.wake_fd >= 0);
+    network_data.frame_fd = eventfd(0, EFD_NONBLOCK);
+    assert(network_data.frame_fd >= 0);
+
+    pthread_t network_thread;
+    pthread_create(&network_thread, NULL, &NetworkThread, &network_data);
+
+    uint32_t sequence = 0;
+
+    global_running = true;
+    while(global_running)
+    {
+        uint64_t capture_time = GetWallTimestamp();
+        MagicMotion_CaptureFrame();
+        PublishFrame(++sequence, capture_time);
+        if(publish_shared)
+        {
+            PublishSharedFrame(sequence);
+        }
+
+        uint64_t published = 1;
+        write(network_data.frame_fd, &published, sizeof(published));
+
+        pthread_mutex_lock(&exchange.mutex);
+        bool save_flight_recording = exchange.flight_save_requested;
+        PacketHeader header = exchange.flight_save_header;
+        sockaddr_in from = exchange.flight_save_from;
+        pthread_mutex_unlock(&exchange.mutex);
+
+        if(save_flight_recording)
+        {
+            header.data = SaveFlightRecording() ? 1 : 0;
+            SendPacket(socket, &header, sizeof(PacketHeader), from, MSG_CONFIRM);
+
+            pthread_mutex_lock(&exchange.mutex);
+            exchange.flight_save_requested = false;
+            pthread_mutex_unlock(&exchange.mutex);
+        }
+    }
+
+    uint64_t wake = 1;
+    write(network_data.wake_fd, &wake, sizeof(wake));
+    pthread_join(network_thread, NULL);
+    close(network_data.wake_fd);
+    close(network_data.frame_fd);
 
     CloseSocket(socket);
+    StopSharedFrames();
     MagicMotion_Finalize();
 
+    for(int i=0; i<3; ++i)
+    {
+        free(exchange.frames[i].voxels);
+        free(exchange.frames[i].occupied);
+        free(exchange.frames[i].history);
+    }
+
+    pthread_mutex_destroy(&exchange.mutex);
+
     return 0;
 }
-
@@ -0,0 +1,142 @@
+// Publishes every frame in shared memory, for magic_motion_shared.cpp to
+// read. Included by server.cpp, and only used by the capture loop.
+
+#include "magic_motion_shared.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static struct
+{
+    uint8_t *memory;
+    size_t size;
+    SharedMemoryHeader *header;
+} shared;
+
+static inline uint64_t
+_AlignShared(uint64_t offset)
+{
+    return (offset + 63) & ~(uint64_t)63;
+}
+
+/// Creates the shared memory, with room for clouds of up to point_capacity points
+static bool
+StartSharedFrames(unsigned int point_capacity)
+{
+    // A server that did not shut down cleanly leaves its memory behind
+    shm_unlink(SHARED_MEMORY_NAME);
+
+    int fd = shm_open(SHARED_MEMORY_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0)
+    {
+        perror("shm_open");
+        return false;
+    }
+
+    SharedMemoryHeader layout = {};
+    layout.version = SHARED_MEMORY_VERSION;
+    layout.running = 1;
+    layout.point_capacity = point_capacity;
+    layout.num_slots = SHARED_FRAME_SLOTS;
+    layout.positions_offset = _AlignShared(sizeof(SharedSlotHeader));
+    layout.colors_offset = _AlignShared(layout.positions_offset + point_capacity * sizeof(V3));
+    layout.tags_offset = _AlignShared(layout.colors_offset + point_capacity * sizeof(ColorPixel));
+    layout.voxels_offset = _AlignShared(layout.tags_offset + point_capacity * sizeof(MagicMotionTag));
+    layout.occupied_offset = _AlignShared(layout.voxels_offset + NUM_VOXELS * sizeof(Voxel));
+    layout.slot_size = (layout.occupied_offset + NUM_VOXELS * sizeof(uint32_t) + 4095) & ~(uint64_t)4095;
+    layout.slots_offset = 4096;
+
+    size_t size = layout.slots_offset + layout.slot_size * layout.num_slots;
+    if(ftruncate(fd, size) != 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(SHARED_MEMORY_NAME);
+        return false;
+    }
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED)
+    {
+        perror("mmap");
+        shm_unlink(SHARED_MEMORY_NAME);
+        return false;
+    }
+
+    // NOTE(istarnion): ftruncate gives zeroed memory, so every slot starts
+    // out empty, with nothing in its occupied list to clear
+    shared.memory = (uint8_t *)memory;
+    shared.size = size;
+    shared.header = (SharedMemoryHeader *)memory;
+    *shared.header = layout;
+    __atomic_store_n(&shared.header->magic, SHARED_MEMORY_MAGIC, __ATOMIC_RELEASE);
+
+    printf("Publishing frames in shared memory %s (%.1f MB)\n", SHARED_MEMORY_NAME, size / (1024.0*1024.0));
+
+    return true;
+}
+
+static void
+StopSharedFrames(void)
+{
+    if(shared.memory)
+    {
+        // Readers that are attached keep their mapping, and see we are gone
+        __atomic_store_n(&shared.header->running, 0, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &shared.header->latest_sequence, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+
+        munmap(shared.memory, shared.size);
+        shm_unlink(SHARED_MEMORY_NAME);
+        memset(&shared, 0, sizeof(shared));
+    }
+}
+
+/// Writes the latest frame into the next slot, and wakes the readers
+static void
+PublishSharedFrame(uint32_t sequence)
+{
+    SharedMemoryHeader *header = shared.header;
+    uint8_t *slot = shared.memory + header->slots_offset + header->slot_size * (sequence % header->num_slots);
+    SharedSlotHeader *slot_header = (SharedSlotHeader *)slot;
+
+    // Odd while we write. The fence keeps the writes below from being
+    // seen before the version is.
+    uint32_t version = slot_header->version;
+    __atomic_store_n(&slot_header->version, version+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    unsigned int num_points = MIN(MagicMotion_GetCloudSize(), header->point_capacity);
+    memcpy(slot + header->positions_offset, MagicMotion_GetPositions(), num_points * sizeof(V3));
+    memcpy(slot + header->colors_offset, MagicMotion_GetColors(), num_points * sizeof(ColorPixel));
+    memcpy(slot + header->tags_offset, MagicMotion_GetTags(), num_points * sizeof(MagicMotionTag));
+
+    // Like PublishFrame, only the voxels occupied the last time the slot
+    // was written need clearing
+    Voxel *slot_voxels = (Voxel *)(slot + header->voxels_offset);
+    uint32_t *slot_occupied = (uint32_t *)(slot + header->occupied_offset);
+    for(unsigned int i=0; i<slot_header->num_occupied; ++i)
+    {
+        memset(&slot_voxels[slot_occupied[i]], 0, sizeof(Voxel));
+    }
+
+    const Voxel *voxels = MagicMotion_GetVoxels();
+    const uint32_t *occupied = MagicMotion_GetOccupiedVoxels();
+    unsigned int num_occupied = MagicMotion_GetNumOccupiedVoxels();
+    for(unsigned int i=0; i<num_occupied; ++i)
+    {
+        slot_voxels[occupied[i]] = voxels[occupied[i]];
+    }
+
+    memcpy(slot_occupied, occupied, num_occupied * sizeof(uint32_t));
+
+    slot_header->sequence = sequence;
+    slot_header->num_points = num_points;
+    slot_header->num_occupied = num_occupied;
+
+    __atomic_store_n(&slot_header->version, version+2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest_sequence, sequence, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->latest_sequence, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
@@ -0,0 +1,238 @@
+// Streams the occupancy of the voxel grid to clients, as run length coded
+// deltas against the frame sent before. Included by server.cpp, and only
+// touched by the network thread.
+
+#define MAX_STREAMS 8
+#define OCCUPANCY_BYTES ((NUM_VOXELS+7)/8)
+
+// Every literal byte takes at most two bytes with its token, and zero runs
+// less than that, so this is more than a frame ever needs
+#define MAX_STREAM_FRAGMENTS (2*OCCUPANCY_BYTES / (STREAM_FRAGMENT_SIZE - sizeof(PacketStreamFragment)) + 2)
+
+struct Stream
+{
+    sockaddr_in client;
+    uint32_t min_point_count;
+    bool needs_keyframe;
+    uint32_t frames_since_keyframe;
+    uint32_t last_frame;              // The frame sent last, which the next is coded against
+    uint8_t sent[OCCUPANCY_BYTES];    // Its bitmap
+};
+
+static struct
+{
+    Stream streams[MAX_STREAMS];
+    int num_streams;
+
+    uint8_t occupancy[OCCUPANCY_BYTES];
+    uint8_t fragments[MAX_STREAM_FRAGMENTS][STREAM_FRAGMENT_SIZE];
+    size_t fragment_sizes[MAX_STREAM_FRAGMENTS];
+} streaming;
+
+static Stream *
+_FindStream(const sockaddr_in *client)
+{
+    for(int i=0; i<streaming.num_streams; ++i)
+    {
+        if(SameAddress(&streaming.streams[i].client, client))
+        {
+            return &streaming.streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+/// Starts streaming to the client, or restarts it with a new threshold.
+/// Returns false if there is no room.
+static bool
+StartStream(const sockaddr_in *client, uint8_t min_point_count)
+{
+    Stream *stream = _FindStream(client);
+    if(!stream)
+    {
+        if(streaming.num_streams == MAX_STREAMS)
+        {
+            fprintf(stderr, "Too many streams, ignoring a new one\n");
+            return false;
+        }
+
+        stream = &streaming.streams[streaming.num_streams++];
+    }
+
+    stream->client = *client;
+    stream->min_point_count = MAX(min_point_count, 1);
+    stream->needs_keyframe = true;
+    stream->frames_since_keyframe = 0;
+    stream->last_frame = 0;
+
+    return true;
+}
+
+static void
+StopStream(const sockaddr_in *client)
+{
+    Stream *stream = _FindStream(client);
+    if(stream)
+    {
+        *stream = streaming.streams[--streaming.num_streams];
+    }
+}
+
+static void
+RequestKeyframe(const sockaddr_in *client)
+{
+    Stream *stream = _FindStream(client);
+    if(stream)
+    {
+        stream->needs_keyframe = true;
+    }
+}
+
+static void
+_BuildOccupancy(const ServerFrame *frame, uint32_t min_point_count, uint8_t *occupancy)
+{
+    memset(occupancy, 0, OCCUPANCY_BYTES);
+    for(unsigned int i=0; i<frame->num_occupied; ++i)
+    {
+        uint32_t index = frame->occupied[i];
+        if(frame->voxels[index].point_count >= min_point_count)
+        {
+            occupancy[index/8] |= 1 << (index%8);
+        }
+    }
+}
+
+/// Codes the XOR of the occupancy and base in fragments. A fragment is
+/// closed when the next token would not fit, so each one stands alone.
+/// Returns the number of fragments.
+static int
+_EncodeOccupancy(const uint8_t *occupancy, const uint8_t *base)
+{
+    const size_t capacity = STREAM_FRAGMENT_SIZE - sizeof(PacketStreamFragment);
+
+    int num_fragments = 0;
+    uint8_t *payload = NULL;
+    size_t payload_size = capacity; // Makes the first token open a fragment
+    uint32_t offset = 0;
+
+    uint32_t i = 0;
+    while(i < OCCUPANCY_BYTES)
+    {
+        uint32_t run = 0;
+        bool zero = (occupancy[i] ^ base[i]) == 0;
+        uint32_t max_run = zero ? 0xFFFF : 128;
+        while(i+run < OCCUPANCY_BYTES && run < max_run &&
+              ((occupancy[i+run] ^ base[i+run]) == 0) == zero)
+        {
+            ++run;
+        }
+
+        size_t token_size = zero ? (run < 128 ? 1 : 3) : 1+run;
+        if(payload_size + token_size > capacity)
+        {
+            if(payload)
+            {
+                PacketStreamFragment *fragment = (PacketStreamFragment *)streaming.fragments[num_fragments-1];
+                fragment->length = i - offset;
+                streaming.fragment_sizes[num_fragments-1] = sizeof(PacketStreamFragment) + payload_size;
+            }
+
+            PacketStreamFragment *fragment = (PacketStreamFragment *)streaming.fragments[num_fragments++];
+            fragment->offset = offset = i;
+            payload = streaming.fragments[num_fragments-1] + sizeof(PacketStreamFragment);
+            payload_size = 0;
+        }
+
+        if(zero && run < 128)
+        {
+            payload[payload_size++] = (uint8_t)(0x7F + run);
+        }
+        else if(zero)
+        {
+            uint16_t count = (uint16_t)run;
+            payload[payload_size++] = 0xFF;
+            memcpy(payload + payload_size, &count, sizeof(uint16_t));
+            payload_size += sizeof(uint16_t);
+        }
+        else
+        {
+            payload[payload_size++] = (uint8_t)(run-1);
+            for(uint32_t k=0; k<run; ++k)
+            {
+                payload[payload_size++] = occupancy[i+k] ^ base[i+k];
+            }
+        }
+
+        i += run;
+    }
+
+    PacketStreamFragment *fragment = (PacketStreamFragment *)streaming.fragments[num_fragments-1];
+    fragment->length = i - offset;
+    streaming.fragment_sizes[num_fragments-1] = sizeof(PacketStreamFragment) + payload_size;
+
+    return num_fragments;
+}
+
+static uint32_t
+_CountOccupied(const uint8_t *occupancy)
+{
+    uint32_t count = 0;
+    for(uint32_t i=0; i<OCCUPANCY_BYTES; ++i)
+    {
+        count += __builtin_popcount(occupancy[i]);
+    }
+
+    return count;
+}
+
+/// Sends the frame to every stream, as a keyframe to those that need one
+static void
+UpdateStreams(int socket_handle, PacketBatch *replies, const ServerFrame *frame)
+{
+    static const uint8_t empty[OCCUPANCY_BYTES] = {};
+
+    for(int s=0; s<streaming.num_streams; ++s)
+    {
+        Stream *stream = &streaming.streams[s];
+        if(stream->last_frame == frame->sequence)
+        {
+            continue;
+        }
+
+        if(stream->frames_since_keyframe >= STREAM_KEYFRAME_INTERVAL)
+        {
+            stream->needs_keyframe = true;
+        }
+
+        _BuildOccupancy(frame, stream->min_point_count, streaming.occupancy);
+
+        bool keyframe = stream->needs_keyframe;
+        int num_fragments = _EncodeOccupancy(streaming.occupancy, keyframe ? empty : stream->sent);
+        uint32_t num_occupied = _CountOccupied(streaming.occupancy);
+
+        for(int i=0; i<num_fragments; ++i)
+        {
+            PacketStreamFragment *fragment = (PacketStreamFragment *)streaming.fragments[i];
+            fragment->type = PACKET_STREAM_FRAGMENT;
+            fragment->control = PACKET_CONTROL;
+            fragment->frame = frame->sequence;
+            fragment->base_frame = keyframe ? 0 : stream->last_frame;
+            fragment->num_occupied = num_occupied;
+            fragment->fragment = i;
+            fragment->num_fragments = num_fragments;
+            fragment->capture_time = frame->capture_time;
+
+            uint8_t *packet = QueueReply(socket_handle, replies, &stream->client);
+            memcpy(packet, fragment, streaming.fragment_sizes[i]);
+            FinishReply(replies, streaming.fragment_sizes[i]);
+        }
+
+        memcpy(stream->sent, streaming.occupancy, OCCUPANCY_BYTES);
+        stream->last_frame = frame->sequence;
+        stream->needs_keyframe = false;
+        stream->frames_since_keyframe = keyframe ? 1 : stream->frames_since_keyframe+1;
+    }
+
+    FlushReplies(socket_handle, replies);
+}
@@ -0,0 +1,436 @@
+// Streams the occupancy from a magicmotion_server, and reports the
+// bandwidth it takes, how often frames arrive, how old they are when they
+// have arrived, and how long it takes to get a keyframe. Packets can be
+// dropped on purpose, to see the stream recover from loss.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define MAX_FRAGMENTS 256
+#define KEYFRAME_RETRY_SECONDS 0.1
+#define MAX_LATENCIES 1024
+#define MAX_FRAME_LATENCIES (1 << 16)
+
+typedef struct
+{
+    uint32_t frame;
+    uint32_t base_frame;
+    uint32_t num_occupied;
+    uint64_t capture_time;
+    uint16_t num_fragments;
+    int num_received;
+    bool received[MAX_FRAGMENTS];
+    bool broken; // Its base is not the frame we have
+} Assembly;
+
+typedef struct
+{
+    size_t frames;
+    size_t keyframes;
+    size_t lost_frames;
+    size_t failed_checks;
+    size_t keyframe_requests;
+    size_t packets;
+    size_t dropped_packets;
+    size_t bytes;
+    size_t keyframe_bytes;
+    size_t delta_bytes;
+    double latencies[MAX_LATENCIES]; // Seconds from keyframe requests until we had it
+    int num_latencies;
+    double frame_latencies[MAX_FRAME_LATENCIES]; // Seconds from capture until we had the frame
+    int num_frame_latencies;
+} StreamStats;
+
+static double
+_Now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Only the same as the server's capture_time clock on the same machine
+static uint64_t
+_NowNanoseconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void
+_SendHeader(int socket_handle, const sockaddr_in *server, uint8_t type, uint8_t data)
+{
+    PacketHeader header = {};
+    header.type = (PacketType)type;
+    header.control = PACKET_CONTROL;
+    header.data = data;
+    sendto(socket_handle, &header, sizeof(PacketHeader), 0, (const sockaddr *)server, sizeof(sockaddr_in));
+}
+
+/// XORs the bytes coded in the fragment into the bitmap. Returns false if
+/// the fragment does not add up.
+static bool
+_DecodeFragment(const uint8_t *packet, size_t packet_size, uint8_t *bitmap, size_t bitmap_size)
+{
+    const PacketStreamFragment *fragment = (const PacketStreamFragment *)packet;
+    if((size_t)fragment->offset + fragment->length > bitmap_size)
+    {
+        return false;
+    }
+
+    const uint8_t *token = packet + sizeof(PacketStreamFragment);
+    const uint8_t *end = packet + packet_size;
+    uint8_t *out = bitmap + fragment->offset;
+    uint8_t *out_end = out + fragment->length;
+
+    while(token < end)
+    {
+        uint8_t t = *token++;
+        if(t == 0xFF)
+        {
+            uint16_t count;
+            if(token + sizeof(uint16_t) > end)
+            {
+                return false;
+            }
+
+            memcpy(&count, token, sizeof(uint16_t));
+            token += sizeof(uint16_t);
+            out += count;
+        }
+        else if(t >= 0x80)
+        {
+            out += t - 0x7F;
+        }
+        else
+        {
+            size_t run = t+1;
+            if(token + run > end || out + run > out_end)
+            {
+                return false;
+            }
+
+            for(size_t i=0; i<run; ++i)
+            {
+                out[i] ^= token[i];
+            }
+
+            token += run;
+            out += run;
+        }
+    }
+
+    return out == out_end;
+}
+
+static uint32_t
+_CountOccupied(const uint8_t *bitmap, size_t bitmap_size)
+{
+    uint32_t count = 0;
+    for(size_t i=0; i<bitmap_size; ++i)
+    {
+        count += __builtin_popcount(bitmap[i]);
+    }
+
+    return count;
+}
+
+static int
+_CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+_PrintUsage(void)
+{
+    fprintf(stderr,
+            "usage: magicmotion_stream_client [server address] [options]\n"
+            "    -t <seconds>      How long to stream. Default 10\n"
+            "    -m <points>       Points a voxel needs to be occupied. Default 1\n"
+            "    -l <percent>      Drop this share of the packets, to test loss recovery\n");
+}
+
+int
+main(int num_args, char *args[])
+{
+    const char *address = "127.0.0.1";
+    double seconds = 10.0;
+    int min_point_count = 1;
+    double loss = 0.0;
+
+    for(int i=1; i<num_args; ++i)
+    {
+        if(args[i][0] != '-')
+        {
+            address = args[i];
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-t") == 0)
+        {
+            seconds = atof(args[++i]);
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-m") == 0)
+        {
+            min_point_count = atoi(args[++i]);
+        }
+        else if(i+1 < num_args && strcmp(args[i], "-l") == 0)
+        {
+            loss = atof(args[++i]) / 100.0;
+        }
+        else
+        {
+            _PrintUsage();
+            return 1;
+        }
+    }
+
+    sockaddr_in server = {};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT);
+    if(inet_pton(AF_INET, address, &server.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address: %s\n", address);
+        return 1;
+    }
+
+    int socket_handle = socket(AF_INET, SOCK_DGRAM, 0);
+    if(socket_handle < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    timeval timeout = { 0, 100000 };
+    setsockopt(socket_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int receive_buffer = 4 << 20;
+    setsockopt(socket_handle, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+
+    static uint8_t packet[MAX_PACKET_SIZE];
+
+    // Pinging whitelists us
+    _SendHeader(socket_handle, &server, PACKET_PING, 0);
+    if(recv(socket_handle, packet, sizeof(packet), 0) != sizeof(PacketHeader))
+    {
+        fprintf(stderr, "No answer from %s\n", address);
+        return 1;
+    }
+
+    _SendHeader(socket_handle, &server, PACKET_STREAM_START, (uint8_t)min_point_count);
+
+    PacketStreamInfo info = {};
+    double give_up = _Now() + 1.0;
+    while(_Now() < give_up)
+    {
+        ssize_t size = recv(socket_handle, packet, sizeof(packet), 0);
+        if(size == sizeof(PacketStreamInfo) && packet[0] == PACKET_STREAM_START)
+        {
+            memcpy(&info, packet, sizeof(PacketStreamInfo));
+            break;
+        }
+    }
+
+    if(info.header.data != 1)
+    {
+        fprintf(stderr, "The server did not start the stream\n");
+        return 1;
+    }
+
+    size_t num_voxels = (size_t)info.voxels[0] * info.voxels[1] * info.voxels[2];
+    size_t bitmap_size = (num_voxels+7)/8;
+    printf("Streaming %ux%ux%u voxels of %.2f from %s\n",
+           info.voxels[0], info.voxels[1], info.voxels[2], info.voxel_size, address);
+
+    uint8_t *current = (uint8_t *)calloc(bitmap_size, 1); // The last complete frame
+    uint8_t *working = (uint8_t *)calloc(bitmap_size, 1); // The frame being assembled
+    uint32_t current_frame = 0;
+    bool have_frame = false;
+
+    Assembly assembly = {};
+    static StreamStats stats = {};
+    srand(1);
+
+    // Keyframe requests outstanding. The first frame is always a keyframe.
+    double keyframe_requested_at = _Now();
+    bool keyframe_requested = true;
+
+    double start = _Now();
+    double end = start + seconds;
+    while(_Now() < end)
+    {
+        if(keyframe_requested && _Now() - keyframe_requested_at > KEYFRAME_RETRY_SECONDS)
+        {
+            _SendHeader(socket_handle, &server, PACKET_STREAM_KEYFRAME, 0);
+            keyframe_requested_at = _Now();
+            ++stats.keyframe_requests;
+        }
+
+        ssize_t size = recv(socket_handle, packet, sizeof(packet), 0);
+        if(size < (ssize_t)sizeof(PacketStreamFragment) || packet[0] != PACKET_STREAM_FRAGMENT)
+        {
+            continue;
+        }
+
+        ++stats.packets;
+        if(loss > 0 && rand() < loss * RAND_MAX)
+        {
+            ++stats.dropped_packets;
+            continue;
+        }
+
+        stats.bytes += size;
+
+        const PacketStreamFragment *fragment = (const PacketStreamFragment *)packet;
+        if(fragment->frame != assembly.frame)
+        {
+            if(assembly.frame != 0 && assembly.num_received < assembly.num_fragments)
+            {
+                ++stats.lost_frames;
+            }
+
+            memset(&assembly, 0, sizeof(Assembly));
+            assembly.frame = fragment->frame;
+            assembly.base_frame = fragment->base_frame;
+            assembly.num_occupied = fragment->num_occupied;
+            assembly.capture_time = fragment->capture_time;
+            assembly.num_fragments = fragment->num_fragments;
+            assembly.broken = fragment->num_fragments > MAX_FRAGMENTS ||
+                              (fragment->base_frame != 0 && !(have_frame && fragment->base_frame == current_frame));
+
+            if(fragment->base_frame == 0)
+            {
+                memset(working, 0, bitmap_size);
+            }
+            else
+            {
+                memcpy(working, current, bitmap_size);
+            }
+        }
+
+        if(assembly.broken)
+        {
+            if(!keyframe_requested)
+            {
+                keyframe_requested = true;
+                keyframe_requested_at = 0; // Sent at the top of the loop
+                have_frame = false;
+            }
+
+            continue;
+        }
+
+        if(fragment->fragment >= assembly.num_fragments || assembly.received[fragment->fragment])
+        {
+            continue;
+        }
+
+        assembly.received[fragment->fragment] = true;
+        ++assembly.num_received;
+
+        if(!_DecodeFragment(packet, size, working, bitmap_size))
+        {
+            assembly.broken = true;
+            ++stats.failed_checks;
+            continue;
+        }
+
+        if(fragment->base_frame == 0)
+        {
+            stats.keyframe_bytes += size;
+        }
+        else
+        {
+            stats.delta_bytes += size;
+        }
+
+        if(assembly.num_received == assembly.num_fragments)
+        {
+            if(_CountOccupied(working, bitmap_size) != assembly.num_occupied)
+            {
+                assembly.broken = true;
+                ++stats.failed_checks;
+                continue;
+            }
+
+            uint8_t *swap = current;
+            current = working;
+            working = swap;
+            current_frame = assembly.frame;
+            have_frame = true;
+
+            ++stats.frames;
+            if(stats.num_frame_latencies < MAX_FRAME_LATENCIES)
+            {
+                uint64_t now = _NowNanoseconds();
+                uint64_t age = now > assembly.capture_time ? now - assembly.capture_time : 0;
+                stats.frame_latencies[stats.num_frame_latencies++] = age / 1e9;
+            }
+
+            if(assembly.base_frame == 0)
+            {
+                ++stats.keyframes;
+                if(keyframe_requested)
+                {
+                    if(keyframe_requested_at > 0 && stats.num_latencies < MAX_LATENCIES)
+                    {
+                        stats.latencies[stats.num_latencies++] = _Now() - keyframe_requested_at;
+                    }
+
+                    keyframe_requested = false;
+                }
+            }
+        }
+    }
+
+    _SendHeader(socket_handle, &server, PACKET_STREAM_STOP, 0);
+
+    double elapsed = _Now() - start;
+    size_t deltas = stats.frames - stats.keyframes;
+    printf("%zu frames in %.1f s (%.1f fps), %zu keyframes, %zu frames lost, %zu failed checks\n",
+           stats.frames, elapsed, stats.frames / elapsed, stats.keyframes, stats.lost_frames, stats.failed_checks);
+    printf("%zu packets, %zu dropped on purpose, %zu keyframe requests\n",
+           stats.packets, stats.dropped_packets, stats.keyframe_requests);
+    printf("%.3f Mbit/s, %.0f bytes per keyframe, %.0f bytes per delta, %zu bytes uncompressed\n",
+           stats.bytes * 8 / elapsed / 1e6,
+           stats.keyframes ? (double)stats.keyframe_bytes / stats.keyframes : 0.0,
+           deltas ? (double)stats.delta_bytes / deltas : 0.0,
+           bitmap_size);
+
+    if(stats.num_frame_latencies > 0)
+    {
+        int n = stats.num_frame_latencies;
+        qsort(stats.frame_latencies, n, sizeof(double), _CompareDoubles);
+        printf("Frame latency from capture: p50 %.2f ms, p99 %.2f ms, max %.2f ms over %d frames\n",
+               stats.frame_latencies[n/2] * 1e3,
+               stats.frame_latencies[(int)(n * 0.99)] * 1e3,
+               stats.frame_latencies[n-1] * 1e3,
+               n);
+    }
+
+    if(stats.num_latencies > 0)
+    {
+        qsort(stats.latencies, stats.num_latencies, sizeof(double), _CompareDoubles);
+        printf("Keyframe latency: median %.2f ms, max %.2f ms over %d requests\n",
+               stats.latencies[stats.num_latencies/2] * 1e3,
+               stats.latencies[stats.num_latencies-1] * 1e3,
+               stats.num_latencies);
+    }
+
+    printf("%u voxels occupied in the last frame\n", _CountOccupied(current, bitmap_size));
+
+    free(current);
+    free(working);
+    close(socket_handle);
+
+    return 0;
+}
@@ -0,0 +1,311 @@
+// Volumes clients have subscribed to, and the events they get when the
+// volumes change. Included by server.cpp, and only touched by the network
+// thread.
+
+#define MAX_SUBSCRIPTIONS 1024
+
+struct Subscription
+{
+    sockaddr_in client;
+    uint16_t volume_id;
+    uint8_t shape;
+
+    V3 min; // Bounds of the volume, for both shapes
+    V3 max;
+    V3 center;
+    float radius_squared;
+
+    uint32_t enter_count;
+    uint32_t exit_count;
+    uint32_t count_step;
+
+    // Count occupied voxels over a window of frames instead, if frames is above 0
+    uint8_t window_frames;
+    uint8_t window_min_frames;
+
+    // Updated every frame
+    uint32_t count;
+    bool entered;
+    uint32_t reported_count;
+};
+
+static struct
+{
+    Subscription subscriptions[MAX_SUBSCRIPTIONS];
+    int num_subscriptions;
+    uint32_t last_frame; // The frame the events were last sent for
+} subscriptions;
+
+static Subscription *
+_FindSubscription(const sockaddr_in *client, uint16_t volume_id)
+{
+    for(int i=0; i<subscriptions.num_subscriptions; ++i)
+    {
+        Subscription *s = &subscriptions.subscriptions[i];
+        if(s->volume_id == volume_id && SameAddress(&s->client, client))
+        {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/// Registers or replaces a volume. Returns false if there is no room.
+static bool
+Subscribe(const PacketSubscribe *packet, const sockaddr_in *client)
+{
+    Subscription *s = _FindSubscription(client, packet->volume_id);
+    if(!s)
+    {
+        if(subscriptions.num_subscriptions == MAX_SUBSCRIPTIONS)
+        {
+            fprintf(stderr, "Too many subscriptions, ignoring volume %u\n", packet->volume_id);
+            return false;
+        }
+
+        s = &subscriptions.subscriptions[subscriptions.num_subscriptions++];
+    }
+
+    memset(s, 0, sizeof(Subscription));
+    s->client = *client;
+    s->volume_id = packet->volume_id;
+    s->shape = packet->shape;
+
+    V3 a = { packet->a[0], packet->a[1], packet->a[2] };
+    V3 b = { packet->b[0], packet->b[1], packet->b[2] };
+    if(s->shape == VOLUME_SPHERE)
+    {
+        float r = b.x;
+        s->center = a;
+        s->radius_squared = r*r;
+        s->min = (V3){ a.x-r, a.y-r, a.z-r };
+        s->max = (V3){ a.x+r, a.y+r, a.z+r };
+    }
+    else
+    {
+        s->shape = VOLUME_AABB;
+        s->min = a;
+        s->max = b;
+    }
+
+    // A volume that is entered with no points would be entered forever
+    s->enter_count = MAX(packet->enter_count, 1u);
+    s->exit_count = MIN(packet->exit_count, s->enter_count);
+    s->count_step = packet->count_step;
+    s->window_frames = MIN(packet->window.frames, OCCUPANCY_HISTORY_LENGTH);
+    s->window_min_frames = packet->window.min_frames;
+
+    char name[sizeof(packet->name)+1] = {};
+    memcpy(name, packet->name, sizeof(packet->name));
+    if(s->window_frames > 0)
+    {
+        printf("Subscribed to volume %u (%s) over %u frames\n", s->volume_id, name, s->window_frames);
+    }
+    else
+    {
+        printf("Subscribed to volume %u (%s)\n", s->volume_id, name);
+    }
+
+    return true;
+}
+
+static void
+Unsubscribe(const PacketUnsubscribe *packet, const sockaddr_in *client)
+{
+    for(int i=0; i<subscriptions.num_subscriptions;)
+    {
+        Subscription *s = &subscriptions.subscriptions[i];
+        if(SameAddress(&s->client, client) &&
+           (packet->volume_id == ALL_VOLUMES || packet->volume_id == s->volume_id))
+        {
+            *s = subscriptions.subscriptions[--subscriptions.num_subscriptions];
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+static inline bool
+_VolumeContains(const Subscription *s, V3 p)
+{
+    if(p.x < s->min.x || p.x > s->max.x ||
+       p.y < s->min.y || p.y > s->max.y ||
+       p.z < s->min.z || p.z > s->max.z)
+    {
+        return false;
+    }
+
+    if(s->shape == VOLUME_SPHERE)
+    {
+        V3 d = { p.x - s->center.x, p.y - s->center.y, p.z - s->center.z };
+        return d.x*d.x + d.y*d.y + d.z*d.z <= s->radius_squared;
+    }
+
+    return true;
+}
+
+/// The voxels of the volume set in the occupancy bitmap
+static uint32_t
+_CountWindowVoxels(const Subscription *s, const uint64_t *mask)
+{
+    const int dims[3] = { NUM_VOXELS_X, NUM_VOXELS_Y, NUM_VOXELS_Z };
+    const float grid_min[3] = { BOUNDING_BOX_X/-2.0f, BOUNDING_BOX_Y/-2.0f, BOUNDING_BOX_Z/-2.0f };
+
+    // Every voxel whose center can be inside the bounds
+    int start[3], end[3];
+    for(int axis=0; axis<3; ++axis)
+    {
+        float lo = floorf((s->min.v[axis] - grid_min[axis]) / VOXEL_SIZE);
+        float hi = floorf((s->max.v[axis] - grid_min[axis]) / VOXEL_SIZE) + 1.0f;
+        lo = MAX(lo, 0.0f);
+        hi = MIN(hi, (float)dims[axis]);
+        if(!(lo < hi))
+        {
+            return 0;
+        }
+
+        start[axis] = (int)lo;
+        end[axis] = (int)hi;
+    }
+
+    uint32_t count = 0;
+    for(int z=start[2]; z<end[2]; ++z)
+    for(int y=start[1]; y<end[1]; ++y)
+    for(int x=start[0]; x<end[0]; ++x)
+    {
+        uint32_t index = VOXEL_INDEX(x, y, z);
+        if((mask[index/64] & ((uint64_t)1 << (index%64))) && _VolumeContains(s, VOXEL_TO_WORLD(index)))
+        {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/// Counts the points in every volume with one pass over the occupied
+/// voxels, and sends each client the events of its volumes. A voxel counts
+/// towards a volume if its center is inside it. Volumes with a window count
+/// the voxels occupied over it instead.
+static void
+UpdateSubscriptions(int socket_handle, PacketBatch *replies, const ServerFrame *frame)
+{
+    if(frame->sequence == subscriptions.last_frame || subscriptions.num_subscriptions == 0)
+    {
+        return;
+    }
+
+    subscriptions.last_frame = frame->sequence;
+
+    for(int i=0; i<subscriptions.num_subscriptions; ++i)
+    {
+        subscriptions.subscriptions[i].count = 0;
+    }
+
+    for(unsigned int v=0; v<frame->num_occupied; ++v)
+    {
+        uint32_t index = frame->occupied[v];
+        V3 center = VOXEL_TO_WORLD(index);
+        uint32_t point_count = frame->voxels[index].point_count;
+
+        for(int i=0; i<subscriptions.num_subscriptions; ++i)
+        {
+            Subscription *s = &subscriptions.subscriptions[i];
+            if(s->window_frames == 0 && _VolumeContains(s, center))
+            {
+                s->count += point_count;
+            }
+        }
+    }
+
+    for(int i=0; i<subscriptions.num_subscriptions; ++i)
+    {
+        Subscription *s = &subscriptions.subscriptions[i];
+        if(s->window_frames > 0)
+        {
+            const OccupancyWindow *window = GetOccupancyWindow(frame, s->window_frames, s->window_min_frames);
+            s->count = _CountWindowVoxels(s, window->mask);
+        }
+    }
+
+    // Subscriptions are not ordered by client, so each client gets its
+    // events gathered from all of them. There are only a handful of clients.
+    static bool handled[MAX_SUBSCRIPTIONS];
+    memset(handled, 0, sizeof(handled));
+
+    for(int first=0; first<subscriptions.num_subscriptions; ++first)
+    {
+        if(handled[first])
+        {
+            continue;
+        }
+
+        const sockaddr_in client = subscriptions.subscriptions[first].client;
+        uint8_t *packet = NULL;
+        PacketEvents header = { PACKET_EVENTS, PACKET_CONTROL, frame->sequence, 0 };
+
+        for(int i=first; i<subscriptions.num_subscriptions; ++i)
+        {
+            Subscription *s = &subscriptions.subscriptions[i];
+            if(handled[i] || !SameAddress(&s->client, &client))
+            {
+                continue;
+            }
+
+            handled[i] = true;
+
+            VolumeEvent event = { s->volume_id, 0, s->count };
+            if(!s->entered && s->count >= s->enter_count)
+            {
+                s->entered = true;
+                event.type = VOLUME_ENTERED;
+            }
+            else if(s->entered && s->count < s->exit_count)
+            {
+                s->entered = false;
+                event.type = VOLUME_EXITED;
+            }
+            else if(s->entered && s->count_step > 0 &&
+                    (s->count >= s->reported_count + s->count_step ||
+                     s->count + s->count_step <= s->reported_count))
+            {
+                event.type = VOLUME_COUNT_CHANGED;
+            }
+            else
+            {
+                continue;
+            }
+
+            s->reported_count = s->count;
+
+            size_t size = sizeof(PacketEvents) + sizeof(VolumeEvent) * header.num_events;
+            if(packet && size + sizeof(VolumeEvent) > MAX_PACKET_SIZE)
+            {
+                memcpy(packet, &header, sizeof(PacketEvents));
+                FinishReply(replies, size);
+                packet = NULL;
+            }
+
+            if(!packet)
+            {
+                packet = QueueReply(socket_handle, replies, &client);
+                header.num_events = 0;
+            }
+
+            memcpy(packet + sizeof(PacketEvents) + sizeof(VolumeEvent) * header.num_events,
+                   &event, sizeof(VolumeEvent));
+            ++header.num_events;
+        }
+
+        if(packet)
+        {
+            memcpy(packet, &header, sizeof(PacketEvents));
+            FinishReply(replies, sizeof(PacketEvents) + sizeof(VolumeEvent) * header.num_events);
+        }
+    }
+
+    FlushReplies(socket_handle, replies);
+}
@@ -0,0 +1,39 @@
+#if defined(VERTEX_SHADER)
+
+out vec2 uv;
+
+void
+main()
+{
+    // One triangle that covers the whole viewport
+    vec2 p = vec2(float((gl_VertexID & 1) << 2),
+                  float((gl_VertexID & 2) << 1));
+
+    uv = 0.5*p;
+    gl_Position = vec4(p - 1.0, 0.0, 1.0);
+}
+
+#else
+
+in vec2 uv;
+
+uniform sampler2D Depths;
+uniform float MaxDepth;
+uniform float Step;
+
+out vec4 color;
+
+void
+main()
+{
+    float depth = texture(Depths, uv).r;
+    if(Step > 0.0)
+    {
+        depth = floor(depth / Step) * Step;
+    }
+
+    float v = clamp(depth / MaxDepth, 0.0, 1.0);
+    color = vec4(v, v, v, 1.0);
+}
+
+#endif
@@ -2,10 +2,10 @@
 
 layout(location=0) in vec3 v_position;
 layout(location=1) in vec3 v_normal;
+layout(location=2) in vec3 i_center; // Per instance
+layout(location=3) in vec3 i_color;  // Per instance, RGB8 normalized
 
 uniform mat4 MVP;
-uniform vec3 Positions[256];
-uniform vec3 Colors[256];
 
 out vec3 normal;
 out vec3 color;
@@ -14,9 +14,8 @@ void
 main()
 {
     normal = v_normal;
-    vec3 pos = Positions[gl_InstanceID];
-    color = Colors[gl_InstanceID];
-    gl_Position = MVP * vec4(pos + 0.5*v_position, 1.0);
+    color = i_color;
+    gl_Position = MVP * vec4(i_center + 0.5*v_position, 1.0);
 }
 
 #else
@@ -37,4 +36,3 @@ main()
 }
 
 #endif
-
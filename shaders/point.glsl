@@ -1,16 +1,44 @@
 #if defined(VERTEX_SHADER)
 
 layout(location=0) in vec3 v_position;
-layout(location=1) in vec3 v_color;
+layout(location=1) in vec4 v_color; // RGBA8, normalized. Alpha is not used
+layout(location=2) in uint v_tag;
 
 uniform mat4 MVP;
+uniform bool RemoveBackground;
+uniform bool VisualizeBGSub;
+uniform uint ForegroundTag;
+uniform uint BackgroundTag;
 
 out vec3 point_color;
 
 void
 main()
 {
-    point_color = v_color;
+    bool foreground = (v_tag & ForegroundTag) != 0u;
+
+    if(RemoveBackground && !foreground)
+    {
+        // Outside the clip volume, so the point is culled before rasterization
+        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+        gl_PointSize = 1.0;
+        point_color = vec3(0.0);
+        return;
+    }
+
+    point_color = v_color.rgb;
+    if(VisualizeBGSub)
+    {
+        if(foreground)
+        {
+            point_color *= vec3(0.5, 2.0, 0.5);
+        }
+        else if((v_tag & BackgroundTag) != 0u)
+        {
+            point_color *= vec3(2.0, 0.5, 0.5);
+        }
+    }
+
     gl_Position = MVP * vec4(v_position, 1.0);
     gl_PointSize = max(1.0, 10.0 - gl_Position.z * 0.1);
 }
@@ -28,4 +56,3 @@ main()
 }
 
 #endif
-
@@ -0,0 +1,262 @@
+#include "magic_motion.h"
+#include <math.h>
+#include <stdio.h>
+#include <assert.h>
+
+// The per-voxel background models, and how points are classified against
+// them. Used by the classifier threads in magic_motion.cpp, and by the
+// offline evaluation and reprocessing tools, so all agree on what a
+// classifier does.
+
+#define BACKGROUND_PROBABILITY_TRESHOLD 0.25
+
+// The simple MOG classifier averages the point count of every voxel over
+// this many frames, and voxels that average more points are background
+#define MOG_DURATION (30 * 30)
+#define MOG_POINT_COUNT_TRESHOLD 25.0f
+
+// The naive classifier drops foreground points in voxels with fewer points
+#define NAIVE_MIN_FOREGROUND_POINTS 8
+
+typedef struct
+{
+    int indices[8];
+} Neighbours;
+
+// Get the indices of the 8 nearest neighbours of point
+static inline Neighbours
+_GetNeighbours(V3 point)
+{
+    // Get voxel index
+    int i = WORLD_TO_VOXEL(point);
+    // Get center position of that voxel
+    V3 v = VOXEL_TO_WORLD(i);
+    // Calc the offset from the point to the
+    // center of the containing voxel
+    V3 offset = SubV3(point, v);
+
+    // Get voxel space coordinates for the voxel
+    // (inverse of VOXEL_INDEX)
+    int x0 = i % NUM_VOXELS_X;
+    int y0 = (i / NUM_VOXELS_X) % NUM_VOXELS_Y;
+    int z0 = i / (NUM_VOXELS_X * NUM_VOXELS_Y);
+
+    if(offset.x < 0) --x0;
+    if(offset.y < 0) --y0;
+    if(offset.z < 0) --z0;
+
+    x0 = MAX(x0, 0);
+    y0 = MAX(y0, 0);
+    z0 = MAX(z0, 0);
+
+    int x1 = MIN(x0+1, NUM_VOXELS_X-1);
+    int y1 = MIN(y0+1, NUM_VOXELS_Y-1);
+    int z1 = MIN(z0+1, NUM_VOXELS_Z-1);
+
+    return (Neighbours){{
+        VOXEL_INDEX(x0, y0, z0),
+        VOXEL_INDEX(x0, y0, z1),
+        VOXEL_INDEX(x0, y1, z0),
+        VOXEL_INDEX(x0, y1, z1),
+        VOXEL_INDEX(x1, y0, z0),
+        VOXEL_INDEX(x1, y0, z1),
+        VOXEL_INDEX(x1, y1, z0),
+        VOXEL_INDEX(x1, y1, z1)
+    }};
+}
+
+// Get the probability of point being part of the background by interpolating
+// the probabilities of the 8 nearest neighbours
+static float
+_TrilinearlyInterpolate(V3 point, const float *background)
+{
+    float probability = 0;
+    Neighbours n = _GetNeighbours(point);
+
+    for(int i=0; i<8; ++i)
+    {
+        const int index = n.indices[i];
+        V3 voxel = VOXEL_TO_WORLD(index);
+        float weight = (1.0f - (fabs(point.x - voxel.x) / VOXEL_SIZE)) *
+                       (1.0f - (fabs(point.y - voxel.y) / VOXEL_SIZE)) *
+                       (1.0f - (fabs(point.z - voxel.z) / VOXEL_SIZE));
+
+        probability += weight * background[index];
+    }
+
+    return probability;
+}
+
+static inline bool
+_IsInVoxelGrid(V3 point)
+{
+    return fabs(point.x) < BOUNDING_BOX_X/2.0f &&
+           fabs(point.y) < BOUNDING_BOX_Y/2.0f &&
+           fabs(point.z) < BOUNDING_BOX_Z/2.0f;
+}
+
+// Returns TAG_FOREGROUND or TAG_BACKGROUND for a point inside the voxel grid
+static inline int
+_ClassifyPoint(V3 point, const float *background_model, float treshold)
+{
+    float background_probability = _TrilinearlyInterpolate(point, background_model);
+    return (background_probability < treshold) ? TAG_FOREGROUND : TAG_BACKGROUND;
+}
+
+// Calibration keeps the highest point count seen in every voxel
+static void
+_UpdateNaiveCalibration(float *max_point_counts, const Voxel *voxels)
+{
+    for(uint32_t i=0; i<NUM_VOXELS; ++i)
+    {
+        float point_count = (float)voxels[i].point_count;
+        /* Average: */
+        // avg_point_counts[i] = (avg_point_counts[i] * framenum +
+        //                        point_count) / (framenum+1);
+        /* Max: */
+        max_point_counts[i] = MAX(max_point_counts[i], point_count);
+    }
+}
+
+static void
+_FinishNaiveCalibration(const float *max_point_counts, float *background_model)
+{
+    for(uint32_t i=0; i<NUM_VOXELS; ++i)
+    {
+        background_model[i] = MIN(1.0f, max_point_counts[i]);
+    }
+}
+
+// framenum is the number of frames averaged so far. Update after classifying
+// a frame, so that every frame is classified against the model as it was
+// before the frame, as it would have been live
+static void
+_UpdateSimpleMOG(float *avg_point_counts, const Voxel *voxels, size_t framenum,
+                 int duration, float treshold, float *background_model)
+{
+    framenum = MIN(framenum, (size_t)duration-1);
+
+    for(size_t i=0; i<NUM_VOXELS; ++i)
+    {
+        float point_count = (float)voxels[i].point_count;
+        avg_point_counts[i] = (avg_point_counts[i] * framenum +
+                               point_count) / (framenum+1);
+
+        background_model[i] = (avg_point_counts[i] >= treshold) ? 1 : 0;
+    }
+}
+
+// Point counts only, as _ClassifyCloud makes them. Voxels must be cleared first
+static void
+_CountVoxelPoints(const V3 *positions, size_t num_points, Voxel *voxels)
+{
+    for(size_t i=0; i<num_points; ++i)
+    {
+        V3 point = positions[i];
+        if(_IsInVoxelGrid(point))
+        {
+            uint32_t voxel_index = WORLD_TO_VOXEL(point);
+            if(voxel_index < NUM_VOXELS)
+            {
+                ++voxels[voxel_index].point_count;
+            }
+        }
+    }
+}
+
+// Tags every point as foreground or background, and adds the points inside
+// the voxel grid to their voxels, which must be cleared first. Without a
+// background model, every point inside the grid is foreground. If occupied
+// is not NULL, the index of every voxel that gets a point is appended to it,
+// once, and num_occupied counts them. It must have room for NUM_VOXELS.
+// Returns how many points were tagged foreground.
+static size_t
+_ClassifyCloud(const V3 *positions, const ColorPixel *colors, MagicMotionTag *tags, size_t num_points,
+               const float *background_model, float treshold, Voxel *voxels,
+               uint32_t *occupied, unsigned int *num_occupied)
+{
+    size_t num_foreground = 0;
+    for(size_t i=0; i<num_points; ++i)
+    {
+        V3 point = positions[i];
+        ColorPixel color = colors[i];
+        int tag = (int)tags[i];
+
+        // Check if the point is within the voxel grid
+        if(_IsInVoxelGrid(point))
+        {
+            if(background_model)
+            {
+                tag |= _ClassifyPoint(point, background_model, treshold);
+            }
+            else
+            {
+                tag |= TAG_FOREGROUND;
+            }
+
+            tags[i] = (MagicMotionTag)tag;
+            num_foreground += (tag & TAG_FOREGROUND) != 0;
+
+            uint32_t voxel_index = WORLD_TO_VOXEL(point);
+            if(voxel_index < 0 || voxel_index >= NUM_VOXELS)
+            {
+                // NOTE(istarnion): I think this bug is fixed. Do some testing,
+                // and replace this with an assert
+                printf("WARNING: Point (%f, %f, %f) was transformed to voxel index %d\n",
+                       point.x, point.y, point.z, voxel_index);
+                continue;
+            }
+
+            Voxel *v = &voxels[voxel_index];
+            if(occupied && v->point_count == 0)
+            {
+                occupied[(*num_occupied)++] = voxel_index;
+            }
+
+            // Add the current points color into the running average
+            v->color.r = (uint8_t)((color.r + v->point_count * v->color.r) /
+                                   (v->point_count+1));
+            v->color.g = (uint8_t)((color.g + v->point_count * v->color.g) /
+                                   (v->point_count+1));
+            v->color.b = (uint8_t)((color.b + v->point_count * v->color.b) /
+                                   (v->point_count+1));
+
+            ++v->point_count;
+        }
+        else
+        {
+            tag |= TAG_BACKGROUND;
+            tags[i] = (MagicMotionTag)tag;
+        }
+    }
+
+    return num_foreground;
+}
+
+// The naive classifier needs some help with noise. Returns how many points
+// it moved to the background.
+static size_t
+_FilterSparseForeground(const V3 *positions, MagicMotionTag *tags, size_t num_points, const Voxel *voxels)
+{
+    size_t num_filtered = 0;
+    for(size_t i=0; i<num_points; ++i)
+    {
+        uint32_t tag = tags[i];
+        if(tag & TAG_FOREGROUND)
+        {
+            // If it has been tagged as foreground, it will be within the
+            // voxel bounds, so the voxel_index will always be within bounds
+            uint32_t voxel_index = WORLD_TO_VOXEL(positions[i]);
+            assert(voxel_index >= 0 && voxel_index < NUM_VOXELS);
+            if(voxels[voxel_index].point_count < NAIVE_MIN_FOREGROUND_POINTS)
+            {
+                tag |= TAG_BACKGROUND;
+                tag &= ~TAG_FOREGROUND;
+                tags[i] = (MagicMotionTag)tag;
+                ++num_filtered;
+            }
+        }
+    }
+
+    return num_filtered;
+}
@@ -0,0 +1,655 @@
+// The flight recorder keeps the last few seconds of capture in memory,
+// compressed, so they can be written to file after something interesting
+// happened. Expects miniz.c and recording_format.h to be included already.
+
+#include <time.h>
+
+#define MAX_FLIGHT_FRAMES 4096
+#define MAX_FLIGHT_BLOBS (MAX_SENSORS*2 + 3) // Color and depth per sensor, then the cloud
+
+typedef struct
+{
+    double timestamp;
+    size_t offset; // Into the arena
+    size_t size;
+    size_t num_points;
+    size_t blob_sizes[MAX_FLIGHT_BLOBS]; // Including the blob word
+} FlightFrame;
+
+// A raw frame waiting to be compressed
+typedef struct
+{
+    double timestamp;
+    ColorPixel *color_frames[MAX_SENSORS];
+    float *depth_frames[MAX_SENSORS];
+    V3 *positions;
+    ColorPixel *colors;
+    MagicMotionTag *tags;
+    size_t num_points;
+} FlightStaging;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} ArenaWriter;
+
+static struct
+{
+    bool active;
+    double seconds;
+    bool include_clouds;
+
+    const SensorInfo *sensors;
+    unsigned int num_sensors;
+
+    // Compressed frames are stored back to back in one big ring buffer, and
+    // the oldest ones are evicted to make room. Frames are numbered from the
+    // start of the recording, and kept in frames[index % MAX_FLIGHT_FRAMES].
+    uint8_t *arena;
+    size_t arena_size;
+    size_t arena_head;
+    FlightFrame *frames;
+    size_t first_frame;
+    size_t end_frame;
+    size_t frames_skipped;
+    pthread_mutex_t lock;
+
+    // The capture thread copies frames here for the compression thread.
+    // If it is still busy with the last one, the frame is skipped.
+    FlightStaging staging;
+    bool staging_full;
+    bool compressor_running;
+    pthread_cond_t staging_cond;
+    pthread_t compressor_thread;
+    tdefl_compressor *compressor;
+
+    // Frames in [dump_frame, dump_end) are being written to file, and can
+    // not be evicted until then
+    bool dumping;
+    bool dump_failed; // The last dump could not be written in full
+    size_t dump_frame;
+    size_t dump_end;
+    char dump_video_file[256];
+    char dump_cloud_file[256];
+    pthread_t dump_thread;
+    bool has_dump_thread; // Not joined yet
+} flight_recorder;
+
+static double
+_FlightClock(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1000000000.0;
+}
+
+static bool
+_IsFlightFramePinned(size_t index)
+{
+    return flight_recorder.dumping &&
+           index >= flight_recorder.dump_frame &&
+           index < flight_recorder.dump_end;
+}
+
+// Must hold the lock
+static bool
+_EvictOldestFlightFrame(void)
+{
+    if(flight_recorder.first_frame == flight_recorder.end_frame ||
+       _IsFlightFramePinned(flight_recorder.first_frame))
+    {
+        return false;
+    }
+
+    ++flight_recorder.first_frame;
+    return true;
+}
+
+// Finds room for size bytes in the arena, evicting frames as needed.
+// Must hold the lock.
+static bool
+_ReserveFlightArena(size_t size, size_t *offset)
+{
+    if(size > flight_recorder.arena_size)
+    {
+        return false;
+    }
+
+    while(true)
+    {
+        if(flight_recorder.end_frame - flight_recorder.first_frame >= MAX_FLIGHT_FRAMES)
+        {
+            if(!_EvictOldestFlightFrame())
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        if(flight_recorder.first_frame == flight_recorder.end_frame)
+        {
+            flight_recorder.arena_head = 0;
+            *offset = 0;
+            return true;
+        }
+
+        size_t head = flight_recorder.arena_head;
+        size_t tail = flight_recorder.frames[flight_recorder.first_frame % MAX_FLIGHT_FRAMES].offset;
+        if(head > tail)
+        {
+            // Free space at the end, and before the oldest frame
+            if(flight_recorder.arena_size - head >= size)
+            {
+                *offset = head;
+                return true;
+            }
+            else if(tail >= size)
+            {
+                *offset = 0;
+                return true;
+            }
+        }
+        else if(tail - head >= size)
+        {
+            *offset = head;
+            return true;
+        }
+
+        if(!_EvictOldestFlightFrame())
+        {
+            return false;
+        }
+    }
+}
+
+static mz_bool
+_PutFlightOutput(const void *data, int size, void *context)
+{
+    ArenaWriter *writer = (ArenaWriter *)context;
+    if(writer->size + size > writer->capacity)
+    {
+        return MZ_FALSE;
+    }
+
+    memcpy(writer->data + writer->size, data, size);
+    writer->size += size;
+    return MZ_TRUE;
+}
+
+// Writes the blob word and the deflated data. Returns the bytes written,
+// or 0 if it did not fit.
+static size_t
+_CompressFlightBlob(ArenaWriter *writer, const void *data, size_t size)
+{
+    if(writer->size + sizeof(size_t) > writer->capacity)
+    {
+        return 0;
+    }
+
+    size_t start = writer->size;
+    writer->size += sizeof(size_t);
+
+    tdefl_init(flight_recorder.compressor, _PutFlightOutput, writer, 0);
+    if(tdefl_compress_buffer(flight_recorder.compressor, data, size, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+    {
+        writer->size = start;
+        return 0;
+    }
+
+    size_t blob_word = BLOB_WORD(writer->size - start - sizeof(size_t), BLOB_DEFLATE);
+    memcpy(writer->data + start, &blob_word, sizeof(size_t));
+
+    return writer->size - start;
+}
+
+static size_t
+_FlightBlobBound(size_t size)
+{
+    return sizeof(size_t) + size + size/16 + 1024;
+}
+
+static void
+_CompressStagedFlightFrame(void)
+{
+    FlightStaging *staging = &flight_recorder.staging;
+
+    size_t raw_sizes[MAX_FLIGHT_BLOBS];
+    const void *raw_data[MAX_FLIGHT_BLOBS];
+    int num_blobs = 0;
+    for(unsigned int i=0; i<flight_recorder.num_sensors; ++i)
+    {
+        const SensorInfo *sensor = &flight_recorder.sensors[i];
+        raw_data[num_blobs] = staging->color_frames[i];
+        raw_sizes[num_blobs++] = sensor->color_stream_info.width*sensor->color_stream_info.height*sizeof(ColorPixel);
+        raw_data[num_blobs] = staging->depth_frames[i];
+        raw_sizes[num_blobs++] = sensor->depth_stream_info.width*sensor->depth_stream_info.height*sizeof(float);
+    }
+
+    if(flight_recorder.include_clouds)
+    {
+        raw_data[num_blobs] = staging->positions;
+        raw_sizes[num_blobs++] = staging->num_points*sizeof(V3);
+        raw_data[num_blobs] = staging->colors;
+        raw_sizes[num_blobs++] = staging->num_points*sizeof(ColorPixel);
+        raw_data[num_blobs] = staging->tags;
+        raw_sizes[num_blobs++] = staging->num_points*sizeof(MagicMotionTag);
+    }
+
+    size_t bound = 0;
+    for(int i=0; i<num_blobs; ++i)
+    {
+        bound += _FlightBlobBound(raw_sizes[i]);
+    }
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    size_t offset = 0;
+    bool reserved = _ReserveFlightArena(bound, &offset);
+    pthread_mutex_unlock(&flight_recorder.lock);
+
+    if(!reserved)
+    {
+        __atomic_fetch_add(&flight_recorder.frames_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // The reserved space is not part of any frame yet, so it is safe to
+    // write to without holding the lock
+    FlightFrame frame = {};
+    frame.timestamp = staging->timestamp;
+    frame.offset = offset;
+    frame.num_points = staging->num_points;
+
+    ArenaWriter writer = { flight_recorder.arena + offset, 0, bound };
+    for(int i=0; i<num_blobs; ++i)
+    {
+        frame.blob_sizes[i] = _CompressFlightBlob(&writer, raw_data[i], raw_sizes[i]);
+        if(frame.blob_sizes[i] == 0)
+        {
+            __atomic_fetch_add(&flight_recorder.frames_skipped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    frame.size = writer.size;
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    flight_recorder.frames[flight_recorder.end_frame % MAX_FLIGHT_FRAMES] = frame;
+    ++flight_recorder.end_frame;
+    flight_recorder.arena_head = offset + frame.size;
+
+    // Keep only the last few seconds
+    while(flight_recorder.frames[flight_recorder.first_frame % MAX_FLIGHT_FRAMES].timestamp < frame.timestamp - flight_recorder.seconds &&
+          _EvictOldestFlightFrame()) {}
+    pthread_mutex_unlock(&flight_recorder.lock);
+}
+
+static void *
+_FlightCompressorThread(void *userdata)
+{
+    while(true)
+    {
+        pthread_mutex_lock(&flight_recorder.lock);
+        while(flight_recorder.compressor_running && !flight_recorder.staging_full)
+        {
+            pthread_cond_wait(&flight_recorder.staging_cond, &flight_recorder.lock);
+        }
+
+        bool running = flight_recorder.compressor_running;
+        pthread_mutex_unlock(&flight_recorder.lock);
+
+        if(!running)
+        {
+            break;
+        }
+
+        _CompressStagedFlightFrame();
+
+        __atomic_store_n(&flight_recorder.staging_full, false, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+// Called at the end of MagicMotion_CaptureFrame, on the capture thread
+static void
+_AddFlightFrame(SensorFrame *frames, const V3 *positions, const ColorPixel *colors, const MagicMotionTag *tags, size_t num_points)
+{
+    if(!flight_recorder.active)
+    {
+        return;
+    }
+
+    if(__atomic_load_n(&flight_recorder.staging_full, __ATOMIC_ACQUIRE))
+    {
+        __atomic_fetch_add(&flight_recorder.frames_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for(unsigned int i=0; i<flight_recorder.num_sensors; ++i)
+    {
+        if(!frames[i].color_frame || !frames[i].depth_frame)
+        {
+            // A sensor dropped this frame
+            __atomic_fetch_add(&flight_recorder.frames_skipped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    FlightStaging *staging = &flight_recorder.staging;
+    staging->timestamp = _FlightClock();
+    for(unsigned int i=0; i<flight_recorder.num_sensors; ++i)
+    {
+        const SensorInfo *sensor = &flight_recorder.sensors[i];
+        memcpy(staging->color_frames[i], frames[i].color_frame,
+               sensor->color_stream_info.width*sensor->color_stream_info.height*sizeof(ColorPixel));
+        memcpy(staging->depth_frames[i], frames[i].depth_frame,
+               sensor->depth_stream_info.width*sensor->depth_stream_info.height*sizeof(float));
+    }
+
+    staging->num_points = 0;
+    if(flight_recorder.include_clouds)
+    {
+        staging->num_points = num_points;
+        memcpy(staging->positions, positions, num_points*sizeof(V3));
+        memcpy(staging->colors, colors, num_points*sizeof(ColorPixel));
+        memcpy(staging->tags, tags, num_points*sizeof(MagicMotionTag));
+    }
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    flight_recorder.staging_full = true;
+    pthread_cond_signal(&flight_recorder.staging_cond);
+    pthread_mutex_unlock(&flight_recorder.lock);
+}
+
+static void
+_WriteFlightHeader(FILE *f)
+{
+    fprintf(f, "%u sensors\n", flight_recorder.num_sensors);
+    for(unsigned int i=0; i<flight_recorder.num_sensors; ++i)
+    {
+        const SensorInfo *s = &flight_recorder.sensors[i];
+        fprintf(f, "%s %s %s\n", s->vendor, s->name, s->serial);
+        fprintf(f, "%d %d %f\n",
+                s->color_stream_info.width, s->color_stream_info.height,
+                s->color_stream_info.fov);
+        fprintf(f, "%d %d %f %f %f\n",
+                s->depth_stream_info.width, s->depth_stream_info.height,
+                s->depth_stream_info.fov,
+                s->depth_stream_info.min_depth,
+                s->depth_stream_info.max_depth);
+    }
+}
+
+static void *
+_FlightDumpThread(void *userdata)
+{
+    FILE *video_file = fopen(flight_recorder.dump_video_file, "wb");
+    FILE *cloud_file = NULL;
+    bool write_clouds = flight_recorder.include_clouds && flight_recorder.dump_cloud_file[0];
+    if(write_clouds)
+    {
+        cloud_file = fopen(flight_recorder.dump_cloud_file, "wb");
+    }
+
+    // NOTE(istarnion): The files are laid out as the video recorder in
+    // the launchpad writes them, so the recording interface and reprocess
+    // read them the same way. That means "frame N" before every sensor.
+    bool ok = true;
+    if(!video_file)
+    {
+        fprintf(stderr, "Failed to open %s for the flight recording\n", flight_recorder.dump_video_file);
+        ok = false;
+    }
+    else
+    {
+        _WriteFlightHeader(video_file);
+    }
+
+    if(write_clouds && !cloud_file)
+    {
+        fprintf(stderr, "Failed to open %s for the flight recording\n", flight_recorder.dump_cloud_file);
+        ok = false;
+    }
+
+    size_t frame_count = 0;
+    size_t end = flight_recorder.dump_end;
+    for(size_t index=flight_recorder.dump_frame; ok && index<end; ++index)
+    {
+        // Pinned frames are not touched by the compression thread
+        const FlightFrame *frame = &flight_recorder.frames[index % MAX_FLIGHT_FRAMES];
+        const uint8_t *blob = flight_recorder.arena + frame->offset;
+        ++frame_count;
+
+        int blob_index = 0;
+        for(unsigned int i=0; ok && i<flight_recorder.num_sensors; ++i)
+        {
+            size_t color_size = frame->blob_sizes[blob_index++];
+            size_t depth_size = frame->blob_sizes[blob_index++];
+            ok = fprintf(video_file, "frame %zu\ncolor\n", frame_count) > 0 &&
+                 fwrite(blob, 1, color_size, video_file) == color_size &&
+                 fputs("\ndepth\n", video_file) != EOF &&
+                 fwrite(blob+color_size, 1, depth_size, video_file) == depth_size &&
+                 fputs("\n", video_file) != EOF;
+
+            blob += color_size + depth_size;
+        }
+
+        if(ok && cloud_file)
+        {
+            ok = fprintf(cloud_file, "frame %zu %zu\n", frame_count, frame->num_points) > 0;
+            for(int i=0; ok && i<3; ++i)
+            {
+                size_t size = frame->blob_sizes[blob_index++];
+                ok = fwrite(blob, 1, size, cloud_file) == size;
+                blob += size;
+            }
+
+            ok = ok && fputs("\n", cloud_file) != EOF;
+        }
+
+        pthread_mutex_lock(&flight_recorder.lock);
+        flight_recorder.dump_frame = index+1;
+        pthread_mutex_unlock(&flight_recorder.lock);
+    }
+
+    if(video_file)
+    {
+        ok = ok && fwrite(&frame_count, sizeof(size_t), 1, video_file) == 1;
+        ok = (fclose(video_file) == 0) && ok;
+    }
+
+    if(cloud_file)
+    {
+        ok = ok && fwrite(&frame_count, sizeof(size_t), 1, cloud_file) == 1;
+        ok = (fclose(cloud_file) == 0) && ok;
+    }
+
+    if(ok)
+    {
+        printf("Wrote %zu frames of flight recording to %s\n", frame_count, flight_recorder.dump_video_file);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to write the flight recording to %s\n", flight_recorder.dump_video_file);
+    }
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    flight_recorder.dump_failed = !ok;
+    flight_recorder.dumping = false;
+    pthread_mutex_unlock(&flight_recorder.lock);
+
+    return NULL;
+}
+
+static bool
+_StartFlightRecorder(const SensorInfo *sensors, unsigned int num_sensors, size_t cloud_capacity,
+                     float seconds, size_t max_bytes, bool include_clouds)
+{
+    if(flight_recorder.active || seconds <= 0 || max_bytes == 0)
+    {
+        return false;
+    }
+
+    memset(&flight_recorder, 0, sizeof(flight_recorder));
+    flight_recorder.seconds = seconds;
+    flight_recorder.include_clouds = include_clouds;
+    flight_recorder.sensors = sensors;
+    flight_recorder.num_sensors = num_sensors;
+
+    flight_recorder.arena = (uint8_t *)malloc(max_bytes);
+    flight_recorder.frames = (FlightFrame *)calloc(MAX_FLIGHT_FRAMES, sizeof(FlightFrame));
+    flight_recorder.compressor = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+    if(!flight_recorder.arena || !flight_recorder.frames || !flight_recorder.compressor)
+    {
+        fprintf(stderr, "Failed to allocate %zu bytes for the flight recorder\n", max_bytes);
+        free(flight_recorder.arena);
+        free(flight_recorder.frames);
+        free(flight_recorder.compressor);
+        return false;
+    }
+
+    flight_recorder.arena_size = max_bytes;
+
+    FlightStaging *staging = &flight_recorder.staging;
+    for(unsigned int i=0; i<num_sensors; ++i)
+    {
+        const SensorInfo *sensor = &sensors[i];
+        staging->color_frames[i] = (ColorPixel *)malloc(sensor->color_stream_info.width*sensor->color_stream_info.height*sizeof(ColorPixel));
+        staging->depth_frames[i] = (float *)malloc(sensor->depth_stream_info.width*sensor->depth_stream_info.height*sizeof(float));
+    }
+
+    if(include_clouds)
+    {
+        staging->positions = (V3 *)malloc(cloud_capacity*sizeof(V3));
+        staging->colors = (ColorPixel *)malloc(cloud_capacity*sizeof(ColorPixel));
+        staging->tags = (MagicMotionTag *)malloc(cloud_capacity*sizeof(MagicMotionTag));
+    }
+
+    pthread_mutex_init(&flight_recorder.lock, NULL);
+    pthread_cond_init(&flight_recorder.staging_cond, NULL);
+    flight_recorder.compressor_running = true;
+    pthread_create(&flight_recorder.compressor_thread, NULL, _FlightCompressorThread, NULL);
+
+    flight_recorder.active = true;
+
+    return true;
+}
+
+static void
+_StopFlightRecorder(void)
+{
+    if(!flight_recorder.active)
+    {
+        return;
+    }
+
+    flight_recorder.active = false;
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    flight_recorder.compressor_running = false;
+    pthread_cond_signal(&flight_recorder.staging_cond);
+    pthread_mutex_unlock(&flight_recorder.lock);
+
+    pthread_join(flight_recorder.compressor_thread, NULL);
+    if(flight_recorder.has_dump_thread)
+    {
+        pthread_join(flight_recorder.dump_thread, NULL);
+    }
+
+    pthread_cond_destroy(&flight_recorder.staging_cond);
+    pthread_mutex_destroy(&flight_recorder.lock);
+
+    FlightStaging *staging = &flight_recorder.staging;
+    for(unsigned int i=0; i<flight_recorder.num_sensors; ++i)
+    {
+        free(staging->color_frames[i]);
+        free(staging->depth_frames[i]);
+    }
+
+    free(staging->positions);
+    free(staging->colors);
+    free(staging->tags);
+    free(flight_recorder.compressor);
+    free(flight_recorder.frames);
+    free(flight_recorder.arena);
+
+    memset(&flight_recorder, 0, sizeof(flight_recorder));
+}
+
+static bool
+_DumpFlightRecording(const char *video_file, const char *cloud_file)
+{
+    if(!flight_recorder.active)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    bool busy = flight_recorder.dumping;
+    pthread_mutex_unlock(&flight_recorder.lock);
+
+    if(busy)
+    {
+        return false;
+    }
+
+    // The previous dump thread has finished, but has not been joined
+    if(flight_recorder.has_dump_thread)
+    {
+        pthread_join(flight_recorder.dump_thread, NULL);
+        flight_recorder.has_dump_thread = false;
+    }
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    snprintf(flight_recorder.dump_video_file, sizeof(flight_recorder.dump_video_file), "%s", video_file);
+    snprintf(flight_recorder.dump_cloud_file, sizeof(flight_recorder.dump_cloud_file), "%s", cloud_file ? cloud_file : "");
+    flight_recorder.dump_frame = flight_recorder.first_frame;
+    flight_recorder.dump_end = flight_recorder.end_frame;
+    flight_recorder.dumping = true;
+    flight_recorder.dump_failed = false;
+    pthread_mutex_unlock(&flight_recorder.lock);
+
+    if(pthread_create(&flight_recorder.dump_thread, NULL, _FlightDumpThread, NULL) != 0)
+    {
+        pthread_mutex_lock(&flight_recorder.lock);
+        flight_recorder.dumping = false;
+        pthread_mutex_unlock(&flight_recorder.lock);
+        return false;
+    }
+
+    flight_recorder.has_dump_thread = true;
+    return true;
+}
+
+static void
+_GetFlightRecorderStatus(FlightRecorderStatus *status)
+{
+    memset(status, 0, sizeof(FlightRecorderStatus));
+    if(!flight_recorder.active)
+    {
+        return;
+    }
+
+    status->active = true;
+    status->frames_skipped = __atomic_load_n(&flight_recorder.frames_skipped, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&flight_recorder.lock);
+    status->dumping = flight_recorder.dumping;
+    status->dump_failed = flight_recorder.dump_failed;
+    status->num_frames = (unsigned int)(flight_recorder.end_frame - flight_recorder.first_frame);
+    for(size_t i=flight_recorder.first_frame; i<flight_recorder.end_frame; ++i)
+    {
+        status->bytes_used += flight_recorder.frames[i % MAX_FLIGHT_FRAMES].size;
+    }
+
+    if(status->num_frames > 0)
+    {
+        const FlightFrame *first = &flight_recorder.frames[flight_recorder.first_frame % MAX_FLIGHT_FRAMES];
+        const FlightFrame *last = &flight_recorder.frames[(flight_recorder.end_frame-1) % MAX_FLIGHT_FRAMES];
+        status->seconds_held = (float)(last->timestamp - first->timestamp);
+    }
+    pthread_mutex_unlock(&flight_recorder.lock);
+}
@@ -10,6 +10,15 @@
 #include <opencv2/bgsegm.hpp>
 #endif
 
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ARCHIVE_WRITING_APIS
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "miniz.c"
+#include "recording_format.cpp"
+
 #ifdef SENSOR_REALSENSE
 #include "sensor_interface_realsense.cpp"
 #elif defined(SENSOR_OPENNI)
@@ -22,6 +31,7 @@
 #include "sensor_serialization.cpp"
 
 #include "magic_motion.h"
+#include "occupancy_history.cpp"
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,8 +45,6 @@ extern "C" {
 #define MM_TRACE(title)
 #endif
 
-#define BACKGROUND_PROBABILITY_TRESHOLD 0.25
-
 // The 3D classifiers create a voxel grid
 // background model each point in the cloud
 // can get it's background probability from
@@ -102,80 +110,21 @@ static struct
     unsigned int cloud_capacity; // The maximum number of points in the cloud
 
     Voxel voxels[NUM_VOXELS];    // The voxel grid, with the lastest information
+    uint32_t occupied_voxels[NUM_VOXELS]; // Indices of the voxels with points in them
+    unsigned int num_occupied_voxels;
+    MagicMotionQueryGrid query_grid;
+    OccupancyHistory occupancy_history;
+    FrameStatsHistory frame_stats;
 
     // Thread userdata
     ClassifierData3D classifier_thread_3D;
     ClassifierData2D classifier_thread_2D;
 } magic_motion;
 
-typedef struct
-{
-    int indices[8];
-} Neighbours;
-
-// Get the indices of the 8 nearest neighbours of point
-static inline Neighbours
-_GetNeighbours(V3 point)
-{
-    // Get voxel index
-    int i = WORLD_TO_VOXEL(point);
-    // Get center position of that voxel
-    V3 v = VOXEL_TO_WORLD(i);
-    // Calc the offset from the point to the
-    // center of the containing voxel
-    V3 offset = SubV3(point, v);
-
-    // Get voxel space coordinates for the voxel
-    // (inverse of VOXEL_INDEX)
-    int x0 = i % NUM_VOXELS_X;
-    int y0 = (i / NUM_VOXELS_X) % NUM_VOXELS_Y;
-    int z0 = i / (NUM_VOXELS_X * NUM_VOXELS_Y);
-
-    if(offset.x < 0) --x0;
-    if(offset.y < 0) --y0;
-    if(offset.z < 0) --z0;
-
-    x0 = MAX(x0, 0);
-    y0 = MAX(y0, 0);
-    z0 = MAX(z0, 0);
-
-    int x1 = MIN(x0+1, NUM_VOXELS_X-1);
-    int y1 = MIN(y0+1, NUM_VOXELS_Y-1);
-    int z1 = MIN(z0+1, NUM_VOXELS_Z-1);
-
-    return (Neighbours){{
-        VOXEL_INDEX(x0, y0, z0),
-        VOXEL_INDEX(x0, y0, z1),
-        VOXEL_INDEX(x0, y1, z0),
-        VOXEL_INDEX(x0, y1, z1),
-        VOXEL_INDEX(x1, y0, z0),
-        VOXEL_INDEX(x1, y0, z1),
-        VOXEL_INDEX(x1, y1, z0),
-        VOXEL_INDEX(x1, y1, z1)
-    }};
-}
-
-// Get the probability of point being part of the background by interpolating
-// the probabilities of the 8 nearest neighbours
-float
-_TrilinearlyInterpolate(V3 point, float *background)
-{
-    float probability = 0;
-    Neighbours n = _GetNeighbours(point);
-
-    for(int i=0; i<8; ++i)
-    {
-        const int index = n.indices[i];
-        V3 voxel = VOXEL_TO_WORLD(index);
-        float weight = (1.0f - (fabs(point.x - voxel.x) / VOXEL_SIZE)) *
-                       (1.0f - (fabs(point.y - voxel.y) / VOXEL_SIZE)) *
-                       (1.0f - (fabs(point.z - voxel.z) / VOXEL_SIZE));
-
-        probability += weight * background[index];
-    }
-
-    return probability;
-}
+#include "flight_recorder.cpp"
+#include "background_model.cpp"
+#include "point_cloud.cpp"
+#include "voxel_queries.cpp"
 
 // Prototype of the functions that will run in a background thread and
 // compute the background model.
@@ -284,13 +233,7 @@ MagicMotion_Initialize(void)
             printf("Initialized %s %s (URI: %s).\n", sensor->vendor, sensor->name, sensor->URI);
         }
 
-        magic_motion.sensor_frustums[i] = (Frustum){
-            .transform = IdentityMat4(),
-            .fov = sensor->depth_stream_info.fov,
-            .aspect = sensor->depth_stream_info.aspect_ratio,
-            .near_plane = MAX(0.05f, sensor->depth_stream_info.min_depth / 100.0f),
-            .far_plane = sensor->depth_stream_info.max_depth / 100.0f
-        };
+        magic_motion.sensor_frustums[i] = _DefaultFrustum(sensor);
 
         magic_motion.sensor_frames[i].color_frame = (ColorPixel *)calloc(sensor->color_stream_info.width * sensor->color_stream_info.height, sizeof(ColorPixel));
         magic_motion.sensor_masks[i] = (float *)malloc(sensor->depth_stream_info.width *
@@ -398,6 +341,8 @@ void
 MagicMotion_Finalize(void)
 {
     MM_TRACE("Finalizing");
+    _StopFlightRecorder();
+
     if(magic_motion.classifier_thread_3D.running)
     {
         magic_motion.classifier_thread_3D.running = false;
@@ -489,8 +434,15 @@ MagicMotion_CaptureFrame(void)
     // so we need to take the mutex up here, and do the 2D classification
     // during rendering / other work
 
+    FrameStatsHistory *history = &magic_motion.frame_stats;
+    FrameStats *stats = &history->frames[(history->newest+1) % FRAME_STATS_HISTORY_LENGTH];
+    memset(stats, 0, sizeof(FrameStats));
+    Timinginfo timing = StartTiming();
+    Timinginfo frame_start = timing;
+
     pthread_mutex_lock(&magic_motion.classifier_thread_2D.mutex_handle);
     MM_TRACE("Got the 2D mutex");
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_MUTEX_WAIT], &stats->cpu_ns[FRAME_STAGE_MUTEX_WAIT]);
 
     for(size_t i=0; i<magic_motion.num_active_sensors; ++i)
     {
@@ -501,11 +453,20 @@ MagicMotion_CaptureFrame(void)
         MM_TRACE("Got depth frame");
     }
 
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_SENSORS], &stats->cpu_ns[FRAME_STAGE_SENSORS]);
+
     pthread_mutex_lock(&magic_motion.classifier_thread_3D.mutex_handle);
     MM_TRACE("Got 3D mutex");
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_MUTEX_WAIT], &stats->cpu_ns[FRAME_STAGE_MUTEX_WAIT]);
 
     magic_motion.cloud_size = 0;
-    memset(magic_motion.voxels, 0, NUM_VOXELS*sizeof(Voxel));
+
+    // Only the voxels that got points last frame need clearing
+    for(unsigned int i=0; i<magic_motion.num_occupied_voxels; ++i)
+    {
+        memset(&magic_motion.voxels[magic_motion.occupied_voxels[i]], 0, sizeof(Voxel));
+    }
+    magic_motion.num_occupied_voxels = 0;
     ++magic_motion.frame_count;
 
     for(unsigned int i=0; i<magic_motion.num_active_sensors; ++i)
@@ -514,160 +475,87 @@ MagicMotion_CaptureFrame(void)
         SensorInfo *sensor = &magic_motion.sensors[i];
         ColorPixel *colors = magic_motion.sensor_frames[i].color_frame;
         DepthPixel *depths = magic_motion.sensor_frames[i].depth_frame;
-
-        // NOTE(istarnion): The color and depth streams does often
-        // NOT have the same resolution, especially with image
-        // registration enabled, but depth resolution is always
-        // smaller than color resolution.
-        assert(sensor->depth_stream_info.width <= sensor->color_stream_info.width);
-        assert(sensor->depth_stream_info.height <= sensor->color_stream_info.height);
-
-        const unsigned int w = sensor->depth_stream_info.width;
-        const unsigned int h = sensor->depth_stream_info.height;
-        const unsigned int color_w = sensor->color_stream_info.width;
-        const unsigned int color_h = sensor->color_stream_info.height;
-
-        const float fov = sensor->depth_stream_info.fov;
-        const float aspect = sensor->depth_stream_info.aspect_ratio;
-
-        const Frustum f = magic_motion.sensor_frustums[i];
-        const Mat4 camera_transform = f.transform;
-
-        Timinginfo timing = StartTiming();
-
-        for(uint32_t y=0; y<h; ++y)
+        if(!depths)
         {
-            for(uint32_t x=0; x<w; ++x)
-            {
-                float depth = depths[x+y*w];
-                // float mask = magic_motion.sensor_masks[i][x+y*w];
-                if(depth > 0.0f)
-                {
-                    float pos_x = tanf((((float)x/(float)w)-0.5f)*fov) * depth;
-                    float pos_y = tanf((0.5f-((float)y / (float)h))*(fov/aspect)) * depth;
-
-                    // Convert from mm to dm as we create the point
-                    V3 point = MulMat4Vec3(camera_transform,
-                                           (V3){ pos_x / 100.0f,
-                                                 pos_y / 100.0f,
-                                                 depth / 100.0f });
-
-                    ColorPixel color = colors[(color_w/2-w/2+x)+(color_h/2-h/2+y)*color_w];
+            // The sensor gave up waiting for a frame
+            ++stats->num_dropped;
+            continue;
+        }
 
-                    int tag = (TAG_CAMERA_0 + i);
+        size_t cloud_size = magic_motion.cloud_size;
+        magic_motion.cloud_size += _ProjectDepthFrame(sensor, &magic_motion.sensor_frustums[i],
+                                                      depths, colors, (TAG_CAMERA_0 + i),
+                                                      magic_motion.spatial_cloud + cloud_size,
+                                                      magic_motion.color_cloud + cloud_size,
+                                                      magic_motion.tag_cloud + cloud_size);
+    }
 
-                    // Add to point clouds
-                    unsigned int index = magic_motion.cloud_size++;
-                    magic_motion.spatial_cloud[index] = point;
-                    magic_motion.color_cloud[index] = color;
-                    magic_motion.tag_cloud[index] = (MagicMotionTag)tag;
-                }
-            }
-        }
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_PROJECTION], &stats->cpu_ns[FRAME_STAGE_PROJECTION]);
 
-        EndTimingAndPrint(&timing, "Cloud computation");
+    // Determine if the points are background or foreground
+    const float *background_model = magic_motion.background_model;
+    if(classifier3D == CLASSIFIER_3D_NONE && classifier2D == CLASSIFIER_2D_NONE)
+    {
+        // If we are not using any classifiers, we just set every tag to foreground.
+        // Some applications don't use MM for background subtraction, and shouldn't
+        // have to pay for it.
+        background_model = NULL;
+    }
+    else if(magic_motion.classifier_thread_3D.is_calibrating)
+    {
+        background_model = NULL;
     }
 
-    Timinginfo timing = StartTiming();
+    /* mask is computed per point, but we don't store it in a "cloud",
+     * as it is quite useless on its own. we _could_ store a temp cloud
+     * on the stack so we can use this again.
+    const float mix = 0.2f; // 0 is only background model, 1 is only sensor mask
+    background_probability = LERP(background_probability, (1.0f - mask), mix);
+    */
 
-    for(size_t i=0; i<magic_motion.cloud_size; ++i)
+    size_t num_foreground = _ClassifyCloud(magic_motion.spatial_cloud, magic_motion.color_cloud,
+                                           magic_motion.tag_cloud, magic_motion.cloud_size,
+                                           background_model, BACKGROUND_PROBABILITY_TRESHOLD,
+                                           magic_motion.voxels, magic_motion.occupied_voxels,
+                                           &magic_motion.num_occupied_voxels);
+
+    // The naive classifier needs some help with noise
+    if(classifier3D == CLASSIFIER_3D_CALIBRATION_NAIVE)
     {
-        V3 point = magic_motion.spatial_cloud[i];
-        ColorPixel color = magic_motion.color_cloud[i];
-        int tag = (int)magic_motion.tag_cloud[i];
-
-        // Check if the point is within the voxel grid
-        if(fabs(point.x) < BOUNDING_BOX_X/2.0f &&
-           fabs(point.y) < BOUNDING_BOX_Y/2.0f &&
-           fabs(point.z) < BOUNDING_BOX_Z/2.0f)
-        {
-            // Determine if the point is background or foreground
-            if(classifier3D == CLASSIFIER_3D_NONE && classifier2D == CLASSIFIER_2D_NONE)
-            {
-                // If we are not using any classifiers, we just set every tag to foreground.
-                // Some applications don't use MM for background subtraction, and shouldn't
-                // have to pay for it.
-                tag |= TAG_FOREGROUND;
-            }
-            else
-            {
-                #if 1
-                float background_probability = _TrilinearlyInterpolate(point, magic_motion.background_model);
-                #else
-                // Skip trilinear interpolation, and use nearest voxel instead:
-                float background_probability = magic_motion.background_data.background[voxel_index];
-                #endif
-
-                /* mask is computed per point, but we don't store it in a "cloud",
-                 * as it is quite useless on its own. we _could_ store a temp cloud
-                 * on the stack so we can use this again.
-                const float mix = 0.2f; // 0 is only background model, 1 is only sensor mask
-                background_probability = LERP(background_probability, (1.0f - mask), mix);
-                */
-
-                if(background_probability < BACKGROUND_PROBABILITY_TRESHOLD ||
-                   magic_motion.classifier_thread_3D.is_calibrating)
-                {
-                    tag |= TAG_FOREGROUND;
-                }
-                else
-                {
-                    tag |= TAG_BACKGROUND;
-                }
-            }
+        num_foreground -= _FilterSparseForeground(magic_motion.spatial_cloud, magic_motion.tag_cloud,
+                                                  magic_motion.cloud_size, magic_motion.voxels);
+    }
 
-            uint32_t voxel_index = WORLD_TO_VOXEL(point);
-            if(voxel_index < 0 || voxel_index >= NUM_VOXELS)
-            {
-                // NOTE(istarnion): I think this bug is fixed. Do some testing,
-                // and replace this with an assert
-                printf("WARNING: Point (%f, %f, %f) was transformed to voxel index %d\n",
-                       point.x, point.y, point.z, voxel_index);
-                continue;
-            }
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_CLASSIFICATION], &stats->cpu_ns[FRAME_STAGE_CLASSIFICATION]);
 
-            Voxel *v = &magic_motion.voxels[voxel_index];
+    MagicMotion_BuildQueryGrid(&magic_motion.query_grid, magic_motion.voxels,
+                               magic_motion.occupied_voxels, magic_motion.num_occupied_voxels, 1);
+    _PushOccupancy(&magic_motion.occupancy_history,
+                   magic_motion.occupied_voxels, magic_motion.num_occupied_voxels);
 
-            // Add the current points color into the running average
-            v->color.r = (uint8_t)((color.r + v->point_count * v->color.r) /
-                                   (v->point_count+1));
-            v->color.g = (uint8_t)((color.g + v->point_count * v->color.g) /
-                                   (v->point_count+1));
-            v->color.b = (uint8_t)((color.b + v->point_count * v->color.b) /
-                                   (v->point_count+1));
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_QUERIES], &stats->cpu_ns[FRAME_STAGE_QUERIES]);
 
-            ++v->point_count;
-        }
-        else
-        {
-            tag |= TAG_BACKGROUND;
-        }
-    }
+    _AddFlightFrame(magic_motion.sensor_frames, magic_motion.spatial_cloud,
+                    magic_motion.color_cloud, magic_motion.tag_cloud,
+                    magic_motion.cloud_size);
 
-    EndTimingAndPrint(&timing, "Voxel computation");
+    LapTiming(&timing, &stats->wall_ns[FRAME_STAGE_FLIGHT_RECORDER], &stats->cpu_ns[FRAME_STAGE_FLIGHT_RECORDER]);
 
-    // The naive classifier needs some help with noise
-    if(classifier3D == CLASSIFIER_3D_CALIBRATION_NAIVE)
+    stats->frame = magic_motion.frame_count;
+    stats->total_wall_ns = timing.wall - frame_start.wall;
+    stats->total_cpu_ns = timing.cpu - frame_start.cpu;
+    stats->num_points = magic_motion.cloud_size;
+    stats->num_foreground = num_foreground;
+    stats->num_occupied_voxels = magic_motion.num_occupied_voxels;
+    for(unsigned int i=0; i<magic_motion.num_occupied_voxels; ++i)
     {
-        for(int i=0; i<magic_motion.cloud_size; ++i)
-        {
-            uint32_t tag = magic_motion.tag_cloud[i];
-            if(tag & TAG_FOREGROUND)
-            {
-                // If it has been tagged as foreground, it will be within the
-                // voxel bounds, so the voxel_index will always be within bounds
-                uint32_t voxel_index = WORLD_TO_VOXEL(magic_motion.spatial_cloud[i]);
-                assert(voxel_index >= 0 && voxel_index < NUM_VOXELS);
-                if(magic_motion.voxels[voxel_index].point_count < 8)
-                {
-                    tag |= TAG_BACKGROUND;
-                    tag &= ~TAG_FOREGROUND;
-                    magic_motion.tag_cloud[i] = (MagicMotionTag)tag;
-                }
-            }
-        }
+        stats->num_points_in_bounds += magic_motion.voxels[magic_motion.occupied_voxels[i]].point_count;
     }
 
+    history->newest = (history->newest+1) % FRAME_STATS_HISTORY_LENGTH;
+    history->num_frames = MIN(history->num_frames+1, FRAME_STATS_HISTORY_LENGTH);
+    history->total_dropped += stats->num_dropped;
+
     pthread_mutex_unlock(&magic_motion.classifier_thread_3D.mutex_handle);
     pthread_mutex_unlock(&magic_motion.classifier_thread_2D.mutex_handle);
 
@@ -732,6 +620,70 @@ MagicMotion_GetVoxels(void)
     return magic_motion.voxels;
 }
 
+unsigned int
+MagicMotion_GetNumOccupiedVoxels(void)
+{
+    return magic_motion.num_occupied_voxels;
+}
+
+const uint32_t *
+MagicMotion_GetOccupiedVoxels(void)
+{
+    return magic_motion.occupied_voxels;
+}
+
+const MagicMotionQueryGrid *
+MagicMotion_GetQueryGrid(void)
+{
+    return &magic_motion.query_grid;
+}
+
+unsigned int
+MagicMotion_GetOccupancyHistoryLength(void)
+{
+    return magic_motion.occupancy_history.num_frames;
+}
+
+void
+MagicMotion_GetOccupancyWindow(unsigned int frames, unsigned int min_frames, uint64_t *mask)
+{
+    _OccupancyWindow(&magic_motion.occupancy_history, frames, min_frames, mask);
+}
+
+const uint64_t *
+MagicMotion_GetOccupancyFrame(unsigned int age)
+{
+    return _OccupancyFrame(&magic_motion.occupancy_history, age);
+}
+
+void
+MagicMotion_CombineOccupancy(const uint64_t *const *frames, unsigned int num_frames,
+                             unsigned int min_frames, uint64_t *mask)
+{
+    _CombineOccupancy(frames, num_frames, min_frames, mask);
+}
+
+const FrameStatsHistory *
+MagicMotion_GetFrameStats(void)
+{
+    return &magic_motion.frame_stats;
+}
+
+const char *
+MagicMotion_GetFrameStageName(FrameStage stage)
+{
+    switch(stage)
+    {
+        case FRAME_STAGE_SENSORS:         return "Sensors";
+        case FRAME_STAGE_MUTEX_WAIT:      return "Mutex wait";
+        case FRAME_STAGE_PROJECTION:      return "Projection";
+        case FRAME_STAGE_CLASSIFICATION:  return "Classification";
+        case FRAME_STAGE_QUERIES:         return "Queries";
+        case FRAME_STAGE_FLIGHT_RECORDER: return "Flight recorder";
+        default:                          return "Unknown";
+    }
+}
+
 static void *
 _ComputeBackgroundModelNaiveCalibration(void *userdata)
 {
@@ -743,7 +695,6 @@ _ComputeBackgroundModelNaiveCalibration(void *userdata)
     // Buffer to store average point counts per voxel during calibration
     float *avg_point_counts = (float *)malloc(NUM_VOXELS * sizeof(float));
     bool was_calibrating_last_frame = false;
-    unsigned int calibration_start_frame = 0;
 
     while(data->running)
     {
@@ -758,23 +709,12 @@ _ComputeBackgroundModelNaiveCalibration(void *userdata)
             if(!was_calibrating_last_frame)
             {
                 // This is the first frame of the calibration
-                calibration_start_frame = frame_count;
                 memset(avg_point_counts, 0, NUM_VOXELS * sizeof(float));
                 memset(magic_motion.background_model, 0, NUM_VOXELS * sizeof(float));
                 was_calibrating_last_frame = true;
             }
 
-            unsigned int framenum = frame_count - calibration_start_frame;
-
-            for(uint32_t i=0; i<NUM_VOXELS; ++i)
-            {
-                float point_count = (float)latest_frame[i].point_count;
-                /* Average: */
-                // avg_point_counts[i] = (avg_point_counts[i] * framenum +
-                //                        point_count) / (framenum+1);
-                /* Max: */
-                avg_point_counts[i] = MAX(avg_point_counts[i], point_count);
-            }
+            _UpdateNaiveCalibration(avg_point_counts, latest_frame);
         }
         else
         {
@@ -782,13 +722,7 @@ _ComputeBackgroundModelNaiveCalibration(void *userdata)
             {
                 // This is the first frame after we stop calibrating
                 pthread_mutex_lock(&data->mutex_handle);
-
-                for(uint32_t i=0; i<NUM_VOXELS; ++i)
-                {
-                    float background_prob = MIN(1.0f, avg_point_counts[i]);
-                    magic_motion.background_model[i] = background_prob;
-                }
-
+                _FinishNaiveCalibration(avg_point_counts, magic_motion.background_model);
                 pthread_mutex_unlock(&data->mutex_handle);
             }
 
@@ -815,9 +749,6 @@ _ComputeBackgroundModelSimpleMOG(void *userdata)
     // Buffer to store average point counts per voxel during calibration
     float *avg_point_counts = (float *)calloc(NUM_VOXELS, sizeof(float));
 
-    static const int duration = 30 * 30;
-    static const float treshold = 25.0f;
-
     size_t last_frame_count = 0;
 
     while(data->running)
@@ -837,21 +768,8 @@ _ComputeBackgroundModelSimpleMOG(void *userdata)
         // Get last frame voxel grid.
         memcpy(latest_frame, magic_motion.voxels, NUM_VOXELS * sizeof(Voxel));
 
-        size_t framenum = MIN(frame_count, duration-1);
-
-        for(size_t i=0; i<NUM_VOXELS; ++i)
-        {
-            float point_count = (float)latest_frame[i].point_count;
-            avg_point_counts[i] = (avg_point_counts[i] * framenum +
-                                   point_count) / (framenum+1);
-
-            float background_prob = (avg_point_counts[i] >= treshold) ? 1 : 0;
-            magic_motion.background_model[i] = background_prob;
-
-            // if(point_count > 0) printf("(%d, %f)", (int)point_count, avg_point_counts[i]);
-        }
-
-        // putc('\n', stdout);
+        _UpdateSimpleMOG(avg_point_counts, latest_frame, frame_count,
+                         MOG_DURATION, MOG_POINT_COUNT_TRESHOLD, magic_motion.background_model);
 
         pthread_mutex_unlock(&data->mutex_handle);
         sched_yield();
@@ -1007,7 +925,32 @@ MagicMotion_IsCalibrating(void)
     return magic_motion.classifier_thread_3D.is_calibrating;
 }
 
+bool
+MagicMotion_StartFlightRecorder(float seconds, size_t max_bytes, bool include_clouds)
+{
+    return _StartFlightRecorder(magic_motion.sensors, magic_motion.num_active_sensors,
+                                magic_motion.cloud_capacity,
+                                seconds, max_bytes, include_clouds);
+}
+
+void
+MagicMotion_StopFlightRecorder(void)
+{
+    _StopFlightRecorder();
+}
+
+bool
+MagicMotion_DumpFlightRecording(const char *video_file, const char *cloud_file)
+{
+    return _DumpFlightRecording(video_file, cloud_file);
+}
+
+void
+MagicMotion_GetFlightRecorderStatus(FlightRecorderStatus *status)
+{
+    _GetFlightRecorderStatus(status);
+}
+
 #ifdef __cplusplus
 }
 #endif
-
@@ -91,10 +91,182 @@ MagicMotionTag *MagicMotion_GetTags(void);
 
 Voxel *MagicMotion_GetVoxels(void); // Return the full voxel grid as an array of length NUM_VOXELS
 
+// The indices into the voxel grid of every voxel with at least one point in
+// it, in no particular order. Walk these instead of the whole grid.
+unsigned int MagicMotion_GetNumOccupiedVoxels(void);
+const uint32_t *MagicMotion_GetOccupiedVoxels(void);
+
+// A voxel grid made ready for queries. It keeps a mask of which bricks of
+// QUERY_BRICK_SIZE^3 voxels have occupied voxels, so queries skip empty
+// space a brick at a time. A voxel is occupied if it has at least
+// min_point_count points.
+#define QUERY_BRICK_SIZE 4
+#define QUERY_BRICKS_X ((NUM_VOXELS_X+QUERY_BRICK_SIZE-1)/QUERY_BRICK_SIZE)
+#define QUERY_BRICKS_Y ((NUM_VOXELS_Y+QUERY_BRICK_SIZE-1)/QUERY_BRICK_SIZE)
+#define QUERY_BRICKS_Z ((NUM_VOXELS_Z+QUERY_BRICK_SIZE-1)/QUERY_BRICK_SIZE)
+#define NUM_QUERY_BRICKS (QUERY_BRICKS_X*QUERY_BRICKS_Y*QUERY_BRICKS_Z)
+
+typedef struct
+{
+    const Voxel *voxels;
+    const uint64_t *mask; // If not NULL, the occupied voxels, a bit each, and voxels is not used
+    uint32_t min_point_count;
+    uint8_t bricks[(NUM_QUERY_BRICKS+7)/8]; // One bit per brick
+} MagicMotionQueryGrid;
+
+typedef struct
+{
+    V3 origin;
+    V3 direction; // Need not be normalized
+    float max_distance;
+} MagicMotionRay;
+
+typedef struct
+{
+    bool hit;
+    float distance; // Along the ray, to where it enters the voxel
+    V3 point;
+    uint32_t voxel;
+} MagicMotionRayHit;
+
+typedef struct
+{
+    V3 center;
+    float radius;
+} MagicMotionSphere;
+
+typedef struct
+{
+    V3 a; // The ends of the line the capsule is around
+    V3 b;
+    float radius;
+} MagicMotionCapsule;
+
+typedef struct
+{
+    V3 center;
+    V3 half_extents;
+    V3 axes[3]; // Orthonormal, along the x, y and z of the box
+} MagicMotionOBB;
+
+// Builds a query grid over voxels from the list of occupied voxels. The
+// grid points to voxels, which must outlive it.
+void MagicMotion_BuildQueryGrid(MagicMotionQueryGrid *grid, const Voxel *voxels,
+                                const uint32_t *occupied, unsigned int num_occupied,
+                                uint32_t min_point_count);
+
+// The query grid of the latest frame, where any point makes a voxel occupied
+const MagicMotionQueryGrid *MagicMotion_GetQueryGrid(void);
+
+// Builds a query grid over a bitmap of OCCUPANCY_WORDS words, like the
+// ones from MagicMotion_GetOccupancyWindow. The mask must outlive the grid.
+void MagicMotion_BuildMaskQueryGrid(MagicMotionQueryGrid *grid, const uint64_t *mask);
+
+// Finds the first occupied voxel along each ray
+void MagicMotion_Raycast(const MagicMotionQueryGrid *grid, const MagicMotionRay *rays,
+                         unsigned int num_rays, MagicMotionRayHit *hits);
+
+// Sets results[i] if the shape has an occupied voxel whose center is inside it
+void MagicMotion_QuerySpheres(const MagicMotionQueryGrid *grid, const MagicMotionSphere *spheres,
+                              unsigned int num_spheres, bool *results);
+void MagicMotion_QueryCapsules(const MagicMotionQueryGrid *grid, const MagicMotionCapsule *capsules,
+                               unsigned int num_capsules, bool *results);
+void MagicMotion_QueryOBBs(const MagicMotionQueryGrid *grid, const MagicMotionOBB *boxes,
+                           unsigned int num_boxes, bool *results);
+
+// The library keeps which voxels were occupied in each of the last
+// OCCUPANCY_HISTORY_LENGTH frames, as bitmaps of one bit per voxel, lowest
+// bit first, in voxel index order.
+#define OCCUPANCY_HISTORY_LENGTH 32
+#define OCCUPANCY_WORDS ((NUM_VOXELS+63)/64)
+
+// How many frames the history has, up to OCCUPANCY_HISTORY_LENGTH
+unsigned int MagicMotion_GetOccupancyHistoryLength(void);
+
+// Writes the voxels occupied in at least min_frames of the last frames to
+// mask, which must have room for OCCUPANCY_WORDS words. min_frames 1 is
+// any of the frames, and min_frames = frames is all of them.
+void MagicMotion_GetOccupancyWindow(unsigned int frames, unsigned int min_frames, uint64_t *mask);
+
+// The bitmap of the frame age frames before the latest, 0 being the latest,
+// for ages below MagicMotion_GetOccupancyHistoryLength. Valid until the next
+// MagicMotion_CaptureFrame, for keeping a copy of the history that other
+// threads can read.
+const uint64_t *MagicMotion_GetOccupancyFrame(unsigned int age);
+
+// The same as MagicMotion_GetOccupancyWindow, over bitmaps of your own,
+// newest first, such as copies of the history
+void MagicMotion_CombineOccupancy(const uint64_t *const *frames, unsigned int num_frames,
+                                  unsigned int min_frames, uint64_t *mask);
+
+// The stages of MagicMotion_CaptureFrame. The mutex is waited for both
+// before and after the sensors are read, and the two waits are summed.
+typedef enum
+{
+    FRAME_STAGE_SENSORS,         // Waiting for and reading the sensor frames
+    FRAME_STAGE_MUTEX_WAIT,      // Total of the waits for the classifier threads to let go of the frame
+    FRAME_STAGE_PROJECTION,      // Depth frames to point cloud
+    FRAME_STAGE_CLASSIFICATION,  // Foreground and background, and the voxel grid
+    FRAME_STAGE_QUERIES,         // The query grid and the occupancy history
+    FRAME_STAGE_FLIGHT_RECORDER,
+    NUM_FRAME_STAGES
+} FrameStage;
+
+typedef struct
+{
+    unsigned int frame;                 // Counts calls to MagicMotion_CaptureFrame
+    uint64_t wall_ns[NUM_FRAME_STAGES];
+    uint64_t cpu_ns[NUM_FRAME_STAGES];  // Of the capture thread
+    uint64_t total_wall_ns;
+    uint64_t total_cpu_ns;
+    uint32_t num_points;                // In the cloud
+    uint32_t num_points_in_bounds;      // That landed in the voxel grid
+    uint32_t num_foreground;
+    uint32_t num_occupied_voxels;
+    uint32_t num_dropped;               // Sensor frames that did not arrive, and were left out
+} FrameStats;
+
+#define FRAME_STATS_HISTORY_LENGTH 256
+
+typedef struct
+{
+    FrameStats frames[FRAME_STATS_HISTORY_LENGTH]; // A ring of the last frames
+    unsigned int newest;                           // The slot of the latest frame
+    unsigned int num_frames;                       // Up to FRAME_STATS_HISTORY_LENGTH
+    uint64_t total_dropped;                        // Since MagicMotion_Initialize
+} FrameStatsHistory;
+
+// Where the time of the last frames went, and what they made. Always kept,
+// at the cost of a few clock reads per stage. It is written by
+// MagicMotion_CaptureFrame, so read it from the same thread.
+const FrameStatsHistory *MagicMotion_GetFrameStats(void);
+const char *MagicMotion_GetFrameStageName(FrameStage stage);
+
 void MagicMotion_StartCalibration(void); // If using the calibration classifier, start calibrating. While calibrating, the the sensors should see only background.
 void MagicMotion_EndCalibration(void);
 bool MagicMotion_IsCalibrating(void);
 
+typedef struct
+{
+    bool active;
+    bool dumping;
+    bool dump_failed;   // The last dump could not be written in full
+    float seconds_held; // Time between the oldest and newest frame in memory
+    unsigned int num_frames;
+    size_t bytes_used;
+    size_t frames_skipped; // Frames that came in while the last was still being compressed, or did not fit
+} FlightRecorderStatus;
+
+// The flight recorder keeps the last few seconds of sensor frames, and
+// optionally the point clouds, compressed in a ring buffer of max_bytes.
+// A dump writes them to recording files on a background thread, without
+// stopping the flight recorder. cloud_file may be NULL. These must be
+// called from the same thread as MagicMotion_CaptureFrame.
+bool MagicMotion_StartFlightRecorder(float seconds, size_t max_bytes, bool include_clouds);
+void MagicMotion_StopFlightRecorder(void);
+bool MagicMotion_DumpFlightRecording(const char *video_file, const char *cloud_file);
+void MagicMotion_GetFlightRecorderStatus(FlightRecorderStatus *status);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,134 @@
+#include "magic_motion.h"
+#include <string.h>
+
+// Which voxels were occupied in each of the last frames, a bitmap per
+// frame in a ring. Windows over the ring are answered 64 voxels at a time.
+
+typedef struct
+{
+    uint64_t frames[OCCUPANCY_HISTORY_LENGTH][OCCUPANCY_WORDS];
+    unsigned int newest;     // The slot of the latest frame
+    unsigned int num_frames; // Up to OCCUPANCY_HISTORY_LENGTH
+} OccupancyHistory;
+
+// Bits needed to count to OCCUPANCY_HISTORY_LENGTH
+#define HISTORY_COUNTER_BITS 6
+#define HISTORY_BLOCK_WORDS 64
+
+static void
+_PushOccupancy(OccupancyHistory *history, const uint32_t *occupied, unsigned int num_occupied)
+{
+    history->newest = (history->newest+1) % OCCUPANCY_HISTORY_LENGTH;
+    history->num_frames = MIN(history->num_frames+1, OCCUPANCY_HISTORY_LENGTH);
+
+    uint64_t *frame = history->frames[history->newest];
+    memset(frame, 0, sizeof(uint64_t)*OCCUPANCY_WORDS);
+    for(unsigned int i=0; i<num_occupied; ++i)
+    {
+        frame[occupied[i]/64] |= (uint64_t)1 << (occupied[i]%64);
+    }
+}
+
+// The bitmap of the frame age frames before the latest one
+static const uint64_t *
+_OccupancyFrame(const OccupancyHistory *history, unsigned int age)
+{
+    unsigned int slot = (history->newest + OCCUPANCY_HISTORY_LENGTH - age) % OCCUPANCY_HISTORY_LENGTH;
+    return history->frames[slot];
+}
+
+// The voxels set in at least min_frames of the num_frames bitmaps
+static void
+_CombineOccupancy(const uint64_t *const *frames, unsigned int num_frames,
+                  unsigned int min_frames, uint64_t *mask)
+{
+    num_frames = MIN(num_frames, OCCUPANCY_HISTORY_LENGTH);
+    min_frames = MAX(min_frames, 1);
+    if(min_frames > num_frames)
+    {
+        memset(mask, 0, sizeof(uint64_t)*OCCUPANCY_WORDS);
+        return;
+    }
+
+    if(min_frames == 1 || min_frames == num_frames)
+    {
+        // Any is an OR of the frames, and all is an AND
+        bool all = min_frames == num_frames;
+        memcpy(mask, frames[0], sizeof(uint64_t)*OCCUPANCY_WORDS);
+        for(unsigned int i=1; i<num_frames; ++i)
+        {
+            const uint64_t *frame = frames[i];
+            if(all)
+            {
+                for(uint32_t w=0; w<OCCUPANCY_WORDS; ++w) mask[w] &= frame[w];
+            }
+            else
+            {
+                for(uint32_t w=0; w<OCCUPANCY_WORDS; ++w) mask[w] |= frame[w];
+            }
+        }
+
+        return;
+    }
+
+    // NOTE(istarnion): Counts the frames every voxel was occupied in with
+    // a counter per bit of the count, each one a word, so adding a frame is
+    // a ripple carry add of one bit to 64 counters at once. The count is
+    // then compared to min_frames a bit at a time, from the top. This is
+    // done a block of words at a time, so the counters stay in cache.
+    int num_bits = 32 - __builtin_clz(num_frames); // Enough to count to num_frames
+    for(uint32_t first=0; first<OCCUPANCY_WORDS; first+=HISTORY_BLOCK_WORDS)
+    {
+        uint32_t num_words = MIN(HISTORY_BLOCK_WORDS, OCCUPANCY_WORDS-first);
+        uint64_t counter[HISTORY_COUNTER_BITS][HISTORY_BLOCK_WORDS] = {};
+        for(unsigned int i=0; i<num_frames; ++i)
+        {
+            const uint64_t *frame = frames[i] + first;
+            for(uint32_t w=0; w<num_words; ++w)
+            {
+                uint64_t carry = frame[w];
+                for(int b=0; b<num_bits; ++b)
+                {
+                    uint64_t next = counter[b][w] & carry;
+                    counter[b][w] ^= carry;
+                    carry = next;
+                }
+            }
+        }
+
+        for(uint32_t w=0; w<num_words; ++w)
+        {
+            uint64_t greater = 0;
+            uint64_t equal = ~(uint64_t)0;
+            for(int b=num_bits-1; b>=0; --b)
+            {
+                if((min_frames >> b) & 1)
+                {
+                    equal &= counter[b][w];
+                }
+                else
+                {
+                    greater |= equal & counter[b][w];
+                    equal &= ~counter[b][w];
+                }
+            }
+
+            mask[first+w] = greater | equal;
+        }
+    }
+}
+
+static void
+_OccupancyWindow(const OccupancyHistory *history, unsigned int num_frames,
+                 unsigned int min_frames, uint64_t *mask)
+{
+    num_frames = MIN(num_frames, history->num_frames);
+
+    const uint64_t *frames[OCCUPANCY_HISTORY_LENGTH];
+    for(unsigned int i=0; i<num_frames; ++i)
+    {
+        frames[i] = _OccupancyFrame(history, i);
+    }
+
+    _CombineOccupancy(frames, num_frames, min_frames, mask);
+}
@@ -0,0 +1,79 @@
+#include "magic_motion.h"
+#include "sensor_interface.h"
+#include "frustum.h"
+#include <math.h>
+#include <assert.h>
+
+// Turns the depth frame of one sensor into points, as MagicMotion_CaptureFrame
+// does live. Shared with the offline reprocessing tool, so a recording played
+// back through either ends up with the same clouds.
+
+// Appends a point for every pixel with a depth, with the color of the pixel
+// in the middle of the color frame and the given tag. Colors may be NULL,
+// then color_cloud is not written. Returns the number of points added.
+static size_t
+_ProjectDepthFrame(const SensorInfo *sensor, const Frustum *frustum,
+                   const DepthPixel *depths, const ColorPixel *colors, int tag,
+                   V3 *spatial_cloud, ColorPixel *color_cloud, MagicMotionTag *tag_cloud)
+{
+    // NOTE(istarnion): The color and depth streams does often
+    // NOT have the same resolution, especially with image
+    // registration enabled, but depth resolution is always
+    // smaller than color resolution.
+    assert(sensor->depth_stream_info.width <= sensor->color_stream_info.width);
+    assert(sensor->depth_stream_info.height <= sensor->color_stream_info.height);
+
+    const unsigned int w = sensor->depth_stream_info.width;
+    const unsigned int h = sensor->depth_stream_info.height;
+    const unsigned int color_w = sensor->color_stream_info.width;
+    const unsigned int color_h = sensor->color_stream_info.height;
+
+    const float fov = sensor->depth_stream_info.fov;
+    const float aspect = sensor->depth_stream_info.aspect_ratio;
+
+    const Mat4 camera_transform = frustum->transform;
+
+    size_t num_points = 0;
+    for(uint32_t y=0; y<h; ++y)
+    {
+        for(uint32_t x=0; x<w; ++x)
+        {
+            float depth = depths[x+y*w];
+            if(depth > 0.0f)
+            {
+                float pos_x = tanf((((float)x/(float)w)-0.5f)*fov) * depth;
+                float pos_y = tanf((0.5f-((float)y / (float)h))*(fov/aspect)) * depth;
+
+                // Convert from mm to dm as we create the point
+                V3 point = MulMat4Vec3(camera_transform,
+                                       (V3){ pos_x / 100.0f,
+                                             pos_y / 100.0f,
+                                             depth / 100.0f });
+
+                spatial_cloud[num_points] = point;
+                if(colors)
+                {
+                    color_cloud[num_points] = colors[(color_w/2-w/2+x)+(color_h/2-h/2+y)*color_w];
+                }
+
+                tag_cloud[num_points] = (MagicMotionTag)tag;
+                ++num_points;
+            }
+        }
+    }
+
+    return num_points;
+}
+
+// The frustum a sensor gets before it is calibrated
+static Frustum
+_DefaultFrustum(const SensorInfo *sensor)
+{
+    return (Frustum){
+        .transform = IdentityMat4(),
+        .fov = sensor->depth_stream_info.fov,
+        .aspect = sensor->depth_stream_info.aspect_ratio,
+        .near_plane = MAX(0.05f, sensor->depth_stream_info.min_depth / 100.0f),
+        .far_plane = sensor->depth_stream_info.max_depth / 100.0f
+    };
+}
@@ -0,0 +1,297 @@
+#include "recording_format.h"
+#include "magic_motion.h" // V3, ColorPixel, MagicMotionTag
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Expects miniz.c to be included already
+
+// Reads with pread, so threads can share a descriptor without sharing a file
+// position
+static bool
+_ReadAt(int fd, void *buffer, size_t size, size_t offset)
+{
+    uint8_t *target = (uint8_t *)buffer;
+    while(size > 0)
+    {
+        ssize_t n = pread(fd, target, size, (off_t)offset);
+        if(n <= 0)
+        {
+            return false;
+        }
+
+        target += n;
+        offset += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+typedef struct
+{
+    const uint8_t *source;
+    size_t source_size;
+    uint8_t *target;
+    size_t target_size;
+    bool ok;
+} BlobChunk;
+
+typedef struct
+{
+    BlobChunk *chunks;
+    uint32_t num_chunks;
+    uint32_t next_chunk;
+} ChunkDecoding;
+
+#define MAX_DECODE_THREADS 16
+
+static void *
+_DecodeChunks(void *userdata)
+{
+    ChunkDecoding *decoding = (ChunkDecoding *)userdata;
+    while(true)
+    {
+        uint32_t index = __atomic_fetch_add(&decoding->next_chunk, 1, __ATOMIC_RELAXED);
+        if(index >= decoding->num_chunks)
+        {
+            break;
+        }
+
+        BlobChunk *chunk = &decoding->chunks[index];
+        size_t bytes_written = tinfl_decompress_mem_to_mem(chunk->target, chunk->target_size,
+                                                           chunk->source, chunk->source_size, 0);
+        chunk->ok = (bytes_written == chunk->target_size);
+    }
+
+    return NULL;
+}
+
+static bool
+_DecompressChunkedBlob(const uint8_t *blob, size_t blob_size, void *target, size_t target_size)
+{
+    uint32_t header[2];
+    if(blob_size < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(header, blob, sizeof(header));
+    const uint32_t num_chunks = header[0];
+    const size_t chunk_size = header[1];
+    if(num_chunks == 0 || num_chunks > MAX_BLOB_CHUNKS ||
+       blob_size < CHUNK_TABLE_SIZE(num_chunks) ||
+       (num_chunks-1)*chunk_size >= target_size ||
+       num_chunks*chunk_size < target_size)
+    {
+        return false;
+    }
+
+    uint32_t compressed_sizes[MAX_BLOB_CHUNKS];
+    memcpy(compressed_sizes, blob + sizeof(header), num_chunks*sizeof(uint32_t));
+
+    BlobChunk chunks[MAX_BLOB_CHUNKS];
+    size_t source_offset = CHUNK_TABLE_SIZE(num_chunks);
+    for(uint32_t i=0; i<num_chunks; ++i)
+    {
+        BlobChunk *chunk = &chunks[i];
+        chunk->source = blob + source_offset;
+        chunk->source_size = compressed_sizes[i];
+        chunk->target = (uint8_t *)target + i*chunk_size;
+        chunk->target_size = (i == num_chunks-1) ? target_size - i*chunk_size : chunk_size;
+        chunk->ok = false;
+
+        source_offset += compressed_sizes[i];
+        if(source_offset > blob_size)
+        {
+            return false;
+        }
+    }
+
+    ChunkDecoding decoding = { chunks, num_chunks, 0 };
+
+    // The calling thread decodes chunks too
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_threads > (long)num_chunks)
+    {
+        num_threads = num_chunks;
+    }
+
+    if(num_threads > MAX_DECODE_THREADS)
+    {
+        num_threads = MAX_DECODE_THREADS;
+    }
+
+    --num_threads;
+    pthread_t threads[MAX_DECODE_THREADS];
+    int num_started = 0;
+    for(; num_started<num_threads; ++num_started)
+    {
+        if(pthread_create(&threads[num_started], NULL, _DecodeChunks, &decoding) != 0)
+        {
+            break;
+        }
+    }
+
+    _DecodeChunks(&decoding);
+
+    for(int i=0; i<num_started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(uint32_t i=0; i<num_chunks; ++i)
+    {
+        if(!chunks[i].ok)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Decompresses a BLOB_DEFLATE or BLOB_DEFLATE_CHUNKED blob into exactly
+// target_size bytes. Returns false if the blob is corrupt, or of another kind.
+static bool
+DecompressBlob(BlobEncoding encoding, const void *blob, size_t blob_size, void *target, size_t target_size)
+{
+    if(encoding == BLOB_DEFLATE)
+    {
+        size_t bytes_written = tinfl_decompress_mem_to_mem(target, target_size, blob, blob_size, 0);
+        return bytes_written == target_size;
+    }
+    else if(encoding == BLOB_DEFLATE_CHUNKED)
+    {
+        return _DecompressChunkedBlob((const uint8_t *)blob, blob_size, target, target_size);
+    }
+
+    return false;
+}
+
+typedef enum
+{
+    CLOUD_POSITIONS,
+    CLOUD_COLORS,
+    CLOUD_TAGS
+} CloudStream;
+
+// Number of bytes a cloud stream takes up before it is compressed
+static size_t
+CloudStreamSize(CloudStream stream, BlobLayout layout, size_t num_points)
+{
+    switch(stream)
+    {
+        case CLOUD_POSITIONS:
+            return num_points * (layout == BLOB_LAYOUT_POSITIONS_Q16 ? 3*sizeof(int16_t) : sizeof(V3));
+        case CLOUD_COLORS:
+            return num_points * sizeof(ColorPixel);
+        case CLOUD_TAGS:
+            return num_points * (layout == BLOB_LAYOUT_TAGS_U8 ? sizeof(uint8_t) : sizeof(MagicMotionTag));
+    }
+
+    return 0;
+}
+
+static void
+QuantizePositions(const V3 *positions, size_t num_points, int16_t *output)
+{
+    for(int axis=0; axis<3; ++axis)
+    {
+        int16_t *plane = output + axis*num_points;
+        int32_t previous = 0;
+        for(size_t i=0; i<num_points; ++i)
+        {
+            float steps = positions[i].v[axis] / POSITION_QUANTUM;
+            int32_t value;
+            if(!(steps > (float)INT16_MIN)) // Also catches NaN
+            {
+                value = INT16_MIN;
+            }
+            else if(steps > (float)INT16_MAX)
+            {
+                value = INT16_MAX;
+            }
+            else
+            {
+                value = (int32_t)(steps < 0.0f ? steps - 0.5f : steps + 0.5f);
+            }
+
+            // NOTE(istarnion): Wraps around, which the decoder undoes
+            plane[i] = (int16_t)(uint16_t)(value - previous);
+            previous = value;
+        }
+    }
+}
+
+static void
+DequantizePositions(const int16_t *quantized, size_t num_points, V3 *positions)
+{
+    for(int axis=0; axis<3; ++axis)
+    {
+        const int16_t *plane = quantized + axis*num_points;
+        uint16_t value = 0;
+        for(size_t i=0; i<num_points; ++i)
+        {
+            value = (uint16_t)(value + (uint16_t)plane[i]);
+            positions[i].v[axis] = (float)(int16_t)value * POSITION_QUANTUM;
+        }
+    }
+}
+
+static void
+PackTags(const MagicMotionTag *tags, size_t num_points, uint8_t *output)
+{
+    for(size_t i=0; i<num_points; ++i)
+    {
+        output[i] = (uint8_t)tags[i];
+    }
+}
+
+static void
+UnpackTags(const uint8_t *packed, size_t num_points, MagicMotionTag *tags)
+{
+    for(size_t i=0; i<num_points; ++i)
+    {
+        tags[i] = (MagicMotionTag)packed[i];
+    }
+}
+
+// Decompresses a cloud blob of any layout into num_points V3s, ColorPixels
+// or MagicMotionTags, depending on the stream.
+static bool
+DecompressCloudBlob(size_t blob_word, CloudStream stream, const void *blob, size_t num_points, void *target)
+{
+    BlobEncoding encoding = BLOB_ENCODING(blob_word);
+    BlobLayout layout = BLOB_LAYOUT(blob_word);
+    size_t blob_size = BLOB_SIZE(blob_word);
+
+    if(layout == BLOB_LAYOUT_RAW)
+    {
+        return DecompressBlob(encoding, blob, blob_size, target, CloudStreamSize(stream, layout, num_points));
+    }
+
+    if(!((stream == CLOUD_POSITIONS && layout == BLOB_LAYOUT_POSITIONS_Q16) ||
+         (stream == CLOUD_TAGS && layout == BLOB_LAYOUT_TAGS_U8)))
+    {
+        return false;
+    }
+
+    size_t packed_size = CloudStreamSize(stream, layout, num_points);
+    void *packed = malloc(packed_size);
+    bool ok = DecompressBlob(encoding, blob, blob_size, packed, packed_size);
+    if(ok)
+    {
+        if(layout == BLOB_LAYOUT_POSITIONS_Q16)
+        {
+            DequantizePositions((const int16_t *)packed, num_points, (V3 *)target);
+        }
+        else
+        {
+            UnpackTags((const uint8_t *)packed, num_points, (MagicMotionTag *)target);
+        }
+    }
+
+    free(packed);
+    return ok;
+}
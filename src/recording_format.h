@@ -0,0 +1,51 @@
+#ifndef RECORDING_FORMAT_H_
+#define RECORDING_FORMAT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Every compressed buffer in a recording file is prefixed by a size_t word.
+// The lower 56 bits hold the number of bytes that follows the word, and the
+// top byte tells how those bytes are encoded. Recordings made before the
+// encoding byte was introduced have it set to zero, which is BLOB_DEFLATE.
+typedef enum
+{
+    BLOB_DEFLATE         = 0, // Raw deflate stream (tdefl/tinfl, no zlib header)
+    BLOB_JPEG            = 1, // Baseline JPEG, 3 channel RGB. Only used for color frames
+    BLOB_DEFLATE_CHUNKED = 2  // Independently deflated chunks, see below
+} BlobEncoding;
+
+// Large buffers are split into chunks that are deflated on their own, so
+// they can be compressed and decompressed in parallel. The blob starts with
+// a chunk table, followed by the raw deflate streams back to back:
+//     uint32 chunk_count
+//     uint32 chunk_size  Uncompressed size of every chunk but the last
+//     uint32 compressed_sizes[chunk_count]
+#define MAX_BLOB_CHUNKS 64
+#define CHUNK_TABLE_SIZE(chunk_count) (sizeof(uint32_t)*(2+(size_t)(chunk_count)))
+
+// Point clouds can be stored in a compact layout before they are compressed.
+// The layout is kept in the upper four bits of the encoding byte, so every
+// blob says how to expand it, and older recordings read as BLOB_LAYOUT_RAW.
+typedef enum
+{
+    BLOB_LAYOUT_RAW           = 0, // Exactly as in memory
+    BLOB_LAYOUT_POSITIONS_Q16 = 1, // int16 x, y and z planes, see below
+    BLOB_LAYOUT_TAGS_U8       = 2  // One byte per MagicMotionTag
+} BlobLayout;
+
+// Quantized positions are stored in steps of POSITION_QUANTUM decimeters,
+// which is 0.4 mm and covers 12.8 m in every direction from the origin.
+// Points further out are clamped. All x values come first, then all y and
+// then all z, each stored as the difference from the previous point. The
+// sensors scan in rows, so the differences are small and deflate well.
+#define POSITION_QUANTUM (1.0f/256.0f)
+
+#define BLOB_SIZE_MASK (((size_t)1 << 56) - 1)
+#define BLOB_SIZE(word) ((size_t)(word) & BLOB_SIZE_MASK)
+#define BLOB_ENCODING(word) ((BlobEncoding)(((size_t)(word) >> 56) & 0xF))
+#define BLOB_LAYOUT(word) ((BlobLayout)((size_t)(word) >> 60))
+#define BLOB_WORD(size, encoding) (((size_t)(encoding) << 56) | ((size_t)(size) & BLOB_SIZE_MASK))
+#define BLOB_WORD_WITH_LAYOUT(size, encoding, layout) (BLOB_WORD(size, encoding) | ((size_t)(layout) << 60))
+
+#endif /* end of include guard: RECORDING_FORMAT_H_ */
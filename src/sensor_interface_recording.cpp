@@ -1,17 +1,20 @@
 #include "sensor_interface.h"
 
+#include "recording_format.h"
 #include "utils.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define MINIZ_NO_STDIO
-#define MINIZ_NO_TIME
-#define MINIZ_NO_ARCHIVE_APIS
-#define MINIZ_NO_ARCHIVE_WRITING_APIS
-#define MINIZ_NO_ZLIB_APIS
-#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
-#include "miniz.c"
+// miniz.c and recording_format.cpp are included by magic_motion.cpp
+
+// Color frames may be stored as JPEG. The decoder is kept static, so it
+// does not clash with the stb_image copy the host application may link.
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_NO_STDIO
+#include "stb_image.h"
 
 struct _sensor;
 
@@ -105,7 +108,7 @@ InitializeSensorInterface(void)
         {
             Sensor *sensor = &_interface.sensors[j];
 
-            size_t frame_index;
+            size_t frame_index = 0;
             fscanf(_interface.video_file, "frame %zu\n", &frame_index);
             assert(frame_index == (i+1));
             char frame_type[64] = {0};
@@ -113,17 +116,17 @@ InitializeSensorInterface(void)
             assert(strcmp(frame_type, "color\n") == 0);
             sensor->color_frame_offsets[i] = ftell(_interface.video_file);
 
-            size_t compressed_size = 0;
-            fread(&compressed_size, sizeof(size_t), 1, _interface.video_file);
-            fseek(_interface.video_file, compressed_size+1, SEEK_CUR); // Skip compressed data and following newline
+            size_t blob_word = 0;
+            fread(&blob_word, sizeof(size_t), 1, _interface.video_file);
+            fseek(_interface.video_file, BLOB_SIZE(blob_word)+1, SEEK_CUR); // Skip compressed data and following newline
 
             memset(frame_type, 0, 64);
             fgets(frame_type, 64, _interface.video_file);
             printf("Frame %zu: %s\n", frame_index, frame_type);
             assert(strcmp(frame_type, "depth\n") == 0);
             sensor->depth_frame_offsets[i] = ftell(_interface.video_file);
-            fread(&compressed_size, sizeof(size_t), 1, _interface.video_file);
-            fseek(_interface.video_file, compressed_size+1, SEEK_CUR); // Skip compressed data and following newline
+            fread(&blob_word, sizeof(size_t), 1, _interface.video_file);
+            fseek(_interface.video_file, BLOB_SIZE(blob_word)+1, SEEK_CUR); // Skip compressed data and following newline
         }
     }
 
@@ -181,14 +184,42 @@ GetSensorColorFrame(SensorInfo *sensor)
     Sensor *s = sensor->sensor_data;
 
     const size_t buffer_size = sensor->color_stream_info.width * sensor->color_stream_info.height * sizeof(ColorPixel);
-    uint8_t *compressed_buffer = (uint8_t *)malloc(buffer_size);
     fseek(_interface.video_file, s->color_frame_offsets[_interface.frame_index], SEEK_SET);
-    size_t compressed_size = 0;
-    fread(&compressed_size, sizeof(size_t), 1, _interface.video_file);
+    size_t blob_word = 0;
+    fread(&blob_word, sizeof(size_t), 1, _interface.video_file);
+    const size_t compressed_size = BLOB_SIZE(blob_word);
+    uint8_t *compressed_buffer = (uint8_t *)malloc(compressed_size);
     fread(compressed_buffer, 1, compressed_size, _interface.video_file);
 
-    size_t bytes_written = tinfl_decompress_mem_to_mem(s->color_frame, buffer_size, compressed_buffer, compressed_size, 0);
-    assert(bytes_written == buffer_size);
+    bool decoded;
+    if(BLOB_ENCODING(blob_word) == BLOB_JPEG)
+    {
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load_from_memory(compressed_buffer, (int)compressed_size,
+                                                &width, &height, &channels, 3);
+        decoded = pixels &&
+                  width == sensor->color_stream_info.width &&
+                  height == sensor->color_stream_info.height;
+        if(decoded)
+        {
+            memcpy(s->color_frame, pixels, buffer_size);
+        }
+
+        stbi_image_free(pixels);
+    }
+    else
+    {
+        decoded = DecompressBlob(BLOB_ENCODING(blob_word), compressed_buffer, compressed_size,
+                                 s->color_frame, buffer_size);
+    }
+
+    if(!decoded)
+    {
+        // A black frame rather than a broken one
+        printf("WARN: Failed to decode the color frame %zu of %s\n", _interface.frame_index+1, sensor->serial);
+        memset(s->color_frame, 0, buffer_size);
+    }
+
     free(compressed_buffer);
 
     return s->color_frame;
@@ -200,14 +231,22 @@ GetSensorDepthFrame(SensorInfo *sensor)
     Sensor *s = sensor->sensor_data;
 
     const size_t buffer_size = sensor->depth_stream_info.width * sensor->depth_stream_info.height * sizeof(DepthPixel);
-    uint8_t *compressed_buffer = (uint8_t *)malloc(buffer_size);
     fseek(_interface.video_file, s->depth_frame_offsets[_interface.frame_index], SEEK_SET);
-    size_t compressed_size = 0;
-    fread(&compressed_size, sizeof(size_t), 1, _interface.video_file);
+    size_t blob_word = 0;
+    fread(&blob_word, sizeof(size_t), 1, _interface.video_file);
+    const size_t compressed_size = BLOB_SIZE(blob_word);
+    uint8_t *compressed_buffer = (uint8_t *)malloc(compressed_size);
     fread(compressed_buffer, 1, compressed_size, _interface.video_file);
 
-    size_t bytes_written = tinfl_decompress_mem_to_mem(s->depth_frame, buffer_size, compressed_buffer, compressed_size, 0);
-    assert(bytes_written == buffer_size);
+    bool decompressed = DecompressBlob(BLOB_ENCODING(blob_word), compressed_buffer, compressed_size,
+                                       s->depth_frame, buffer_size);
+    if(!decompressed)
+    {
+        // No depth means no points
+        printf("WARN: Failed to decode the depth frame %zu of %s\n", _interface.frame_index+1, sensor->serial);
+        memset(s->depth_frame, 0, buffer_size);
+    }
+
     free(compressed_buffer);
 
     // Increment frame_index
@@ -65,10 +65,16 @@ SaveSensor(const char *serial, Frustum *frustum)
 
 int
 LoadSensors(SerializedSensor *sensors, int max_sensors)
+{
+    return LoadSensorsFromFile(PERSIST_FILE, sensors, max_sensors);
+}
+
+int
+LoadSensorsFromFile(const char *filename, SerializedSensor *sensors, int max_sensors)
 {
     int sensors_read = -1;
 
-    FILE *f = fopen(PERSIST_FILE, "r");
+    FILE *f = fopen(filename, "r");
     if(f)
     {
         int eof = false;
@@ -148,6 +154,8 @@ LoadSensors(SerializedSensor *sensors, int max_sensors)
                 }
             }
         }
+
+        fclose(f);
     }
 
     return sensors_read;
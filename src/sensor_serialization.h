@@ -11,6 +11,7 @@ typedef struct
 
 void SaveSensor(const char *uri, Frustum *frustum);
 int LoadSensors(SerializedSensor *sensors, int max_sensors);
+int LoadSensorsFromFile(const char *filename, SerializedSensor *sensors, int max_sensors);
 
 #endif /* end of include guard: SENSOR_SERIALIZATION_H_ */
 
@@ -0,0 +1,418 @@
+#include "magic_motion.h"
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+// Ray and shape queries against a voxel grid. The server runs them on its
+// own copies of the grid, so they only touch the grid they are given.
+
+static const int query_dims[3] = { NUM_VOXELS_X, NUM_VOXELS_Y, NUM_VOXELS_Z };
+
+static inline V3
+_GridMin(void)
+{
+    return (V3){ BOUNDING_BOX_X/-2.0f, BOUNDING_BOX_Y/-2.0f, BOUNDING_BOX_Z/-2.0f };
+}
+
+static inline uint32_t
+_BrickIndex(int x, int y, int z)
+{
+    return (x/QUERY_BRICK_SIZE) +
+           (y/QUERY_BRICK_SIZE)*QUERY_BRICKS_X +
+           (z/QUERY_BRICK_SIZE)*QUERY_BRICKS_X*QUERY_BRICKS_Y;
+}
+
+static inline bool
+_IsBrickOccupied(const MagicMotionQueryGrid *grid, int x, int y, int z)
+{
+    uint32_t brick = _BrickIndex(x, y, z);
+    return (grid->bricks[brick/8] >> (brick%8)) & 1;
+}
+
+static inline bool
+_IsVoxelOccupied(const MagicMotionQueryGrid *grid, int x, int y, int z)
+{
+    uint32_t index = VOXEL_INDEX(x, y, z);
+    if(grid->mask)
+    {
+        return (grid->mask[index/64] >> (index%64)) & 1;
+    }
+
+    return grid->voxels[index].point_count >= grid->min_point_count;
+}
+
+static inline void
+_SetBrick(MagicMotionQueryGrid *grid, uint32_t index)
+{
+    int x = index % NUM_VOXELS_X;
+    int y = (index / NUM_VOXELS_X) % NUM_VOXELS_Y;
+    int z = index / (NUM_VOXELS_X*NUM_VOXELS_Y);
+    uint32_t brick = _BrickIndex(x, y, z);
+    grid->bricks[brick/8] |= 1 << (brick%8);
+}
+
+void
+MagicMotion_BuildQueryGrid(MagicMotionQueryGrid *grid, const Voxel *voxels,
+                           const uint32_t *occupied, unsigned int num_occupied,
+                           uint32_t min_point_count)
+{
+    grid->voxels = voxels;
+    grid->mask = NULL;
+    grid->min_point_count = MAX(min_point_count, 1);
+    memset(grid->bricks, 0, sizeof(grid->bricks));
+
+    for(unsigned int i=0; i<num_occupied; ++i)
+    {
+        if(voxels[occupied[i]].point_count >= grid->min_point_count)
+        {
+            _SetBrick(grid, occupied[i]);
+        }
+    }
+}
+
+void
+MagicMotion_BuildMaskQueryGrid(MagicMotionQueryGrid *grid, const uint64_t *mask)
+{
+    grid->voxels = NULL;
+    grid->mask = mask;
+    grid->min_point_count = 1;
+    memset(grid->bricks, 0, sizeof(grid->bricks));
+
+    for(uint32_t w=0; w<OCCUPANCY_WORDS; ++w)
+    {
+        uint64_t word = mask[w];
+        while(word)
+        {
+            _SetBrick(grid, w*64 + __builtin_ctzll(word));
+            word &= word-1;
+        }
+    }
+}
+
+// Amanatides & Woo: step voxel by voxel, always across the nearest voxel
+// boundary. In an empty brick, every axis is stepped straight to where the
+// ray leaves the brick.
+static MagicMotionRayHit
+_Raycast(const MagicMotionQueryGrid *grid, const MagicMotionRay *ray)
+{
+    MagicMotionRayHit hit = {};
+
+    V3 origin = ray->origin;
+    V3 direction = NormalizeV3(ray->direction);
+    if(MagnitudeSquaredV3(direction) == 0.0f)
+    {
+        return hit;
+    }
+
+    // Clip the ray to the grid
+    V3 grid_min = _GridMin();
+    float t_enter = 0.0f;
+    float t_exit = ray->max_distance;
+    for(int axis=0; axis<3; ++axis)
+    {
+        float min = grid_min.v[axis];
+        float max = min + query_dims[axis]*VOXEL_SIZE;
+        if(direction.v[axis] != 0.0f)
+        {
+            float t0 = (min - origin.v[axis]) / direction.v[axis];
+            float t1 = (max - origin.v[axis]) / direction.v[axis];
+            t_enter = MAX(t_enter, MIN(t0, t1));
+            t_exit = MIN(t_exit, MAX(t0, t1));
+        }
+        else if(origin.v[axis] < min || origin.v[axis] > max)
+        {
+            return hit;
+        }
+    }
+
+    if(!(t_enter <= t_exit))
+    {
+        return hit;
+    }
+
+    int cell[3];
+    int step[3];
+    float t_max[3];   // Where the ray crosses the next voxel boundary on each axis
+    float t_delta[3]; // Between voxel boundaries on each axis
+    for(int axis=0; axis<3; ++axis)
+    {
+        float p = origin.v[axis] + direction.v[axis]*t_enter;
+        int c = (int)floorf((p - grid_min.v[axis]) / VOXEL_SIZE);
+        cell[axis] = MIN(MAX(c, 0), query_dims[axis]-1);
+
+        if(direction.v[axis] > 0.0f)
+        {
+            step[axis] = 1;
+            t_max[axis] = (grid_min.v[axis] + (cell[axis]+1)*VOXEL_SIZE - origin.v[axis]) / direction.v[axis];
+            t_delta[axis] = VOXEL_SIZE / direction.v[axis];
+        }
+        else if(direction.v[axis] < 0.0f)
+        {
+            step[axis] = -1;
+            t_max[axis] = (grid_min.v[axis] + cell[axis]*VOXEL_SIZE - origin.v[axis]) / direction.v[axis];
+            t_delta[axis] = VOXEL_SIZE / -direction.v[axis];
+        }
+        else
+        {
+            step[axis] = 0;
+            t_max[axis] = FLT_MAX;
+            t_delta[axis] = FLT_MAX;
+        }
+    }
+
+    float t = t_enter;
+    while(t <= t_exit)
+    {
+        if(!_IsBrickOccupied(grid, cell[0], cell[1], cell[2]))
+        {
+            // Where the ray leaves the brick, on the axis it leaves it by first
+            float t_leave = FLT_MAX;
+            for(int axis=0; axis<3; ++axis)
+            {
+                if(step[axis] == 0)
+                {
+                    continue;
+                }
+
+                int brick_start = cell[axis] / QUERY_BRICK_SIZE * QUERY_BRICK_SIZE;
+                int brick_end = MIN(brick_start + QUERY_BRICK_SIZE, query_dims[axis]);
+                int crossings = step[axis] > 0 ? brick_end-1 - cell[axis] : cell[axis] - brick_start;
+                t_leave = MIN(t_leave, t_max[axis] + crossings*t_delta[axis]);
+            }
+
+            for(int axis=0; axis<3; ++axis)
+            {
+                while(t_max[axis] <= t_leave)
+                {
+                    cell[axis] += step[axis];
+                    t_max[axis] += t_delta[axis];
+                }
+
+                if(cell[axis] < 0 || cell[axis] >= query_dims[axis])
+                {
+                    return hit;
+                }
+            }
+
+            t = t_leave;
+            continue;
+        }
+
+        if(_IsVoxelOccupied(grid, cell[0], cell[1], cell[2]))
+        {
+            hit.hit = true;
+            hit.distance = t;
+            hit.point = AddV3(origin, ScaleV3(direction, t));
+            hit.voxel = VOXEL_INDEX(cell[0], cell[1], cell[2]);
+            return hit;
+        }
+
+        int axis = 0;
+        if(t_max[1] < t_max[axis]) axis = 1;
+        if(t_max[2] < t_max[axis]) axis = 2;
+
+        t = t_max[axis];
+        cell[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+        if(cell[axis] < 0 || cell[axis] >= query_dims[axis])
+        {
+            break;
+        }
+    }
+
+    return hit;
+}
+
+void
+MagicMotion_Raycast(const MagicMotionQueryGrid *grid, const MagicMotionRay *rays,
+                    unsigned int num_rays, MagicMotionRayHit *hits)
+{
+    for(unsigned int i=0; i<num_rays; ++i)
+    {
+        hits[i] = _Raycast(grid, &rays[i]);
+    }
+}
+
+typedef enum
+{
+    QUERY_SPHERE,
+    QUERY_CAPSULE,
+    QUERY_OBB
+} QueryShapeType;
+
+typedef struct
+{
+    QueryShapeType type;
+    union
+    {
+        MagicMotionSphere sphere;
+        MagicMotionCapsule capsule;
+        MagicMotionOBB obb;
+    };
+} QueryShape;
+
+static inline bool
+_ShapeContains(const QueryShape *shape, V3 p)
+{
+    switch(shape->type)
+    {
+        case QUERY_SPHERE:
+        {
+            V3 d = SubV3(p, shape->sphere.center);
+            return DotV3(d, d) <= shape->sphere.radius*shape->sphere.radius;
+        }
+        case QUERY_CAPSULE:
+        {
+            const MagicMotionCapsule *capsule = &shape->capsule;
+            V3 ab = SubV3(capsule->b, capsule->a);
+            V3 ap = SubV3(p, capsule->a);
+            float length2 = DotV3(ab, ab);
+            float t = length2 > 0.0f ? Clamp(DotV3(ap, ab) / length2, 0.0f, 1.0f) : 0.0f;
+            V3 d = SubV3(ap, ScaleV3(ab, t));
+            return DotV3(d, d) <= capsule->radius*capsule->radius;
+        }
+        case QUERY_OBB:
+        {
+            const MagicMotionOBB *obb = &shape->obb;
+            V3 d = SubV3(p, obb->center);
+            for(int axis=0; axis<3; ++axis)
+            {
+                if(fabsf(DotV3(d, obb->axes[axis])) > obb->half_extents.v[axis])
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+_ShapeBounds(const QueryShape *shape, V3 *min, V3 *max)
+{
+    switch(shape->type)
+    {
+        case QUERY_SPHERE:
+        {
+            float r = shape->sphere.radius;
+            *min = SubV3(shape->sphere.center, (V3){ r, r, r });
+            *max = AddV3(shape->sphere.center, (V3){ r, r, r });
+        } break;
+        case QUERY_CAPSULE:
+        {
+            const MagicMotionCapsule *capsule = &shape->capsule;
+            float r = capsule->radius;
+            for(int axis=0; axis<3; ++axis)
+            {
+                min->v[axis] = MIN(capsule->a.v[axis], capsule->b.v[axis]) - r;
+                max->v[axis] = MAX(capsule->a.v[axis], capsule->b.v[axis]) + r;
+            }
+        } break;
+        case QUERY_OBB:
+        {
+            const MagicMotionOBB *obb = &shape->obb;
+            for(int axis=0; axis<3; ++axis)
+            {
+                float extent = 0.0f;
+                for(int i=0; i<3; ++i)
+                {
+                    extent += fabsf(obb->axes[i].v[axis]) * obb->half_extents.v[i];
+                }
+
+                min->v[axis] = obb->center.v[axis] - extent;
+                max->v[axis] = obb->center.v[axis] + extent;
+            }
+        } break;
+    }
+}
+
+// Visits the bricks the bounds of the shape overlaps, and in the occupied
+// ones, the voxels with their center inside the bounds.
+static bool
+_QueryShape(const MagicMotionQueryGrid *grid, const QueryShape *shape)
+{
+    V3 min, max;
+    _ShapeBounds(shape, &min, &max);
+
+    V3 grid_min = _GridMin();
+    int lo[3], hi[3];
+    for(int axis=0; axis<3; ++axis)
+    {
+        // The voxels with their center between min and max
+        float first = ceilf((min.v[axis] - grid_min.v[axis]) / VOXEL_SIZE - 0.5f);
+        float last = floorf((max.v[axis] - grid_min.v[axis]) / VOXEL_SIZE - 0.5f);
+        if(!(first <= last) || last < 0.0f || first >= query_dims[axis])
+        {
+            return false;
+        }
+
+        lo[axis] = (int)MAX(first, 0.0f);
+        hi[axis] = (int)MIN(last, (float)(query_dims[axis]-1));
+    }
+
+    for(int bz=lo[2]/QUERY_BRICK_SIZE; bz<=hi[2]/QUERY_BRICK_SIZE; ++bz)
+    for(int by=lo[1]/QUERY_BRICK_SIZE; by<=hi[1]/QUERY_BRICK_SIZE; ++by)
+    for(int bx=lo[0]/QUERY_BRICK_SIZE; bx<=hi[0]/QUERY_BRICK_SIZE; ++bx)
+    {
+        int x0 = bx*QUERY_BRICK_SIZE, y0 = by*QUERY_BRICK_SIZE, z0 = bz*QUERY_BRICK_SIZE;
+        if(!_IsBrickOccupied(grid, x0, y0, z0))
+        {
+            continue;
+        }
+
+        for(int z=MAX(z0, lo[2]); z<=MIN(z0+QUERY_BRICK_SIZE-1, hi[2]); ++z)
+        for(int y=MAX(y0, lo[1]); y<=MIN(y0+QUERY_BRICK_SIZE-1, hi[1]); ++y)
+        for(int x=MAX(x0, lo[0]); x<=MIN(x0+QUERY_BRICK_SIZE-1, hi[0]); ++x)
+        {
+            if(_IsVoxelOccupied(grid, x, y, z) &&
+               _ShapeContains(shape, VOXEL_TO_WORLD(VOXEL_INDEX(x, y, z))))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void
+MagicMotion_QuerySpheres(const MagicMotionQueryGrid *grid, const MagicMotionSphere *spheres,
+                         unsigned int num_spheres, bool *results)
+{
+    QueryShape shape = {};
+    shape.type = QUERY_SPHERE;
+    for(unsigned int i=0; i<num_spheres; ++i)
+    {
+        shape.sphere = spheres[i];
+        results[i] = _QueryShape(grid, &shape);
+    }
+}
+
+void
+MagicMotion_QueryCapsules(const MagicMotionQueryGrid *grid, const MagicMotionCapsule *capsules,
+                          unsigned int num_capsules, bool *results)
+{
+    QueryShape shape = {};
+    shape.type = QUERY_CAPSULE;
+    for(unsigned int i=0; i<num_capsules; ++i)
+    {
+        shape.capsule = capsules[i];
+        results[i] = _QueryShape(grid, &shape);
+    }
+}
+
+void
+MagicMotion_QueryOBBs(const MagicMotionQueryGrid *grid, const MagicMotionOBB *boxes,
+                      unsigned int num_boxes, bool *results)
+{
+    QueryShape shape = {};
+    shape.type = QUERY_OBB;
+    for(unsigned int i=0; i<num_boxes; ++i)
+    {
+        shape.obb = boxes[i];
+        results[i] = _QueryShape(grid, &shape);
+    }
+}